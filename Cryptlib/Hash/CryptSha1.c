@@ -97,6 +97,69 @@ Sha1Duplicate (
   return TRUE;
 }
 
+/**
+  Digests the input data with the processor's SHA instructions.
+
+  Any bytes left over from a previous update are completed by OpenSSL first,
+  whole blocks then go straight to Sha1AccelBlocks(), and the tail is left
+  buffered in the OpenSSL context, so the context stays usable by the
+  portable code.
+
+  @param[in, out]  Context   Pointer to the OpenSSL SHA-1 context.
+  @param[in]       Data      Pointer to the buffer containing the data to be hashed.
+  @param[in]       DataSize  Size of Data buffer in bytes.
+
+  @retval TRUE   SHA-1 data digest succeeded.
+  @retval FALSE  SHA-1 data digest failed.
+
+**/
+STATIC
+BOOLEAN
+Sha1AccelUpdate (
+  IN OUT  SHA_CTX      *Context,
+  IN      CONST UINT8  *Data,
+  IN      UINTN        DataSize
+  )
+{
+  UINTN     Length;
+  SHA_LONG  Nl;
+
+  if (Context->num != 0) {
+    Length = SHA_CBLOCK - Context->num;
+    if (Length > DataSize) {
+      Length = DataSize;
+    }
+    if (!SHA1_Update (Context, Data, Length)) {
+      return FALSE;
+    }
+    Data     += Length;
+    DataSize -= Length;
+  }
+
+  Length = DataSize - (DataSize % SHA_CBLOCK);
+  if (Length != 0) {
+    Sha1AccelBlocks ((UINT32 *) &Context->h0, Data, Length / SHA_CBLOCK);
+
+    //
+    // Same bit count bookkeeping as md32_common.h's HASH_UPDATE.
+    //
+    Nl = (SHA_LONG) (Context->Nl + (((SHA_LONG) Length) << 3));
+    if (Nl < Context->Nl) {
+      Context->Nh++;
+    }
+    Context->Nh += (SHA_LONG) (Length >> 29);
+    Context->Nl  = Nl;
+
+    Data     += Length;
+    DataSize -= Length;
+  }
+
+  if (DataSize == 0) {
+    return TRUE;
+  }
+  return (BOOLEAN) (SHA1_Update (Context, Data, DataSize));
+}
+
 /**
   Digests the input data and updates SHA-1 context.
 
@@ -140,6 +203,9 @@ Sha1Update (
   //
   // OpenSSL SHA-1 Hash Update
   //
+  if ((ShaAccelFeatures () & SHA_ACCEL_SHA1) != 0) {
+    return Sha1AccelUpdate ((SHA_CTX *) Sha1Context, Data, DataSize);
+  }
   return (BOOLEAN) (SHA1_Update ((SHA_CTX *) Sha1Context, Data, DataSize));
 }
 
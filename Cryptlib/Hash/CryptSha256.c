@@ -96,6 +96,85 @@ Sha256Duplicate (
   return TRUE;
 }
 
+/**
+  Accounts for whole blocks hashed into an OpenSSL context behind its back.
+
+  Same bit count bookkeeping as md32_common.h's HASH_UPDATE.
+
+  @param[in, out]  Context  Pointer to the OpenSSL SHA-256 context.
+  @param[in]       Length   Number of bytes hashed, a multiple of SHA_CBLOCK.
+
+**/
+STATIC
+VOID
+Sha256AddLength (
+  IN OUT  SHA256_CTX  *Context,
+  IN      UINTN       Length
+  )
+{
+  SHA_LONG  Nl;
+
+  Nl = (SHA_LONG) (Context->Nl + (((SHA_LONG) Length) << 3));
+  if (Nl < Context->Nl) {
+    Context->Nh++;
+  }
+  Context->Nh += (SHA_LONG) (Length >> 29);
+  Context->Nl  = Nl;
+}
+
+/**
+  Digests the input data with the processor's SHA instructions.
+
+  Any bytes left over from a previous update are completed by OpenSSL first,
+  whole blocks then go straight to Sha256AccelBlocks(), and the tail is left
+  buffered in the OpenSSL context, so the context stays usable by the
+  portable code.
+
+  @param[in, out]  Context   Pointer to the OpenSSL SHA-256 context.
+  @param[in]       Data      Pointer to the buffer containing the data to be hashed.
+  @param[in]       DataSize  Size of Data buffer in bytes.
+
+  @retval TRUE   SHA-256 data digest succeeded.
+  @retval FALSE  SHA-256 data digest failed.
+
+**/
+STATIC
+BOOLEAN
+Sha256AccelUpdate (
+  IN OUT  SHA256_CTX   *Context,
+  IN      CONST UINT8  *Data,
+  IN      UINTN        DataSize
+  )
+{
+  UINTN  Length;
+
+  if (Context->num != 0) {
+    Length = SHA_CBLOCK - Context->num;
+    if (Length > DataSize) {
+      Length = DataSize;
+    }
+    if (!SHA256_Update (Context, Data, Length)) {
+      return FALSE;
+    }
+    Data     += Length;
+    DataSize -= Length;
+  }
+
+  Length = DataSize - (DataSize % SHA_CBLOCK);
+  if (Length != 0) {
+    Sha256AccelBlocks ((UINT32 *) Context->h, Data, Length / SHA_CBLOCK);
+    Sha256AddLength (Context, Length);
+
+    Data     += Length;
+    DataSize -= Length;
+  }
+
+  if (DataSize == 0) {
+    return TRUE;
+  }
+  return (BOOLEAN) (SHA256_Update (Context, Data, DataSize));
+}
+
 /**
   Digests the input data and updates SHA-256 context.
 
@@ -139,9 +218,143 @@ Sha256Update (
   //
   // OpenSSL SHA-256 Hash Update
   //
+  if ((ShaAccelFeatures () & SHA_ACCEL_SHA256) != 0) {
+    return Sha256AccelUpdate ((SHA256_CTX *) Sha256Context, Data, DataSize);
+  }
   return (BOOLEAN) (SHA256_Update ((SHA256_CTX *) Sha256Context, Data, DataSize));
 }
 
+/**
+  Digests one buffer into each of several SHA-256 contexts.
+
+  When the processor has no SHA instructions but can run the compression
+  function on several messages at once (SHA_ACCEL_SHA256_MB), the whole
+  blocks of the buffers go through Sha256AccelMultiBlocks() together, for as
+  long as at least two of them have any left.  Otherwise this is the same as
+  calling Sha256Update() on each context in turn: one message through the SHA
+  instructions is faster than eight through the vector units.
+
+  If Sha256Contexts, Data or DataSize is NULL, then return FALSE.
+
+  @param[in, out]  Sha256Contexts  Pointers to the SHA-256 contexts.
+  @param[in]       Data            For each context, the buffer to be hashed into it.
+  @param[in]       DataSize        For each context, the size of its buffer in bytes.
+  @param[in]       Count           Number of contexts.
+
+  @retval TRUE   SHA-256 data digest succeeded.
+  @retval FALSE  SHA-256 data digest failed.
+
+**/
+BOOLEAN
+EFIAPI
+Sha256UpdateMulti (
+  IN OUT  VOID         **Sha256Contexts,
+  IN      CONST VOID   **Data,
+  IN      CONST UINTN  *DataSize,
+  IN      UINTN        Count
+  )
+{
+  SHA256_CTX   *Contexts[SHA256_MB_LANES];
+  CONST UINT8  *Next[SHA256_MB_LANES];
+  UINTN        Left[SHA256_MB_LANES];
+  UINT32       *States[SHA256_MB_LANES];
+  CONST UINT8  *Blocks[SHA256_MB_LANES];
+  UINTN        Active[SHA256_MB_LANES];
+  UINTN        First;
+  UINTN        Lanes;
+  UINTN        Lane;
+  UINTN        Busy;
+  UINTN        Length;
+
+  if (Sha256Contexts == NULL || Data == NULL || DataSize == NULL) {
+    return FALSE;
+  }
+
+  if ((ShaAccelFeatures () & (SHA_ACCEL_SHA256 | SHA_ACCEL_SHA256_MB)) != SHA_ACCEL_SHA256_MB ||
+      Count < 2) {
+    for (First = 0; First < Count; First++) {
+      if (!Sha256Update (Sha256Contexts[First], Data[First], DataSize[First])) {
+        return FALSE;
+      }
+    }
+    return TRUE;
+  }
+
+  for (First = 0; First < Count; First += Lanes) {
+    Lanes = Count - First;
+    if (Lanes > SHA256_MB_LANES) {
+      Lanes = SHA256_MB_LANES;
+    }
+
+    //
+    // Finish off whatever each context already has buffered.
+    //
+    for (Lane = 0; Lane < Lanes; Lane++) {
+      Contexts[Lane] = Sha256Contexts[First + Lane];
+      Next[Lane]     = Data[First + Lane];
+      Left[Lane]     = DataSize[First + Lane];
+      if (Contexts[Lane] == NULL || (Next[Lane] == NULL && Left[Lane] != 0)) {
+        return FALSE;
+      }
+      if (Contexts[Lane]->num != 0 && Left[Lane] != 0) {
+        Length = SHA_CBLOCK - Contexts[Lane]->num;
+        if (Length > Left[Lane]) {
+          Length = Left[Lane];
+        }
+        if (!SHA256_Update (Contexts[Lane], Next[Lane], Length)) {
+          return FALSE;
+        }
+        Next[Lane] += Length;
+        Left[Lane] -= Length;
+      }
+    }
+
+    //
+    // Then run the whole blocks of every message that has some, as many
+    // blocks at a time as the shortest of them has.
+    //
+    for (;;) {
+      Busy   = 0;
+      Length = 0;
+      for (Lane = 0; Lane < Lanes; Lane++) {
+        if (Left[Lane] < SHA_CBLOCK) {
+          continue;
+        }
+        States[Busy] = (UINT32 *) Contexts[Lane]->h;
+        Blocks[Busy] = Next[Lane];
+        Active[Busy] = Lane;
+        if (Busy == 0 || Left[Lane] < Length) {
+          Length = Left[Lane];
+        }
+        Busy++;
+      }
+      if (Busy < 2) {
+        break;
+      }
+
+      Length -= Length % SHA_CBLOCK;
+      Sha256AccelMultiBlocks (States, Blocks, Busy, Length / SHA_CBLOCK);
+      for (Lane = 0; Lane < Busy; Lane++) {
+        Sha256AddLength (Contexts[Active[Lane]], Length);
+        Next[Active[Lane]] += Length;
+        Left[Active[Lane]] -= Length;
+      }
+    }
+
+    //
+    // Whatever is left, at most one message with whole blocks and the
+    // tails of the rest, goes through OpenSSL.
+    //
+    for (Lane = 0; Lane < Lanes; Lane++) {
+      if (Left[Lane] != 0 && !SHA256_Update (Contexts[Lane], Next[Lane], Left[Lane])) {
+        return FALSE;
+      }
+    }
+  }
+
+  return TRUE;
+}
+
 /**
   Completes computation of the SHA-256 digest value.
 
@@ -0,0 +1,930 @@
+/** @file
+  SHA-1 and SHA-256 compression functions using processor SHA extensions.
+
+  The x86-64 code uses the SHA New Instructions, the AArch64 code uses the
+  ARMv8 Cryptographic Extension.  Sha1Update() and Sha256Update() hand whole
+  blocks to these when ShaAccelFeatures() reports support for them, and fall
+  back to the portable OpenSSL code otherwise.
+
+  Processors without those can still hash several SHA-256 messages at once,
+  one per vector lane: eight with AVX2, four with AArch64 Advanced SIMD.
+  Sha256UpdateMulti() uses that.
+
+This program and the accompanying materials
+are licensed and made available under the terms and conditions of the BSD License
+which accompanies this distribution.  The full text of the license may be found at
+http://opensource.org/licenses/bsd-license.php
+
+THE PROGRAM IS DISTRIBUTED UNDER THE BSD LICENSE ON AN "AS IS" BASIS,
+WITHOUT WARRANTIES OR REPRESENTATIONS OF ANY KIND, EITHER EXPRESS OR IMPLIED.
+
+**/
+
+#ifdef SHIM_UNIT_TEST
+#include "shim.h"
+#include <Library/BaseCryptLib.h>
+#else
+#include "InternalCryptLib.h"
+#endif
+
+#if defined(__x86_64__)
+#include <cpuid.h>
+#include <immintrin.h>
+#define SHA_ACCEL_TARGET __attribute__((target ("sse4.1,sha")))
+#define SHA_MB_TARGET    __attribute__((target ("avx2")))
+#define SHA_MB_WIDTH     8
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define SHA_ACCEL_TARGET __attribute__((target ("+crypto")))
+#define SHA_MB_TARGET    __attribute__((target ("+simd")))
+#define SHA_MB_WIDTH     4
+#endif
+
+STATIC BOOLEAN  mShaAccelProbed = FALSE;
+STATIC UINT32   mShaAccelFeatures = 0;
+
+#if defined(__x86_64__) || defined(__aarch64__)
+STATIC CONST UINT32 mSha256K[64] __attribute__((aligned (16))) = {
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+  0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+  0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+  0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+  0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+  0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+#endif
+
+#if defined(__x86_64__)
+
+STATIC
+UINT32
+ShaAccelProbe (
+  VOID
+  )
+{
+  UINT32  Eax;
+  UINT32  Ebx;
+  UINT32  Ecx;
+  UINT32  Edx;
+  UINT32  Leaf1Ecx;
+  UINT32  Xcr0;
+  UINT32  Features;
+
+  if (!__get_cpuid (1, &Eax, &Ebx, &Ecx, &Edx)) {
+    return 0;
+  }
+  Leaf1Ecx = Ecx;
+  if (!__get_cpuid_count (7, 0, &Eax, &Ebx, &Ecx, &Edx)) {
+    return 0;
+  }
+
+  //
+  // SHA-NI needs SSSE3 (pshufb) and SSE4.1 (pblendw, pextrd) as well.
+  //
+  Features = 0;
+  if ((Leaf1Ecx & bit_SSSE3) != 0 && (Leaf1Ecx & bit_SSE4_1) != 0 &&
+      (Ebx & bit_SHA) != 0) {
+    Features |= SHA_ACCEL_SHA1 | SHA_ACCEL_SHA256;
+  }
+
+  //
+  // AVX2 also needs the YMM state to have been enabled in XCR0, which
+  // firmware doesn't always do.
+  //
+  if ((Ebx & bit_AVX2) != 0 && (Leaf1Ecx & bit_OSXSAVE) != 0) {
+    __asm__ ("xgetbv" : "=a" (Xcr0) : "c" (0) : "edx");
+    if ((Xcr0 & 0x6) == 0x6) {
+      Features |= SHA_ACCEL_SHA256_MB;
+    }
+  }
+
+  return Features;
+}
+
+//
+// Four SHA-1 rounds.  Even groups consume E0 and leave the next E in E1,
+// odd groups the other way around.
+//
+#define SHA1_ROUNDS4(Ea, Eb, W, F)                       \
+  do {                                                   \
+    Ea = _mm_sha1nexte_epu32 (Ea, W);                    \
+    Eb = Abcd;                                           \
+    Abcd = _mm_sha1rnds4_epu32 (Abcd, Ea, F);            \
+  } while (0)
+
+SHA_ACCEL_TARGET
+STATIC
+VOID
+Sha1BlocksShaNi (
+  IN OUT  UINT32       *State,
+  IN      CONST UINT8  *Data,
+  IN      UINTN        Blocks
+  )
+{
+  __m128i  Abcd;
+  __m128i  AbcdSave;
+  __m128i  E0;
+  __m128i  E0Save;
+  __m128i  E1;
+  __m128i  W0;
+  __m128i  W1;
+  __m128i  W2;
+  __m128i  W3;
+  __m128i  Mask;
+
+  Mask = _mm_set_epi64x (0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+  Abcd = _mm_shuffle_epi32 (_mm_loadu_si128 ((CONST __m128i *) State), 0x1B);
+  E0   = _mm_set_epi32 ((INT32) State[4], 0, 0, 0);
+
+  for ( ; Blocks > 0; Blocks--, Data += 64) {
+    AbcdSave = Abcd;
+    E0Save   = E0;
+
+    W0 = _mm_shuffle_epi8 (_mm_loadu_si128 ((CONST __m128i *) (Data + 0)), Mask);
+    W1 = _mm_shuffle_epi8 (_mm_loadu_si128 ((CONST __m128i *) (Data + 16)), Mask);
+    W2 = _mm_shuffle_epi8 (_mm_loadu_si128 ((CONST __m128i *) (Data + 32)), Mask);
+    W3 = _mm_shuffle_epi8 (_mm_loadu_si128 ((CONST __m128i *) (Data + 48)), Mask);
+
+    //
+    // Rounds 0-15
+    //
+    E0   = _mm_add_epi32 (E0, W0);
+    E1   = Abcd;
+    Abcd = _mm_sha1rnds4_epu32 (Abcd, E0, 0);
+    SHA1_ROUNDS4 (E1, E0, W1, 0);
+    W0 = _mm_sha1msg1_epu32 (W0, W1);
+    SHA1_ROUNDS4 (E0, E1, W2, 0);
+    W1 = _mm_sha1msg1_epu32 (W1, W2);
+    W0 = _mm_xor_si128 (W0, W2);
+    W0 = _mm_sha1msg2_epu32 (W0, W3);
+    SHA1_ROUNDS4 (E1, E0, W3, 0);
+    W2 = _mm_sha1msg1_epu32 (W2, W3);
+    W1 = _mm_xor_si128 (W1, W3);
+
+    //
+    // Rounds 16-67: each group finishes W[i+1], starts W[i+3] and
+    // folds W[i] into W[i+2].
+    //
+#define SHA1_SCHEDULE4(Ea, Eb, Wc, Wn, Wp, Wx, F)        \
+    do {                                                 \
+      Wn = _mm_sha1msg2_epu32 (Wn, Wc);                  \
+      SHA1_ROUNDS4 (Ea, Eb, Wc, F);                      \
+      Wp = _mm_sha1msg1_epu32 (Wp, Wc);                  \
+      Wx = _mm_xor_si128 (Wx, Wc);                       \
+    } while (0)
+
+    SHA1_SCHEDULE4 (E0, E1, W0, W1, W3, W2, 0);
+    SHA1_SCHEDULE4 (E1, E0, W1, W2, W0, W3, 1);
+    SHA1_SCHEDULE4 (E0, E1, W2, W3, W1, W0, 1);
+    SHA1_SCHEDULE4 (E1, E0, W3, W0, W2, W1, 1);
+    SHA1_SCHEDULE4 (E0, E1, W0, W1, W3, W2, 1);
+    SHA1_SCHEDULE4 (E1, E0, W1, W2, W0, W3, 1);
+    SHA1_SCHEDULE4 (E0, E1, W2, W3, W1, W0, 2);
+    SHA1_SCHEDULE4 (E1, E0, W3, W0, W2, W1, 2);
+    SHA1_SCHEDULE4 (E0, E1, W0, W1, W3, W2, 2);
+    SHA1_SCHEDULE4 (E1, E0, W1, W2, W0, W3, 2);
+    SHA1_SCHEDULE4 (E0, E1, W2, W3, W1, W0, 2);
+    SHA1_SCHEDULE4 (E1, E0, W3, W0, W2, W1, 3);
+    SHA1_SCHEDULE4 (E0, E1, W0, W1, W3, W2, 3);
+#undef SHA1_SCHEDULE4
+
+    //
+    // Rounds 68-79
+    //
+    W2 = _mm_sha1msg2_epu32 (W2, W1);
+    SHA1_ROUNDS4 (E1, E0, W1, 3);
+    W3 = _mm_xor_si128 (W3, W1);
+    W3 = _mm_sha1msg2_epu32 (W3, W2);
+    SHA1_ROUNDS4 (E0, E1, W2, 3);
+    SHA1_ROUNDS4 (E1, E0, W3, 3);
+
+    E0   = _mm_sha1nexte_epu32 (E0, E0Save);
+    Abcd = _mm_add_epi32 (Abcd, AbcdSave);
+  }
+
+  _mm_storeu_si128 ((__m128i *) State, _mm_shuffle_epi32 (Abcd, 0x1B));
+  State[4] = (UINT32) _mm_extract_epi32 (E0, 3);
+}
+
+#undef SHA1_ROUNDS4
+
+//
+// Four SHA-256 rounds on W[i] + K[i].
+//
+#define SHA256_ROUNDS4(W, I)                                                        \
+  do {                                                                              \
+    Msg    = _mm_add_epi32 (W, _mm_load_si128 ((CONST __m128i *) &mSha256K[(I) * 4])); \
+    State1 = _mm_sha256rnds2_epu32 (State1, State0, Msg);                           \
+    Msg    = _mm_shuffle_epi32 (Msg, 0x0E);                                         \
+    State0 = _mm_sha256rnds2_epu32 (State0, State1, Msg);                           \
+  } while (0)
+
+//
+// Four rounds that also finish W[i+1] and start W[i-1] (== W[i+3]).
+//
+#define SHA256_SCHEDULE4(Wc, Wn, Wp, I)                 \
+  do {                                                  \
+    Wn = _mm_add_epi32 (Wn, _mm_alignr_epi8 (Wc, Wp, 4)); \
+    Wn = _mm_sha256msg2_epu32 (Wn, Wc);                 \
+    SHA256_ROUNDS4 (Wc, I);                             \
+    Wp = _mm_sha256msg1_epu32 (Wp, Wc);                 \
+  } while (0)
+
+SHA_ACCEL_TARGET
+STATIC
+VOID
+Sha256BlocksShaNi (
+  IN OUT  UINT32       *State,
+  IN      CONST UINT8  *Data,
+  IN      UINTN        Blocks
+  )
+{
+  __m128i  State0;
+  __m128i  State1;
+  __m128i  Save0;
+  __m128i  Save1;
+  __m128i  Msg;
+  __m128i  Tmp;
+  __m128i  W0;
+  __m128i  W1;
+  __m128i  W2;
+  __m128i  W3;
+  __m128i  Mask;
+
+  Mask = _mm_set_epi64x (0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+
+  //
+  // The instructions want the state as ABEF / CDGH.
+  //
+  Tmp    = _mm_shuffle_epi32 (_mm_loadu_si128 ((CONST __m128i *) &State[0]), 0xB1);
+  State1 = _mm_shuffle_epi32 (_mm_loadu_si128 ((CONST __m128i *) &State[4]), 0x1B);
+  State0 = _mm_alignr_epi8 (Tmp, State1, 8);
+  State1 = _mm_blend_epi16 (State1, Tmp, 0xF0);
+
+  for ( ; Blocks > 0; Blocks--, Data += 64) {
+    Save0 = State0;
+    Save1 = State1;
+
+    W0 = _mm_shuffle_epi8 (_mm_loadu_si128 ((CONST __m128i *) (Data + 0)), Mask);
+    W1 = _mm_shuffle_epi8 (_mm_loadu_si128 ((CONST __m128i *) (Data + 16)), Mask);
+    W2 = _mm_shuffle_epi8 (_mm_loadu_si128 ((CONST __m128i *) (Data + 32)), Mask);
+    W3 = _mm_shuffle_epi8 (_mm_loadu_si128 ((CONST __m128i *) (Data + 48)), Mask);
+
+    SHA256_ROUNDS4 (W0, 0);
+    SHA256_ROUNDS4 (W1, 1);
+    W0 = _mm_sha256msg1_epu32 (W0, W1);
+    SHA256_ROUNDS4 (W2, 2);
+    W1 = _mm_sha256msg1_epu32 (W1, W2);
+    SHA256_SCHEDULE4 (W3, W0, W2, 3);
+    SHA256_SCHEDULE4 (W0, W1, W3, 4);
+    SHA256_SCHEDULE4 (W1, W2, W0, 5);
+    SHA256_SCHEDULE4 (W2, W3, W1, 6);
+    SHA256_SCHEDULE4 (W3, W0, W2, 7);
+    SHA256_SCHEDULE4 (W0, W1, W3, 8);
+    SHA256_SCHEDULE4 (W1, W2, W0, 9);
+    SHA256_SCHEDULE4 (W2, W3, W1, 10);
+    SHA256_SCHEDULE4 (W3, W0, W2, 11);
+    SHA256_SCHEDULE4 (W0, W1, W3, 12);
+
+    //
+    // Rounds 52-63 only need to finish the schedule.
+    //
+    W2 = _mm_add_epi32 (W2, _mm_alignr_epi8 (W1, W0, 4));
+    W2 = _mm_sha256msg2_epu32 (W2, W1);
+    SHA256_ROUNDS4 (W1, 13);
+    W3 = _mm_add_epi32 (W3, _mm_alignr_epi8 (W2, W1, 4));
+    W3 = _mm_sha256msg2_epu32 (W3, W2);
+    SHA256_ROUNDS4 (W2, 14);
+    SHA256_ROUNDS4 (W3, 15);
+
+    State0 = _mm_add_epi32 (State0, Save0);
+    State1 = _mm_add_epi32 (State1, Save1);
+  }
+
+  Tmp    = _mm_shuffle_epi32 (State0, 0x1B);
+  State1 = _mm_shuffle_epi32 (State1, 0xB1);
+  State0 = _mm_blend_epi16 (Tmp, State1, 0xF0);
+  State1 = _mm_alignr_epi8 (State1, Tmp, 8);
+  _mm_storeu_si128 ((__m128i *) &State[0], State0);
+  _mm_storeu_si128 ((__m128i *) &State[4], State1);
+}
+
+#undef SHA256_SCHEDULE4
+#undef SHA256_ROUNDS4
+
+//
+// The SHA-256 functions, on one word from each of eight messages.
+//
+#define MB_ROTR(X, N)  _mm256_or_si256 (_mm256_srli_epi32 (X, N), _mm256_slli_epi32 (X, 32 - (N)))
+#define MB_XOR3(X, Y, Z)  _mm256_xor_si256 (_mm256_xor_si256 (X, Y), Z)
+#define MB_BSIG0(X)  MB_XOR3 (MB_ROTR (X, 2), MB_ROTR (X, 13), MB_ROTR (X, 22))
+#define MB_BSIG1(X)  MB_XOR3 (MB_ROTR (X, 6), MB_ROTR (X, 11), MB_ROTR (X, 25))
+#define MB_SSIG0(X)  MB_XOR3 (MB_ROTR (X, 7), MB_ROTR (X, 18), _mm256_srli_epi32 (X, 3))
+#define MB_SSIG1(X)  MB_XOR3 (MB_ROTR (X, 17), MB_ROTR (X, 19), _mm256_srli_epi32 (X, 10))
+#define MB_CH(X, Y, Z)   _mm256_xor_si256 (_mm256_and_si256 (X, Y), _mm256_andnot_si256 (X, Z))
+#define MB_MAJ(X, Y, Z)  _mm256_or_si256 (_mm256_and_si256 (X, Y), _mm256_and_si256 (Z, _mm256_or_si256 (X, Y)))
+#define MB_ADD(X, Y)     _mm256_add_epi32 (X, Y)
+
+//
+// Load eight big-endian words from each of eight messages, and turn them
+// into eight vectors of one word from every message.
+//
+SHA_MB_TARGET
+STATIC
+VOID
+Sha256MultiLoadAvx2 (
+  OUT  __m256i      *W,
+  IN   CONST UINT8  **Data,
+  IN   UINTN        Offset
+  )
+{
+  __m256i  Mask;
+  __m256i  R[8];
+  __m256i  T[8];
+  __m256i  U[8];
+  UINTN    Lane;
+
+  Mask = _mm256_set_epi8 (
+           12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3,
+           12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3
+           );
+  for (Lane = 0; Lane < 8; Lane++) {
+    R[Lane] = _mm256_shuffle_epi8 (
+                _mm256_loadu_si256 ((CONST __m256i *) (Data[Lane] + Offset)),
+                Mask
+                );
+  }
+
+  for (Lane = 0; Lane < 8; Lane += 2) {
+    T[Lane]     = _mm256_unpacklo_epi32 (R[Lane], R[Lane + 1]);
+    T[Lane + 1] = _mm256_unpackhi_epi32 (R[Lane], R[Lane + 1]);
+  }
+  for (Lane = 0; Lane < 8; Lane += 4) {
+    U[Lane]     = _mm256_unpacklo_epi64 (T[Lane], T[Lane + 2]);
+    U[Lane + 1] = _mm256_unpackhi_epi64 (T[Lane], T[Lane + 2]);
+    U[Lane + 2] = _mm256_unpacklo_epi64 (T[Lane + 1], T[Lane + 3]);
+    U[Lane + 3] = _mm256_unpackhi_epi64 (T[Lane + 1], T[Lane + 3]);
+  }
+  for (Lane = 0; Lane < 4; Lane++) {
+    W[Lane]     = _mm256_permute2x128_si256 (U[Lane], U[Lane + 4], 0x20);
+    W[Lane + 4] = _mm256_permute2x128_si256 (U[Lane], U[Lane + 4], 0x31);
+  }
+}
+
+SHA_MB_TARGET
+STATIC
+VOID
+Sha256MultiBlocksAvx2 (
+  IN OUT  UINT32       **States,
+  IN      CONST UINT8  **Data,
+  IN      UINTN        Blocks
+  )
+{
+  CONST UINT8  *Ptr[8];
+  UINT32       Words[8] __attribute__((aligned (32)));
+  __m256i      S[8];
+  __m256i      W[16];
+  __m256i      A, B, C, D, E, F, G, H;
+  __m256i      T1;
+  __m256i      T2;
+  UINTN        Index;
+  UINTN        Lane;
+
+  for (Lane = 0; Lane < 8; Lane++) {
+    Ptr[Lane] = Data[Lane];
+  }
+
+  //
+  // Every lane's state is read before any is written back, so a lane
+  // that's a copy of another, to fill the vector, is harmless.
+  //
+  for (Index = 0; Index < 8; Index++) {
+    for (Lane = 0; Lane < 8; Lane++) {
+      Words[Lane] = States[Lane][Index];
+    }
+    S[Index] = _mm256_load_si256 ((CONST __m256i *) Words);
+  }
+
+  for ( ; Blocks > 0; Blocks--) {
+    Sha256MultiLoadAvx2 (&W[0], Ptr, 0);
+    Sha256MultiLoadAvx2 (&W[8], Ptr, 32);
+
+    A = S[0];
+    B = S[1];
+    C = S[2];
+    D = S[3];
+    E = S[4];
+    F = S[5];
+    G = S[6];
+    H = S[7];
+
+    for (Index = 0; Index < 64; Index++) {
+      if (Index >= 16) {
+        W[Index % 16] = MB_ADD (
+                          MB_ADD (MB_SSIG1 (W[(Index - 2) % 16]), W[(Index - 7) % 16]),
+                          MB_ADD (MB_SSIG0 (W[(Index - 15) % 16]), W[Index % 16])
+                          );
+      }
+      T1 = MB_ADD (
+             MB_ADD (H, MB_BSIG1 (E)),
+             MB_ADD (
+               MB_CH (E, F, G),
+               MB_ADD (_mm256_set1_epi32 ((INT32) mSha256K[Index]), W[Index % 16])
+               )
+             );
+      T2 = MB_ADD (MB_BSIG0 (A), MB_MAJ (A, B, C));
+      H  = G;
+      G  = F;
+      F  = E;
+      E  = MB_ADD (D, T1);
+      D  = C;
+      C  = B;
+      B  = A;
+      A  = MB_ADD (T1, T2);
+    }
+
+    S[0] = MB_ADD (S[0], A);
+    S[1] = MB_ADD (S[1], B);
+    S[2] = MB_ADD (S[2], C);
+    S[3] = MB_ADD (S[3], D);
+    S[4] = MB_ADD (S[4], E);
+    S[5] = MB_ADD (S[5], F);
+    S[6] = MB_ADD (S[6], G);
+    S[7] = MB_ADD (S[7], H);
+
+    for (Lane = 0; Lane < 8; Lane++) {
+      Ptr[Lane] += 64;
+    }
+  }
+
+  for (Index = 0; Index < 8; Index++) {
+    _mm256_store_si256 ((__m256i *) Words, S[Index]);
+    for (Lane = 0; Lane < 8; Lane++) {
+      States[Lane][Index] = Words[Lane];
+    }
+  }
+}
+
+#undef MB_ADD
+#undef MB_MAJ
+#undef MB_CH
+#undef MB_SSIG1
+#undef MB_SSIG0
+#undef MB_BSIG1
+#undef MB_BSIG0
+#undef MB_XOR3
+#undef MB_ROTR
+
+#define Sha1BlocksAccel         Sha1BlocksShaNi
+#define Sha256BlocksAccel       Sha256BlocksShaNi
+#define Sha256MultiBlocksAccel  Sha256MultiBlocksAvx2
+
+#elif defined(__aarch64__)
+
+STATIC
+UINT32
+ShaAccelProbe (
+  VOID
+  )
+{
+  UINT64  Isar0;
+  UINT64  Pfr0;
+  UINT32  Features;
+
+  //
+  // ID_AA64ISAR0_EL1.SHA1 is bits [11:8], .SHA2 is bits [15:12].
+  //
+  __asm__ ("mrs %0, ID_AA64ISAR0_EL1" : "=r" (Isar0));
+
+  Features = 0;
+  if (((Isar0 >> 8) & 0xF) != 0) {
+    Features |= SHA_ACCEL_SHA1;
+  }
+  if (((Isar0 >> 12) & 0xF) != 0) {
+    Features |= SHA_ACCEL_SHA256;
+  }
+
+  //
+  // ID_AA64PFR0_EL1.AdvSIMD is bits [23:20], 0xF if it isn't there.
+  //
+  __asm__ ("mrs %0, ID_AA64PFR0_EL1" : "=r" (Pfr0));
+  if (((Pfr0 >> 20) & 0xF) != 0xF) {
+    Features |= SHA_ACCEL_SHA256_MB;
+  }
+  return Features;
+}
+
+SHA_ACCEL_TARGET
+STATIC
+VOID
+Sha1BlocksArmv8 (
+  IN OUT  UINT32       *State,
+  IN      CONST UINT8  *Data,
+  IN      UINTN        Blocks
+  )
+{
+  STATIC CONST UINT32  K[4] = { 0x5A827999, 0x6ED9EBA1, 0x8F1BBCDC, 0xCA62C1D6 };
+  uint32x4_t           Abcd;
+  uint32x4_t           AbcdSave;
+  uint32x4_t           W[4];
+  uint32x4_t           Wk;
+  UINT32               E;
+  UINT32               ESave;
+  UINT32               ENext;
+  UINTN                Index;
+
+  Abcd = vld1q_u32 (State);
+  E    = State[4];
+
+  for ( ; Blocks > 0; Blocks--, Data += 64) {
+    AbcdSave = Abcd;
+    ESave    = E;
+
+    for (Index = 0; Index < 4; Index++) {
+      W[Index] = vreinterpretq_u32_u8 (vrev32q_u8 (vld1q_u8 (Data + Index * 16)));
+    }
+
+    for (Index = 0; Index < 20; Index++) {
+      Wk    = vaddq_u32 (W[Index % 4], vdupq_n_u32 (K[Index / 5]));
+      ENext = vsha1h_u32 (vgetq_lane_u32 (Abcd, 0));
+      if (Index < 5) {
+        Abcd = vsha1cq_u32 (Abcd, E, Wk);
+      } else if (Index >= 10 && Index < 15) {
+        Abcd = vsha1mq_u32 (Abcd, E, Wk);
+      } else {
+        Abcd = vsha1pq_u32 (Abcd, E, Wk);
+      }
+      E = ENext;
+
+      if (Index < 16) {
+        W[Index % 4] = vsha1su1q_u32 (
+                         vsha1su0q_u32 (W[Index % 4], W[(Index + 1) % 4], W[(Index + 2) % 4]),
+                         W[(Index + 3) % 4]
+                         );
+      }
+    }
+
+    Abcd = vaddq_u32 (Abcd, AbcdSave);
+    E   += ESave;
+  }
+
+  vst1q_u32 (State, Abcd);
+  State[4] = E;
+}
+
+SHA_ACCEL_TARGET
+STATIC
+VOID
+Sha256BlocksArmv8 (
+  IN OUT  UINT32       *State,
+  IN      CONST UINT8  *Data,
+  IN      UINTN        Blocks
+  )
+{
+  uint32x4_t  State0;
+  uint32x4_t  State1;
+  uint32x4_t  Save0;
+  uint32x4_t  Save1;
+  uint32x4_t  Tmp;
+  uint32x4_t  W[4];
+  uint32x4_t  Wk;
+  UINTN       Index;
+
+  State0 = vld1q_u32 (&State[0]);
+  State1 = vld1q_u32 (&State[4]);
+
+  for ( ; Blocks > 0; Blocks--, Data += 64) {
+    Save0 = State0;
+    Save1 = State1;
+
+    for (Index = 0; Index < 4; Index++) {
+      W[Index] = vreinterpretq_u32_u8 (vrev32q_u8 (vld1q_u8 (Data + Index * 16)));
+    }
+
+    for (Index = 0; Index < 16; Index++) {
+      Wk = vaddq_u32 (W[Index % 4], vld1q_u32 (&mSha256K[Index * 4]));
+      if (Index < 12) {
+        W[Index % 4] = vsha256su0q_u32 (W[Index % 4], W[(Index + 1) % 4]);
+      }
+      Tmp    = State0;
+      State0 = vsha256hq_u32 (State0, State1, Wk);
+      State1 = vsha256h2q_u32 (State1, Tmp, Wk);
+      if (Index < 12) {
+        W[Index % 4] = vsha256su1q_u32 (W[Index % 4], W[(Index + 2) % 4], W[(Index + 3) % 4]);
+      }
+    }
+
+    State0 = vaddq_u32 (State0, Save0);
+    State1 = vaddq_u32 (State1, Save1);
+  }
+
+  vst1q_u32 (&State[0], State0);
+  vst1q_u32 (&State[4], State1);
+}
+
+//
+// The SHA-256 functions, on one word from each of four messages.
+//
+#define MB_ROTR(X, N)  vsriq_n_u32 (vshlq_n_u32 (X, 32 - (N)), X, N)
+#define MB_XOR3(X, Y, Z)  veorq_u32 (veorq_u32 (X, Y), Z)
+#define MB_BSIG0(X)  MB_XOR3 (MB_ROTR (X, 2), MB_ROTR (X, 13), MB_ROTR (X, 22))
+#define MB_BSIG1(X)  MB_XOR3 (MB_ROTR (X, 6), MB_ROTR (X, 11), MB_ROTR (X, 25))
+#define MB_SSIG0(X)  MB_XOR3 (MB_ROTR (X, 7), MB_ROTR (X, 18), vshrq_n_u32 (X, 3))
+#define MB_SSIG1(X)  MB_XOR3 (MB_ROTR (X, 17), MB_ROTR (X, 19), vshrq_n_u32 (X, 10))
+#define MB_CH(X, Y, Z)   vbslq_u32 (X, Y, Z)
+#define MB_MAJ(X, Y, Z)  vbslq_u32 (veorq_u32 (X, Y), Z, Y)
+#define MB_ADD(X, Y)     vaddq_u32 (X, Y)
+
+//
+// Load four big-endian words from each of four messages, and turn them
+// into four vectors of one word from every message.
+//
+SHA_MB_TARGET
+STATIC
+VOID
+Sha256MultiLoadNeon (
+  OUT  uint32x4_t   *W,
+  IN   CONST UINT8  **Data,
+  IN   UINTN        Offset
+  )
+{
+  uint32x4_t    R[4];
+  uint32x4x2_t  P0;
+  uint32x4x2_t  P1;
+  UINTN         Lane;
+
+  for (Lane = 0; Lane < 4; Lane++) {
+    R[Lane] = vreinterpretq_u32_u8 (vrev32q_u8 (vld1q_u8 (Data[Lane] + Offset)));
+  }
+
+  P0   = vtrnq_u32 (R[0], R[1]);
+  P1   = vtrnq_u32 (R[2], R[3]);
+  W[0] = vcombine_u32 (vget_low_u32 (P0.val[0]), vget_low_u32 (P1.val[0]));
+  W[1] = vcombine_u32 (vget_low_u32 (P0.val[1]), vget_low_u32 (P1.val[1]));
+  W[2] = vcombine_u32 (vget_high_u32 (P0.val[0]), vget_high_u32 (P1.val[0]));
+  W[3] = vcombine_u32 (vget_high_u32 (P0.val[1]), vget_high_u32 (P1.val[1]));
+}
+
+SHA_MB_TARGET
+STATIC
+VOID
+Sha256MultiBlocksNeon (
+  IN OUT  UINT32       **States,
+  IN      CONST UINT8  **Data,
+  IN      UINTN        Blocks
+  )
+{
+  CONST UINT8  *Ptr[4];
+  UINT32       Words[4];
+  uint32x4_t   S[8];
+  uint32x4_t   W[16];
+  uint32x4_t   A, B, C, D, E, F, G, H;
+  uint32x4_t   T1;
+  uint32x4_t   T2;
+  UINTN        Index;
+  UINTN        Lane;
+
+  for (Lane = 0; Lane < 4; Lane++) {
+    Ptr[Lane] = Data[Lane];
+  }
+
+  //
+  // Every lane's state is read before any is written back, so a lane
+  // that's a copy of another, to fill the vector, is harmless.
+  //
+  for (Index = 0; Index < 8; Index++) {
+    for (Lane = 0; Lane < 4; Lane++) {
+      Words[Lane] = States[Lane][Index];
+    }
+    S[Index] = vld1q_u32 (Words);
+  }
+
+  for ( ; Blocks > 0; Blocks--) {
+    for (Index = 0; Index < 4; Index++) {
+      Sha256MultiLoadNeon (&W[Index * 4], Ptr, Index * 16);
+    }
+
+    A = S[0];
+    B = S[1];
+    C = S[2];
+    D = S[3];
+    E = S[4];
+    F = S[5];
+    G = S[6];
+    H = S[7];
+
+    for (Index = 0; Index < 64; Index++) {
+      if (Index >= 16) {
+        W[Index % 16] = MB_ADD (
+                          MB_ADD (MB_SSIG1 (W[(Index - 2) % 16]), W[(Index - 7) % 16]),
+                          MB_ADD (MB_SSIG0 (W[(Index - 15) % 16]), W[Index % 16])
+                          );
+      }
+      T1 = MB_ADD (
+             MB_ADD (H, MB_BSIG1 (E)),
+             MB_ADD (
+               MB_CH (E, F, G),
+               MB_ADD (vdupq_n_u32 (mSha256K[Index]), W[Index % 16])
+               )
+             );
+      T2 = MB_ADD (MB_BSIG0 (A), MB_MAJ (A, B, C));
+      H  = G;
+      G  = F;
+      F  = E;
+      E  = MB_ADD (D, T1);
+      D  = C;
+      C  = B;
+      B  = A;
+      A  = MB_ADD (T1, T2);
+    }
+
+    S[0] = MB_ADD (S[0], A);
+    S[1] = MB_ADD (S[1], B);
+    S[2] = MB_ADD (S[2], C);
+    S[3] = MB_ADD (S[3], D);
+    S[4] = MB_ADD (S[4], E);
+    S[5] = MB_ADD (S[5], F);
+    S[6] = MB_ADD (S[6], G);
+    S[7] = MB_ADD (S[7], H);
+
+    for (Lane = 0; Lane < 4; Lane++) {
+      Ptr[Lane] += 64;
+    }
+  }
+
+  for (Index = 0; Index < 8; Index++) {
+    vst1q_u32 (Words, S[Index]);
+    for (Lane = 0; Lane < 4; Lane++) {
+      States[Lane][Index] = Words[Lane];
+    }
+  }
+}
+
+#undef MB_ADD
+#undef MB_MAJ
+#undef MB_CH
+#undef MB_SSIG1
+#undef MB_SSIG0
+#undef MB_BSIG1
+#undef MB_BSIG0
+#undef MB_XOR3
+#undef MB_ROTR
+
+#define Sha1BlocksAccel         Sha1BlocksArmv8
+#define Sha256BlocksAccel       Sha256BlocksArmv8
+#define Sha256MultiBlocksAccel  Sha256MultiBlocksNeon
+
+#else
+
+STATIC
+UINT32
+ShaAccelProbe (
+  VOID
+  )
+{
+  return 0;
+}
+
+#endif
+
+/**
+  Retrieves which SHA instruction set extensions the processor supports.
+
+  The processor is probed on the first call (CPUID on X64, ID_AA64ISAR0_EL1
+  on AArch64) and the result is cached.
+
+  @return  Bitmask of SHA_ACCEL_* values.  Zero if the portable code is used.
+
+**/
+UINT32
+EFIAPI
+ShaAccelFeatures (
+  VOID
+  )
+{
+  if (!mShaAccelProbed) {
+    mShaAccelFeatures = ShaAccelProbe ();
+    mShaAccelProbed   = TRUE;
+  }
+  return mShaAccelFeatures;
+}
+
+/**
+  Runs the SHA-1 compression function over whole 64-byte blocks using the
+  processor's SHA instructions.
+
+  @param[in, out]  State   The five SHA-1 chaining words.
+  @param[in]       Data    Pointer to the blocks to be hashed.
+  @param[in]       Blocks  Number of 64-byte blocks at Data.
+
+  @retval TRUE   The blocks were hashed.
+  @retval FALSE  The processor does not support SHA_ACCEL_SHA1.
+
+**/
+BOOLEAN
+EFIAPI
+Sha1AccelBlocks (
+  IN OUT  UINT32       *State,
+  IN      CONST UINT8  *Data,
+  IN      UINTN        Blocks
+  )
+{
+  if ((ShaAccelFeatures () & SHA_ACCEL_SHA1) == 0) {
+    return FALSE;
+  }
+#ifdef Sha1BlocksAccel
+  Sha1BlocksAccel (State, Data, Blocks);
+  return TRUE;
+#else
+  return FALSE;
+#endif
+}
+
+/**
+  Runs the SHA-256 compression function over whole 64-byte blocks using the
+  processor's SHA instructions.
+
+  @param[in, out]  State   The eight SHA-256 chaining words.
+  @param[in]       Data    Pointer to the blocks to be hashed.
+  @param[in]       Blocks  Number of 64-byte blocks at Data.
+
+  @retval TRUE   The blocks were hashed.
+  @retval FALSE  The processor does not support SHA_ACCEL_SHA256.
+
+**/
+BOOLEAN
+EFIAPI
+Sha256AccelBlocks (
+  IN OUT  UINT32       *State,
+  IN      CONST UINT8  *Data,
+  IN      UINTN        Blocks
+  )
+{
+  if ((ShaAccelFeatures () & SHA_ACCEL_SHA256) == 0) {
+    return FALSE;
+  }
+#ifdef Sha256BlocksAccel
+  Sha256BlocksAccel (State, Data, Blocks);
+  return TRUE;
+#else
+  return FALSE;
+#endif
+}
+
+/**
+  Runs the SHA-256 compression function over whole 64-byte blocks of
+  several messages at once, one per vector lane.
+
+  @param[in, out]  States  For each message, its eight SHA-256 chaining words.
+  @param[in]       Data    For each message, a pointer to its blocks.
+  @param[in]       Lanes   Number of messages, at most SHA256_MB_LANES.
+  @param[in]       Blocks  Number of 64-byte blocks to hash from every message.
+
+  @retval TRUE   The blocks were hashed.
+  @retval FALSE  The processor does not support SHA_ACCEL_SHA256_MB, or
+                 Lanes is out of range.
+
+**/
+BOOLEAN
+EFIAPI
+Sha256AccelMultiBlocks (
+  IN OUT  UINT32       **States,
+  IN      CONST UINT8  **Data,
+  IN      UINTN        Lanes,
+  IN      UINTN        Blocks
+  )
+{
+#ifdef Sha256MultiBlocksAccel
+  UINT32       *GroupStates[SHA_MB_WIDTH];
+  CONST UINT8  *GroupData[SHA_MB_WIDTH];
+  UINTN        First;
+  UINTN        Lane;
+#endif
+
+  if ((ShaAccelFeatures () & SHA_ACCEL_SHA256_MB) == 0 ||
+      Lanes == 0 || Lanes > SHA256_MB_LANES) {
+    return FALSE;
+  }
+#ifdef Sha256MultiBlocksAccel
+  for (First = 0; First < Lanes; First += SHA_MB_WIDTH) {
+    //
+    // A short group is filled up with copies of its first message.
+    //
+    for (Lane = 0; Lane < SHA_MB_WIDTH; Lane++) {
+      if (First + Lane < Lanes) {
+        GroupStates[Lane] = States[First + Lane];
+        GroupData[Lane]   = Data[First + Lane];
+      } else {
+        GroupStates[Lane] = States[First];
+        GroupData[Lane]   = Data[First];
+      }
+    }
+    Sha256MultiBlocksAccel (GroupStates, GroupData, Blocks);
+  }
+  return TRUE;
+#else
+  return FALSE;
+#endif
+}
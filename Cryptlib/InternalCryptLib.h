@@ -32,5 +32,52 @@ WITHOUT WARRANTIES OR REPRESENTATIONS OF ANY KIND, EITHER EXPRESS OR IMPLIED.
 #define OBJ_length(o) ((o)->length)
 #endif
 
+#include <openssl/pkcs7.h>
+
+//
+// Registers the digests every verifier needs, the first time it's called;
+// used by the X.509 and timestamp code too.
+//
+BOOLEAN
+Pkcs7RegisterDigests (
+  VOID
+  );
+
+//
+// Shared between the PKCS#7 and Authenticode verifiers
+//
+BOOLEAN
+Pkcs7VerifyDecoded (
+  IN  PKCS7        *Pkcs7,
+  IN  VOID         *Anchor,
+  IN  CONST UINT8  *InData,
+  IN  UINTN        DataLength,
+  OUT UINTN        *Matched  OPTIONAL
+  );
+
+//
+// Shared between the PKCS#7 verifier and Pk/CryptPkcs7Anchor.c
+//
+int
+X509VerifyCb (
+  IN int            Status,
+  IN X509_STORE_CTX *Context
+  );
+
+X509_STORE *
+Pkcs7StoreNew (
+  VOID
+  );
+
+BOOLEAN
+Pkcs7FindAnchor (
+  IN  STACK_OF(X509)  *Certs,
+  IN  STACK_OF(X509)  *Chain,
+  IN  PKCS7           *Pkcs7,
+  IN  CONST UINT8     *InData,
+  IN  UINTN           DataLength,
+  OUT UINTN           *Matched
+  );
+
 #endif
 
@@ -578,6 +578,33 @@ Sha256Update (
   IN      UINTN       DataSize
   );
 
+/**
+  Digests one buffer into each of several SHA-256 contexts.
+
+  Equivalent to calling Sha256Update() on each context in turn, but where the
+  processor can hash several messages at once (SHA_ACCEL_SHA256_MB) and has no
+  faster way to hash one, the buffers are hashed side by side.
+
+  If Sha256Contexts, Data or DataSize is NULL, then return FALSE.
+
+  @param[in, out]  Sha256Contexts  Pointers to the SHA-256 contexts.
+  @param[in]       Data            For each context, the buffer to be hashed into it.
+  @param[in]       DataSize        For each context, the size of its buffer in bytes.
+  @param[in]       Count           Number of contexts.
+
+  @retval TRUE   SHA-256 data digest succeeded.
+  @retval FALSE  SHA-256 data digest failed.
+
+**/
+BOOLEAN
+EFIAPI
+Sha256UpdateMulti (
+  IN OUT  VOID         **Sha256Contexts,
+  IN      CONST VOID   **Data,
+  IN      CONST UINTN  *DataSize,
+  IN      UINTN        Count
+  );
+
 /**
   Completes computation of the SHA-256 digest value.
 
@@ -893,6 +920,100 @@ Sha512HashAll (
   OUT  UINT8       *HashValue
   );
 
+///
+/// SHA instruction set extensions usable by Sha1Update() and Sha256Update().
+///
+#define SHA_ACCEL_SHA1       0x1
+#define SHA_ACCEL_SHA256     0x2
+///
+/// Vector instructions usable by Sha256UpdateMulti() to hash several
+/// messages at once.
+///
+#define SHA_ACCEL_SHA256_MB  0x4
+
+///
+/// The most messages Sha256AccelMultiBlocks() and Sha256UpdateMulti() take at once.
+///
+#define SHA256_MB_LANES  8
+
+/**
+  Retrieves which SHA instruction set extensions the processor supports.
+
+  The processor is probed on the first call (CPUID on X64, ID_AA64ISAR0_EL1
+  on AArch64) and the result is cached.
+
+  @return  Bitmask of SHA_ACCEL_* values.  Zero if the portable code is used.
+
+**/
+UINT32
+EFIAPI
+ShaAccelFeatures (
+  VOID
+  );
+
+/**
+  Runs the SHA-1 compression function over whole 64-byte blocks using the
+  processor's SHA instructions.
+
+  @param[in, out]  State   The five SHA-1 chaining words.
+  @param[in]       Data    Pointer to the blocks to be hashed.
+  @param[in]       Blocks  Number of 64-byte blocks at Data.
+
+  @retval TRUE   The blocks were hashed.
+  @retval FALSE  The processor does not support SHA_ACCEL_SHA1.
+
+**/
+BOOLEAN
+EFIAPI
+Sha1AccelBlocks (
+  IN OUT  UINT32       *State,
+  IN      CONST UINT8  *Data,
+  IN      UINTN        Blocks
+  );
+
+/**
+  Runs the SHA-256 compression function over whole 64-byte blocks using the
+  processor's SHA instructions.
+
+  @param[in, out]  State   The eight SHA-256 chaining words.
+  @param[in]       Data    Pointer to the blocks to be hashed.
+  @param[in]       Blocks  Number of 64-byte blocks at Data.
+
+  @retval TRUE   The blocks were hashed.
+  @retval FALSE  The processor does not support SHA_ACCEL_SHA256.
+
+**/
+BOOLEAN
+EFIAPI
+Sha256AccelBlocks (
+  IN OUT  UINT32       *State,
+  IN      CONST UINT8  *Data,
+  IN      UINTN        Blocks
+  );
+
+/**
+  Runs the SHA-256 compression function over whole 64-byte blocks of
+  several messages at once, one per vector lane.
+
+  @param[in, out]  States  For each message, its eight SHA-256 chaining words.
+  @param[in]       Data    For each message, a pointer to its blocks.
+  @param[in]       Lanes   Number of messages, at most SHA256_MB_LANES.
+  @param[in]       Blocks  Number of 64-byte blocks to hash from every message.
+
+  @retval TRUE   The blocks were hashed.
+  @retval FALSE  The processor does not support SHA_ACCEL_SHA256_MB, or
+                 Lanes is out of range.
+
+**/
+BOOLEAN
+EFIAPI
+Sha256AccelMultiBlocks (
+  IN OUT  UINT32       **States,
+  IN      CONST UINT8  **Data,
+  IN      UINTN        Lanes,
+  IN      UINTN        Blocks
+  );
+
 //=====================================================================================
 //    MAC (Message Authentication Code) Primitive
 //=====================================================================================
@@ -2403,6 +2524,68 @@ Pkcs7Verify (
   IN  UINTN        DataLength
   );
 
+/**
+  Decodes a trusted certificate and builds what is needed to verify PKCS#7
+  signed data against it, so it can be reused for many signatures.
+
+  If TrustedCert is NULL, then return NULL.
+  If this interface is not supported, then return NULL.
+
+  @param[in]  TrustedCert  Pointer to a trusted/root certificate encoded in DER, which
+                           is used for certificate chain verification.
+  @param[in]  CertLength   Length of the trusted certificate in bytes.
+
+  @return  Opaque trust anchor, to be released with Pkcs7TrustAnchorFree(), or
+           NULL if the certificate could not be decoded.
+
+**/
+VOID *
+EFIAPI
+Pkcs7TrustAnchorNew (
+  IN  CONST UINT8  *TrustedCert,
+  IN  UINTN        CertLength
+  );
+
+/**
+  Adds another trusted certificate to a trust anchor built by
+  Pkcs7TrustAnchorNew(), so one verification checks a signature against
+  every certificate in it.
+
+  If Anchor or TrustedCert is NULL, then return FALSE.
+  If this interface is not supported, then return FALSE.
+
+  @param[in]  Anchor       Pointer to the trust anchor.
+  @param[in]  TrustedCert  Pointer to a trusted/root certificate encoded in DER.
+  @param[in]  CertLength   Length of the trusted certificate in bytes.
+
+  @retval  TRUE   The certificate was added. Certificates are numbered from
+                  0 in the order they are added, starting with the one passed
+                  to Pkcs7TrustAnchorNew().
+  @retval  FALSE  The certificate could not be decoded, or a different one with
+                  the same subject is already in the anchor. The anchor is
+                  unchanged.
+
+**/
+BOOLEAN
+EFIAPI
+Pkcs7TrustAnchorAdd (
+  IN  VOID         *Anchor,
+  IN  CONST UINT8  *TrustedCert,
+  IN  UINTN        CertLength
+  );
+
+/**
+  Release a trust anchor built by Pkcs7TrustAnchorNew().
+
+  @param[in]  Anchor  Pointer to the trust anchor, or NULL.
+
+**/
+VOID
+EFIAPI
+Pkcs7TrustAnchorFree (
+  IN  VOID  *Anchor
+  );
+
 /**
   Extracts the attached content from a PKCS#7 signed data if existed. The input signed
   data could be wrapped in a ContentInfo structure.
@@ -2467,6 +2650,70 @@ AuthenticodeVerify (
   IN  UINTN        HashSize
   );
 
+/**
+  Decodes a PE/COFF Authenticode Signature once, so it can be checked against
+  several trust anchors with AuthenticodeVerifyWithAnchor().
+
+  If AuthData is NULL, then return NULL.
+  If this interface is not supported, then return NULL.
+
+  Caution: This function may receive untrusted input.
+  PE/COFF Authenticode is external input, so this function will do basic check for
+  Authenticode data structure.
+
+  @param[in]  AuthData     Pointer to the Authenticode Signature retrieved from signed
+                           PE/COFF image to be verified.
+  @param[in]  DataSize     Size of the Authenticode Signature in bytes.
+
+  @return  Opaque decoded signature, to be released with AuthenticodeFree(), or
+           NULL if AuthData is not a well formed Authenticode Signature.
+
+**/
+VOID *
+EFIAPI
+AuthenticodeParse (
+  IN  CONST UINT8  *AuthData,
+  IN  UINTN        DataSize
+  );
+
+/**
+  Verifies a decoded PE/COFF Authenticode Signature against a trust anchor.
+
+  @param[in]   Authenticode  Decoded signature from AuthenticodeParse().
+  @param[in]   Anchor        Trust anchor from Pkcs7TrustAnchorNew().
+  @param[in]   ImageHash     Pointer to the original image file hash value.
+  @param[in]   HashSize      Size of Image hash value in bytes.
+  @param[out]  Matched       If not NULL, receives the number of the first
+                             certificate of Anchor, in the order they were
+                             added, that verifies the signature on its own.
+
+  @retval  TRUE   The specified Authenticode Signature is valid.
+  @retval  FALSE  Invalid Authenticode Signature.
+  @retval  FALSE  This interface is not supported.
+
+**/
+BOOLEAN
+EFIAPI
+AuthenticodeVerifyWithAnchor (
+  IN  VOID         *Authenticode,
+  IN  VOID         *Anchor,
+  IN  CONST UINT8  *ImageHash,
+  IN  UINTN        HashSize,
+  OUT UINTN        *Matched  OPTIONAL
+  );
+
+/**
+  Release a signature decoded by AuthenticodeParse().
+
+  @param[in]  Authenticode  Pointer to the decoded signature, or NULL.
+
+**/
+VOID
+EFIAPI
+AuthenticodeFree (
+  IN  VOID  *Authenticode
+  );
+
 /**
   Verifies the validity of a RFC3161 Timestamp CounterSignature embedded in PE/COFF Authenticode
   signature.
@@ -2712,4 +2959,142 @@ RandomBytes (
   IN   UINTN  Size
   );
 
+//=====================================================================================
+//    Montgomery Multiplication
+//=====================================================================================
+
+///
+/// Montgomery multiplication kernels usable by BnMontMul() and OpenSSL's
+/// bn_mul_mont(): one using the compiler's 128-bit multiply, on X64 and
+/// AArch64, and one using MULX, ADCX and ADOX on X64.
+///
+#define BN_MONT_INT128  0x1
+#define BN_MONT_MULX    0x2
+
+///
+/// The biggest numbers BnMontMul() takes, in 64-bit words: 8192 bits.
+///
+#define BN_MONT_MAX_WORDS  128
+
+/**
+  Retrieves which Montgomery multiplication kernels the processor can run.
+
+  The processor is probed on the first call (CPUID on X64) and the result
+  is cached.
+
+  @return  Bitmask of BN_MONT_* values.  Zero if OpenSSL's portable code is
+           used.
+
+**/
+UINT32
+EFIAPI
+BnMontFeatures (
+  VOID
+  );
+
+/**
+  Computes A * B / 2^(64 * Words) mod N, with one of the kernels.
+
+  @param[out]  Result  Receives the product.  It may be the same as A or B.
+  @param[in]   A       First factor, less than N.
+  @param[in]   B       Second factor, less than N.  If it's A, A is squared.
+  @param[in]   N       Odd modulus.
+  @param[in]   N0      -1 / N mod 2^64.
+  @param[in]   Words   Size of each number in 64-bit words, least
+                       significant first, from 2 to BN_MONT_MAX_WORDS.
+  @param[in]   Kernel  The BN_MONT_* kernel to use.
+
+  @retval TRUE   Result holds the product.
+  @retval FALSE  The processor can't run Kernel, or Words is out of range.
+
+**/
+BOOLEAN
+EFIAPI
+BnMontMul (
+  OUT  UINT64        *Result,
+  IN   CONST UINT64  *A,
+  IN   CONST UINT64  *B,
+  IN   CONST UINT64  *N,
+  IN   UINT64        N0,
+  IN   UINTN         Words,
+  IN   UINT32        Kernel
+  );
+
+//=====================================================================================
+//    Memory Allocation for OpenSSL
+//=====================================================================================
+
+///
+/// Counters kept by the allocator behind OpenSSL's malloc(), realloc() and free().
+///
+typedef struct {
+  UINTN   Allocations;      ///< Blocks handed out, including by realloc() moves
+  UINTN   Frees;            ///< Blocks given back
+  UINTN   PoolAllocations;  ///< AllocatePool() calls made to get them
+  UINTN   CurrentBytes;     ///< Bytes asked for and not yet freed
+  UINTN   PeakBytes;        ///< The most CurrentBytes has been
+} CRYPTO_MEM_STATS;
+
+/**
+  Allocates Size bytes for OpenSSL.
+
+  Blocks up to 2 KiB come from slabs carved out of larger pool allocations,
+  so the many small ASN.1 and BIGNUM objects OpenSSL makes don't each cost
+  a trip to the firmware.  Every block records its size, which is what lets
+  CryptoMemRealloc() work.
+
+  @param[in]  Size  Number of bytes to allocate.
+
+  @return  The allocated memory, or NULL if there's not enough.
+
+**/
+VOID *
+EFIAPI
+CryptoMemAlloc (
+  IN  UINTN  Size
+  );
+
+/**
+  Resizes a block from CryptoMemAlloc(), keeping what it held.
+
+  A block that already has room for Size bytes is returned as it is.
+
+  @param[in]  Ptr   The block to resize, or NULL to allocate a new one.
+  @param[in]  Size  The size it's to have.  Zero frees it.
+
+  @return  The resized block, or NULL if there's not enough memory, in
+           which case Ptr is left alone.
+
+**/
+VOID *
+EFIAPI
+CryptoMemRealloc (
+  IN  VOID   *Ptr,
+  IN  UINTN  Size
+  );
+
+/**
+  Frees a block from CryptoMemAlloc() or CryptoMemRealloc().
+
+  @param[in]  Ptr  The block to free, or NULL.
+
+**/
+VOID
+EFIAPI
+CryptoMemFree (
+  IN  VOID  *Ptr
+  );
+
+/**
+  Retrieves the allocator's counters.
+
+  @param[out]  Stats  Receives the counters.
+
+**/
+VOID
+EFIAPI
+CryptoMemGetStats (
+  OUT  CRYPTO_MEM_STATS  *Stats
+  );
+
 #endif // __BASE_CRYPT_LIB_H__
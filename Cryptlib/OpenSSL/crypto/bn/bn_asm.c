@@ -987,11 +987,11 @@ int bn_mul_mont(BN_ULONG *rp, const BN_ULONG *ap, const BN_ULONG *bp,
     vp[num + 1] = 0;
     return 1;
 }
-#  else
+#  elif !defined(OPENSSL_BN_MONT_ACCEL)
 /*
  * Return value of 0 indicates that multiplication/convolution was not
  * performed to signal the caller to fall down to alternative/original
- * code-path.
+ * code-path.  With OPENSSL_BN_MONT_ACCEL, Cryptlib provides bn_mul_mont().
  */
 int bn_mul_mont(BN_ULONG *rp, const BN_ULONG *ap, const BN_ULONG *bp,
                 const BN_ULONG *np, const BN_ULONG *n0, int num)
@@ -1081,7 +1081,7 @@ int bn_mul_mont(BN_ULONG *rp, const BN_ULONG *ap, const BN_ULONG *bp,
     vp[num + 1] = 0;
     return 1;
 }
-#  else
+#  elif !defined(OPENSSL_BN_MONT_ACCEL)
 int bn_mul_mont(BN_ULONG *rp, const BN_ULONG *ap, const BN_ULONG *bp,
                 const BN_ULONG *np, const BN_ULONG *n0, int num)
 {
@@ -131,7 +131,8 @@ int BN_mod_mul_montgomery(BIGNUM *r, const BIGNUM *a, const BIGNUM *b,
 {
     BIGNUM *tmp;
     int ret = 0;
-#if defined(OPENSSL_BN_ASM_MONT) && defined(MONT_WORD)
+#if (defined(OPENSSL_BN_ASM_MONT) || defined(OPENSSL_BN_MONT_ACCEL)) && \
+    defined(MONT_WORD)
     int num = mont->N.top;
 
     if (num > 1 && a->top == num && b->top == num) {
@@ -33,12 +33,21 @@ UINT8 mSpcIndirectOidValue[] = {
   0x2B, 0x06, 0x01, 0x04, 0x01, 0x82, 0x37, 0x02, 0x01, 0x04
   };
 
+//
+// A decoded Authenticode signature and where its SpcIndirectDataContent,
+// which holds the image hash, sits inside it.
+//
+typedef struct {
+  PKCS7  *Pkcs7;
+  UINT8  *Content;
+  UINTN  ContentSize;
+} AUTHENTICODE_CONTEXT;
+
 /**
-  Verifies the validity of a PE/COFF Authenticode Signature as described in "Windows
-  Authenticode Portable Executable Signature Format".
+  Decodes a PE/COFF Authenticode Signature once, so it can be checked against
+  several trust anchors with AuthenticodeVerifyWithAnchor().
 
-  If AuthData is NULL, then return FALSE.
-  If ImageHash is NULL, then return FALSE.
+  If AuthData is NULL, then return NULL.
 
   Caution: This function may receive untrusted input.
   PE/COFF Authenticode is external input, so this function will do basic check for
@@ -47,67 +56,56 @@ UINT8 mSpcIndirectOidValue[] = {
   @param[in]  AuthData     Pointer to the Authenticode Signature retrieved from signed
                            PE/COFF image to be verified.
   @param[in]  DataSize     Size of the Authenticode Signature in bytes.
-  @param[in]  TrustedCert  Pointer to a trusted/root certificate encoded in DER, which
-                           is used for certificate chain verification.
-  @param[in]  CertSize     Size of the trusted certificate in bytes.
-  @param[in]  ImageHash    Pointer to the original image file hash value. The procedure
-                           for calculating the image hash value is described in Authenticode
-                           specification.
-  @param[in]  HashSize     Size of Image hash value in bytes.
 
-  @retval  TRUE   The specified Authenticode Signature is valid.
-  @retval  FALSE  Invalid Authenticode Signature.
+  @return  Opaque decoded signature, to be released with AuthenticodeFree(), or
+           NULL if AuthData is not a well formed Authenticode Signature.
 
 **/
-BOOLEAN
+VOID *
 EFIAPI
-AuthenticodeVerify (
+AuthenticodeParse (
   IN  CONST UINT8  *AuthData,
-  IN  UINTN        DataSize,
-  IN  CONST UINT8  *TrustedCert,
-  IN  UINTN        CertSize,
-  IN  CONST UINT8  *ImageHash,
-  IN  UINTN        HashSize
+  IN  UINTN        DataSize
   )
 {
-  BOOLEAN      Status;
-  PKCS7        *Pkcs7;
-  CONST UINT8  *Temp;
-  CONST UINT8  *OrigAuthData;
-  UINT8        *SpcIndirectDataContent;
-  UINT8        Asn1Byte;
-  UINTN        ContentSize;
-  CONST UINT8  *SpcIndirectDataOid;
+  AUTHENTICODE_CONTEXT  *Context;
+  PKCS7                 *Pkcs7;
+  ASN1_STRING           *Asn1Content;
+  CONST UINT8           *Temp;
+  UINT8                 *SpcIndirectDataContent;
+  UINT8                 Asn1Byte;
+  UINTN                 ContentSize;
+  UINTN                 HeaderSize;
+  CONST UINT8           *SpcIndirectDataOid;
 
   //
   // Check input parameters.
   //
-  if ((AuthData == NULL) || (TrustedCert == NULL) || (ImageHash == NULL)) {
-    return FALSE;
+  if ((AuthData == NULL) || (DataSize > INT_MAX)) {
+    return NULL;
   }
 
-  if ((DataSize > INT_MAX) || (CertSize > INT_MAX) || (HashSize > INT_MAX)) {
-    return FALSE;
+  Context = AllocateZeroPool (sizeof (*Context));
+  if (Context == NULL) {
+    return NULL;
   }
 
-  Status       = FALSE;
-  Pkcs7        = NULL;
-  OrigAuthData = AuthData;
-
   //
   // Retrieve & Parse PKCS#7 Data (DER encoding) from Authenticode Signature
   //
   Temp  = AuthData;
   Pkcs7 = d2i_PKCS7 (NULL, &Temp, (int)DataSize);
   if (Pkcs7 == NULL) {
-    goto _Exit;
+    goto _Error;
   }
+  Context->Pkcs7 = Pkcs7;
 
   //
   // Check if it's PKCS#7 Signed Data (for Authenticode Scenario)
   //
-  if (!PKCS7_type_is_signed (Pkcs7)) {
-    goto _Exit;
+  if (!PKCS7_type_is_signed (Pkcs7) || Pkcs7->d.sign == NULL ||
+      Pkcs7->d.sign->contents == NULL) {
+    goto _Error;
   }
 
   //
@@ -125,11 +123,18 @@ AuthenticodeVerify (
     //
     // Un-matched SPC_INDIRECT_DATA_OBJID.
     //
-    goto _Exit;
+    goto _Error;
   }
 
+  if (Pkcs7->d.sign->contents->d.other == NULL) {
+    goto _Error;
+  }
+  Asn1Content = Pkcs7->d.sign->contents->d.other->value.asn1_string;
+  if (Asn1Content == NULL || Asn1Content->data == NULL || Asn1Content->length < 4) {
+    goto _Error;
+  }
 
-  SpcIndirectDataContent = (UINT8 *)(Pkcs7->d.sign->contents->d.other->value.asn1_string->data);
+  SpcIndirectDataContent = (UINT8 *)(Asn1Content->data);
 
   //
   // Retrieve the SEQUENCE data size from ASN.1-encoded SpcIndirectDataContent.
@@ -144,7 +149,7 @@ AuthenticodeVerify (
     //
     // Skip the SEQUENCE Tag;
     //
-    SpcIndirectDataContent += 2;
+    HeaderSize = 2;
 
   } else if ((Asn1Byte & 0x81) == 0x81) {
     //
@@ -154,7 +159,7 @@ AuthenticodeVerify (
     //
     // Skip the SEQUENCE Tag;
     //
-    SpcIndirectDataContent += 3;
+    HeaderSize = 3;
 
   } else if ((Asn1Byte & 0x82) == 0x82) {
     //
@@ -165,10 +170,58 @@ AuthenticodeVerify (
     //
     // Skip the SEQUENCE Tag;
     //
-    SpcIndirectDataContent += 4;
+    HeaderSize = 4;
 
   } else {
-    goto _Exit;
+    goto _Error;
+  }
+
+  if (HeaderSize + ContentSize > (UINTN) Asn1Content->length) {
+    goto _Error;
+  }
+
+  Context->Content     = SpcIndirectDataContent + HeaderSize;
+  Context->ContentSize = ContentSize;
+
+  return Context;
+
+_Error:
+  AuthenticodeFree (Context);
+  return NULL;
+}
+
+/**
+  Verifies a decoded PE/COFF Authenticode Signature against a trust anchor.
+
+  @param[in]  Authenticode  Decoded signature from AuthenticodeParse().
+  @param[in]  Anchor        Trust anchor from Pkcs7TrustAnchorNew().
+  @param[in]  ImageHash     Pointer to the original image file hash value. The procedure
+                            for calculating the image hash value is described in Authenticode
+                            specification.
+  @param[in]  HashSize      Size of Image hash value in bytes.
+  @param[out] Matched       If not NULL, receives the number of the first certificate
+                            of Anchor that the signature chains to.
+
+  @retval  TRUE   The specified Authenticode Signature is valid.
+  @retval  FALSE  Invalid Authenticode Signature.
+
+**/
+BOOLEAN
+EFIAPI
+AuthenticodeVerifyWithAnchor (
+  IN  VOID         *Authenticode,
+  IN  VOID         *Anchor,
+  IN  CONST UINT8  *ImageHash,
+  IN  UINTN        HashSize,
+  OUT UINTN        *Matched  OPTIONAL
+  )
+{
+  AUTHENTICODE_CONTEXT  *Context;
+
+  Context = (AUTHENTICODE_CONTEXT *) Authenticode;
+  if ((Context == NULL) || (Anchor == NULL) || (ImageHash == NULL) ||
+      (HashSize > Context->ContentSize)) {
+    return FALSE;
   }
 
   //
@@ -176,23 +229,119 @@ AuthenticodeVerify (
   // defined in Authenticode
   // NOTE: Need to double-check HashLength here!
   //
-  if (CompareMem (SpcIndirectDataContent + ContentSize - HashSize, ImageHash, HashSize) != 0) {
+  if (CompareMem (Context->Content + Context->ContentSize - HashSize, ImageHash, HashSize) != 0) {
     //
     // Un-matched PE/COFF Hash Value
     //
-    goto _Exit;
+    return FALSE;
   }
 
   //
   // Verifies the PKCS#7 Signed Data in PE/COFF Authenticode Signature
   //
-  Status = (BOOLEAN) Pkcs7Verify (OrigAuthData, DataSize, TrustedCert, CertSize, SpcIndirectDataContent, ContentSize);
+  return Pkcs7VerifyDecoded (Context->Pkcs7, Anchor, Context->Content, Context->ContentSize, Matched);
+}
+
+/**
+  Release a signature decoded by AuthenticodeParse().
+
+  @param[in]  Authenticode  Pointer to the decoded signature, or NULL.
+
+**/
+VOID
+EFIAPI
+AuthenticodeFree (
+  IN  VOID  *Authenticode
+  )
+{
+  AUTHENTICODE_CONTEXT  *Context;
+
+  Context = (AUTHENTICODE_CONTEXT *) Authenticode;
+  if (Context == NULL) {
+    return;
+  }
+
+  PKCS7_free (Context->Pkcs7);
+  FreePool (Context);
+}
+
+/**
+  Verifies the validity of a PE/COFF Authenticode Signature as described in "Windows
+  Authenticode Portable Executable Signature Format".
+
+  If AuthData is NULL, then return FALSE.
+  If ImageHash is NULL, then return FALSE.
+
+  Caution: This function may receive untrusted input.
+  PE/COFF Authenticode is external input, so this function will do basic check for
+  Authenticode data structure.
+
+  @param[in]  AuthData     Pointer to the Authenticode Signature retrieved from signed
+                           PE/COFF image to be verified.
+  @param[in]  DataSize     Size of the Authenticode Signature in bytes.
+  @param[in]  TrustedCert  Pointer to a trusted/root certificate encoded in DER, which
+                           is used for certificate chain verification.
+  @param[in]  CertSize     Size of the trusted certificate in bytes.
+  @param[in]  ImageHash    Pointer to the original image file hash value. The procedure
+                           for calculating the image hash value is described in Authenticode
+                           specification.
+  @param[in]  HashSize     Size of Image hash value in bytes.
+
+  @retval  TRUE   The specified Authenticode Signature is valid.
+  @retval  FALSE  Invalid Authenticode Signature.
+
+**/
+BOOLEAN
+EFIAPI
+AuthenticodeVerify (
+  IN  CONST UINT8  *AuthData,
+  IN  UINTN        DataSize,
+  IN  CONST UINT8  *TrustedCert,
+  IN  UINTN        CertSize,
+  IN  CONST UINT8  *ImageHash,
+  IN  UINTN        HashSize
+  )
+{
+  BOOLEAN  Status;
+  VOID     *Authenticode;
+  VOID     *Anchor;
+
+  //
+  // Check input parameters.
+  //
+  if ((AuthData == NULL) || (TrustedCert == NULL) || (ImageHash == NULL)) {
+    return FALSE;
+  }
+
+  if ((DataSize > INT_MAX) || (CertSize > INT_MAX) || (HashSize > INT_MAX)) {
+    return FALSE;
+  }
+
+  Status = FALSE;
+  Anchor = NULL;
+
+  //
+  // The signature is only decoded once; the PKCS#7 verification works on
+  // the same structure the image hash was found in.
+  //
+  Authenticode = AuthenticodeParse (AuthData, DataSize);
+  if (Authenticode == NULL) {
+    goto _Exit;
+  }
+
+  Anchor = Pkcs7TrustAnchorNew (TrustedCert, CertSize);
+  if (Anchor == NULL) {
+    goto _Exit;
+  }
+
+  Status = AuthenticodeVerifyWithAnchor (Authenticode, Anchor, ImageHash, HashSize, NULL);
 
 _Exit:
   //
   // Release Resources
   //
-  PKCS7_free (Pkcs7);
+  Pkcs7TrustAnchorFree (Anchor);
+  AuthenticodeFree (Authenticode);
 
   return Status;
 }
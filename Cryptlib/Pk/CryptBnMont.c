@@ -0,0 +1,431 @@
+/** @file
+  Montgomery multiplication using the processor's 64x64 bit multiply.
+
+  The bundled OpenSSL is built with OPENSSL_NO_ASM, and has no double word
+  type on 64-bit targets, so its portable bignum code splits every word
+  multiply into four 32x32 bit ones.  Checking an RSA signature is almost
+  all Montgomery multiplication, which BN_mod_mul_montgomery() hands to
+  bn_mul_mont() when there is one.  This provides it on X64 and AArch64.
+
+  Products are built up a row at a time, each row adding one word times a
+  whole number into a running total, and then reduced a row at a time.
+  Squaring only works out each cross product once.  The portable rows use
+  the compiler's unsigned __int128, which is MUL on X64 and MUL/UMULH on
+  AArch64.  X64 processors with BMI2 and ADX get rows that use MULX, which
+  leaves the flags alone, so that ADCX and ADOX can add the low and high
+  halves of the products in two carry chains at once.
+
+This program and the accompanying materials
+are licensed and made available under the terms and conditions of the BSD License
+which accompanies this distribution.  The full text of the license may be found at
+http://opensource.org/licenses/bsd-license.php
+
+THE PROGRAM IS DISTRIBUTED UNDER THE BSD LICENSE ON AN "AS IS" BASIS,
+WITHOUT WARRANTIES OR REPRESENTATIONS OF ANY KIND, EITHER EXPRESS OR IMPLIED.
+
+**/
+
+#ifdef SHIM_UNIT_TEST
+#include "shim.h"
+#include <Library/BaseCryptLib.h>
+#else
+#include "InternalCryptLib.h"
+#include <openssl/bn.h>
+#endif
+
+#if defined(__x86_64__)
+#include <cpuid.h>
+#define BN_MONT_MULX_TARGET  __attribute__((target ("bmi2,adx")))
+#endif
+
+STATIC BOOLEAN  mBnMontProbed = FALSE;
+STATIC UINT32   mBnMontFeatures = 0;
+
+#if defined(__x86_64__) || defined(__aarch64__)
+
+typedef unsigned __int128  UINT128;
+
+//
+// T[0..Words-1] += A[0..Words-1] * B + Carry, returning the word that
+// carries out of the top, which always fits in a word.
+//
+typedef
+UINT64
+(*BN_MONT_ROW) (
+  IN OUT  UINT64        *T,
+  IN      CONST UINT64  *A,
+  IN      UINT64        B,
+  IN      UINTN         Words,
+  IN      UINT64        Carry
+  );
+
+STATIC
+UINT64
+BnMontRowInt128 (
+  IN OUT  UINT64        *T,
+  IN      CONST UINT64  *A,
+  IN      UINT64        B,
+  IN      UINTN         Words,
+  IN      UINT64        Carry
+  )
+{
+  UINT128  P;
+  UINTN    Index;
+
+  for (Index = 0; Index < Words; Index++) {
+    P        = (UINT128) A[Index] * B + T[Index] + Carry;
+    T[Index] = (UINT64) P;
+    Carry    = (UINT64) (P >> 64);
+  }
+  return Carry;
+}
+
+#if defined(__x86_64__)
+
+//
+// Four words a time through the loop.  LEA and JRCXZ leave CF and OF
+// alone, so both carry chains run from one group into the next.  Whatever
+// is left over after the last group of four goes through the portable row.
+//
+BN_MONT_MULX_TARGET
+STATIC
+UINT64
+BnMontRowMulx (
+  IN OUT  UINT64        *T,
+  IN      CONST UINT64  *A,
+  IN      UINT64        B,
+  IN      UINTN         Words,
+  IN      UINT64        Carry
+  )
+{
+  UINTN   Groups;
+  UINT64  Hi;
+  UINT64  Hi2;
+  UINT64  Lo;
+
+  Groups = Words / 4;
+  if (Groups == 0) {
+    return BnMontRowInt128 (T, A, B, Words, Carry);
+  }
+
+  Hi = Carry;
+  __asm__ __volatile__ (
+    "xorl   %k[lo], %k[lo]              \n\t"     // clears CF and OF
+    "1:                                 \n\t"
+    "movq   (%[a]), %%rdx               \n\t"
+    "mulxq  %[b], %[lo], %[hi2]         \n\t"
+    "adcxq  (%[t]), %[lo]               \n\t"
+    "adoxq  %[hi], %[lo]                \n\t"
+    "movq   %[lo], (%[t])               \n\t"
+    "movq   8(%[a]), %%rdx              \n\t"
+    "mulxq  %[b], %[lo], %[hi]          \n\t"
+    "adcxq  8(%[t]), %[lo]              \n\t"
+    "adoxq  %[hi2], %[lo]               \n\t"
+    "movq   %[lo], 8(%[t])              \n\t"
+    "movq   16(%[a]), %%rdx             \n\t"
+    "mulxq  %[b], %[lo], %[hi2]         \n\t"
+    "adcxq  16(%[t]), %[lo]             \n\t"
+    "adoxq  %[hi], %[lo]                \n\t"
+    "movq   %[lo], 16(%[t])             \n\t"
+    "movq   24(%[a]), %%rdx             \n\t"
+    "mulxq  %[b], %[lo], %[hi]          \n\t"
+    "adcxq  24(%[t]), %[lo]             \n\t"
+    "adoxq  %[hi2], %[lo]               \n\t"
+    "movq   %[lo], 24(%[t])             \n\t"
+    "leaq   32(%[a]), %[a]              \n\t"
+    "leaq   32(%[t]), %[t]              \n\t"
+    "leaq   -1(%%rcx), %%rcx            \n\t"
+    "jrcxz  2f                          \n\t"
+    "jmp    1b                          \n\t"
+    "2:                                 \n\t"
+    "movl   $0, %k[lo]                  \n\t"     // MOV leaves the flags alone
+    "adcxq  %[lo], %[hi]                \n\t"
+    "adoxq  %[lo], %[hi]                \n\t"
+    : [hi] "+&r" (Hi), [lo] "=&r" (Lo), [hi2] "=&r" (Hi2),
+      [t] "+r" (T), [a] "+r" (A), "+c" (Groups)
+    : [b] "r" (B)
+    : "rdx", "cc", "memory"
+    );
+
+  return BnMontRowInt128 (T, A, B, Words % 4, Hi);
+}
+
+STATIC
+UINT32
+BnMontProbe (
+  VOID
+  )
+{
+  UINT32  Eax;
+  UINT32  Ebx;
+  UINT32  Ecx;
+  UINT32  Edx;
+  UINT32  Features;
+
+  Features = BN_MONT_INT128;
+  if (__get_cpuid_count (7, 0, &Eax, &Ebx, &Ecx, &Edx) &&
+      (Ebx & bit_BMI2) != 0 && (Ebx & bit_ADX) != 0) {
+    Features |= BN_MONT_MULX;
+  }
+  return Features;
+}
+
+#else
+
+STATIC
+UINT32
+BnMontProbe (
+  VOID
+  )
+{
+  return BN_MONT_INT128;
+}
+
+#endif
+
+/**
+  Montgomery reduction of the 2 * Words word T, into Result.  T is used
+  as scratch.
+
+**/
+STATIC
+VOID
+BnMontReduce (
+  OUT     UINT64        *Result,
+  IN OUT  UINT64        *T,
+  IN      CONST UINT64  *N,
+  IN      UINT64        N0,
+  IN      UINTN         Words,
+  IN      BN_MONT_ROW   Row
+  )
+{
+  UINT64   Diff[BN_MONT_MAX_WORDS];
+  UINT64   Top;
+  UINT64   Borrow;
+  UINT64   Mask;
+  UINT128  P;
+  UINTN    Index;
+
+  //
+  // Adding the right multiple of N clears the bottom word of T each time
+  // around, and the top carries into the next word up.
+  //
+  Top = 0;
+  for (Index = 0; Index < Words; Index++) {
+    P                 = (UINT128) T[Index + Words] + Top +
+                        Row (T + Index, N, T[Index] * N0, Words, 0);
+    T[Index + Words]  = (UINT64) P;
+    Top               = (UINT64) (P >> 64);
+  }
+
+  //
+  // What's left is less than 2 * N; take N away if that doesn't go
+  // negative, without branching on whether it does.
+  //
+  T     += Words;
+  Borrow = 0;
+  for (Index = 0; Index < Words; Index++) {
+    P           = (UINT128) T[Index] - N[Index] - Borrow;
+    Diff[Index] = (UINT64) P;
+    Borrow      = (UINT64) (P >> 64) & 1;
+  }
+  Mask = (UINT64) 0 - (UINT64) (Borrow > Top);
+  for (Index = 0; Index < Words; Index++) {
+    Result[Index] = (T[Index] & Mask) | (Diff[Index] & ~Mask);
+  }
+}
+
+STATIC
+VOID
+BnMontMulRows (
+  OUT     UINT64        *Result,
+  IN      CONST UINT64  *A,
+  IN      CONST UINT64  *B,
+  IN      CONST UINT64  *N,
+  IN      UINT64        N0,
+  IN      UINTN         Words,
+  IN      BN_MONT_ROW   Row
+  )
+{
+  UINT64  T[2 * BN_MONT_MAX_WORDS];
+  UINTN   Index;
+
+  ZeroMem (T, 2 * Words * sizeof (UINT64));
+  for (Index = 0; Index < Words; Index++) {
+    T[Index + Words] = Row (T + Index, A, B[Index], Words, 0);
+  }
+
+  BnMontReduce (Result, T, N, N0, Words, Row);
+}
+
+STATIC
+VOID
+BnMontSqrRows (
+  OUT     UINT64        *Result,
+  IN      CONST UINT64  *A,
+  IN      CONST UINT64  *N,
+  IN      UINT64        N0,
+  IN      UINTN         Words,
+  IN      BN_MONT_ROW   Row
+  )
+{
+  UINT64   T[2 * BN_MONT_MAX_WORDS];
+  UINT64   Carry;
+  UINT128  Square;
+  UINT128  P;
+  UINTN    Index;
+
+  //
+  // Each A[i] * A[j] with i < j once, then doubled, then the squares of
+  // each word added in.
+  //
+  ZeroMem (T, 2 * Words * sizeof (UINT64));
+  for (Index = 0; Index < Words - 1; Index++) {
+    T[Index + Words] = Row (T + 2 * Index + 1, A + Index + 1, A[Index],
+                            Words - Index - 1, 0);
+  }
+
+  for (Index = 2 * Words - 1; Index > 0; Index--) {
+    T[Index] = (T[Index] << 1) | (T[Index - 1] >> 63);
+  }
+  T[0] <<= 1;
+
+  Carry = 0;
+  for (Index = 0; Index < Words; Index++) {
+    Square            = (UINT128) A[Index] * A[Index];
+    P                 = (UINT128) T[2 * Index] + (UINT64) Square + Carry;
+    T[2 * Index]      = (UINT64) P;
+    P                 = (UINT128) T[2 * Index + 1] + (UINT64) (Square >> 64) +
+                        (UINT64) (P >> 64);
+    T[2 * Index + 1]  = (UINT64) P;
+    Carry             = (UINT64) (P >> 64);
+  }
+
+  BnMontReduce (Result, T, N, N0, Words, Row);
+}
+
+#else
+
+STATIC
+UINT32
+BnMontProbe (
+  VOID
+  )
+{
+  return 0;
+}
+
+#endif
+
+/**
+  Retrieves which Montgomery multiplication kernels the processor can run.
+
+  The processor is probed on the first call and the result is cached.
+
+  @return  Bitmask of BN_MONT_* values.  Zero if OpenSSL's portable code is
+           used.
+
+**/
+UINT32
+EFIAPI
+BnMontFeatures (
+  VOID
+  )
+{
+  if (!mBnMontProbed) {
+    mBnMontFeatures = BnMontProbe ();
+    mBnMontProbed   = TRUE;
+  }
+  return mBnMontFeatures;
+}
+
+/**
+  Computes A * B / 2^(64 * Words) mod N, with one of the kernels.
+
+  @param[out]  Result  Receives the product.  It may be the same as A or B.
+  @param[in]   A       First factor, less than N.
+  @param[in]   B       Second factor, less than N.  If it's A, A is squared.
+  @param[in]   N       Odd modulus.
+  @param[in]   N0      -1 / N mod 2^64.
+  @param[in]   Words   Size of each number in 64-bit words, least
+                       significant first, from 2 to BN_MONT_MAX_WORDS.
+  @param[in]   Kernel  The BN_MONT_* kernel to use.
+
+  @retval TRUE   Result holds the product.
+  @retval FALSE  The processor can't run Kernel, or Words is out of range.
+
+**/
+BOOLEAN
+EFIAPI
+BnMontMul (
+  OUT  UINT64        *Result,
+  IN   CONST UINT64  *A,
+  IN   CONST UINT64  *B,
+  IN   CONST UINT64  *N,
+  IN   UINT64        N0,
+  IN   UINTN         Words,
+  IN   UINT32        Kernel
+  )
+{
+#if defined(__x86_64__) || defined(__aarch64__)
+  BN_MONT_ROW  Row;
+
+  if (Words < 2 || Words > BN_MONT_MAX_WORDS ||
+      (BnMontFeatures () & Kernel) == 0) {
+    return FALSE;
+  }
+
+  switch (Kernel) {
+#if defined(__x86_64__)
+    case BN_MONT_MULX:
+      Row = BnMontRowMulx;
+      break;
+#endif
+    case BN_MONT_INT128:
+      Row = BnMontRowInt128;
+      break;
+    default:
+      return FALSE;
+  }
+
+  if (A == B) {
+    BnMontSqrRows (Result, A, N, N0, Words, Row);
+  } else {
+    BnMontMulRows (Result, A, B, N, N0, Words, Row);
+  }
+  return TRUE;
+#else
+  return FALSE;
+#endif
+}
+
+#if !defined(SHIM_UNIT_TEST) && (defined(__x86_64__) || defined(__aarch64__))
+
+/**
+  OpenSSL's Montgomery multiplication hook, used by BN_mod_mul_montgomery()
+  when the Makefile defines OPENSSL_BN_MONT_ACCEL.  Returning 0 sends it
+  back to the portable code.
+
+**/
+int
+bn_mul_mont (
+  BN_ULONG        *rp,
+  const BN_ULONG  *ap,
+  const BN_ULONG  *bp,
+  const BN_ULONG  *np,
+  const BN_ULONG  *n0,
+  int             num
+  )
+{
+  UINT32  Kernel;
+
+  Kernel = BnMontFeatures ();
+  if ((Kernel & BN_MONT_MULX) != 0) {
+    Kernel = BN_MONT_MULX;
+  }
+
+  return BnMontMul ((UINT64 *) rp, (CONST UINT64 *) ap, (CONST UINT64 *) bp,
+                    (CONST UINT64 *) np, n0[0], (UINTN) num, Kernel);
+}
+
+#endif
@@ -0,0 +1,197 @@
+/** @file
+  Telling which certificate of a trust anchor a PKCS#7 verification relied on.
+
+  A trust anchor holding a whole signature database is checked with one chain
+  build, but what gets measured is the certificate that checking each one on
+  its own, in list order, would have stopped at.  Those aren't always the
+  first of the anchor's certificates in the chain: having found a trusted
+  certificate, OpenSSL goes on building the chain through the store, so it can
+  end at a root whose intermediate the signature doesn't carry, and which it
+  would never have verified against alone.
+
+This program and the accompanying materials
+are licensed and made available under the terms and conditions of the BSD License
+which accompanies this distribution.  The full text of the license may be found at
+http://opensource.org/licenses/bsd-license.php
+
+THE PROGRAM IS DISTRIBUTED UNDER THE BSD LICENSE ON AN "AS IS" BASIS,
+WITHOUT WARRANTIES OR REPRESENTATIONS OF ANY KIND, EITHER EXPRESS OR IMPLIED.
+
+**/
+
+#ifdef SHIM_UNIT_TEST
+#include "shim.h"
+#include <Library/BaseCryptLib.h>
+#include <openssl/pkcs7.h>
+#include <openssl/x509.h>
+#include <openssl/x509v3.h>
+
+int
+X509VerifyCb (
+  IN int            Status,
+  IN X509_STORE_CTX *Context
+  );
+#else
+#include "InternalCryptLib.h"
+
+#include <openssl/x509.h>
+#include <openssl/x509v3.h>
+#endif
+
+/**
+  Creates an empty X509 store set up the way every PKCS#7 verification here
+  uses one.
+
+  @return  The store, or NULL if there's no memory.
+
+**/
+X509_STORE *
+Pkcs7StoreNew (
+  VOID
+  )
+{
+  X509_STORE  *Store;
+
+  Store = X509_STORE_new ();
+  if (Store == NULL) {
+    return NULL;
+  }
+
+  X509_STORE_set_verify_cb (Store, X509VerifyCb);
+
+  //
+  // Allow partial certificate chains, terminated by a non-self-signed but
+  // still trusted intermediate certificate. Also disable time checks.
+  //
+  X509_STORE_set_flags (Store,
+                        X509_V_FLAG_PARTIAL_CHAIN | X509_V_FLAG_NO_CHECK_TIME);
+
+  //
+  // OpenSSL PKCS7 Verification by default checks for SMIME (email signing) and
+  // doesn't support the extended key usage for Authenticode Code Signing.
+  // Bypass the certificate purpose checking by enabling any purposes setting.
+  //
+  X509_STORE_set_purpose (Store, X509_PURPOSE_ANY);
+
+  return Store;
+}
+
+STATIC
+BOOLEAN
+Pkcs7InChain (
+  IN  STACK_OF(X509)  *Chain,
+  IN  X509            *Cert
+  )
+{
+  int  Link;
+
+  for (Link = 0; Link < sk_X509_num (Chain); Link++) {
+    if (X509_cmp (sk_X509_value (Chain, Link), Cert) == 0) {
+      return TRUE;
+    }
+  }
+  return FALSE;
+}
+
+/**
+  Verifies PKCS#7 signed data with one certificate as the only trusted one.
+
+**/
+STATIC
+BOOLEAN
+Pkcs7VerifyWithCert (
+  IN  PKCS7        *Pkcs7,
+  IN  X509         *Cert,
+  IN  CONST UINT8  *InData,
+  IN  UINTN        DataLength
+  )
+{
+  X509_STORE  *Store;
+  BIO         *DataBio;
+  BOOLEAN     Status;
+
+  Status  = FALSE;
+  DataBio = NULL;
+
+  Store = Pkcs7StoreNew ();
+  if (Store == NULL || !X509_STORE_add_cert (Store, Cert)) {
+    goto _Exit;
+  }
+
+  DataBio = BIO_new_mem_buf (InData, (int) DataLength);
+  if (DataBio == NULL) {
+    goto _Exit;
+  }
+
+  Status = (BOOLEAN) (PKCS7_verify (Pkcs7, NULL, Store, DataBio, NULL, PKCS7_BINARY) == 1);
+
+_Exit:
+  BIO_free (DataBio);
+  X509_STORE_free (Store);
+  return Status;
+}
+
+/**
+  Finds the certificate of a trust anchor that a verification against each
+  of its certificates in turn would have stopped at, given the chain a
+  verification against all of them at once built.
+
+  Only certificates in that chain can verify the signature on their own.
+  When there's just one, it is the answer; otherwise each is checked on its
+  own, in list order.
+
+  @param[in]   Certs       The trust anchor's certificates, in list order.
+  @param[in]   Chain       The verified chain, leaf first.
+  @param[in]   Pkcs7       The PKCS#7 signed data that was verified.
+  @param[in]   InData      The content it was verified with.
+  @param[in]   DataLength  Length of InData in bytes.
+  @param[out]  Matched     Index in Certs of the certificate.
+
+  @retval  TRUE   A certificate was found.
+  @retval  FALSE  None of the certificates verifies the signature alone.
+
+**/
+BOOLEAN
+Pkcs7FindAnchor (
+  IN  STACK_OF(X509)  *Certs,
+  IN  STACK_OF(X509)  *Chain,
+  IN  PKCS7           *Pkcs7,
+  IN  CONST UINT8     *InData,
+  IN  UINTN           DataLength,
+  OUT UINTN           *Matched
+  )
+{
+  int  First;
+  int  Found;
+  int  Index;
+  int  Link;
+
+  First = -1;
+  Found = 0;
+  for (Link = 0; Link < sk_X509_num (Chain); Link++) {
+    for (Index = 0; Index < sk_X509_num (Certs); Index++) {
+      if (X509_cmp (sk_X509_value (Chain, Link), sk_X509_value (Certs, Index)) == 0) {
+        if (First < 0 || Index < First) {
+          First = Index;
+        }
+        Found++;
+        break;
+      }
+    }
+  }
+
+  if (Found == 1) {
+    *Matched = (UINTN) First;
+    return TRUE;
+  }
+
+  for (Index = 0; Found > 1 && Index < sk_X509_num (Certs); Index++) {
+    if (Pkcs7InChain (Chain, sk_X509_value (Certs, Index)) &&
+        Pkcs7VerifyWithCert (Pkcs7, sk_X509_value (Certs, Index), InData, DataLength)) {
+      *Matched = (UINTN) Index;
+      return TRUE;
+    }
+  }
+
+  return FALSE;
+}
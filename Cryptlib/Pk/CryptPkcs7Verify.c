@@ -27,6 +27,7 @@ WITHOUT WARRANTIES OR REPRESENTATIONS OF ANY KIND, EITHER EXPRESS OR IMPLIED.
 #include <openssl/x509.h>
 #include <openssl/x509v3.h>
 #include <openssl/pkcs7.h>
+#include <openssl/sha.h>
 
 UINT8 mOidValue[9] = { 0x2A, 0x86, 0x48, 0x86, 0xF7, 0x0D, 0x01, 0x07, 0x02 };
 
@@ -73,6 +74,13 @@ static int cert_in_store(X509 *cert, X509_STORE_CTX *ctx)
 }
 #endif
 
+//
+// While Pkcs7VerifyDecoded() needs to know which anchor a signature chains
+// to, X509VerifyCb() keeps a copy of the chain it is asked about last.
+//
+STATIC BOOLEAN         mCaptureChain  = FALSE;
+STATIC STACK_OF(X509)  *mVerifiedChain = NULL;
+
 int
 X509VerifyCb (
   IN int            Status,
@@ -112,6 +120,17 @@ X509VerifyCb (
 #endif
   }
 
+  //
+  // The final callback of a successful verification is made for the leaf,
+  // once the whole chain is known.
+  //
+  if (mCaptureChain && Status == 1 && X509_STORE_CTX_get_error_depth (Context) == 0) {
+    if (mVerifiedChain != NULL) {
+      sk_X509_pop_free (mVerifiedChain, X509_free);
+    }
+    mVerifiedChain = X509_STORE_CTX_get1_chain (Context);
+  }
+
   return Status;
 }
 
@@ -802,6 +821,369 @@ _Error:
   return Status;
 }
 
+//
+// One or more trusted certificates and the X509 store that trusts them,
+// built once and reused for every signature checked against them. Certs
+// keeps them in the order they were added, so a verification can report
+// which one it matched.
+//
+typedef struct {
+  STACK_OF(X509)  *Certs;
+  X509_STORE      *Store;
+} PKCS7_TRUST_ANCHOR;
+
+/**
+  Register the digest algorithms needed for PKCS#7 handling. They stay
+  registered, so this only does the work the first time it succeeds.
+
+  @retval  TRUE   The digests are registered.
+  @retval  FALSE  Registration failed.
+
+**/
+BOOLEAN
+Pkcs7RegisterDigests (
+  VOID
+  )
+{
+  STATIC BOOLEAN  Registered = FALSE;
+
+  if (Registered) {
+    return TRUE;
+  }
+
+  if (EVP_add_digest (EVP_md5 ()) == 0) {
+    return FALSE;
+  }
+  if (EVP_add_digest (EVP_sha1 ()) == 0) {
+    return FALSE;
+  }
+  if (EVP_add_digest (EVP_sha256 ()) == 0) {
+    return FALSE;
+  }
+  if (EVP_add_digest (EVP_sha384 ()) == 0) {
+    return FALSE;
+  }
+  if (EVP_add_digest (EVP_sha512 ()) == 0) {
+    return FALSE;
+  }
+  if (EVP_add_digest_alias (SN_sha1WithRSAEncryption, SN_sha1WithRSA) == 0) {
+    return FALSE;
+  }
+
+  Registered = TRUE;
+  return TRUE;
+}
+
+//
+// RSA public keys decoded from certificates, kept for the rest of the boot
+// and keyed by a hash of the key as the certificate encodes it. Each key
+// holds on to the Montgomery context OpenSSL builds for its modulus the
+// first time a signature is checked with it, so sharing one key between
+// every certificate that carries it saves decoding the key and setting up
+// its modulus for each signature.
+//
+#define PKCS7_KEY_CACHE_SIZE  32
+
+typedef struct {
+  UINT8     Hash[SHA256_DIGEST_LENGTH];
+  EVP_PKEY  *Key;
+} PKCS7_CACHED_KEY;
+
+STATIC PKCS7_CACHED_KEY  mKeyCache[PKCS7_KEY_CACHE_SIZE];
+STATIC UINTN             mKeyCacheNext = 0;
+
+/**
+  Give a certificate the cached copy of its RSA public key, or cache the
+  key it has. Certificates with other kinds of keys are left alone.
+
+  @param[in]  Cert  The certificate.
+
+**/
+STATIC
+VOID
+Pkcs7ShareKey (
+  IN  X509  *Cert
+  )
+{
+  X509_PUBKEY       *PubKey;
+  PKCS7_CACHED_KEY  *Entry;
+  EVP_PKEY          *Key;
+  UINT8             Hash[SHA256_DIGEST_LENGTH];
+  UINTN             Index;
+
+  PubKey = X509_get_X509_PUBKEY (Cert);
+  if (PubKey == NULL || PubKey->pkey != NULL || PubKey->public_key == NULL ||
+      OBJ_obj2nid (PubKey->algor->algorithm) != NID_rsaEncryption) {
+    return;
+  }
+
+  //
+  // An RSA key's parameters are always NULL, so the RSAPublicKey in the
+  // bit string is all there is to it.
+  //
+  SHA256 (PubKey->public_key->data, PubKey->public_key->length, Hash);
+  for (Index = 0; Index < PKCS7_KEY_CACHE_SIZE; Index++) {
+    Entry = &mKeyCache[Index];
+    if (Entry->Key != NULL && CompareMem (Entry->Hash, Hash, sizeof (Hash)) == 0) {
+      CRYPTO_add (&Entry->Key->references, 1, CRYPTO_LOCK_EVP_PKEY);
+      PubKey->pkey = Entry->Key;
+      return;
+    }
+  }
+
+  //
+  // Decoding it leaves the certificate with a reference, and gives us
+  // one for the cache.
+  //
+  Key = X509_get_pubkey (Cert);
+  if (Key == NULL) {
+    return;
+  }
+
+  Entry         = &mKeyCache[mKeyCacheNext];
+  mKeyCacheNext = (mKeyCacheNext + 1) % PKCS7_KEY_CACHE_SIZE;
+  if (Entry->Key != NULL) {
+    EVP_PKEY_free (Entry->Key);
+  }
+  CopyMem (Entry->Hash, Hash, sizeof (Hash));
+  Entry->Key = Key;
+}
+
+/**
+  Decodes a trusted certificate and builds the X509 store used to verify
+  PKCS#7 signed data against it, so that a caller checking many signatures
+  against the same certificate only does so once.
+
+  @param[in]  TrustedCert  Pointer to a trusted/root certificate encoded in DER.
+  @param[in]  CertLength   Length of the trusted certificate in bytes.
+
+  @return  The trust anchor, to be released with Pkcs7TrustAnchorFree(), or
+           NULL if the certificate can't be decoded or there's no memory.
+
+**/
+VOID *
+EFIAPI
+Pkcs7TrustAnchorNew (
+  IN  CONST UINT8  *TrustedCert,
+  IN  UINTN        CertLength
+  )
+{
+  PKCS7_TRUST_ANCHOR  *Anchor;
+
+  if (TrustedCert == NULL || CertLength > INT_MAX) {
+    return NULL;
+  }
+
+  Anchor = AllocateZeroPool (sizeof (*Anchor));
+  if (Anchor == NULL) {
+    return NULL;
+  }
+
+  Anchor->Certs = sk_X509_new_null ();
+  if (Anchor->Certs == NULL) {
+    goto _Error;
+  }
+
+  //
+  // Setup X509 Store for trusted certificate
+  //
+  Anchor->Store = Pkcs7StoreNew ();
+  if (Anchor->Store == NULL) {
+    goto _Error;
+  }
+
+  if (!Pkcs7TrustAnchorAdd (Anchor, TrustedCert, CertLength)) {
+    goto _Error;
+  }
+
+  return Anchor;
+
+_Error:
+  Pkcs7TrustAnchorFree (Anchor);
+  return NULL;
+}
+
+/**
+  Adds another trusted certificate to a trust anchor, so that one
+  verification checks a signature against all of them.
+
+  @param[in]  Anchor       Trust anchor from Pkcs7TrustAnchorNew().
+  @param[in]  TrustedCert  Pointer to a trusted/root certificate encoded in DER.
+  @param[in]  CertLength   Length of the trusted certificate in bytes.
+
+  @retval  TRUE   The certificate was added; its index is the number of
+                  certificates added before it.
+  @retval  FALSE  The certificate can't be decoded, another one with the same
+                  subject is already in the anchor, or there's no memory.
+                  The anchor is unchanged.
+
+**/
+BOOLEAN
+EFIAPI
+Pkcs7TrustAnchorAdd (
+  IN  VOID         *Anchor,
+  IN  CONST UINT8  *TrustedCert,
+  IN  UINTN        CertLength
+  )
+{
+  PKCS7_TRUST_ANCHOR  *TrustAnchor;
+  X509                *Cert;
+  CONST UINT8         *Temp;
+  BOOLEAN             Duplicate;
+  int                 Index;
+
+  TrustAnchor = (PKCS7_TRUST_ANCHOR *) Anchor;
+  if (TrustAnchor == NULL || TrustedCert == NULL || CertLength > INT_MAX) {
+    return FALSE;
+  }
+
+  //
+  // Read DER-encoded root certificate and Construct X509 Certificate
+  //
+  Temp = TrustedCert;
+  Cert = d2i_X509 (NULL, &Temp, (long) CertLength);
+  if (Cert == NULL) {
+    return FALSE;
+  }
+  Pkcs7ShareKey (Cert);
+
+  //
+  // The store refuses a certificate it already has, but it still needs its
+  // own index so the caller's numbering doesn't shift. A different
+  // certificate with the same subject is refused: the store looks issuers
+  // up by name, and could settle on the wrong one where verifying against
+  // each certificate on its own would have succeeded.
+  //
+  Duplicate = FALSE;
+  for (Index = 0; Index < sk_X509_num (TrustAnchor->Certs); Index++) {
+    if (X509_cmp (sk_X509_value (TrustAnchor->Certs, Index), Cert) == 0) {
+      Duplicate = TRUE;
+      break;
+    }
+    if (X509_NAME_cmp (X509_get_subject_name (sk_X509_value (TrustAnchor->Certs, Index)),
+                       X509_get_subject_name (Cert)) == 0) {
+      X509_free (Cert);
+      return FALSE;
+    }
+  }
+
+  if (sk_X509_push (TrustAnchor->Certs, Cert) == 0) {
+    X509_free (Cert);
+    return FALSE;
+  }
+
+  if (!Duplicate && !X509_STORE_add_cert (TrustAnchor->Store, Cert)) {
+    sk_X509_pop (TrustAnchor->Certs);
+    X509_free (Cert);
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+/**
+  Release a trust anchor built by Pkcs7TrustAnchorNew().
+
+  @param[in]  Anchor  The trust anchor to release, or NULL.
+
+**/
+VOID
+EFIAPI
+Pkcs7TrustAnchorFree (
+  IN  VOID  *Anchor
+  )
+{
+  PKCS7_TRUST_ANCHOR  *TrustAnchor;
+
+  TrustAnchor = (PKCS7_TRUST_ANCHOR *) Anchor;
+  if (TrustAnchor == NULL) {
+    return;
+  }
+
+  X509_STORE_free (TrustAnchor->Store);
+  if (TrustAnchor->Certs != NULL) {
+    sk_X509_pop_free (TrustAnchor->Certs, X509_free);
+  }
+  FreePool (TrustAnchor);
+}
+
+/**
+  Verifies already decoded PKCS#7 signed data against a trust anchor.
+
+  @param[in]   Pkcs7       The decoded PKCS#7 signed data.
+  @param[in]   Anchor      Trust anchor from Pkcs7TrustAnchorNew().
+  @param[in]   InData      Pointer to the content to be verified.
+  @param[in]   DataLength  Length of InData in bytes.
+  @param[out]  Matched     If not NULL, receives the index of the first
+                           certificate of Anchor, in the order they were
+                           added, that verifies the signature on its own.
+
+  @retval  TRUE  The specified PKCS#7 signed data is valid.
+  @retval  FALSE Invalid PKCS#7 signed data.
+
+**/
+BOOLEAN
+Pkcs7VerifyDecoded (
+  IN  PKCS7        *Pkcs7,
+  IN  VOID         *Anchor,
+  IN  CONST UINT8  *InData,
+  IN  UINTN        DataLength,
+  OUT UINTN        *Matched  OPTIONAL
+  )
+{
+  PKCS7_TRUST_ANCHOR  *TrustAnchor;
+  BIO                 *DataBio;
+  BOOLEAN             Status;
+  int                 Index;
+
+  TrustAnchor = (PKCS7_TRUST_ANCHOR *) Anchor;
+  if (Pkcs7 == NULL || TrustAnchor == NULL || InData == NULL ||
+      DataLength > INT_MAX || !PKCS7_type_is_signed (Pkcs7)) {
+    return FALSE;
+  }
+
+  if (!Pkcs7RegisterDigests ()) {
+    return FALSE;
+  }
+
+  Status = FALSE;
+
+  for (Index = 0; Index < sk_X509_num (Pkcs7->d.sign->cert); Index++) {
+    Pkcs7ShareKey (sk_X509_value (Pkcs7->d.sign->cert, Index));
+  }
+
+  //
+  // PKCS7_verify() only reads the content, so it's read in place rather
+  // than copied into a memory BIO of its own.
+  //
+  DataBio = BIO_new_mem_buf (InData, (int) DataLength);
+  if (DataBio == NULL) {
+    goto _Exit;
+  }
+
+  //
+  // Verifies the PKCS#7 signedData structure
+  //
+  mCaptureChain = (BOOLEAN) (Matched != NULL);
+  Status = (BOOLEAN) PKCS7_verify (Pkcs7, NULL, TrustAnchor->Store, DataBio, NULL, PKCS7_BINARY);
+  mCaptureChain = FALSE;
+
+  if (Status && Matched != NULL) {
+    Status = (BOOLEAN) (mVerifiedChain != NULL &&
+                        Pkcs7FindAnchor (TrustAnchor->Certs, mVerifiedChain, Pkcs7,
+                                         InData, DataLength, Matched));
+  }
+
+_Exit:
+  if (mVerifiedChain != NULL) {
+    sk_X509_pop_free (mVerifiedChain, X509_free);
+    mVerifiedChain = NULL;
+  }
+  BIO_free (DataBio);
+
+  return Status;
+}
+
 /**
   Verifies the validity of a PKCS#7 signed data as described in "PKCS #7:
   Cryptographic Message Syntax Standard". The input signed data could be wrapped
@@ -838,10 +1220,8 @@ Pkcs7Verify (
   )
 {
   PKCS7       *Pkcs7;
-  BIO         *DataBio;
   BOOLEAN     Status;
-  X509        *Cert;
-  X509_STORE  *CertStore;
+  VOID        *Anchor;
   UINT8       *SignedData;
   CONST UINT8 *Temp;
   UINTN       SignedDataSize;
@@ -856,29 +1236,12 @@ Pkcs7Verify (
   }
 
   Pkcs7     = NULL;
-  DataBio   = NULL;
-  Cert      = NULL;
-  CertStore = NULL;
+  Anchor    = NULL;
 
   //
   // Register & Initialize necessary digest algorithms for PKCS#7 Handling
   //
-  if (EVP_add_digest (EVP_md5 ()) == 0) {
-    return FALSE;
-  }
-  if (EVP_add_digest (EVP_sha1 ()) == 0) {
-    return FALSE;
-  }
-  if (EVP_add_digest (EVP_sha256 ()) == 0) {
-    return FALSE;
-  }
-  if (EVP_add_digest (EVP_sha384 ()) == 0) {
-    return FALSE;
-  }
-  if (EVP_add_digest (EVP_sha512 ()) == 0) {
-    return FALSE;
-  }
-  if (EVP_add_digest_alias (SN_sha1WithRSAEncryption, SN_sha1WithRSA) == 0) {
+  if (!Pkcs7RegisterDigests ()) {
     return FALSE;
   }
 
@@ -909,67 +1272,18 @@ Pkcs7Verify (
     goto _Exit;
   }
 
-  //
-  // Read DER-encoded root certificate and Construct X509 Certificate
-  //
-  Temp = TrustedCert;
-  Cert = d2i_X509 (NULL, &Temp, (long) CertLength);
-  if (Cert == NULL) {
-    goto _Exit;
-  }
-
-  //
-  // Setup X509 Store for trusted certificate
-  //
-  CertStore = X509_STORE_new ();
-  if (CertStore == NULL) {
-    goto _Exit;
-  }
-  if (!(X509_STORE_add_cert (CertStore, Cert))) {
-    goto _Exit;
-  }
-
-  X509_STORE_set_verify_cb (CertStore, X509VerifyCb);
-
-  //
-  // For generic PKCS#7 handling, InData may be NULL if the content is present
-  // in PKCS#7 structure. So ignore NULL checking here.
-  //
-  DataBio = BIO_new (BIO_s_mem ());
-  if (DataBio == NULL) {
-    goto _Exit;
-  }
-
-  if (BIO_write (DataBio, InData, (int) DataLength) <= 0) {
+  Anchor = Pkcs7TrustAnchorNew (TrustedCert, CertLength);
+  if (Anchor == NULL) {
     goto _Exit;
   }
 
-  //
-  // Allow partial certificate chains, terminated by a non-self-signed but
-  // still trusted intermediate certificate. Also disable time checks.
-  //
-  X509_STORE_set_flags (CertStore,
-                        X509_V_FLAG_PARTIAL_CHAIN | X509_V_FLAG_NO_CHECK_TIME);
-
-  //
-  // OpenSSL PKCS7 Verification by default checks for SMIME (email signing) and
-  // doesn't support the extended key usage for Authenticode Code Signing.
-  // Bypass the certificate purpose checking by enabling any purposes setting.
-  //
-  X509_STORE_set_purpose (CertStore, X509_PURPOSE_ANY);
-
-  //
-  // Verifies the PKCS#7 signedData structure
-  //
-  Status = (BOOLEAN) PKCS7_verify (Pkcs7, NULL, CertStore, DataBio, NULL, PKCS7_BINARY);
+  Status = Pkcs7VerifyDecoded (Pkcs7, Anchor, InData, DataLength, NULL);
 
 _Exit:
   //
   // Release Resources
   //
-  BIO_free (DataBio);
-  X509_free (Cert);
-  X509_STORE_free (CertStore);
+  Pkcs7TrustAnchorFree (Anchor);
   PKCS7_free (Pkcs7);
 
   if (!Wrapped) {
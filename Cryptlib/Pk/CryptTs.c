@@ -553,8 +553,7 @@ ImageTimestampVerify (
   //
   // Register & Initialize necessary digest algorithms for PKCS#7 Handling.
   //
-  if ((EVP_add_digest (EVP_md5 ()) == 0) || (EVP_add_digest (EVP_sha1 ()) == 0) ||
-      (EVP_add_digest (EVP_sha256 ()) == 0) || (EVP_add_digest_alias (SN_sha1WithRSAEncryption, SN_sha1WithRSA)) == 0) {
+  if (!Pkcs7RegisterDigests ()) {
     return FALSE;
   }
 
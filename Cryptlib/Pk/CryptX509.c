@@ -422,13 +422,7 @@ X509VerifyCert (
   //
   // Register & Initialize necessary digest algorithms for certificate verification.
   //
-  if (EVP_add_digest (EVP_md5 ()) == 0) {
-    goto _Exit;
-  }
-  if (EVP_add_digest (EVP_sha1 ()) == 0) {
-    goto _Exit;
-  }
-  if (EVP_add_digest (EVP_sha256 ()) == 0) {
+  if (!Pkcs7RegisterDigests ()) {
     goto _Exit;
   }
 
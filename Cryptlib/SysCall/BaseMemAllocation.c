@@ -14,6 +14,7 @@ WITHOUT WARRANTIES OR REPRESENTATIONS OF ANY KIND, EITHER EXPRESS OR IMPLIED.
 **/
 
 #include <OpenSslSupport.h>
+#include <Library/BaseCryptLib.h>
 
 //
 // -- Memory-Allocation Routines --
@@ -22,27 +23,17 @@ WITHOUT WARRANTIES OR REPRESENTATIONS OF ANY KIND, EITHER EXPRESS OR IMPLIED.
 /* Allocates memory blocks */
 void *malloc (size_t size)
 {
-  return AllocatePool ((UINTN) size);
+  return CryptoMemAlloc ((UINTN) size);
 }
 
 /* Reallocate memory blocks */
 void *realloc (void *ptr, size_t size)
 {
-  //
-  // BUG: hardcode OldSize == size! We have no any knowledge about
-  // memory size of original pointer ptr.
-  //
-  return ReallocatePool (ptr, (UINTN) size, (UINTN) size);
+  return CryptoMemRealloc (ptr, (UINTN) size);
 }
 
 /* De-allocates or frees a memory block */
 void free (void *ptr)
 {
-  //
-  // In Standard C, free() handles a null pointer argument transparently. This
-  // is not true of FreePool() below, so protect it.
-  //
-  if (ptr != NULL) {
-    FreePool (ptr);
-  }
+  CryptoMemFree (ptr);
 }
@@ -0,0 +1,255 @@
+/** @file
+  Slab allocator behind OpenSSL's malloc(), realloc() and free().
+
+  Decoding and verifying one signature makes thousands of allocations,
+  nearly all of them a few dozen bytes.  Small blocks are carved out of
+  16 KiB slabs, one size class per power of two from 16 bytes to 2 KiB, and
+  go back on a free list for their class when they're freed.  Anything
+  bigger comes straight from AllocatePool().
+
+  Each block starts with a header giving its size and class.  A free block
+  keeps the link to the next free one of its class where its data was.
+
+This program and the accompanying materials
+are licensed and made available under the terms and conditions of the BSD License
+which accompanies this distribution.  The full text of the license may be found at
+http://opensource.org/licenses/bsd-license.php
+
+THE PROGRAM IS DISTRIBUTED UNDER THE BSD LICENSE ON AN "AS IS" BASIS,
+WITHOUT WARRANTIES OR REPRESENTATIONS OF ANY KIND, EITHER EXPRESS OR IMPLIED.
+
+**/
+
+#ifdef SHIM_UNIT_TEST
+#include "shim.h"
+#include <Library/BaseCryptLib.h>
+#else
+#include "InternalCryptLib.h"
+#endif
+
+#define CRYPT_MEM_MIN_SHIFT   4
+#define CRYPT_MEM_CLASSES     8
+#define CRYPT_MEM_LARGE       CRYPT_MEM_CLASSES
+#define CRYPT_MEM_SLAB_SIZE   0x4000
+
+#define CRYPT_MEM_CLASS_SIZE(Class)  ((UINTN) 1 << ((Class) + CRYPT_MEM_MIN_SHIFT))
+
+//
+// Eight bytes on both 32 and 64 bit, so what follows it is aligned as well
+// as AllocatePool() would have.
+//
+typedef struct {
+  UINT32  Size;       ///< Bytes asked for
+  UINT32  Class;      ///< CRYPT_MEM_LARGE if it's not from a slab
+} CRYPT_MEM_HEADER;
+
+#define CRYPT_MEM_NEXT_FREE(Header)  (*(CRYPT_MEM_HEADER **) ((Header) + 1))
+
+STATIC CRYPT_MEM_HEADER  *mFreeBlocks[CRYPT_MEM_CLASSES];
+STATIC UINT8             *mSlabNext[CRYPT_MEM_CLASSES];
+STATIC UINTN             mSlabLeft[CRYPT_MEM_CLASSES];
+
+STATIC CRYPTO_MEM_STATS  mStats;
+
+/**
+  Gets a block with room for Size bytes.
+
+**/
+STATIC
+CRYPT_MEM_HEADER *
+CryptMemGetBlock (
+  IN  UINTN  Size
+  )
+{
+  CRYPT_MEM_HEADER  *Header;
+  UINTN             Class;
+  UINTN             BlockSize;
+
+  if (Size > 0xFFFFFFFF - sizeof (CRYPT_MEM_HEADER)) {
+    return NULL;
+  }
+
+  for (Class = 0; Class < CRYPT_MEM_CLASSES; Class++) {
+    if (Size <= CRYPT_MEM_CLASS_SIZE (Class)) {
+      break;
+    }
+  }
+
+  if (Class == CRYPT_MEM_LARGE) {
+    Header = AllocatePool (sizeof (CRYPT_MEM_HEADER) + Size);
+    if (Header == NULL) {
+      return NULL;
+    }
+    mStats.PoolAllocations++;
+  } else if (mFreeBlocks[Class] != NULL) {
+    Header             = mFreeBlocks[Class];
+    mFreeBlocks[Class] = CRYPT_MEM_NEXT_FREE (Header);
+  } else {
+    BlockSize = sizeof (CRYPT_MEM_HEADER) + CRYPT_MEM_CLASS_SIZE (Class);
+    if (mSlabLeft[Class] < BlockSize) {
+      //
+      // Whatever is left of the old slab is too small to use; it stays
+      // allocated, as slabs always do.
+      //
+      mSlabNext[Class] = AllocatePool (CRYPT_MEM_SLAB_SIZE);
+      if (mSlabNext[Class] == NULL) {
+        mSlabLeft[Class] = 0;
+        return NULL;
+      }
+      mSlabLeft[Class] = CRYPT_MEM_SLAB_SIZE;
+      mStats.PoolAllocations++;
+    }
+    Header            = (CRYPT_MEM_HEADER *) mSlabNext[Class];
+    mSlabNext[Class] += BlockSize;
+    mSlabLeft[Class] -= BlockSize;
+  }
+
+  Header->Size  = (UINT32) Size;
+  Header->Class = (UINT32) Class;
+  mStats.Allocations++;
+  mStats.CurrentBytes += Size;
+  if (mStats.CurrentBytes > mStats.PeakBytes) {
+    mStats.PeakBytes = mStats.CurrentBytes;
+  }
+  return Header;
+}
+
+/**
+  Gives back a block, to the firmware or to the free list for its class.
+
+**/
+STATIC
+VOID
+CryptMemPutBlock (
+  IN  CRYPT_MEM_HEADER  *Header
+  )
+{
+  mStats.Frees++;
+  mStats.CurrentBytes -= Header->Size;
+
+  if (Header->Class == CRYPT_MEM_LARGE) {
+    FreePool (Header);
+    return;
+  }
+
+  CRYPT_MEM_NEXT_FREE (Header) = mFreeBlocks[Header->Class];
+  mFreeBlocks[Header->Class]    = Header;
+}
+
+/**
+  Allocates Size bytes for OpenSSL.
+
+  @param[in]  Size  Number of bytes to allocate.
+
+  @return  The allocated memory, or NULL if there's not enough.
+
+**/
+VOID *
+EFIAPI
+CryptoMemAlloc (
+  IN  UINTN  Size
+  )
+{
+  CRYPT_MEM_HEADER  *Header;
+
+  Header = CryptMemGetBlock (Size);
+  if (Header == NULL) {
+    return NULL;
+  }
+
+  return Header + 1;
+}
+
+/**
+  Resizes a block from CryptoMemAlloc(), keeping what it held.
+
+  @param[in]  Ptr   The block to resize, or NULL to allocate a new one.
+  @param[in]  Size  The size it's to have.  Zero frees it.
+
+  @return  The resized block, or NULL if there's not enough memory, in
+           which case Ptr is left alone.
+
+**/
+VOID *
+EFIAPI
+CryptoMemRealloc (
+  IN  VOID   *Ptr,
+  IN  UINTN  Size
+  )
+{
+  CRYPT_MEM_HEADER  *Header;
+  CRYPT_MEM_HEADER  *NewHeader;
+  UINTN             Room;
+
+  if (Ptr == NULL) {
+    return CryptoMemAlloc (Size);
+  }
+  if (Size == 0) {
+    CryptoMemFree (Ptr);
+    return NULL;
+  }
+
+  //
+  // A big block shrunk to slab size moves to a slab, so the pool
+  // allocation it had goes back to the firmware.
+  //
+  Header = (CRYPT_MEM_HEADER *) Ptr - 1;
+  if (Header->Class == CRYPT_MEM_LARGE) {
+    Room = Size > CRYPT_MEM_CLASS_SIZE (CRYPT_MEM_LARGE - 1) ? Header->Size : 0;
+  } else {
+    Room = CRYPT_MEM_CLASS_SIZE (Header->Class);
+  }
+  if (Size <= Room) {
+    mStats.CurrentBytes  = mStats.CurrentBytes - Header->Size + Size;
+    if (mStats.CurrentBytes > mStats.PeakBytes) {
+      mStats.PeakBytes = mStats.CurrentBytes;
+    }
+    Header->Size = (UINT32) Size;
+    return Ptr;
+  }
+
+  NewHeader = CryptMemGetBlock (Size);
+  if (NewHeader == NULL) {
+    return NULL;
+  }
+  CopyMem (NewHeader + 1, Ptr, Header->Size < Size ? Header->Size : Size);
+  CryptMemPutBlock (Header);
+  return NewHeader + 1;
+}
+
+/**
+  Frees a block from CryptoMemAlloc() or CryptoMemRealloc().
+
+  @param[in]  Ptr  The block to free, or NULL.
+
+**/
+VOID
+EFIAPI
+CryptoMemFree (
+  IN  VOID  *Ptr
+  )
+{
+  CRYPT_MEM_HEADER  *Header;
+
+  if (Ptr == NULL) {
+    return;
+  }
+
+  Header = (CRYPT_MEM_HEADER *) Ptr - 1;
+  CryptMemPutBlock (Header);
+}
+
+/**
+  Retrieves the allocator's counters.
+
+  @param[out]  Stats  Receives the counters.
+
+**/
+VOID
+EFIAPI
+CryptoMemGetStats (
+  OUT  CRYPTO_MEM_STATS  *Stats
+  )
+{
+  CopyMem (Stats, &mStats, sizeof (mStats));
+}
@@ -0,0 +1,490 @@
+// SPDX-License-Identifier: BSD-2-Clause-Patent
+/*
+ * der.c - find things in DER-encoded certificates without decoding them
+ *
+ * Handing a certificate to d2i_X509() to answer one question about it
+ * builds every structure OpenSSL has for it, and allocates each of them.
+ * Most questions we ask only need a few tags and lengths followed.
+ */
+
+#include "shim.h"
+
+BOOLEAN
+der_next(const UINT8 **pos, const UINT8 *end, der_item_t *item)
+{
+	const UINT8 *p = *pos;
+	UINTN size, n;
+
+	if (p >= end || end - p < 2)
+		return FALSE;
+
+	/* Certificates don't use tags above 30 */
+	item->tag = *p++;
+	if ((item->tag & 0x1f) == 0x1f)
+		return FALSE;
+
+	/* Indefinite lengths are BER, not DER */
+	size = *p++;
+	if (size & 0x80) {
+		n = size & 0x7f;
+		if (n == 0 || n > sizeof(size) || n > (UINTN)(end - p))
+			return FALSE;
+		for (size = 0; n; n--)
+			size = (size << 8) | *p++;
+	}
+	if (size > (UINTN)(end - p))
+		return FALSE;
+
+	item->der = *pos;
+	item->data = p;
+	item->size = size;
+	*pos = p + size;
+	return TRUE;
+}
+
+/*
+ * Step into the contents of the element at *pos if it has the given tag.
+ */
+static BOOLEAN
+der_enter(const UINT8 **pos, const UINT8 **end, UINT8 tag)
+{
+	der_item_t item;
+
+	if (!der_next(pos, *end, &item) || item.tag != tag)
+		return FALSE;
+	*pos = item.data;
+	*end = item.data + item.size;
+	return TRUE;
+}
+
+/*
+ * The parts of a certificate we look at.  extensions is empty if there
+ * aren't any.
+ */
+typedef struct {
+	der_item_t issuer;
+	der_item_t subject;
+	der_item_t extensions;
+} x509_parts_t;
+
+static BOOLEAN
+x509_parts(const UINT8 *cert, UINTN size, x509_parts_t *parts)
+{
+	const UINT8 *pos = cert, *end = cert + size;
+	der_item_t item;
+
+	/* Certificate, then tbsCertificate */
+	if (!der_enter(&pos, &end, DER_SEQUENCE) ||
+	    !der_enter(&pos, &end, DER_SEQUENCE))
+		return FALSE;
+
+	/* version, which v1 certificates leave out, serialNumber, signature */
+	if (!der_next(&pos, end, &item))
+		return FALSE;
+	if (item.tag == DER_CONTEXT(0) && !der_next(&pos, end, &item))
+		return FALSE;
+	if (item.tag != DER_INTEGER ||
+	    !der_next(&pos, end, &item) || item.tag != DER_SEQUENCE)
+		return FALSE;
+
+	/* issuer, validity, subject, subjectPublicKeyInfo */
+	if (!der_next(&pos, end, &parts->issuer) ||
+	    parts->issuer.tag != DER_SEQUENCE ||
+	    !der_next(&pos, end, &item) || item.tag != DER_SEQUENCE ||
+	    !der_next(&pos, end, &parts->subject) ||
+	    parts->subject.tag != DER_SEQUENCE ||
+	    !der_next(&pos, end, &item) || item.tag != DER_SEQUENCE)
+		return FALSE;
+
+	/* The extensions are the [3] at the end */
+	ZeroMem(&parts->extensions, sizeof(parts->extensions));
+	while (pos < end) {
+		if (!der_next(&pos, end, &item))
+			return FALSE;
+		if (item.tag != DER_CONTEXT(3))
+			continue;
+		pos = item.data;
+		end = item.data + item.size;
+		return der_next(&pos, end, &parts->extensions) &&
+		       parts->extensions.tag == DER_SEQUENCE;
+	}
+	return TRUE;
+}
+
+/*
+ * Find the extension with the given extnID, and return its extnValue.
+ * Like X509_get_ext_d2i(), finds nothing if it's there more than once.
+ * Returns FALSE if the extensions can't be parsed, and otherwise sets
+ * *found.
+ */
+static BOOLEAN
+x509_find_ext(const x509_parts_t *parts, const UINT8 *id, UINTN id_size,
+	      der_item_t *value, BOOLEAN *found)
+{
+	const UINT8 *pos = parts->extensions.data;
+	const UINT8 *end = pos + parts->extensions.size;
+	const UINT8 *ext, *ext_end;
+	UINTN count = 0;
+	der_item_t item;
+
+	while (pos < end) {
+		if (!der_next(&pos, end, &item) || item.tag != DER_SEQUENCE)
+			return FALSE;
+		ext = item.data;
+		ext_end = item.data + item.size;
+
+		/* extnID, then critical if it's there, then extnValue */
+		if (!der_next(&ext, ext_end, &item) || item.tag != DER_OID)
+			return FALSE;
+		if (item.size != id_size ||
+		    CompareMem(item.data, id, id_size) != 0)
+			continue;
+		if (!der_next(&ext, ext_end, &item))
+			return FALSE;
+		if (item.tag == DER_BOOLEAN && !der_next(&ext, ext_end, &item))
+			return FALSE;
+		if (item.tag != DER_OCTET_STRING)
+			return FALSE;
+		*value = item;
+		count++;
+	}
+
+	*found = count == 1;
+	return TRUE;
+}
+
+/* 2.5.29.37, id-ce-extKeyUsage */
+static const UINT8 ext_key_usage[] = { 0x55, 0x1d, 0x25 };
+
+BOOLEAN
+x509_has_eku(const UINT8 *cert, UINTN size, const UINT8 *oid,
+	     UINTN oid_size, BOOLEAN *listed)
+{
+	const UINT8 *pos, *end;
+	x509_parts_t parts;
+	der_item_t item;
+	BOOLEAN found;
+
+	*listed = FALSE;
+	if (!x509_parts(cert, size, &parts) ||
+	    !x509_find_ext(&parts, ext_key_usage, sizeof(ext_key_usage),
+			   &item, &found))
+		return FALSE;
+	if (!found)
+		return TRUE;
+
+	/*
+	 * ExtKeyUsageSyntax ::= SEQUENCE OF KeyPurposeId.  OpenSSL would
+	 * have decoded it or not as a whole, so anything else in it means
+	 * we can't say.
+	 */
+	pos = item.data;
+	end = item.data + item.size;
+	if (!der_enter(&pos, &end, DER_SEQUENCE))
+		return FALSE;
+	while (pos < end) {
+		if (!der_next(&pos, end, &item) || item.tag != DER_OID)
+			return FALSE;
+		if (item.size == oid_size &&
+		    CompareMem(item.data, oid, oid_size) == 0)
+			*listed = TRUE;
+	}
+
+	return TRUE;
+}
+
+/* 2.5.29.14, id-ce-subjectKeyIdentifier */
+static const UINT8 subject_key_id[] = { 0x55, 0x1d, 0x0e };
+
+/* 2.5.29.35, id-ce-authorityKeyIdentifier */
+static const UINT8 authority_key_id[] = { 0x55, 0x1d, 0x23 };
+
+/*
+ * The certificate's own key identifier, or the one it gives for its
+ * issuer's key.  OpenSSL only compares them if it can decode both
+ * extensions, so only ones with nothing else in them count.
+ */
+static BOOLEAN
+x509_key_id(const x509_parts_t *parts, BOOLEAN authority, der_item_t *key_id)
+{
+	const UINT8 *pos, *end;
+	der_item_t value;
+	BOOLEAN found;
+
+	if (!x509_find_ext(parts, authority ? authority_key_id : subject_key_id,
+			   sizeof(subject_key_id), &value, &found) || !found)
+		return FALSE;
+	pos = value.data;
+	end = value.data + value.size;
+
+	/*
+	 * SubjectKeyIdentifier ::= KeyIdentifier, an OCTET STRING.
+	 * AuthorityKeyIdentifier is a SEQUENCE with it as an IMPLICIT [0],
+	 * which we want to be the only thing in it.
+	 */
+	if (authority && !der_enter(&pos, &end, DER_SEQUENCE))
+		return FALSE;
+	if (!der_next(&pos, end, key_id) || pos != end)
+		return FALSE;
+	return key_id->tag == (authority ? DER_CONTEXT_PRIM(0) :
+					   DER_OCTET_STRING);
+}
+
+/*
+ * The next relative distinguished name of a Name.  OpenSSL drops empty
+ * ones when it compares names, so they're skipped here.
+ */
+static BOOLEAN
+name_next_rdn(const UINT8 **pos, const UINT8 *end, der_item_t *rdn,
+	      BOOLEAN *bad)
+{
+	do {
+		if (*pos == end)
+			return FALSE;
+		if (!der_next(pos, end, rdn) || rdn->tag != DER_SET) {
+			*bad = TRUE;
+			return FALSE;
+		}
+	} while (rdn->size == 0);
+	return TRUE;
+}
+
+/*
+ * The type and value of a relative distinguished name with just one
+ * AttributeTypeAndValue in it.
+ */
+static BOOLEAN
+name_rdn_attribute(const der_item_t *rdn, der_item_t *type, der_item_t *value)
+{
+	const UINT8 *pos = rdn->data, *end = rdn->data + rdn->size;
+
+	if (!der_enter(&pos, &end, DER_SEQUENCE) ||
+	    rdn->data + rdn->size != end)
+		return FALSE;
+	return der_next(&pos, end, type) && type->tag == DER_OID &&
+	       der_next(&pos, end, value) && pos == end;
+}
+
+/*
+ * The string types OpenSSL converts to UTF-8 and folds case and spacing
+ * in before comparing names.
+ */
+static BOOLEAN
+name_string_folds(UINT8 tag)
+{
+	switch (tag) {
+	case DER_UTF8_STRING:
+	case DER_PRINTABLE_STRING:
+	case DER_T61_STRING:
+	case DER_IA5_STRING:
+	case DER_VISIBLE_STRING:
+	case DER_UNIVERSAL_STRING:
+	case DER_BMP_STRING:
+		return TRUE;
+	}
+	return FALSE;
+}
+
+/*
+ * Whether a string could be one OpenSSL folds the same way we do: ASCII,
+ * in a type that takes it byte for byte, with no white space but spaces.
+ */
+static BOOLEAN
+name_string_ascii(const der_item_t *value)
+{
+	UINTN i;
+
+	if (value->tag == DER_UNIVERSAL_STRING || value->tag == DER_BMP_STRING)
+		return FALSE;
+	for (i = 0; i < value->size; i++) {
+		if (value->data[i] >= 0x80 ||
+		    (value->data[i] >= '\t' && value->data[i] <= '\r'))
+			return FALSE;
+	}
+	return TRUE;
+}
+
+/*
+ * The next character of an ASCII string folded the way OpenSSL does:
+ * lower case, with each run of spaces made one.  Leading and trailing
+ * ones have to have been trimmed already.  -1 at the end.
+ */
+static INTN
+name_fold_next(const UINT8 **pos, const UINT8 *end)
+{
+	UINT8 c;
+
+	if (*pos == end)
+		return -1;
+	c = *(*pos)++;
+	if (c == ' ') {
+		while (*pos < end && **pos == ' ')
+			(*pos)++;
+	} else if (c >= 'A' && c <= 'Z') {
+		c += 'a' - 'A';
+	}
+	return c;
+}
+
+static void
+name_trim(const UINT8 **pos, const UINT8 **end)
+{
+	while (*pos < *end && **pos == ' ')
+		(*pos)++;
+	while (*pos < *end && (*end)[-1] == ' ')
+		(*end)--;
+}
+
+/*
+ * Whether OpenSSL could find two attribute values the same.
+ */
+static BOOLEAN
+name_value_may_match(const der_item_t *a, const der_item_t *b)
+{
+	const UINT8 *pa = a->data, *ea = a->data + a->size;
+	const UINT8 *pb = b->data, *eb = b->data + b->size;
+	INTN ca, cb;
+
+	if (!name_string_folds(a->tag) || !name_string_folds(b->tag))
+		return a->tag == b->tag && a->size == b->size &&
+		       CompareMem(a->data, b->data, a->size) == 0;
+	if (!name_string_ascii(a) || !name_string_ascii(b))
+		return TRUE;
+
+	name_trim(&pa, &ea);
+	name_trim(&pb, &eb);
+	do {
+		ca = name_fold_next(&pa, ea);
+		cb = name_fold_next(&pb, eb);
+		if (ca != cb)
+			return FALSE;
+	} while (ca != -1);
+	return TRUE;
+}
+
+/*
+ * Whether OpenSSL could find two names the same.  Only the differences
+ * it doesn't fold away say they aren't: a different number of parts, an
+ * attribute of another type, or a value that differs in more than case
+ * and spacing.
+ */
+static BOOLEAN
+x509_name_may_match(const der_item_t *a, const der_item_t *b)
+{
+	const UINT8 *pa = a->data, *ea = a->data + a->size;
+	const UINT8 *pb = b->data, *eb = b->data + b->size;
+	der_item_t rdn_a, rdn_b, type_a, type_b, value_a, value_b;
+	BOOLEAN more_a, more_b, bad = FALSE;
+
+	if (a->size == b->size && CompareMem(a->data, b->data, a->size) == 0)
+		return TRUE;
+
+	for (;;) {
+		more_a = name_next_rdn(&pa, ea, &rdn_a, &bad);
+		more_b = name_next_rdn(&pb, eb, &rdn_b, &bad);
+		if (bad)
+			return TRUE;
+		if (!more_a || !more_b)
+			return more_a == more_b;
+		if (rdn_a.size == rdn_b.size &&
+		    CompareMem(rdn_a.data, rdn_b.data, rdn_a.size) == 0)
+			continue;
+
+		/* OpenSSL sorts multi-valued ones, which we don't */
+		if (!name_rdn_attribute(&rdn_a, &type_a, &value_a) ||
+		    !name_rdn_attribute(&rdn_b, &type_b, &value_b))
+			return TRUE;
+		if (type_a.size != type_b.size ||
+		    CompareMem(type_a.data, type_b.data, type_a.size) != 0 ||
+		    !name_value_may_match(&value_a, &value_b))
+			return FALSE;
+	}
+}
+
+/* 1.2.840.113549.1.7.2, id-signedData */
+static const UINT8 pkcs7_signed_data[] = {
+	0x2a, 0x86, 0x48, 0x86, 0xf7, 0x0d, 0x01, 0x07, 0x02
+};
+
+/*
+ * Find the certificates of PKCS#7 signed data, which are the [0] after
+ * its version, digestAlgorithms and contentInfo.  If there aren't any,
+ * *pos and *end are the same.
+ */
+static BOOLEAN
+pkcs7_certs(const UINT8 *p7, UINTN size, const UINT8 **pos, const UINT8 **end)
+{
+	const UINT8 *p = p7, *e = p7 + size, *q;
+	der_item_t item;
+
+	if (!der_enter(&p, &e, DER_SEQUENCE))
+		return FALSE;
+
+	/* ContentInfo, if the first thing in it is the content type */
+	q = p;
+	if (!der_next(&q, e, &item))
+		return FALSE;
+	if (item.tag == DER_OID) {
+		if (item.size != sizeof(pkcs7_signed_data) ||
+		    CompareMem(item.data, pkcs7_signed_data, item.size) != 0)
+			return FALSE;
+		p = q;
+		if (!der_enter(&p, &e, DER_CONTEXT(0)) ||
+		    !der_enter(&p, &e, DER_SEQUENCE))
+			return FALSE;
+	}
+
+	if (!der_next(&p, e, &item) || item.tag != DER_INTEGER ||
+	    !der_next(&p, e, &item) || item.tag != DER_SET ||
+	    !der_next(&p, e, &item) || item.tag != DER_SEQUENCE ||
+	    !der_next(&p, e, &item))
+		return FALSE;
+	if (item.tag != DER_CONTEXT(0)) {
+		*pos = *end = item.der;
+		return TRUE;
+	}
+	*pos = item.data;
+	*end = item.data + item.size;
+	return TRUE;
+}
+
+BOOLEAN
+pkcs7_may_chain_to(const UINT8 *p7, UINTN p7_size, const UINT8 *cert,
+		   UINTN cert_size)
+{
+	der_item_t anchor_key_id, key_id, item;
+	x509_parts_t anchor, parts;
+	BOOLEAN anchor_has_key_id;
+	const UINT8 *pos, *end;
+
+	if (!x509_parts(cert, cert_size, &anchor) ||
+	    !pkcs7_certs(p7, p7_size, &pos, &end))
+		return TRUE;
+	anchor_has_key_id = x509_key_id(&anchor, FALSE, &anchor_key_id);
+
+	/*
+	 * OpenSSL only looks for the signer among these, and a chain from
+	 * it only leaves them for a trusted certificate that is one of them
+	 * or is the issuer of one of them.
+	 */
+	while (pos < end) {
+		if (!der_next(&pos, end, &item) ||
+		    !x509_parts(item.der, pos - item.der, &parts))
+			return TRUE;
+
+		if (x509_name_may_match(&parts.subject, &anchor.subject))
+			return TRUE;
+		if (!x509_name_may_match(&parts.issuer, &anchor.subject))
+			continue;
+		if (!anchor_has_key_id || !x509_key_id(&parts, TRUE, &key_id))
+			return TRUE;
+		if (key_id.size == anchor_key_id.size &&
+		    CompareMem(key_id.data, anchor_key_id.data,
+			       key_id.size) == 0)
+			return TRUE;
+	}
+
+	return FALSE;
+}
+
+// vim:fenc=utf-8:tw=75:noet
@@ -0,0 +1,189 @@
+// SPDX-License-Identifier: BSD-2-Clause-Patent
+/*
+ * digest.c - compute several digests of the same data in one pass
+ */
+
+#include "shim.h"
+
+#include <Library/BaseCryptLib.h>
+
+EFI_STATUS
+digest_init(digest_ctx_t *ctx, UINT32 algs)
+{
+	UINTN sha1sz = 0, sha256sz = 0, sha384sz = 0, sha512sz = 0;
+	char *mem;
+
+	ZeroMem(ctx, sizeof(*ctx));
+
+	if (algs & DIGEST_SHA1)
+		sha1sz = ALIGN_VALUE(Sha1GetContextSize(), 16);
+	if (algs & DIGEST_SHA256)
+		sha256sz = ALIGN_VALUE(Sha256GetContextSize(), 16);
+	if (algs & DIGEST_SHA384)
+		sha384sz = ALIGN_VALUE(Sha384GetContextSize(), 16);
+	if (algs & DIGEST_SHA512)
+		sha512sz = ALIGN_VALUE(Sha512GetContextSize(), 16);
+
+	/* One allocation for all of the contexts */
+	mem = AllocatePool(sha1sz + sha256sz + sha384sz + sha512sz + 1);
+	if (!mem) {
+		perror(L"Unable to allocate memory for hash context\n");
+		return EFI_OUT_OF_RESOURCES;
+	}
+	ctx->mem = mem;
+
+	if (algs & DIGEST_SHA1) {
+		ctx->sha1ctx = mem;
+		mem += sha1sz;
+		if (!Sha1Init(ctx->sha1ctx))
+			goto err;
+	}
+	if (algs & DIGEST_SHA256) {
+		ctx->sha256ctx = mem;
+		mem += sha256sz;
+		if (!Sha256Init(ctx->sha256ctx))
+			goto err;
+	}
+	if (algs & DIGEST_SHA384) {
+		ctx->sha384ctx = mem;
+		mem += sha384sz;
+		if (!Sha384Init(ctx->sha384ctx))
+			goto err;
+	}
+	if (algs & DIGEST_SHA512) {
+		ctx->sha512ctx = mem;
+		mem += sha512sz;
+		if (!Sha512Init(ctx->sha512ctx))
+			goto err;
+	}
+	ctx->algs = algs;
+
+	return EFI_SUCCESS;
+err:
+	perror(L"Unable to initialise hash\n");
+	digest_free(ctx);
+	return EFI_OUT_OF_RESOURCES;
+}
+
+/*
+ * Feed data to the hashes in algs, which have to be ones ctx has.
+ */
+static EFI_STATUS
+digest_update_algs(digest_ctx_t *ctx, UINT32 algs, const void *data,
+		   UINTN size)
+{
+	const UINT8 *pos = data;
+	UINTN chunk;
+
+	/*
+	 * Walk the data once, handing each chunk to every hash while it
+	 * is still cache-hot, rather than streaming the whole buffer
+	 * through memory once per algorithm.
+	 */
+	while (size) {
+		chunk = MIN(size, DIGEST_CHUNK_SIZE);
+
+		if ((algs & DIGEST_SHA256) &&
+		    !Sha256Update(ctx->sha256ctx, pos, chunk))
+			goto err;
+		if ((algs & DIGEST_SHA1) &&
+		    !Sha1Update(ctx->sha1ctx, pos, chunk))
+			goto err;
+		if ((algs & DIGEST_SHA384) &&
+		    !Sha384Update(ctx->sha384ctx, pos, chunk))
+			goto err;
+		if ((algs & DIGEST_SHA512) &&
+		    !Sha512Update(ctx->sha512ctx, pos, chunk))
+			goto err;
+
+		pos += chunk;
+		size -= chunk;
+	}
+
+	return EFI_SUCCESS;
+err:
+	perror(L"Unable to generate hash\n");
+	return EFI_OUT_OF_RESOURCES;
+}
+
+EFI_STATUS
+digest_update(digest_ctx_t *ctx, const void *data, UINTN size)
+{
+	return digest_update_algs(ctx, ctx->algs, data, size);
+}
+
+EFI_STATUS
+digest_update_multi(digest_ctx_t **ctxs, const void **data, UINTN *sizes,
+		    UINTN n)
+{
+	VOID *sha256ctxs[SHA256_MB_LANES];
+	const void *sha256data[SHA256_MB_LANES];
+	UINTN sha256sizes[SHA256_MB_LANES];
+	EFI_STATUS efi_status;
+	UINTN i, lanes = 0;
+
+	for (i = 0; i < n; i++) {
+		efi_status = digest_update_algs(ctxs[i],
+						ctxs[i]->algs & ~DIGEST_SHA256,
+						data[i], sizes[i]);
+		if (EFI_ERROR(efi_status))
+			return efi_status;
+
+		if (!(ctxs[i]->algs & DIGEST_SHA256) || !sizes[i])
+			continue;
+		sha256ctxs[lanes] = ctxs[i]->sha256ctx;
+		sha256data[lanes] = data[i];
+		sha256sizes[lanes] = sizes[i];
+		if (++lanes < SHA256_MB_LANES)
+			continue;
+
+		if (!Sha256UpdateMulti(sha256ctxs, sha256data, sha256sizes,
+				       lanes))
+			goto err;
+		lanes = 0;
+	}
+
+	if (lanes &&
+	    !Sha256UpdateMulti(sha256ctxs, sha256data, sha256sizes, lanes))
+		goto err;
+
+	return EFI_SUCCESS;
+err:
+	perror(L"Unable to generate hash\n");
+	return EFI_OUT_OF_RESOURCES;
+}
+
+EFI_STATUS
+digest_final(digest_ctx_t *ctx, digest_set_t *digests)
+{
+	ZeroMem(digests, sizeof(*digests));
+
+	if ((ctx->algs & DIGEST_SHA1) &&
+	    !Sha1Final(ctx->sha1ctx, digests->sha1))
+		goto err;
+	if ((ctx->algs & DIGEST_SHA256) &&
+	    !Sha256Final(ctx->sha256ctx, digests->sha256))
+		goto err;
+	if ((ctx->algs & DIGEST_SHA384) &&
+	    !Sha384Final(ctx->sha384ctx, digests->sha384))
+		goto err;
+	if ((ctx->algs & DIGEST_SHA512) &&
+	    !Sha512Final(ctx->sha512ctx, digests->sha512))
+		goto err;
+	digests->algs = ctx->algs;
+
+	return EFI_SUCCESS;
+err:
+	perror(L"Unable to finalise hash\n");
+	return EFI_OUT_OF_RESOURCES;
+}
+
+void
+digest_free(digest_ctx_t *ctx)
+{
+	if (ctx->mem)
+		FreePool(ctx->mem);
+	ZeroMem(ctx, sizeof(*ctx));
+}
+
+// vim:fenc=utf-8:tw=75:noet
@@ -127,7 +127,7 @@ typedef struct efi_cc_protocol efi_cc_protocol_t;
 
 EFI_STATUS cc_log_event_raw(EFI_PHYSICAL_ADDRESS buf, UINTN size, UINT8 pcr,
                             const CHAR8 *log, UINTN logsize, UINT32 type,
-                            CHAR8 *hash);
+                            const digest_set_t *digests);
 
 #endif /* SHIM_CC_H */
 // vim:fenc=utf-8:tw=75
@@ -0,0 +1,65 @@
+// SPDX-License-Identifier: BSD-2-Clause-Patent
+/*
+ * der.h - find things in DER-encoded certificates without decoding them
+ */
+
+#ifndef DER_H_
+#define DER_H_
+
+#define DER_BOOLEAN		0x01
+#define DER_INTEGER		0x02
+#define DER_OCTET_STRING	0x04
+#define DER_OID			0x06
+#define DER_SEQUENCE		0x30
+#define DER_SET			0x31
+#define DER_UTF8_STRING		0x0c
+#define DER_PRINTABLE_STRING	0x13
+#define DER_T61_STRING		0x14
+#define DER_IA5_STRING		0x16
+#define DER_VISIBLE_STRING	0x1a
+#define DER_UNIVERSAL_STRING	0x1c
+#define DER_BMP_STRING		0x1e
+#define DER_CONTEXT(n)		(0xa0 | (n))
+#define DER_CONTEXT_PRIM(n)	(0x80 | (n))
+
+/*
+ * One element: its tag, and where its contents are.  der is where the
+ * whole encoding, tag and length included, starts.
+ */
+typedef struct {
+	UINT8 tag;
+	const UINT8 *der;
+	const UINT8 *data;
+	UINTN size;
+} der_item_t;
+
+/*
+ * Read the element at *pos, which mustn't run past end, and move *pos
+ * past it.  Returns FALSE, leaving *pos alone, if there isn't a whole
+ * element there, or it isn't DER.
+ */
+BOOLEAN der_next(const UINT8 **pos, const UINT8 *end, der_item_t *item);
+
+/*
+ * Set *listed to whether the certificate has an extended key usage
+ * extension that lists oid, which is the OID's contents without its tag
+ * and length.  Returns FALSE if the certificate can't be parsed, which
+ * says nothing about it: OpenSSL takes some BER that isn't DER, so the
+ * caller has to ask it instead.
+ */
+BOOLEAN x509_has_eku(const UINT8 *cert, UINTN size, const UINT8 *oid,
+		     UINTN oid_size, BOOLEAN *listed);
+
+/*
+ * Whether a chain from the signer of the PKCS#7 signed data p7, with or
+ * without its ContentInfo, could end at cert: whether cert could be one
+ * of the certificates p7 carries, or have issued one, going by their
+ * names and key identifiers the way OpenSSL compares them.  If either
+ * can't be parsed, or names differ in ways that need decoding to compare,
+ * it could.  A FALSE answer means verifying p7 against cert would fail.
+ */
+BOOLEAN pkcs7_may_chain_to(const UINT8 *p7, UINTN p7_size, const UINT8 *cert,
+			   UINTN cert_size);
+
+#endif /* !DER_H_ */
+// vim:fenc=utf-8:tw=75:noet
@@ -0,0 +1,65 @@
+// SPDX-License-Identifier: BSD-2-Clause-Patent
+/*
+ * digest.h - compute several digests of the same data in one pass
+ */
+
+#ifndef DIGEST_H_
+#define DIGEST_H_
+
+#define DIGEST_SHA1	0x1
+#define DIGEST_SHA256	0x2
+#define DIGEST_SHA384	0x4
+#define DIGEST_SHA512	0x8
+
+#ifndef SHA1_DIGEST_SIZE
+#define SHA1_DIGEST_SIZE 20
+#endif
+#ifndef SHA256_DIGEST_SIZE
+#define SHA256_DIGEST_SIZE 32
+#endif
+#ifndef SHA384_DIGEST_SIZE
+#define SHA384_DIGEST_SIZE 48
+#endif
+#ifndef SHA512_DIGEST_SIZE
+#define SHA512_DIGEST_SIZE 64
+#endif
+
+/*
+ * Data is fed to every enabled hash in chunks of this size, so each
+ * chunk is still in the data cache when the second and later hashes
+ * read it.
+ */
+#define DIGEST_CHUNK_SIZE 8192
+
+typedef struct {
+	UINT32 algs;
+	UINT8 sha1[SHA1_DIGEST_SIZE];
+	UINT8 sha256[SHA256_DIGEST_SIZE];
+	UINT8 sha384[SHA384_DIGEST_SIZE];
+	UINT8 sha512[SHA512_DIGEST_SIZE];
+} digest_set_t;
+
+typedef struct {
+	UINT32 algs;
+	void *mem;
+	void *sha1ctx;
+	void *sha256ctx;
+	void *sha384ctx;
+	void *sha512ctx;
+} digest_ctx_t;
+
+EFI_STATUS digest_init(digest_ctx_t *ctx, UINT32 algs);
+EFI_STATUS digest_update(digest_ctx_t *ctx, const void *data, UINTN size);
+/*
+ * The same as digest_update(ctxs[i], data[i], sizes[i]) for each of the n
+ * contexts, except that their SHA-256 digests are worked on side by side,
+ * which is quicker on machines that can do that but have no SHA
+ * instructions.
+ */
+EFI_STATUS digest_update_multi(digest_ctx_t **ctxs, const void **data,
+			       UINTN *sizes, UINTN n);
+EFI_STATUS digest_final(digest_ctx_t *ctx, digest_set_t *digests);
+void digest_free(digest_ctx_t *ctx);
+
+#endif /* !DIGEST_H_ */
+// vim:fenc=utf-8:tw=75:noet
@@ -0,0 +1,73 @@
+// SPDX-License-Identifier: BSD-2-Clause-Patent
+/*
+ * loader.h - how an image gets from its file into memory
+ */
+
+#ifndef LOADER_H_
+#define LOADER_H_
+
+/*
+ * How many bytes of the start of a file loader_file_pages() wants to see
+ */
+#define LOADER_HEADER_SIZE 4096
+
+/*
+ * How much of a file loader_read() asks for at a time, unless it's told
+ * otherwise.  Big enough that the per-read overhead doesn't matter, small
+ * enough that hashing one chunk takes about as long as reading the next.
+ */
+#ifndef LOADER_CHUNK_SIZE
+#define LOADER_CHUNK_SIZE (1024 * 1024)
+#endif
+
+/*
+ * Called by loader_read() with the first "available" bytes of buffer,
+ * each time more of the file has come in.  Returning an error stops the
+ * read.
+ */
+typedef EFI_STATUS (*loader_consumer_t)(void *ctx, UINT8 *buffer,
+					UINTN available);
+
+/*
+ * How many pages to read a file of file_size bytes into, given its
+ * first header_size bytes.  When the image looks like it could run where
+ * it's read, that includes room for the whole of SizeOfImage, so its
+ * uninitialized data fits after the end of the file.
+ */
+UINTN loader_file_pages(void *header, UINTN header_size, UINTN file_size);
+
+/*
+ * Whether an image read into capacity bytes at data can be relocated and
+ * run right there: its file layout is its memory layout, the buffer is
+ * suitably aligned and big enough, and no two sections share memory.
+ * context is what read_header() found.
+ */
+BOOLEAN loader_runs_in_place(void *data, UINTN datasize, UINTN capacity,
+			     PE_COFF_LOADER_IMAGE_CONTEXT *context);
+
+/*
+ * Whether any two sections that are written when the image is loaded
+ * share memory, in which case the order they're written in decides what
+ * ends up there.
+ */
+BOOLEAN loader_sections_overlap(PE_COFF_LOADER_IMAGE_CONTEXT *context);
+
+/*
+ * SizeOfHeaders of an image, given at least its first LOADER_HEADER_SIZE
+ * bytes, or 0 if it doesn't look like a PE image.
+ */
+UINTN loader_headers_size(void *data, UINTN size);
+
+/*
+ * Read from file's current position until buffer holds size bytes, given
+ * that the first offset bytes are there already, chunk bytes at a time
+ * (or LOADER_CHUNK_SIZE if chunk is 0).  When the file supports ReadEx(),
+ * consume() runs on what's arrived so far while the next chunk is being
+ * read.  A file that ends early is EFI_LOAD_ERROR.
+ */
+EFI_STATUS loader_read(EFI_FILE *file, UINT8 *buffer, UINTN offset,
+		       UINTN size, UINTN chunk, loader_consumer_t consume,
+		       void *ctx);
+
+#endif /* !LOADER_H_ */
+// vim:fenc=utf-8:tw=75:noet
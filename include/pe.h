@@ -17,17 +17,112 @@ read_header(void *data, unsigned int datasize,
 EFI_STATUS
 handle_sbat(char *SBATBase, size_t SBATSize);
 
+/*
+ * One contiguous piece of a file that goes into its Authenticode digest.
+ * section is set when the piece is a section's raw data.
+ */
+typedef struct {
+	UINTN offset;
+	UINTN size;
+	EFI_IMAGE_SECTION_HEADER *section;
+} pe_hash_range_t;
+
+/*
+ * Sections we find by name
+ */
+typedef enum {
+	PE_SECTION_OTHER = 0,
+	PE_SECTION_RELOC,
+	PE_SECTION_SBAT,
+	PE_SECTION_LINUX,
+	PE_SECTION_INITRD,
+	PE_SECTION_CMDLINE,
+	PE_SECTION_NAMES
+} pe_section_name_t;
+
+/*
+ * Everything we need to know about an image's layout, checked once:
+ * what read_header() finds, its section table sorted by file offset,
+ * which of its sections have the names we look for, and which parts of
+ * the file its Authenticode digest covers.
+ */
+typedef struct {
+	char *data;
+	unsigned int datasize;
+	PE_COFF_LOADER_IMAGE_CONTEXT context;
+	EFI_IMAGE_SECTION_HEADER *sections;
+	UINT8 *names;
+	EFI_IMAGE_SECTION_HEADER *named[PE_SECTION_NAMES];
+	pe_hash_range_t *ranges;
+	UINTN nranges;
+} pe_image_t;
+
+/*
+ * Build the descriptor for an image of datasize bytes at data, of which
+ * only the headers have to have been read yet.  If context is NULL,
+ * read_header() fills it in; otherwise it's what the caller already has.
+ */
+EFI_STATUS
+pe_image_init (pe_image_t *image, void *data, unsigned int datasize,
+	       PE_COFF_LOADER_IMAGE_CONTEXT *context);
+
+void
+pe_image_free (pe_image_t *image);
+
+EFI_STATUS
+pe_image_digests (pe_image_t *image, UINT32 algs, digest_set_t *digests);
+
+/*
+ * The same as pe_image_digests() on each of count images, into
+ * digests[0] to digests[count - 1], but quicker where SHA-256 can be
+ * worked on several messages at a time.  Images whose data is NULL are
+ * left out.
+ */
 EFI_STATUS
-handle_image (void *data, unsigned int datasize,
+pe_images_digests (pe_image_t *images, UINTN count, UINT32 algs,
+		   digest_set_t *digests);
+
+/*
+ * An Authenticode digest that's calculated as the file arrives, rather
+ * than once it's all been read.
+ */
+typedef struct {
+	pe_image_t *image;
+	char *load;
+	digest_ctx_t ctx;
+	UINTN next;
+	UINTN hashed;
+} image_digest_t;
+
+EFI_STATUS
+image_digest_init (image_digest_t *id, pe_image_t *image, UINT32 algs,
+		   char *load);
+
+EFI_STATUS
+image_digest_update (image_digest_t *id, UINTN available);
+
+/*
+ * The same, for a caller that doesn't keep the whole file: window holds
+ * bytes start to start + size of it.  Windows have to come in file order,
+ * and it's an error if the digest still needed something before start.
+ */
+EFI_STATUS
+image_digest_update_window (image_digest_t *id, char *window, UINTN start,
+			    UINTN size);
+
+EFI_STATUS
+image_digest_final (image_digest_t *id, digest_set_t *digests);
+
+void
+image_digest_free (image_digest_t *id);
+
+EFI_STATUS
+handle_image (void *data, unsigned int datasize, UINTN data_pages,
 	      EFI_LOADED_IMAGE *li,
 	      EFI_IMAGE_ENTRY_POINT *entry_point,
 	      EFI_PHYSICAL_ADDRESS *alloc_address,
-	      UINTN *alloc_pages);
-
-EFI_STATUS
-generate_hash (char *data, unsigned int datasize_in,
-	       PE_COFF_LOADER_IMAGE_CONTEXT *context,
-	       UINT8 *sha256hash, UINT8 *sha1hash);
+	      UINTN *alloc_pages, pe_image_t *image,
+	      digest_set_t *file_digests);
 
 EFI_STATUS
 relocate_coff (PE_COFF_LOADER_IMAGE_CONTEXT *context,
@@ -0,0 +1,56 @@
+// SPDX-License-Identifier: BSD-2-Clause-Patent
+/*
+ * session.h - hash an image as a loader hands it to us, piece by piece
+ */
+
+#ifndef SESSION_H_
+#define SESSION_H_
+
+/*
+ * What's kept of an image while it streams through: its headers, its
+ * certificate table, and its digests so far.  Nothing else is, unless its
+ * sections are laid out in an order that can't be hashed as it arrives,
+ * in which case the whole file is.
+ */
+typedef struct {
+	UINT32 datasize;
+	UINTN received;
+	UINT32 algs;
+	EFI_STATUS status;
+
+	UINT8 *header;
+	UINTN header_len;
+	UINTN header_want;
+
+	BOOLEAN planned;
+	pe_image_t image;
+	image_digest_t id;
+	UINT8 *copy;
+
+	UINT8 *certs;
+	UINTN certs_offset;
+	UINTN certs_size;
+} session_t;
+
+/*
+ * Start a session for an image of datasize bytes, to be hashed with algs.
+ */
+EFI_STATUS session_init(session_t **sessionp, UINT32 datasize, UINT32 algs);
+
+/*
+ * Hand over the next size bytes of the file.  Once anything has gone
+ * wrong, every later call returns the same error.
+ */
+EFI_STATUS session_update(session_t *session, VOID *data, UINTN size);
+
+/*
+ * Finish hashing once all datasize bytes have been handed over.  After
+ * this, session->image describes the image, with only its headers behind
+ * it, and session->certs holds its certificate table.
+ */
+EFI_STATUS session_final(session_t *session, digest_set_t *digests);
+
+void session_free(session_t *session);
+
+#endif /* !SESSION_H_ */
+// vim:fenc=utf-8:tw=75:noet
@@ -0,0 +1,101 @@
+// SPDX-License-Identifier: BSD-2-Clause-Patent
+/*
+ * sigdb.h - indexed lookups in EFI_SIGNATURE_LIST databases
+ */
+
+#ifndef SIGDB_H_
+#define SIGDB_H_
+
+/*
+ * The hash signature types we index: SHA1, SHA256, SHA384 and SHA512
+ */
+#define SIGDB_HASH_TYPES 4
+
+typedef struct {
+	UINT64 key;			/* first 8 digest bytes, big endian */
+	EFI_SIGNATURE_LIST *list;
+	EFI_SIGNATURE_DATA *sig;
+} sigdb_entry_t;
+
+typedef struct {
+	UINTN count;
+	sigdb_entry_t *entries;
+} sigdb_index_t;
+
+/*
+ * An index over a buffer of EFI_SIGNATURE_LISTs.  The buffer is not
+ * copied and has to stay around for as long as the index does.  If
+ * there isn't enough memory for the index, lookups fall back to walking
+ * the buffer, so a sigdb_t always answers the same way the buffer does.
+ */
+typedef struct {
+	UINT8 *data;
+	UINTN size;
+	BOOLEAN indexed;
+	sigdb_index_t hashes[SIGDB_HASH_TYPES];
+	sigdb_index_t certs;
+	sigdb_entry_t *mem;
+} sigdb_t;
+
+EFI_STATUS sigdb_init(sigdb_t *db, UINT8 *data, UINTN size);
+void sigdb_free(sigdb_t *db);
+
+/*
+ * Find the first entry of hash type "type" (EFI_CERT_SHA*_GUID) that
+ * matches "digest", in the same order a linear walk of the lists would.
+ */
+sigdb_entry_t *sigdb_find_hash(sigdb_t *db, EFI_GUID *type, UINT8 *digest);
+
+/*
+ * The DIGEST_* algorithms of the hash entries the database holds.
+ */
+UINT32 sigdb_hash_algs(sigdb_t *db);
+
+/*
+ * The first signature of each EFI_CERT_TYPE_X509_GUID list, in list
+ * order; returns NULL once n is past the last one.
+ */
+sigdb_entry_t *sigdb_cert(sigdb_t *db, UINTN n);
+
+/*
+ * A split block bloom filter over the hash entries of several
+ * databases.  Each digest sets one bit in each of the eight words of a
+ * single 64-byte block, so a check touches one cache line, and about 16
+ * bits per entry keep false positives well under 1%.  Only a positive
+ * answer needs an exact lookup; a negative one is definite.
+ */
+typedef struct {
+	void *mem;
+	UINT64 *blocks;			/* 8 words per block */
+	UINTN nblocks;			/* a power of two */
+	UINTN count;
+	UINTN epoch;
+	BOOLEAN valid;
+} sigdb_filter_t;
+
+#define SIGDB_FILTER_BITS_PER_ENTRY 16
+
+EFI_STATUS sigdb_filter_build(sigdb_filter_t *filter, sigdb_t **dbs,
+			      UINTN ndbs);
+BOOLEAN sigdb_filter_check(sigdb_filter_t *filter, EFI_GUID *type,
+			   UINT8 *digest);
+void sigdb_filter_free(sigdb_filter_t *filter);
+
+/*
+ * Indexed copy of a signature database variable, read from flash once
+ * and kept until the variables change.  Returns EFI_NOT_FOUND if the
+ * variable does not exist, which is remembered like its contents are,
+ * or the error from reading it, which is not.
+ */
+EFI_STATUS sigdb_get_variable(CHAR16 *name, EFI_GUID guid, sigdb_t **db);
+void sigdb_invalidate(void);
+
+/*
+ * Changes every time the cached variables are dropped, including when
+ * shim has written a variable since they were read, so anything derived
+ * from them can tell it needs rebuilding.
+ */
+UINTN sigdb_epoch(void);
+
+#endif /* !SIGDB_H_ */
+// vim:fenc=utf-8:tw=75:noet
@@ -227,6 +227,40 @@ extern int debug;
 			goto label;                                           \
 	})
 
+/*
+ * gnu-efi library functions test.c provides on top of libc
+ */
+INTN StrCmp(CONST CHAR16 *s1, CONST CHAR16 *s2);
+INTN StrnCmp(CONST CHAR16 *s1, CONST CHAR16 *s2, UINTN len);
+UINTN StrLen(CONST CHAR16 *s1);
+UINTN StrSize(CONST CHAR16 *s1);
+VOID StrCpy(CHAR16 *dest, CONST CHAR16 *src);
+INTN CompareGuid(EFI_GUID *guid1, EFI_GUID *guid2);
+
+/*
+ * ... and ones a test has to provide itself if the code it tests uses them
+ */
+EFI_STATUS LibLocateProtocol(EFI_GUID *guid, VOID **interface);
+UINTN DevicePathSize(EFI_DEVICE_PATH *path);
+
+/*
+ * NULL unless a test points it at boot services of its own
+ */
+extern EFI_BOOT_SERVICES *BS;
+#define gBS BS
+
+/*
+ * get_variable() and get_variable_attr() return EFI_UNSUPPORTED unless a
+ * test points this at a variable store of its own
+ */
+extern EFI_STATUS (*test_get_variable_attr)(const CHAR16 * const var,
+					    UINT8 **data, UINTN *len,
+					    EFI_GUID owner,
+					    UINT32 *attributes);
+
+extern UINT64 test_ticks(void);
+extern const char *test_tick_unit(void);
+
 #define test(x, ...)                                    \
 	({                                              \
 		int rc;                                 \
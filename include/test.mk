@@ -11,7 +11,7 @@ DEBUG_PRINTS ?= 0
 CFLAGS = -O2 -ggdb -std=gnu11 \
 	 -isystem $(TOPDIR)/include/system \
 	 $(EFI_INCLUDES) \
-	 -Iinclude -iquote . \
+	 -Iinclude -I$(TOPDIR)/Cryptlib -iquote . \
 	 -fshort-wchar -flto -fno-builtin \
 	 -Wall \
 	 -Wextra \
@@ -36,13 +36,22 @@ test-random.h:
 	dd if=/dev/urandom bs=512 count=17 of=random.bin
 	xxd -i random.bin test-random.h
 
+# test.c provides Cryptlib's hash functions on top of the host libcrypto
+LIBS = -lcrypto
+
+test-bnmont_FILES = Cryptlib/Pk/CryptBnMont.c
+test-pkcs7anchor_FILES = Cryptlib/Pk/CryptPkcs7Anchor.c
+test-cryptmem_FILES = Cryptlib/SysCall/CryptMem.c
+test-digest_FILES = Cryptlib/Hash/CryptShaAccel.c
+test-tpm_FILES = digest.c
 test-sbat_FILES = csv.c
+test-session_FILES = loader.c digest.c
 test-str_FILES = lib/string.c
 
 tests := $(patsubst %.c,%,$(wildcard test-*.c))
 
 $(tests) :: test-% : test.c test-%.c $(test-%_FILES)
-	$(CC) $(CFLAGS) -o $@ $^ $(wildcard $*.c) $(test-$*_FILES)
+	$(CC) $(CFLAGS) -o $@ $^ $(wildcard $*.c) $(test-$*_FILES) $(LIBS)
 	$(VALGRIND) ./$@
 
 test : $(tests)
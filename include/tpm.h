@@ -11,9 +11,18 @@ EFI_STATUS fallback_should_prefer_reset(void);
 
 EFI_STATUS tpm_log_pe(EFI_PHYSICAL_ADDRESS buf, UINTN size,
 		      EFI_PHYSICAL_ADDRESS addr, EFI_DEVICE_PATH *path,
-		      UINT8 *sha1hash, UINT8 pcr);
+		      const digest_set_t *digests, UINT8 pcr);
+UINT32 tpm_digest_algs(void);
+BOOLEAN tpm_measures_image(void);
+EFI_STATUS tpm_backend_init(void);
+void tpm_backend_fini(void);
 
 EFI_STATUS tpm_measure_variable(CHAR16 *dbname, EFI_GUID guid, UINTN size, void *data);
+void tpm_queue_measurements(void);
+EFI_STATUS tpm_flush_measurements(void);
+#ifdef SHIM_UNIT_TEST
+void tpm_forget_measurements(void);
+#endif
 
 typedef struct {
   uint8_t Major;
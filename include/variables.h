@@ -33,6 +33,12 @@ CreateTimeBasedPayload (
   IN OUT UINTN            *DataSize,
   IN OUT UINT8            **Data
 			);
+/*
+ * Bumped every time shim writes a variable, so anything cached from
+ * flash can tell it may be stale.
+ */
+extern UINTN variable_write_generation;
+
 EFI_STATUS
 SetSecureVariable(const CHAR16 * const var, UINT8 *Data, UINTN len, EFI_GUID owner, UINT32 options, int createtimebased);
 EFI_STATUS
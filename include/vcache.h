@@ -0,0 +1,47 @@
+// SPDX-License-Identifier: BSD-2-Clause-Patent
+/*
+ * vcache.h - remember which images we've already verified
+ */
+
+#ifndef VCACHE_H_
+#define VCACHE_H_
+
+/*
+ * How many verdicts are kept, and how many measurements each one can
+ * replay.  A verification only measures the entry it matched, so one is
+ * usually all it takes.
+ */
+#define VCACHE_ENTRIES 16
+#define VCACHE_MEASUREMENTS 4
+
+/*
+ * Look up an image by its Authenticode SHA-256 and the SHA-256 of its
+ * certificate table.  The Authenticode digest leaves the signatures out,
+ * so the same code signed differently, or not at all, needs a verdict of
+ * its own.  On a hit, the measurements its verification made are made
+ * again, and its verdict and how it was reached are returned, along with
+ * whether that replaced verification_method or only set it if nothing had.
+ */
+BOOLEAN vcache_lookup(UINT8 *sha256hash, UINT8 *certs_sha256hash,
+		      EFI_STATUS *status, verification_method_t *method,
+		      BOOLEAN *overrides);
+
+/*
+ * Bracket a verification, so the measurements made in between are
+ * remembered with its verdict.  Only definite verdicts are kept: success,
+ * EFI_SECURITY_VIOLATION and EFI_ACCESS_DENIED.
+ */
+void vcache_start(UINT8 *sha256hash, UINT8 *certs_sha256hash);
+void vcache_measured(CHAR16 *name, EFI_GUID guid, UINTN size, void *data);
+void vcache_finish(EFI_STATUS status, verification_method_t method,
+		   BOOLEAN overrides);
+
+/*
+ * Forget everything.  Changes to the signature databases are noticed on
+ * their own, through sigdb_epoch(); anything else that can change a
+ * verdict, such as the SBAT policy, has to call this.
+ */
+void vcache_invalidate(void);
+
+#endif /* !VCACHE_H_ */
+// vim:fenc=utf-8:tw=75:noet
@@ -7,8 +7,54 @@
 #include <Library/BaseCryptLib.h>
 #include <openssl/err.h>
 #include <openssl/crypto.h>
+#include <openssl/bn.h>
+#include <openssl/dh.h>
+#include <openssl/ocsp.h>
+#include <openssl/pkcs12.h>
+#include <openssl/rand.h>
+#include <openssl/ssl.h>
+#include <openssl/x509.h>
+#include <openssl/x509v3.h>
+#include <openssl/rsa.h>
+#include <openssl/dso.h>
 #include <console.h>
 
+/*
+ * OpenSSL's error strings are only ever read here, when something has
+ * already failed and we're being verbose, so they're loaded the first
+ * time they're needed rather than on every boot.
+ */
+static void
+load_crypto_error_strings(void)
+{
+	static BOOLEAN loaded = FALSE;
+
+	if (loaded)
+		return;
+
+	ERR_load_ERR_strings();
+	ERR_load_BN_strings();
+	ERR_load_RSA_strings();
+	ERR_load_DH_strings();
+	ERR_load_EVP_strings();
+	ERR_load_BUF_strings();
+	ERR_load_OBJ_strings();
+	ERR_load_PEM_strings();
+	ERR_load_X509_strings();
+	ERR_load_ASN1_strings();
+	ERR_load_CONF_strings();
+	ERR_load_CRYPTO_strings();
+	ERR_load_COMP_strings();
+	ERR_load_BIO_strings();
+	ERR_load_PKCS7_strings();
+	ERR_load_X509V3_strings();
+	ERR_load_PKCS12_strings();
+	ERR_load_RAND_strings();
+	ERR_load_DSO_strings();
+	ERR_load_OCSP_strings();
+	loaded = TRUE;
+}
+
 static int
 print_errors_cb(const char *str, size_t len, void *u UNUSED)
 {
@@ -26,6 +72,7 @@ print_crypto_errors(EFI_STATUS efi_status,
 
 	console_print(L"SSL Error: %a:%d %a(): %r\n", file, line, func,
 		      efi_status);
+	load_crypto_error_strings();
 	ERR_print_errors_cb(print_errors_cb, NULL);
 
 	return efi_status;
@@ -12,6 +12,8 @@
  */
 #include "shim.h"
 
+UINTN variable_write_generation;
+
 EFI_STATUS
 fill_esl(const EFI_SIGNATURE_DATA *first_sig, const size_t howmany,
 	 const EFI_GUID *type, const UINT32 sig_size,
@@ -225,6 +227,7 @@ SetSecureVariable(const CHAR16 * const var, UINT8 *Data, UINTN len,
 		return efi_status;
 	}
 
+	variable_write_generation++;
 	efi_status = gRT->SetVariable((CHAR16 *)var, &owner,
 			EFI_VARIABLE_NON_VOLATILE |
 			EFI_VARIABLE_RUNTIME_ACCESS |
@@ -341,6 +344,7 @@ EFI_STATUS
 set_variable(CHAR16 *var, EFI_GUID owner, UINT32 attributes,
 	     UINTN datasize, void *data)
 {
+	variable_write_generation++;
 	return gRT->SetVariable(var, &owner, attributes, datasize, data);
 }
 
@@ -444,11 +448,13 @@ variable_enroll_hash(const CHAR16 * const var, EFI_GUID owner,
 	if (CompareGuid(&owner, &SIG_DB) == 0)
 		efi_status = SetSecureVariable(var, sig, sizeof(sig), owner,
 					       EFI_VARIABLE_APPEND_WRITE, 0);
-	else
+	else {
+		variable_write_generation++;
 		efi_status = gRT->SetVariable((CHAR16 *)var, &owner,
 					      EFI_VARIABLE_NON_VOLATILE |
 					      EFI_VARIABLE_BOOTSERVICE_ACCESS |
 					      EFI_VARIABLE_APPEND_WRITE,
 					      sizeof(sig), sig);
+	}
 	return efi_status;
 }
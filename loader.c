@@ -0,0 +1,268 @@
+// SPDX-License-Identifier: BSD-2-Clause-Patent
+/*
+ * loader.c - how an image gets from its file into memory
+ */
+
+#include "shim.h"
+
+/*
+ * Find the layout fields of the optional header, or return FALSE if this
+ * doesn't look like a PE image.  This is deliberately shallow; the image
+ * still goes through read_header() before anything trusts it.
+ */
+static BOOLEAN
+pe_alignments(void *data, UINTN size, UINT32 *image_size,
+	      UINT32 *section_alignment, UINT32 *file_alignment)
+{
+	EFI_IMAGE_DOS_HEADER *DosHdr = data;
+	EFI_IMAGE_OPTIONAL_HEADER_UNION *PEHdr = data;
+	UINTN offset = 0;
+
+	if (size < sizeof(*DosHdr))
+		return FALSE;
+
+	if (DosHdr->e_magic == EFI_IMAGE_DOS_SIGNATURE)
+		offset = DosHdr->e_lfanew;
+
+	if (offset > size ||
+	    size - offset < sizeof(EFI_IMAGE_OPTIONAL_HEADER_UNION))
+		return FALSE;
+	PEHdr = (EFI_IMAGE_OPTIONAL_HEADER_UNION *)((char *)data + offset);
+
+	if (PEHdr->Pe32.Signature != EFI_IMAGE_NT_SIGNATURE)
+		return FALSE;
+
+	switch (PEHdr->Pe32Plus.OptionalHeader.Magic) {
+	case EFI_IMAGE_NT_OPTIONAL_HDR64_MAGIC:
+		*image_size = PEHdr->Pe32Plus.OptionalHeader.SizeOfImage;
+		*section_alignment = PEHdr->Pe32Plus.OptionalHeader.SectionAlignment;
+		*file_alignment = PEHdr->Pe32Plus.OptionalHeader.FileAlignment;
+		return TRUE;
+	case EFI_IMAGE_NT_OPTIONAL_HDR32_MAGIC:
+		*image_size = PEHdr->Pe32.OptionalHeader.SizeOfImage;
+		*section_alignment = PEHdr->Pe32.OptionalHeader.SectionAlignment;
+		*file_alignment = PEHdr->Pe32.OptionalHeader.FileAlignment;
+		return TRUE;
+	default:
+		return FALSE;
+	}
+}
+
+/*
+ * Sections can only stay where they were read if the file was laid out
+ * with the same alignment as memory, and a page allocation is aligned
+ * enough for it.
+ */
+static BOOLEAN
+layout_matches(UINT32 section_alignment, UINT32 file_alignment)
+{
+	return section_alignment != 0 &&
+	       section_alignment == file_alignment &&
+	       section_alignment <= PAGE_SIZE &&
+	       PAGE_SIZE % section_alignment == 0;
+}
+
+UINTN
+loader_file_pages(void *header, UINTN header_size, UINTN file_size)
+{
+	UINT32 image_size, section_alignment, file_alignment;
+	UINTN size = file_size;
+
+	if (pe_alignments(header, header_size, &image_size,
+			  &section_alignment, &file_alignment) &&
+	    layout_matches(section_alignment, file_alignment) &&
+	    image_size > size)
+		size = image_size;
+
+	if (size == 0)
+		size = 1;
+
+	return ALIGN_VALUE(size, PAGE_SIZE) / PAGE_SIZE;
+}
+
+BOOLEAN
+loader_sections_overlap(PE_COFF_LOADER_IMAGE_CONTEXT *context)
+{
+	EFI_IMAGE_SECTION_HEADER *a, *b;
+	UINT64 a_end, b_end;
+	int i, j;
+
+	for (i = 0; i < context->NumberOfSections; i++) {
+		a = &context->FirstSection[i];
+		if (a->Characteristics & EFI_IMAGE_SCN_MEM_DISCARDABLE)
+			continue;
+		a_end = (UINT64)a->VirtualAddress +
+			MAX(a->SizeOfRawData, a->Misc.VirtualSize);
+
+		for (j = i + 1; j < context->NumberOfSections; j++) {
+			b = &context->FirstSection[j];
+			if (b->Characteristics & EFI_IMAGE_SCN_MEM_DISCARDABLE)
+				continue;
+			b_end = (UINT64)b->VirtualAddress +
+				MAX(b->SizeOfRawData, b->Misc.VirtualSize);
+
+			if (a->VirtualAddress < b_end &&
+			    b->VirtualAddress < a_end)
+				return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+BOOLEAN
+loader_runs_in_place(void *data, UINTN datasize, UINTN capacity,
+		     PE_COFF_LOADER_IMAGE_CONTEXT *context)
+{
+	UINT32 image_size, section_alignment, file_alignment;
+	EFI_IMAGE_SECTION_HEADER *Section;
+	int i;
+
+	if (!data || capacity < datasize)
+		return FALSE;
+
+	if (!pe_alignments(data, datasize, &image_size,
+			   &section_alignment, &file_alignment) ||
+	    !layout_matches(section_alignment, file_alignment))
+		return FALSE;
+
+	if ((UINTN)data % context->SectionAlignment ||
+	    context->ImageSize > capacity)
+		return FALSE;
+
+	for (i = 0; i < context->NumberOfSections; i++) {
+		Section = &context->FirstSection[i];
+		if (Section->SizeOfRawData == 0)
+			continue;
+		if (Section->PointerToRawData != Section->VirtualAddress)
+			return FALSE;
+	}
+
+	return !loader_sections_overlap(context);
+}
+
+UINTN
+loader_headers_size(void *data, UINTN size)
+{
+	EFI_IMAGE_DOS_HEADER *DosHdr = data;
+	EFI_IMAGE_OPTIONAL_HEADER_UNION *PEHdr;
+	UINT32 image_size, section_alignment, file_alignment;
+	UINTN offset = 0;
+
+	if (!pe_alignments(data, size, &image_size, &section_alignment,
+			   &file_alignment))
+		return 0;
+
+	if (DosHdr->e_magic == EFI_IMAGE_DOS_SIGNATURE)
+		offset = DosHdr->e_lfanew;
+	PEHdr = (EFI_IMAGE_OPTIONAL_HEADER_UNION *)((char *)data + offset);
+
+	if (PEHdr->Pe32Plus.OptionalHeader.Magic ==
+	    EFI_IMAGE_NT_OPTIONAL_HDR64_MAGIC)
+		return PEHdr->Pe32Plus.OptionalHeader.SizeOfHeaders;
+	return PEHdr->Pe32.OptionalHeader.SizeOfHeaders;
+}
+
+/*
+ * Start reading the next chunk.  With a file that supports ReadEx(), the
+ * read is left running while we get on with something else, and
+ * loader_read_wait() collects it; otherwise it's done by the time this
+ * returns.
+ */
+static EFI_STATUS
+loader_read_start(EFI_FILE *file, EFI_FILE_IO_TOKEN *token, UINT8 *buffer,
+		  UINTN size)
+{
+	EFI_STATUS efi_status;
+
+	token->Status = EFI_SUCCESS;
+	token->BufferSize = size;
+	token->Buffer = buffer;
+
+	if (token->Event) {
+		efi_status = file->ReadEx(file, token);
+		if (efi_status != EFI_UNSUPPORTED)
+			return efi_status;
+
+		/* Some filesystems only do it the old way */
+		gBS->CloseEvent(token->Event);
+		token->Event = NULL;
+		token->BufferSize = size;
+	}
+
+	token->Status = file->Read(file, &token->BufferSize, buffer);
+	return token->Status;
+}
+
+static EFI_STATUS
+loader_read_wait(EFI_FILE_IO_TOKEN *token)
+{
+	EFI_STATUS efi_status;
+	UINTN index;
+
+	if (!token->Event)
+		return token->Status;
+
+	efi_status = gBS->WaitForEvent(1, &token->Event, &index);
+	if (EFI_ERROR(efi_status))
+		return efi_status;
+
+	return token->Status;
+}
+
+EFI_STATUS
+loader_read(EFI_FILE *file, UINT8 *buffer, UINTN offset, UINTN size,
+	    UINTN chunk, loader_consumer_t consume, void *ctx)
+{
+	EFI_FILE_IO_TOKEN token;
+	EFI_STATUS efi_status = EFI_SUCCESS;
+	EFI_STATUS consumed;
+
+	ZeroMem(&token, sizeof(token));
+
+	if (!chunk)
+		chunk = LOADER_CHUNK_SIZE;
+
+	if (file->Revision >= EFI_FILE_PROTOCOL_REVISION2 && file->ReadEx) {
+		efi_status = gBS->CreateEvent(0, 0, NULL, NULL, &token.Event);
+		if (EFI_ERROR(efi_status))
+			token.Event = NULL;
+	}
+
+	while (offset < size) {
+		efi_status = loader_read_start(file, &token, buffer + offset,
+					       MIN(chunk, size - offset));
+		if (EFI_ERROR(efi_status))
+			break;
+
+		/*
+		 * Whatever came in before this chunk gets used while the
+		 * chunk is on its way.
+		 */
+		consumed = consume ? consume(ctx, buffer, offset) : EFI_SUCCESS;
+
+		efi_status = loader_read_wait(&token);
+		if (EFI_ERROR(efi_status))
+			break;
+		if (EFI_ERROR(consumed)) {
+			efi_status = consumed;
+			break;
+		}
+		if (token.BufferSize == 0) {
+			efi_status = EFI_LOAD_ERROR;
+			break;
+		}
+
+		offset += token.BufferSize;
+	}
+
+	if (!EFI_ERROR(efi_status) && consume)
+		efi_status = consume(ctx, buffer, offset);
+
+	if (token.Event)
+		gBS->CloseEvent(token.Event);
+
+	return efi_status;
+}
+
+// vim:fenc=utf-8:tw=75:noet
@@ -240,78 +240,147 @@ get_section_vma (UINTN section_num,
 }
 
 EFI_STATUS
-get_section_vma_by_name (char *name, size_t namesz,
+get_section_vma_by_name (pe_image_t *image, pe_section_name_t name,
 			 char *buffer, size_t bufsz,
-			 PE_COFF_LOADER_IMAGE_CONTEXT *context,
 			 char **basep, size_t *sizep,
 			 EFI_IMAGE_SECTION_HEADER **sectionp)
 {
-	UINTN i;
-	char namebuf[9];
+	EFI_IMAGE_SECTION_HEADER *section;
 
-	if (!name || namesz == 0 || !buffer || bufsz < namesz || !context
-	    || !basep || !sizep || !sectionp)
+	if (!image || name <= PE_SECTION_OTHER || name >= PE_SECTION_NAMES
+	    || !buffer || !basep || !sizep || !sectionp)
 		return EFI_INVALID_PARAMETER;
 
 	/*
-	 * This code currently is only used for ".reloc\0\0" and
-	 * ".sbat\0\0\0", and it doesn't know how to look up longer section
-	 * names.
+	 * pe_image_init() already found the first section with each of
+	 * the names we know about.
 	 */
-	if (namesz > 8)
-		return EFI_UNSUPPORTED;
+	section = image->named[name];
+	if (!section)
+		return EFI_NOT_FOUND;
 
-	SetMem(namebuf, sizeof(namebuf), 0);
-	CopyMem(namebuf, name, MIN(namesz, 8));
+	return get_section_vma(section - image->context.FirstSection,
+			       buffer, bufsz, &image->context,
+			       basep, sizep, sectionp);
+}
+
+/*
+ * Whether handle_image() copies this section's raw data verbatim to its
+ * virtual address, with the copy entirely inside the image.
+ */
+static BOOLEAN
+section_loads_raw_data(PE_COFF_LOADER_IMAGE_CONTEXT *context,
+		       EFI_IMAGE_SECTION_HEADER *Section)
+{
+	if (Section->Characteristics & (EFI_IMAGE_SCN_MEM_DISCARDABLE |
+					EFI_IMAGE_SCN_CNT_UNINITIALIZED_DATA))
+		return FALSE;
+	if (Section->SizeOfRawData == 0)
+		return FALSE;
+	if (Section->VirtualAddress < context->SizeOfHeaders ||
+	    Section->PointerToRawData < context->SizeOfHeaders)
+		return FALSE;
+	if (Section->VirtualAddress >= context->ImageSize ||
+	    Section->SizeOfRawData > context->ImageSize - Section->VirtualAddress)
+		return FALSE;
+	return TRUE;
+}
+
+/*
+ * Zero what handle_image() would have zeroed in the buffer it copies an
+ * image to, once the image has been verified where it was read.
+ */
+static void
+zero_sections_in_place(PE_COFF_LOADER_IMAGE_CONTEXT *context, char *buffer)
+{
+	EFI_IMAGE_SECTION_HEADER *Section;
+	char *base;
+	int i;
 
-	/*
-	 * Copy the executable's sections to their desired offsets
-	 */
 	for (i = 0; i < context->NumberOfSections; i++) {
-		EFI_STATUS status;
-		EFI_IMAGE_SECTION_HEADER *section = NULL;
-		char *base = NULL;
-		size_t size = 0;
-
-		status = get_section_vma(i, buffer, bufsz, context, &base, &size, &section);
-		if (!EFI_ERROR(status)) {
-			if (CompareMem(section->Name, namebuf, 8) == 0) {
-				*basep = base;
-				*sizep = size;
-				*sectionp = section;
-				return EFI_SUCCESS;
-			}
+		Section = &context->FirstSection[i];
+		if (Section->Characteristics & EFI_IMAGE_SCN_MEM_DISCARDABLE)
 			continue;
-		}
 
-		switch(status) {
-		case EFI_NOT_FOUND:
-			break;
-		}
-	}
+		base = ImageAddress(buffer, context->ImageSize,
+				    Section->VirtualAddress);
+		if (!base)
+			continue;
 
-	return EFI_NOT_FOUND;
+		if (Section->Characteristics & EFI_IMAGE_SCN_CNT_UNINITIALIZED_DATA)
+			ZeroMem(base, Section->Misc.VirtualSize);
+		else if (Section->SizeOfRawData < Section->Misc.VirtualSize)
+			ZeroMem(base + Section->SizeOfRawData,
+				Section->Misc.VirtualSize - Section->SizeOfRawData);
+	}
 }
 
 /*
- * Calculate the SHA1 and SHA256 hashes of a binary
+ * Copy a section to where it's loaded a chunk at a time, hashing each
+ * chunk while it's still in the cache.
  */
+static EFI_STATUS
+copy_and_digest(digest_ctx_t *ctx, char *dest, char *src, unsigned int size)
+{
+	EFI_STATUS efi_status;
+	unsigned int chunk;
 
-EFI_STATUS
-generate_hash(char *data, unsigned int datasize_in,
-	      PE_COFF_LOADER_IMAGE_CONTEXT *context, UINT8 *sha256hash,
-	      UINT8 *sha1hash)
+	while (size) {
+		chunk = MIN(size, DIGEST_CHUNK_SIZE);
+		CopyMem(dest, src, chunk);
+		efi_status = digest_update(ctx, dest, chunk);
+		if (EFI_ERROR(efi_status))
+			return efi_status;
+		dest += chunk;
+		src += chunk;
+		size -= chunk;
+	}
+
+	return EFI_SUCCESS;
+}
+
+static const char pe_section_names[PE_SECTION_NAMES][8] = {
+	[PE_SECTION_RELOC] = ".reloc\0\0",
+	[PE_SECTION_SBAT] = ".sbat\0\0\0",
+	[PE_SECTION_LINUX] = ".linux\0\0",
+	[PE_SECTION_INITRD] = ".initrd\0",
+	[PE_SECTION_CMDLINE] = ".cmdline",
+};
+
+static void
+add_hash_range(pe_image_t *image, char *hashbase, unsigned int hashsize,
+	       EFI_IMAGE_SECTION_HEADER *Section)
+{
+	pe_hash_range_t *range;
+
+	if (hashsize == 0)
+		return;
+
+	range = &image->ranges[image->nranges++];
+	range->offset = hashbase - image->data;
+	range->size = hashsize;
+	range->section = Section;
+}
+
+/*
+ * Work out, and check, which parts of a binary its Authenticode digest
+ * covers, in the order they're hashed, and which of its sections are the
+ * ones we look for by name.  Only the headers have to be in memory yet;
+ * datasize is the size of the whole file.
+ */
+static EFI_STATUS
+pe_image_plan(pe_image_t *image)
 {
-	unsigned int sha256ctxsize, sha1ctxsize;
+	PE_COFF_LOADER_IMAGE_CONTEXT *context = &image->context;
+	char *data = image->data;
+	unsigned int datasize_in = image->datasize;
 	unsigned int size = datasize_in;
-	void *sha256ctx = NULL, *sha1ctx = NULL;
 	char *hashbase;
 	unsigned int hashsize;
 	unsigned int SumOfBytesHashed, SumOfSectionBytes;
-	unsigned int index, pos;
+	unsigned int index, pos, name;
 	unsigned int datasize;
 	EFI_IMAGE_SECTION_HEADER *Section;
-	EFI_IMAGE_SECTION_HEADER *SectionHeader = NULL;
 	EFI_STATUS efi_status = EFI_SUCCESS;
 	EFI_IMAGE_DOS_HEADER *DosHdr = (void *)data;
 	unsigned int PEHdr_offset = 0;
@@ -325,70 +394,6 @@ generate_hash(char *data, unsigned int datasize_in,
 	}
 	PEHdr_offset = DosHdr->e_lfanew;
 
-	sha256ctxsize = Sha256GetContextSize();
-	sha256ctx = AllocatePool(sha256ctxsize);
-
-	sha1ctxsize = Sha1GetContextSize();
-	sha1ctx = AllocatePool(sha1ctxsize);
-
-	if (!sha256ctx || !sha1ctx) {
-		perror(L"Unable to allocate memory for hash context\n");
-		return EFI_OUT_OF_RESOURCES;
-	}
-
-	if (!Sha256Init(sha256ctx) || !Sha1Init(sha1ctx)) {
-		perror(L"Unable to initialise hash\n");
-		efi_status = EFI_OUT_OF_RESOURCES;
-		goto done;
-	}
-
-	/* Hash start to checksum */
-	hashbase = data;
-	hashsize = (char *)&context->PEHdr->Pe32.OptionalHeader.CheckSum -
-		hashbase;
-	check_size(data, datasize_in, hashbase, hashsize);
-
-	if (!(Sha256Update(sha256ctx, hashbase, hashsize)) ||
-	    !(Sha1Update(sha1ctx, hashbase, hashsize))) {
-		perror(L"Unable to generate hash\n");
-		efi_status = EFI_OUT_OF_RESOURCES;
-		goto done;
-	}
-
-	/* Hash post-checksum to start of certificate table */
-	hashbase = (char *)&context->PEHdr->Pe32.OptionalHeader.CheckSum +
-		sizeof (int);
-	hashsize = (char *)context->SecDir - hashbase;
-	check_size(data, datasize_in, hashbase, hashsize);
-
-	if (!(Sha256Update(sha256ctx, hashbase, hashsize)) ||
-	    !(Sha1Update(sha1ctx, hashbase, hashsize))) {
-		perror(L"Unable to generate hash\n");
-		efi_status = EFI_OUT_OF_RESOURCES;
-		goto done;
-	}
-
-	/* Hash end of certificate table to end of image header */
-	EFI_IMAGE_DATA_DIRECTORY *dd = context->SecDir + 1;
-	hashbase = (char *)dd;
-	hashsize = context->SizeOfHeaders - (unsigned long)((char *)dd - data);
-	if (hashsize > datasize_in) {
-		perror(L"Data Directory size %d is invalid\n", hashsize);
-		efi_status = EFI_INVALID_PARAMETER;
-		goto done;
-	}
-	check_size(data, datasize_in, hashbase, hashsize);
-
-	if (!(Sha256Update(sha256ctx, hashbase, hashsize)) ||
-	    !(Sha1Update(sha1ctx, hashbase, hashsize))) {
-		perror(L"Unable to generate hash\n");
-		efi_status = EFI_OUT_OF_RESOURCES;
-		goto done;
-	}
-
-	/* Sort sections */
-	SumOfBytesHashed = context->SizeOfHeaders;
-
 	/*
 	 * XXX Do we need this here, or is it already done in all cases?
 	 */
@@ -433,13 +438,54 @@ generate_hash(char *data, unsigned int datasize_in,
 		context->FirstSection = section0;
 	}
 
+	/*
+	 * Three pieces of header, the sections, and what comes after them
+	 */
+	image->ranges = AllocatePool(sizeof (*image->ranges) *
+				     (context->NumberOfSections + 4));
+	if (image->ranges == NULL) {
+		perror(L"Unable to allocate hash ranges\n");
+		efi_status = EFI_OUT_OF_RESOURCES;
+		goto done;
+	}
+
+	/* Hash start to checksum */
+	hashbase = data;
+	hashsize = (char *)&context->PEHdr->Pe32.OptionalHeader.CheckSum -
+		hashbase;
+	check_size(data, datasize_in, hashbase, hashsize);
+	add_hash_range(image, hashbase, hashsize, NULL);
+
+	/* Hash post-checksum to start of certificate table */
+	hashbase = (char *)&context->PEHdr->Pe32.OptionalHeader.CheckSum +
+		sizeof (int);
+	hashsize = (char *)context->SecDir - hashbase;
+	check_size(data, datasize_in, hashbase, hashsize);
+	add_hash_range(image, hashbase, hashsize, NULL);
+
+	/* Hash end of certificate table to end of image header */
+	EFI_IMAGE_DATA_DIRECTORY *dd = context->SecDir + 1;
+	hashbase = (char *)dd;
+	hashsize = context->SizeOfHeaders - (unsigned long)((char *)dd - data);
+	if (hashsize > datasize_in) {
+		perror(L"Data Directory size %d is invalid\n", hashsize);
+		efi_status = EFI_INVALID_PARAMETER;
+		goto done;
+	}
+	check_size(data, datasize_in, hashbase, hashsize);
+	add_hash_range(image, hashbase, hashsize, NULL);
+
+	/* Sort sections */
+	SumOfBytesHashed = context->SizeOfHeaders;
+
 	/*
 	 * Allocate a new section table so we can sort them without
-	 * modifying the image.
+	 * modifying the image, and the index of names alongside it.
 	 */
-	SectionHeader = AllocateZeroPool (sizeof (EFI_IMAGE_SECTION_HEADER)
-					  * context->NumberOfSections);
-	if (SectionHeader == NULL) {
+	image->sections = AllocateZeroPool (sizeof (EFI_IMAGE_SECTION_HEADER)
+					    * context->NumberOfSections);
+	image->names = AllocateZeroPool (context->NumberOfSections);
+	if (image->sections == NULL || image->names == NULL) {
 		perror(L"Unable to allocate section header\n");
 		efi_status = EFI_OUT_OF_RESOURCES;
 		goto done;
@@ -474,19 +520,28 @@ generate_hash(char *data, unsigned int datasize_in,
 		}
 		SumOfSectionBytes += SectionPtr->SizeOfRawData;
 
+		for (name = PE_SECTION_OTHER + 1; name < PE_SECTION_NAMES; name++) {
+			if (CompareMem(Section->Name, pe_section_names[name], 8))
+				continue;
+			image->names[index] = name;
+			if (!image->named[name])
+				image->named[name] = Section;
+			break;
+		}
+
 		pos = index;
-		while ((pos > 0) && (Section->PointerToRawData < SectionHeader[pos - 1].PointerToRawData)) {
-			CopyMem (&SectionHeader[pos], &SectionHeader[pos - 1], sizeof (EFI_IMAGE_SECTION_HEADER));
+		while ((pos > 0) && (Section->PointerToRawData < image->sections[pos - 1].PointerToRawData)) {
+			CopyMem (&image->sections[pos], &image->sections[pos - 1], sizeof (EFI_IMAGE_SECTION_HEADER));
 			pos--;
 		}
-		CopyMem (&SectionHeader[pos], Section, sizeof (EFI_IMAGE_SECTION_HEADER));
+		CopyMem (&image->sections[pos], Section, sizeof (EFI_IMAGE_SECTION_HEADER));
 		Section += 1;
 
 	}
 
 	/* Hash the sections */
 	for (index = 0; index < context->NumberOfSections; index++) {
-		Section = &SectionHeader[index];
+		Section = &image->sections[index];
 		if (Section->SizeOfRawData == 0) {
 			continue;
 		}
@@ -507,13 +562,7 @@ generate_hash(char *data, unsigned int datasize_in,
 		}
 		hashsize  = (unsigned int) Section->SizeOfRawData;
 		check_size(data, datasize_in, hashbase, hashsize);
-
-		if (!(Sha256Update(sha256ctx, hashbase, hashsize)) ||
-		    !(Sha1Update(sha1ctx, hashbase, hashsize))) {
-			perror(L"Unable to generate hash\n");
-			efi_status = EFI_OUT_OF_RESOURCES;
-			goto done;
-		}
+		add_hash_range(image, hashbase, hashsize, Section);
 		SumOfBytesHashed += Section->SizeOfRawData;
 	}
 
@@ -533,13 +582,7 @@ generate_hash(char *data, unsigned int datasize_in,
 			goto done;
 		}
 		check_size(data, datasize_in, hashbase, hashsize);
-
-		if (!(Sha256Update(sha256ctx, hashbase, hashsize)) ||
-		    !(Sha1Update(sha1ctx, hashbase, hashsize))) {
-			perror(L"Unable to generate hash\n");
-			efi_status = EFI_OUT_OF_RESOURCES;
-			goto done;
-		}
+		add_hash_range(image, hashbase, hashsize, NULL);
 
 #if 1
 	}
@@ -553,38 +596,287 @@ generate_hash(char *data, unsigned int datasize_in,
 		hashsize = datasize - SumOfBytesHashed;
 
 		check_size(data, datasize_in, hashbase, hashsize);
-
-		if (!(Sha256Update(sha256ctx, hashbase, hashsize)) ||
-		    !(Sha1Update(sha1ctx, hashbase, hashsize))) {
-			perror(L"Unable to generate hash\n");
-			efi_status = EFI_OUT_OF_RESOURCES;
-			goto done;
-		}
+		add_hash_range(image, hashbase, hashsize, NULL);
 
 		SumOfBytesHashed += hashsize;
 	}
 #endif
 
-	if (!(Sha256Final(sha256ctx, sha256hash)) ||
-	    !(Sha1Final(sha1ctx, sha1hash))) {
-		perror(L"Unable to finalise hash\n");
-		efi_status = EFI_OUT_OF_RESOURCES;
-		goto done;
+	return EFI_SUCCESS;
+
+done:
+	return efi_status;
+}
+
+EFI_STATUS
+pe_image_init(pe_image_t *image, void *data, unsigned int datasize,
+	      PE_COFF_LOADER_IMAGE_CONTEXT *context)
+{
+	EFI_STATUS efi_status;
+
+	ZeroMem(image, sizeof(*image));
+	image->data = data;
+	image->datasize = datasize;
+
+	if (context) {
+		CopyMem(&image->context, context, sizeof(image->context));
+	} else {
+		efi_status = read_header(data, datasize, &image->context);
+		if (EFI_ERROR(efi_status)) {
+			perror(L"Failed to read header: %r\n", efi_status);
+			return efi_status;
+		}
 	}
 
-	dprint(L"sha1 authenticode hash:\n");
-	dhexdumpat(sha1hash, SHA1_DIGEST_SIZE, 0);
-	dprint(L"sha256 authenticode hash:\n");
-	dhexdumpat(sha256hash, SHA256_DIGEST_SIZE, 0);
+	efi_status = pe_image_plan(image);
+	if (EFI_ERROR(efi_status))
+		pe_image_free(image);
 
-done:
-	if (SectionHeader)
-		FreePool(SectionHeader);
-	if (sha1ctx)
-		FreePool(sha1ctx);
-	if (sha256ctx)
-		FreePool(sha256ctx);
+	return efi_status;
+}
+
+void
+pe_image_free(pe_image_t *image)
+{
+	if (image->ranges)
+		FreePool(image->ranges);
+	if (image->sections)
+		FreePool(image->sections);
+	if (image->names)
+		FreePool(image->names);
+	ZeroMem(image, sizeof(*image));
+}
+
+EFI_STATUS
+image_digest_init(image_digest_t *id, pe_image_t *image, UINT32 algs,
+		  char *load)
+{
+	ZeroMem(id, sizeof(*id));
+	id->image = image;
+	id->load = load;
+
+	return digest_init(&id->ctx, algs);
+}
+
+/*
+ * Hash whatever hasn't been hashed yet of the bytes of the file from
+ * start to start + size, which are at window.  If the digest was set up
+ * to load the image, sections are copied to it on the way through.
+ */
+EFI_STATUS
+image_digest_update_window(image_digest_t *id, char *window, UINTN start,
+			   UINTN size)
+{
+	pe_image_t *image = id->image;
+	pe_hash_range_t *range;
+	EFI_IMAGE_SECTION_HEADER *Section;
+	char *hashbase;
+	UINTN hashsize;
+	UINTN end;
+	EFI_STATUS efi_status;
+
+	if (start > image->datasize)
+		return EFI_SUCCESS;
+	end = start + MIN(size, image->datasize - start);
+
+	while (id->next < image->nranges) {
+		range = &image->ranges[id->next];
+		if (range->offset + id->hashed >= end)
+			break;
+		if (range->offset + id->hashed < start) {
+			perror(L"Image data arrived out of order\n");
+			return EFI_INVALID_PARAMETER;
+		}
+
+		hashbase = window + (range->offset + id->hashed - start);
+		hashsize = MIN(range->offset + range->size, end) -
+			   (range->offset + id->hashed);
+
+		Section = range->section;
+		if (id->load && Section &&
+		    section_loads_raw_data(&image->context, Section))
+			efi_status = copy_and_digest(&id->ctx,
+					id->load + Section->VirtualAddress +
+					id->hashed, hashbase, hashsize);
+		else
+			efi_status = digest_update(&id->ctx, hashbase, hashsize);
+		if (EFI_ERROR(efi_status))
+			return efi_status;
+
+		id->hashed += hashsize;
+		if (id->hashed < range->size)
+			break;
+		id->next++;
+		id->hashed = 0;
+	}
+
+	return EFI_SUCCESS;
+}
+
+/*
+ * Hash whatever hasn't been hashed yet of the first "available" bytes
+ * of the file.
+ */
+EFI_STATUS
+image_digest_update(image_digest_t *id, UINTN available)
+{
+	return image_digest_update_window(id, id->image->data, 0, available);
+}
+
+EFI_STATUS
+image_digest_final(image_digest_t *id, digest_set_t *digests)
+{
+	EFI_STATUS efi_status;
+
+	if (id->next < id->image->nranges) {
+		perror(L"Image was not completely hashed\n");
+		return EFI_INVALID_PARAMETER;
+	}
+
+	efi_status = digest_final(&id->ctx, digests);
+	if (EFI_ERROR(efi_status))
+		return efi_status;
+
+	if (digests->algs & DIGEST_SHA1) {
+		dprint(L"sha1 authenticode hash:\n");
+		dhexdumpat(digests->sha1, SHA1_DIGEST_SIZE, 0);
+	}
+	if (digests->algs & DIGEST_SHA256) {
+		dprint(L"sha256 authenticode hash:\n");
+		dhexdumpat(digests->sha256, SHA256_DIGEST_SIZE, 0);
+	}
+	if (digests->algs & DIGEST_SHA384) {
+		dprint(L"sha384 authenticode hash:\n");
+		dhexdumpat(digests->sha384, SHA384_DIGEST_SIZE, 0);
+	}
+	if (digests->algs & DIGEST_SHA512) {
+		dprint(L"sha512 authenticode hash:\n");
+		dhexdumpat(digests->sha512, SHA512_DIGEST_SIZE, 0);
+	}
+
+	return EFI_SUCCESS;
+}
+
+void
+image_digest_free(image_digest_t *id)
+{
+	digest_free(&id->ctx);
+}
+
+/*
+ * Calculate the Authenticode digests of an image.  If load is not NULL,
+ * every section for which section_loads_raw_data() is true is also
+ * copied to load + VirtualAddress on the way through.
+ */
+static EFI_STATUS
+digest_image(pe_image_t *image, UINT32 algs, digest_set_t *digests,
+	     char *load)
+{
+	image_digest_t id;
+	EFI_STATUS efi_status;
+
+	efi_status = image_digest_init(&id, image, algs, load);
+	if (EFI_ERROR(efi_status))
+		return efi_status;
+
+	efi_status = image_digest_update(&id, image->datasize);
+	if (!EFI_ERROR(efi_status))
+		efi_status = image_digest_final(&id, digests);
+
+	image_digest_free(&id);
+	return efi_status;
+}
+
+EFI_STATUS
+pe_image_digests(pe_image_t *image, UINT32 algs, digest_set_t *digests)
+{
+	return digest_image(image, algs, digests, NULL);
+}
 
+/*
+ * Calculate the Authenticode digests of several images together, taking
+ * a piece of each in turn, so their SHA-256 digests can be worked on side
+ * by side.  Images with no data are skipped, and their digests left empty.
+ */
+#define PE_BATCH_PIECE (64 * 1024)
+
+EFI_STATUS
+pe_images_digests(pe_image_t *images, UINTN count, UINT32 algs,
+		  digest_set_t *digests)
+{
+	image_digest_t *ids, *id;
+	pe_hash_range_t *range;
+	digest_ctx_t **ctxs;
+	const void **data;
+	UINTN *sizes;
+	UINTN i, n;
+	EFI_STATUS efi_status = EFI_OUT_OF_RESOURCES;
+
+	if (!count)
+		return EFI_SUCCESS;
+
+	ids = AllocateZeroPool(count * sizeof(*ids));
+	ctxs = AllocatePool(count * sizeof(*ctxs));
+	data = AllocatePool(count * sizeof(*data));
+	sizes = AllocatePool(count * sizeof(*sizes));
+	if (!ids || !ctxs || !data || !sizes)
+		goto out;
+
+	for (i = 0; i < count; i++) {
+		ZeroMem(&digests[i], sizeof(digests[i]));
+		if (!images[i].data)
+			continue;
+		efi_status = image_digest_init(&ids[i], &images[i], algs, NULL);
+		if (EFI_ERROR(efi_status))
+			goto out;
+	}
+
+	for (;;) {
+		for (i = 0, n = 0; i < count; i++) {
+			id = &ids[i];
+			if (!id->image || id->next >= id->image->nranges)
+				continue;
+
+			range = &id->image->ranges[id->next];
+			ctxs[n] = &id->ctx;
+			data[n] = id->image->data + range->offset + id->hashed;
+			sizes[n] = MIN(range->size - id->hashed, PE_BATCH_PIECE);
+
+			id->hashed += sizes[n++];
+			if (id->hashed < range->size)
+				continue;
+			id->next++;
+			id->hashed = 0;
+		}
+		if (!n)
+			break;
+
+		efi_status = digest_update_multi(ctxs, data, sizes, n);
+		if (EFI_ERROR(efi_status))
+			goto out;
+	}
+	efi_status = EFI_SUCCESS;
+
+	for (i = 0; i < count; i++) {
+		if (!ids[i].image)
+			continue;
+		efi_status = image_digest_final(&ids[i], &digests[i]);
+		if (EFI_ERROR(efi_status))
+			goto out;
+	}
+
+out:
+	if (ids) {
+		for (i = 0; i < count; i++)
+			image_digest_free(&ids[i]);
+		FreePool(ids);
+	}
+	if (ctxs)
+		FreePool(ctxs);
+	if (data)
+		FreePool(data);
+	if (sizes)
+		FreePool(sizes);
 	return efi_status;
 }
 
@@ -880,53 +1172,35 @@ err:
  * Once the image has been loaded it needs to be validated and relocated
  */
 EFI_STATUS
-handle_image (void *data, unsigned int datasize,
+handle_image (void *data, unsigned int datasize, UINTN data_pages,
 	      EFI_LOADED_IMAGE *li,
 	      EFI_IMAGE_ENTRY_POINT *entry_point,
 	      EFI_PHYSICAL_ADDRESS *alloc_address,
-	      UINTN *alloc_pages)
+	      UINTN *alloc_pages, pe_image_t *image,
+	      digest_set_t *file_digests)
 {
 	EFI_STATUS efi_status;
 	char *buffer;
 	int i;
 	EFI_IMAGE_SECTION_HEADER *Section;
 	char *base, *end;
-	PE_COFF_LOADER_IMAGE_CONTEXT context;
+	PE_COFF_LOADER_IMAGE_CONTEXT *context = &image->context;
 	unsigned int alignment, alloc_size;
 	int found_entry_point = 0;
-	UINT8 sha1hash[SHA1_DIGEST_SIZE];
-	UINT8 sha256hash[SHA256_DIGEST_SIZE];
+	BOOLEAN fused, in_place;
+	digest_set_t digests;
+	UINT32 algs;
 
 	/*
-	 * The binary header contains relevant context and section pointers
+	 * The binary header contains relevant context and section pointers,
+	 * unless load_image() has already worked all that out
 	 */
-	efi_status = read_header(data, datasize, &context);
-	if (EFI_ERROR(efi_status)) {
-		perror(L"Failed to read header: %r\n", efi_status);
-		return efi_status;
+	if (!image->data) {
+		efi_status = pe_image_init(image, data, datasize, NULL);
+		if (EFI_ERROR(efi_status))
+			return efi_status;
 	}
 
-	/*
-	 * We only need to verify the binary if we're in secure mode
-	 */
-	efi_status = generate_hash(data, datasize, &context, sha256hash,
-				   sha1hash);
-	if (EFI_ERROR(efi_status))
-		return efi_status;
-
-	/* Measure the binary into the TPM */
-#ifdef REQUIRE_TPM
-	efi_status =
-#endif
-	tpm_log_pe((EFI_PHYSICAL_ADDRESS)(UINTN)data, datasize,
-		   (EFI_PHYSICAL_ADDRESS)(UINTN)context.ImageAddress,
-		   li->FilePath, sha1hash, 4);
-#ifdef REQUIRE_TPM
-	if (efi_status != EFI_SUCCESS) {
-		return efi_status;
-	}
-#endif
-
 	/* The spec says, uselessly, of SectionAlignment:
 	 * =====
 	 * The alignment (in bytes) of sections when they are loaded into
@@ -941,29 +1215,83 @@ handle_image (void *data, unsigned int datasize,
 	 *
 	 * We only support one page size, so if it's zero, nerf it to 4096.
 	 */
-	alignment = context.SectionAlignment;
+	alignment = context->SectionAlignment;
 	if (!alignment)
 		alignment = 4096;
 
-	alloc_size = ALIGN_VALUE(context.ImageSize + context.SectionAlignment,
-				 PAGE_SIZE);
-	*alloc_pages = alloc_size / PAGE_SIZE;
+	/*
+	 * If the file was read into pages and is laid out the way it will
+	 * be in memory, it can run right where it is, and all that's left
+	 * to do is zero its uninitialized data and relocate it.
+	 */
+	in_place = data_pages &&
+		   loader_runs_in_place(data, datasize, data_pages * PAGE_SIZE,
+					context);
+	if (in_place) {
+		dprint(L"running image in place at 0x%lx\n", data);
+		*alloc_address = (EFI_PHYSICAL_ADDRESS)(UINTN)data;
+		*alloc_pages = data_pages;
+		buffer = data;
+	} else {
+		alloc_size = ALIGN_VALUE(context->ImageSize + context->SectionAlignment,
+					 PAGE_SIZE);
+		*alloc_pages = alloc_size / PAGE_SIZE;
 
-	efi_status = gBS->AllocatePages(AllocateAnyPages, EfiLoaderCode,
-					*alloc_pages, alloc_address);
-	if (EFI_ERROR(efi_status)) {
-		perror(L"Failed to allocate image buffer\n");
-		return EFI_OUT_OF_RESOURCES;
+		efi_status = gBS->AllocatePages(AllocateAnyPages, EfiLoaderCode,
+						*alloc_pages, alloc_address);
+		if (EFI_ERROR(efi_status)) {
+			perror(L"Failed to allocate image buffer\n");
+			return EFI_OUT_OF_RESOURCES;
+		}
+
+		buffer = (void *)ALIGN_VALUE((unsigned long)*alloc_address, alignment);
+
+		CopyMem(buffer, data, context->SizeOfHeaders);
 	}
 
-	buffer = (void *)ALIGN_VALUE((unsigned long)*alloc_address, alignment);
+	/*
+	 * We only need to verify the binary if we're in secure mode, but
+	 * the measurement wants the digests regardless, so compute them
+	 * all in one pass, and load the sections into the new buffer in
+	 * the same pass unless they overlap, so each byte is only read
+	 * from the file once.  If it was hashed as it was read off the
+	 * disk, that's already been done.
+	 */
+	algs = digest_plan();
+	if (file_digests && file_digests->algs == algs) {
+		CopyMem(&digests, file_digests, sizeof(digests));
+		fused = FALSE;
+	} else {
+		fused = !in_place && !loader_sections_overlap(context);
+		efi_status = digest_image(image, algs, &digests,
+					  fused ? buffer : NULL);
+		if (EFI_ERROR(efi_status)) {
+			if (!in_place)
+				gBS->FreePages(*alloc_address, *alloc_pages);
+			return efi_status;
+		}
+	}
 
-	CopyMem(buffer, data, context.SizeOfHeaders);
+	/* Measure the binary into the TPM */
+#ifdef REQUIRE_TPM
+	efi_status =
+#endif
+	tpm_log_pe((EFI_PHYSICAL_ADDRESS)(UINTN)data, datasize,
+		   (EFI_PHYSICAL_ADDRESS)(UINTN)context->ImageAddress,
+		   li->FilePath, &digests, 4);
+#ifdef REQUIRE_TPM
+	if (efi_status != EFI_SUCCESS) {
+		if (!in_place)
+			gBS->FreePages(*alloc_address, *alloc_pages);
+		return efi_status;
+	}
+#endif
 
-	*entry_point = ImageAddress(buffer, context.ImageSize, context.EntryPoint);
+	*entry_point = ImageAddress(buffer, context->ImageSize, context->EntryPoint);
 	if (!*entry_point) {
 		perror(L"Entry point is invalid\n");
-		gBS->FreePages(*alloc_address, *alloc_pages);
+		if (!in_place)
+			gBS->FreePages(*alloc_address, *alloc_pages);
 		return EFI_UNSUPPORTED;
 	}
 
@@ -972,14 +1300,14 @@ handle_image (void *data, unsigned int datasize,
 	 * These are relative virtual addresses, so we have to check them
 	 * against the image size, not the data size.
 	 */
-	RelocBase = ImageAddress(buffer, context.ImageSize,
-				 context.RelocDir->VirtualAddress);
+	RelocBase = ImageAddress(buffer, context->ImageSize,
+				 context->RelocDir->VirtualAddress);
 	/*
 	 * RelocBaseEnd here is the address of the last byte of the table
 	 */
-	RelocBaseEnd = ImageAddress(buffer, context.ImageSize,
-				    context.RelocDir->VirtualAddress +
-				    context.RelocDir->Size - 1);
+	RelocBaseEnd = ImageAddress(buffer, context->ImageSize,
+				    context->RelocDir->VirtualAddress +
+				    context->RelocDir->Size - 1);
 
 	EFI_IMAGE_SECTION_HEADER *RelocSection = NULL;
 
@@ -989,33 +1317,34 @@ handle_image (void *data, unsigned int datasize,
 	/*
 	 * Copy the executable's sections to their desired offsets
 	 */
-	Section = context.FirstSection;
-	for (i = 0; i < context.NumberOfSections; i++, Section++) {
+	Section = context->FirstSection;
+	for (i = 0; i < context->NumberOfSections; i++, Section++) {
 		/* Don't try to copy discardable sections with zero size */
 		if ((Section->Characteristics & EFI_IMAGE_SCN_MEM_DISCARDABLE) &&
 		    !Section->Misc.VirtualSize)
 			continue;
 
-		base = ImageAddress (buffer, context.ImageSize,
+		base = ImageAddress (buffer, context->ImageSize,
 				     Section->VirtualAddress);
-		end = ImageAddress (buffer, context.ImageSize,
+		end = ImageAddress (buffer, context->ImageSize,
 				    Section->VirtualAddress
 				     + Section->Misc.VirtualSize - 1);
 
 		if (end < base) {
 			perror(L"Section %d has negative size\n", i);
-			gBS->FreePages(*alloc_address, *alloc_pages);
+			if (!in_place)
+				gBS->FreePages(*alloc_address, *alloc_pages);
 			return EFI_UNSUPPORTED;
 		}
 
-		if (Section->VirtualAddress <= context.EntryPoint &&
+		if (Section->VirtualAddress <= context->EntryPoint &&
 		    (Section->VirtualAddress + Section->SizeOfRawData - 1)
-		    > context.EntryPoint)
+		    > context->EntryPoint)
 			found_entry_point++;
 
 		/* We do want to process .reloc, but it's often marked
 		 * discardable, so we don't want to memcpy it. */
-		if (CompareMem(Section->Name, ".reloc\0\0", 8) == 0) {
+		if (image->names[i] == PE_SECTION_RELOC) {
 			if (RelocSection) {
 				perror(L"Image has multiple relocation sections\n");
 				return EFI_UNSUPPORTED;
@@ -1030,7 +1359,7 @@ handle_image (void *data, unsigned int datasize,
 					RelocBaseEnd == end) {
 				RelocSection = Section;
 			}
-		} else if (CompareMem(Section->Name, ".sbat\0\0\0", 8) == 0) {
+		} else if (image->names[i] == PE_SECTION_SBAT) {
 			if (SBATBase || SBATSize) {
 				perror(L"Image has multiple SBAT sections\n");
 				return EFI_UNSUPPORTED;
@@ -1073,21 +1402,30 @@ handle_image (void *data, unsigned int datasize,
 		}
 
 		if (!(Section->Characteristics & EFI_IMAGE_SCN_CNT_UNINITIALIZED_DATA) &&
-		    (Section->VirtualAddress < context.SizeOfHeaders ||
-		     Section->PointerToRawData < context.SizeOfHeaders)) {
+		    (Section->VirtualAddress < context->SizeOfHeaders ||
+		     Section->PointerToRawData < context->SizeOfHeaders)) {
 			perror(L"Section %d is inside image headers\n", i);
 			return EFI_UNSUPPORTED;
 		}
 
+		/*
+		 * In place, the raw data is already where it belongs, and
+		 * zeroing the rest has to wait until the file has been
+		 * verified, since that may be where the signature is.
+		 */
+		if (in_place)
+			continue;
+
 		if (Section->Characteristics & EFI_IMAGE_SCN_CNT_UNINITIALIZED_DATA) {
 			ZeroMem(base, Section->Misc.VirtualSize);
 		} else {
-			if (Section->PointerToRawData < context.SizeOfHeaders) {
+			if (Section->PointerToRawData < context->SizeOfHeaders) {
 				perror(L"Section %d is inside image headers\n", i);
 				return EFI_UNSUPPORTED;
 			}
 
-			if (Section->SizeOfRawData > 0)
+			if (Section->SizeOfRawData > 0 &&
+			    !(fused && section_loads_raw_data(context, Section)))
 				CopyMem(base, data + Section->PointerToRawData,
 					Section->SizeOfRawData);
 
@@ -1102,13 +1440,16 @@ handle_image (void *data, unsigned int datasize,
 
 		if (!EFI_ERROR(efi_status))
 			efi_status = verify_buffer(data, datasize,
-						   &context, sha256hash, sha1hash);
+						   image, digests.sha256,
+						   digests.sha1);
 
 		if (EFI_ERROR(efi_status)) {
 			if (verbose)
 				console_print(L"Verification failed: %r\n", efi_status);
 			else
 				console_error(L"Verification failed", efi_status);
+			if (!in_place)
+				gBS->FreePages(*alloc_address, *alloc_pages);
 			return efi_status;
 		} else {
 			if (verbose)
@@ -1116,22 +1457,27 @@ handle_image (void *data, unsigned int datasize,
 		}
 	}
 
-	if (context.NumberOfRvaAndSizes <= EFI_IMAGE_DIRECTORY_ENTRY_BASERELOC) {
+	if (in_place)
+		zero_sections_in_place(context, buffer);
+
+	if (context->NumberOfRvaAndSizes <= EFI_IMAGE_DIRECTORY_ENTRY_BASERELOC) {
 		perror(L"Image has no relocation entry\n");
-		FreePool(buffer);
+		if (!in_place)
+			gBS->FreePages(*alloc_address, *alloc_pages);
 		return EFI_UNSUPPORTED;
 	}
 
-	if (context.RelocDir->Size && RelocSection) {
+	if (context->RelocDir->Size && RelocSection) {
 		/*
 		 * Run the relocation fixups
 		 */
-		efi_status = relocate_coff(&context, RelocSection, data,
+		efi_status = relocate_coff(context, RelocSection, data,
 					   buffer);
 
 		if (EFI_ERROR(efi_status)) {
 			perror(L"Relocation failed: %r\n", efi_status);
-			FreePool(buffer);
+			if (!in_place)
+				gBS->FreePages(*alloc_address, *alloc_pages);
 			return efi_status;
 		}
 	}
@@ -1141,7 +1487,7 @@ handle_image (void *data, unsigned int datasize,
 	 * the loaded image protocol values
 	 */
 	li->ImageBase = buffer;
-	li->ImageSize = context.ImageSize;
+	li->ImageSize = context->ImageSize;
 
 	/* Pass the load options to the second stage loader */
 	if ( load_options ) {
@@ -0,0 +1,263 @@
+// SPDX-License-Identifier: BSD-2-Clause-Patent
+/*
+ * session.c - hash an image as a loader hands it to us, piece by piece
+ *
+ * A loader that reads its next stage a chunk at a time shouldn't have to
+ * put the whole file together just so we can look at it once it's done.
+ * The headers say which parts of the file the Authenticode digest covers
+ * and in what order; as long as that's the order they come in, each
+ * chunk can be hashed and forgotten.
+ */
+
+#include "shim.h"
+
+EFI_STATUS
+session_init(session_t **sessionp, UINT32 datasize, UINT32 algs)
+{
+	session_t *session;
+
+	if (datasize == 0 || (INT32)datasize < 0)
+		return EFI_INVALID_PARAMETER;
+
+	session = AllocateZeroPool(sizeof(*session));
+	if (!session)
+		return EFI_OUT_OF_RESOURCES;
+
+	session->datasize = datasize;
+	session->algs = algs;
+	session->header_want = MIN(datasize, LOADER_HEADER_SIZE);
+	session->header = AllocatePool(session->header_want);
+	if (!session->header) {
+		FreePool(session);
+		return EFI_OUT_OF_RESOURCES;
+	}
+
+	*sessionp = session;
+	return EFI_SUCCESS;
+}
+
+/*
+ * Use bytes start to start + size of the file, which are at data, once we
+ * know what the image looks like.
+ */
+static EFI_STATUS
+session_window(session_t *session, UINT8 *data, UINTN start, UINTN size)
+{
+	UINTN certs_end = session->certs_offset + session->certs_size;
+	UINTN from, to;
+
+	if (session->certs_size &&
+	    start < certs_end && session->certs_offset < start + size) {
+		from = MAX(start, session->certs_offset);
+		to = MIN(start + size, certs_end);
+		CopyMem(session->certs + (from - session->certs_offset),
+			data + (from - start), to - from);
+	}
+
+	if (session->copy) {
+		CopyMem(session->copy + start, data, size);
+		return EFI_SUCCESS;
+	}
+
+	return image_digest_update_window(&session->id, (char *)data,
+					  start, size);
+}
+
+/*
+ * Called each time the header buffer fills up.  Either it turns out to
+ * need to be bigger, or it holds all of the headers and we can work out
+ * what to do with the rest of the file.  whole is the whole file, if the
+ * caller handed it over in one go.
+ */
+static EFI_STATUS
+session_plan(session_t *session, UINT8 *whole)
+{
+	PE_COFF_LOADER_IMAGE_CONTEXT context;
+	EFI_IMAGE_DATA_DIRECTORY *SecDir;
+	pe_hash_range_t *ranges;
+	EFI_STATUS efi_status;
+	UINTN headers, i;
+	UINT8 *header;
+
+	headers = loader_headers_size(session->header, session->header_len);
+	if (headers == 0) {
+		perror(L"Failed to read header: %r\n", EFI_UNSUPPORTED);
+		return EFI_UNSUPPORTED;
+	}
+
+	if (headers > session->header_len) {
+		if (headers > session->datasize) {
+			perror(L"Header size %d is invalid\n", headers);
+			return EFI_INVALID_PARAMETER;
+		}
+		header = ReallocatePool(session->header, session->header_len,
+					headers);
+		if (!header)
+			return EFI_OUT_OF_RESOURCES;
+		session->header = header;
+		session->header_want = headers;
+		return EFI_SUCCESS;
+	}
+
+	efi_status = read_header(session->header, session->datasize, &context);
+	if (EFI_ERROR(efi_status)) {
+		perror(L"Failed to read header: %r\n", efi_status);
+		return efi_status;
+	}
+	if ((UINT8 *)(context.FirstSection + context.NumberOfSections) >
+	    session->header + session->header_len) {
+		perror(L"Section table is outside of the headers\n");
+		return EFI_UNSUPPORTED;
+	}
+
+	efi_status = pe_image_init(&session->image, session->header,
+				   session->datasize, &context);
+	if (EFI_ERROR(efi_status))
+		return efi_status;
+
+	/*
+	 * Sections that aren't in the file in the order they're hashed
+	 * mean hashing has to wait until we have all of it.
+	 */
+	ranges = session->image.ranges;
+	for (i = 1; i < session->image.nranges; i++) {
+		if (ranges[i].offset < ranges[i - 1].offset + ranges[i - 1].size)
+			break;
+	}
+	if (i < session->image.nranges && !whole) {
+		dprint(L"Image isn't in hashing order, keeping all of it\n");
+		session->copy = AllocatePool(session->datasize);
+		if (!session->copy)
+			return EFI_OUT_OF_RESOURCES;
+	}
+
+	SecDir = session->image.context.SecDir;
+	if (SecDir->Size && SecDir->VirtualAddress < session->datasize) {
+		session->certs_offset = SecDir->VirtualAddress;
+		session->certs_size = MIN(SecDir->Size,
+					  session->datasize -
+					  SecDir->VirtualAddress);
+		session->certs = AllocatePool(session->certs_size);
+		if (!session->certs)
+			return EFI_OUT_OF_RESOURCES;
+	}
+
+	efi_status = image_digest_init(&session->id, &session->image,
+				       session->algs, NULL);
+	if (EFI_ERROR(efi_status))
+		return efi_status;
+	session->planned = TRUE;
+
+	/*
+	 * With all of it to hand, hash the lot now; what's left of the
+	 * caller's buffer then has nothing more to add to the digest.
+	 */
+	if (whole)
+		return session_window(session, whole, 0, session->datasize);
+
+	return session_window(session, session->header, 0,
+			      session->header_len);
+}
+
+EFI_STATUS
+session_update(session_t *session, VOID *data, UINTN size)
+{
+	UINT8 *bytes = data;
+	UINT8 *whole = NULL;
+	EFI_STATUS efi_status;
+	UINTN n;
+
+	if (EFI_ERROR(session->status))
+		return session->status;
+
+	if (size > session->datasize - session->received) {
+		perror(L"Image is bigger than its declared size %d\n",
+		       session->datasize);
+		efi_status = EFI_BAD_BUFFER_SIZE;
+		goto error;
+	}
+
+	if (session->received == 0 && size == session->datasize)
+		whole = bytes;
+
+	while (!session->planned && size) {
+		n = MIN(size, session->header_want - session->header_len);
+		CopyMem(session->header + session->header_len, bytes, n);
+		session->header_len += n;
+		session->received += n;
+		bytes += n;
+		size -= n;
+
+		if (session->header_len < session->header_want)
+			break;
+		efi_status = session_plan(session, whole);
+		if (EFI_ERROR(efi_status))
+			goto error;
+	}
+
+	if (size) {
+		efi_status = session_window(session, bytes, session->received,
+					    size);
+		if (EFI_ERROR(efi_status))
+			goto error;
+		session->received += size;
+	}
+
+	return EFI_SUCCESS;
+
+error:
+	session->status = efi_status;
+	return efi_status;
+}
+
+EFI_STATUS
+session_final(session_t *session, digest_set_t *digests)
+{
+	EFI_STATUS efi_status;
+
+	if (EFI_ERROR(session->status))
+		return session->status;
+
+	if (session->received < session->datasize) {
+		perror(L"Image was not completely received\n");
+		efi_status = EFI_INVALID_PARAMETER;
+		goto error;
+	}
+
+	if (session->copy) {
+		efi_status = image_digest_update_window(&session->id,
+							(char *)session->copy,
+							0, session->datasize);
+		if (EFI_ERROR(efi_status))
+			goto error;
+	}
+
+	efi_status = image_digest_final(&session->id, digests);
+	if (EFI_ERROR(efi_status))
+		goto error;
+
+	return EFI_SUCCESS;
+
+error:
+	session->status = efi_status;
+	return efi_status;
+}
+
+void
+session_free(session_t *session)
+{
+	if (!session)
+		return;
+
+	image_digest_free(&session->id);
+	pe_image_free(&session->image);
+	if (session->header)
+		FreePool(session->header);
+	if (session->copy)
+		FreePool(session->copy);
+	if (session->certs)
+		FreePool(session->certs);
+	FreePool(session);
+}
+
+// vim:fenc=utf-8:tw=75:noet
@@ -35,6 +35,7 @@
 
 #define OID_EKU_MODSIGN "1.3.6.1.4.1.2312.16.1.2"
 
+
 static EFI_SYSTEM_TABLE *systab;
 static EFI_HANDLE global_image_handle;
 static EFI_LOADED_IMAGE *shim_li;
@@ -127,229 +128,559 @@ static BOOLEAN verify_x509(UINT8 *Cert, UINTN CertSize)
 	return TRUE;
 }
 
+/* Registered with OpenSSL by init_openssl() */
+static int modsign_nid = NID_undef;
+
+/*
+ * Certificates for signing kernel modules mustn't be trusted to sign
+ * anything else.
+ */
 static BOOLEAN verify_eku(UINT8 *Cert, UINTN CertSize)
 {
-	X509 *x509;
+	/* OID_EKU_MODSIGN */
+	static const UINT8 module_signing[] = {
+		0x2b, 0x06, 0x01, 0x04, 0x01, 0x92, 0x08, 0x10, 0x01, 0x02
+	};
 	CONST UINT8 *Temp = Cert;
 	EXTENDED_KEY_USAGE *eku;
-	ASN1_OBJECT *module_signing;
+	BOOLEAN listed = FALSE;
+	X509 *x509;
+	int i;
 
-        module_signing = OBJ_nid2obj(OBJ_create(OID_EKU_MODSIGN,
-                                                "modsign-eku",
-                                                "modsign-eku"));
+	if (x509_has_eku(Cert, CertSize, module_signing,
+			 sizeof(module_signing), &listed))
+		return !listed;
 
-	x509 = d2i_X509 (NULL, &Temp, (long) CertSize);
-	if (x509 != NULL) {
-		eku = X509_get_ext_d2i(x509, NID_ext_key_usage, NULL, NULL);
+	/*
+	 * It isn't DER we can walk, but OpenSSL may still take it, so ask
+	 * OpenSSL.  If it can't answer, the certificate isn't used.
+	 */
+	if (modsign_nid == NID_undef)
+		return FALSE;
+	x509 = d2i_X509(NULL, &Temp, (long) CertSize);
+	if (!x509)
+		return FALSE;
+	eku = X509_get_ext_d2i(x509, NID_ext_key_usage, NULL, NULL);
+	for (i = 0; eku && i < sk_ASN1_OBJECT_num(eku); i++) {
+		if (OBJ_obj2nid(sk_ASN1_OBJECT_value(eku, i)) == modsign_nid)
+			listed = TRUE;
+	}
+	if (eku)
+		EXTENDED_KEY_USAGE_free(eku);
+	X509_free(x509);
 
-		if (eku) {
-			int i = 0;
-			for (i = 0; i < sk_ASN1_OBJECT_num(eku); i++) {
-				ASN1_OBJECT *key_usage = sk_ASN1_OBJECT_value(eku, i);
+	return !listed;
+}
 
-				if (OBJ_cmp(module_signing, key_usage) == 0)
-					return FALSE;
-			}
-			EXTENDED_KEY_USAGE_free(eku);
-		}
+/*
+ * Certificates we verify signatures against, decoded once and kept with
+ * the X509 store built for them.  The ones from db, MokList and dbx point
+ * into the cached signature databases, so the whole cache goes whenever
+ * those are reread.
+ */
+typedef struct {
+	UINT8 *cert;
+	UINTN size;
+	VOID *anchor;
+	BOOLEAN checked;	/* verify_x509() and verify_eku() have run */
+	BOOLEAN usable;		/* ... and passed */
+} trust_anchor_t;
+
+static trust_anchor_t *trust_anchors;
+static UINTN n_trust_anchors;
+
+/*
+ * A signature being checked: decoded for OpenSSL once, and the DER it
+ * came from, for what der.c can tell from it without OpenSSL.
+ */
+typedef struct {
+	VOID *decoded;
+	UINT8 *der;
+	UINTN size;
+} authenticode_t;
+
+/*
+ * How many verifications were skipped because the certificates' names
+ * and key identifiers showed they couldn't succeed.
+ */
+static UINTN verifications_avoided;
+
+/*
+ * Every usable certificate of one database in a single trust anchor, so
+ * a signature is checked against all of them with one chain build.
+ * certs[n] is the sigdb_cert() number of the nth certificate added.  If
+ * one of them can't be added, anchor is NULL and the database is checked
+ * one certificate at a time instead.
+ */
+typedef struct {
+	sigdb_t *db;
+	VOID *anchor;
+	UINTN *certs;
+	UINTN count;
+	BOOLEAN complete;
+} anchor_set_t;
+
+static anchor_set_t *anchor_sets;
+static UINTN n_anchor_sets;
+static UINTN trust_anchors_epoch;
+
+static void free_trust_anchors(void)
+{
+	UINTN i;
 
-		X509_free(x509);
+	for (i = 0; i < n_trust_anchors; i++)
+		Pkcs7TrustAnchorFree(trust_anchors[i].anchor);
+	if (trust_anchors)
+		FreePool(trust_anchors);
+	trust_anchors = NULL;
+	n_trust_anchors = 0;
+
+	for (i = 0; i < n_anchor_sets; i++) {
+		Pkcs7TrustAnchorFree(anchor_sets[i].anchor);
+		if (anchor_sets[i].certs)
+			FreePool(anchor_sets[i].certs);
+	}
+	if (anchor_sets)
+		FreePool(anchor_sets);
+	anchor_sets = NULL;
+	n_anchor_sets = 0;
+}
+
+static void check_trust_anchors_epoch(void)
+{
+	if (trust_anchors_epoch != sigdb_epoch()) {
+		free_trust_anchors();
+		trust_anchors_epoch = sigdb_epoch();
 	}
+}
 
-	OBJ_cleanup();
+static trust_anchor_t *get_trust_anchor(UINT8 *cert, UINTN size)
+{
+	trust_anchor_t *ta;
+	UINTN i;
 
-	return TRUE;
+	check_trust_anchors_epoch();
+
+	for (i = 0; i < n_trust_anchors; i++) {
+		if (trust_anchors[i].cert == cert &&
+		    trust_anchors[i].size == size)
+			return &trust_anchors[i];
+	}
+
+	ta = ReallocatePool(trust_anchors,
+			    n_trust_anchors * sizeof(*ta),
+			    (n_trust_anchors + 1) * sizeof(*ta));
+	if (!ta)
+		return NULL;
+	trust_anchors = ta;
+
+	ta = &trust_anchors[n_trust_anchors++];
+	ZeroMem(ta, sizeof(*ta));
+	ta->cert = cert;
+	ta->size = size;
+	ta->anchor = Pkcs7TrustAnchorNew(cert, size);
+
+	return ta;
 }
 
-static CHECK_STATUS check_db_cert_in_ram(EFI_SIGNATURE_LIST *CertList,
-					 UINTN dbsize,
-					 WIN_CERTIFICATE_EFI_PKCS *data,
-					 UINT8 *hash, CHAR16 *dbname,
-					 EFI_GUID guid)
+static BOOLEAN may_chain_to(authenticode_t *auth, UINT8 *cert, UINTN size)
+{
+	return pkcs7_may_chain_to(auth->der, auth->size, cert, size);
+}
+
+static BOOLEAN verify_with_anchor(authenticode_t *auth, UINT8 *cert,
+				  UINTN size, UINT8 *hash)
 {
+	trust_anchor_t *ta;
+
+	if (!may_chain_to(auth, cert, size)) {
+		verifications_avoided++;
+		return FALSE;
+	}
+
+	ta = get_trust_anchor(cert, size);
+	if (!ta || !ta->anchor)
+		return FALSE;
+
+	return AuthenticodeVerifyWithAnchor(auth->decoded, ta->anchor, hash,
+					    SHA256_DIGEST_SIZE, NULL);
+}
+
+static void build_anchor_set(anchor_set_t *set, CHAR16 *dbname)
+{
+	sigdb_entry_t *entry;
 	EFI_SIGNATURE_DATA *Cert;
 	UINTN CertSize;
-	BOOLEAN IsFound = FALSE;
-	int i = 0;
+	BOOLEAN added;
+	UINTN i, n;
 
-	while ((dbsize > 0) && (dbsize >= CertList->SignatureListSize)) {
-		if (CompareGuid (&CertList->SignatureType, &EFI_CERT_TYPE_X509_GUID) == 0) {
-			Cert = (EFI_SIGNATURE_DATA *) ((UINT8 *) CertList + sizeof (EFI_SIGNATURE_LIST) + CertList->SignatureHeaderSize);
-			CertSize = CertList->SignatureSize - sizeof(EFI_GUID);
-			dprint(L"trying to verify cert %d (%s)\n", i++, dbname);
-			if (verify_x509(Cert->SignatureData, CertSize)) {
-				if (verify_eku(Cert->SignatureData, CertSize)) {
-					drain_openssl_errors();
-					IsFound = AuthenticodeVerify (data->CertData,
-								      data->Hdr.dwLength - sizeof(data->Hdr),
-								      Cert->SignatureData,
-								      CertSize,
-								      hash, SHA256_DIGEST_SIZE);
-					if (IsFound) {
-						dprint(L"AuthenticodeVerify() succeeded: %d\n", IsFound);
-						tpm_measure_variable(dbname, guid, CertList->SignatureSize, Cert);
-						drain_openssl_errors();
-						return DATA_FOUND;
-					} else {
-						LogError(L"AuthenticodeVerify(): %d\n", IsFound);
-					}
-				}
-			} else if (verbose) {
+	for (n = 0; sigdb_cert(set->db, n) != NULL; n++)
+		;
+	if (n == 0) {
+		set->complete = TRUE;
+		return;
+	}
+
+	set->certs = AllocatePool(n * sizeof(*set->certs));
+	if (!set->certs)
+		return;
+
+	for (i = 0; i < n; i++) {
+		entry = sigdb_cert(set->db, i);
+		Cert = entry->sig;
+		CertSize = entry->list->SignatureSize - sizeof(EFI_GUID);
+		dprint(L"adding cert %d (%s)\n", i, dbname);
+
+		if (!verify_x509(Cert->SignatureData, CertSize)) {
+			if (verbose) {
 				console_print(L"Not a DER encoded x.509 Certificate");
 				dprint(L"cert:\n");
 				dhexdumpat(Cert->SignatureData, CertSize, 0);
 			}
+			continue;
 		}
+		if (!verify_eku(Cert->SignatureData, CertSize))
+			continue;
 
-		dbsize -= CertList->SignatureListSize;
-		CertList = (EFI_SIGNATURE_LIST *) ((UINT8 *) CertList + CertList->SignatureListSize);
+		if (!set->anchor) {
+			set->anchor = Pkcs7TrustAnchorNew(Cert->SignatureData,
+							  CertSize);
+			added = set->anchor != NULL;
+		} else {
+			added = Pkcs7TrustAnchorAdd(set->anchor,
+						    Cert->SignatureData,
+						    CertSize);
+		}
+		if (!added) {
+			dprint(L"cert %d (%s) can't share a trust anchor\n",
+			       i, dbname);
+			drain_openssl_errors();
+			Pkcs7TrustAnchorFree(set->anchor);
+			set->anchor = NULL;
+			set->count = 0;
+			return;
+		}
+		set->certs[set->count++] = i;
 	}
 
-	return DATA_NOT_FOUND;
+	set->complete = TRUE;
 }
 
-static CHECK_STATUS check_db_cert(CHAR16 *dbname, EFI_GUID guid,
-				  WIN_CERTIFICATE_EFI_PKCS *data, UINT8 *hash)
+static anchor_set_t *get_anchor_set(sigdb_t *db, CHAR16 *dbname)
 {
-	CHECK_STATUS rc;
-	EFI_STATUS efi_status;
-	EFI_SIGNATURE_LIST *CertList;
-	UINTN dbsize = 0;
-	UINT8 *db;
+	anchor_set_t *set;
+	UINTN i;
 
-	efi_status = get_variable(dbname, &db, &dbsize, guid);
-	if (EFI_ERROR(efi_status))
-		return VAR_NOT_FOUND;
+	check_trust_anchors_epoch();
+
+	for (i = 0; i < n_anchor_sets; i++) {
+		if (anchor_sets[i].db == db)
+			return &anchor_sets[i];
+	}
 
-	CertList = (EFI_SIGNATURE_LIST *)db;
+	set = ReallocatePool(anchor_sets,
+			     n_anchor_sets * sizeof(*set),
+			     (n_anchor_sets + 1) * sizeof(*set));
+	if (!set)
+		return NULL;
+	anchor_sets = set;
 
-	rc = check_db_cert_in_ram(CertList, dbsize, data, hash, dbname, guid);
+	set = &anchor_sets[n_anchor_sets++];
+	ZeroMem(set, sizeof(*set));
+	set->db = db;
+	build_anchor_set(set, dbname);
 
-	FreePool(db);
+	return set;
+}
 
-	return rc;
+/*
+ * Measure the database entry a verification matched, and remember that
+ * we did, in case the verdict is reused.
+ */
+static void measure_match(CHAR16 *dbname, EFI_GUID guid, UINTN size,
+			  void *data)
+{
+	tpm_measure_variable(dbname, guid, size, data);
+	vcache_measured(dbname, guid, size, data);
 }
 
 /*
- * Check a hash against an EFI_SIGNATURE_LIST in a buffer
+ * The same check one certificate at a time, for databases whose
+ * certificates can't all go in one trust anchor.
  */
-static CHECK_STATUS check_db_hash_in_ram(EFI_SIGNATURE_LIST *CertList,
-					 UINTN dbsize, UINT8 *data,
-					 int SignatureSize, EFI_GUID CertType,
-					 CHAR16 *dbname, EFI_GUID guid)
+static CHECK_STATUS check_db_cert_each(sigdb_t *db, authenticode_t *auth,
+				       UINT8 *hash, CHAR16 *dbname,
+				       EFI_GUID guid)
 {
+	sigdb_entry_t *entry;
+	trust_anchor_t *ta;
 	EFI_SIGNATURE_DATA *Cert;
-	UINTN CertCount, Index;
+	UINTN CertSize;
 	BOOLEAN IsFound = FALSE;
+	UINTN i;
 
-	while ((dbsize > 0) && (dbsize >= CertList->SignatureListSize)) {
-		CertCount = (CertList->SignatureListSize -sizeof (EFI_SIGNATURE_LIST) - CertList->SignatureHeaderSize) / CertList->SignatureSize;
-		Cert = (EFI_SIGNATURE_DATA *) ((UINT8 *) CertList + sizeof (EFI_SIGNATURE_LIST) + CertList->SignatureHeaderSize);
-		if (CompareGuid(&CertList->SignatureType, &CertType) == 0) {
-			for (Index = 0; Index < CertCount; Index++) {
-				if (CompareMem (Cert->SignatureData, data, SignatureSize) == 0) {
-					//
-					// Find the signature in database.
-					//
-					IsFound = TRUE;
-					tpm_measure_variable(dbname, guid, CertList->SignatureSize, Cert);
-					break;
-				}
-
-				Cert = (EFI_SIGNATURE_DATA *) ((UINT8 *) Cert + CertList->SignatureSize);
-			}
-			if (IsFound) {
-				break;
+	for (i = 0; (entry = sigdb_cert(db, i)) != NULL; i++) {
+		Cert = entry->sig;
+		CertSize = entry->list->SignatureSize - sizeof(EFI_GUID);
+		dprint(L"trying to verify cert %d (%s)\n", i, dbname);
+
+		ta = get_trust_anchor(Cert->SignatureData, CertSize);
+		if (!ta)
+			continue;
+		if (!ta->checked) {
+			ta->checked = TRUE;
+			if (verify_x509(Cert->SignatureData, CertSize)) {
+				ta->usable = verify_eku(Cert->SignatureData,
+							CertSize);
+			} else if (verbose) {
+				console_print(L"Not a DER encoded x.509 Certificate");
+				dprint(L"cert:\n");
+				dhexdumpat(Cert->SignatureData, CertSize, 0);
 			}
 		}
+		if (!ta->usable || !ta->anchor)
+			continue;
+		if (!may_chain_to(auth, Cert->SignatureData, CertSize)) {
+			verifications_avoided++;
+			continue;
+		}
 
-		dbsize -= CertList->SignatureListSize;
-		CertList = (EFI_SIGNATURE_LIST *) ((UINT8 *) CertList + CertList->SignatureListSize);
+		drain_openssl_errors();
+		IsFound = AuthenticodeVerifyWithAnchor(auth->decoded, ta->anchor,
+						       hash, SHA256_DIGEST_SIZE,
+						       NULL);
+		if (IsFound) {
+			dprint(L"AuthenticodeVerify() succeeded: %d\n", IsFound);
+			measure_match(dbname, guid, entry->list->SignatureSize, Cert);
+			drain_openssl_errors();
+			return DATA_FOUND;
+		} else {
+			LogError(L"AuthenticodeVerify(): %d\n", IsFound);
+		}
 	}
 
-	if (IsFound)
-		return DATA_FOUND;
-
 	return DATA_NOT_FOUND;
 }
 
+/*
+ * Check a signature against every certificate of a database in one
+ * verification.  When it succeeds, the certificate measured is the one
+ * checking each certificate in turn would have stopped at: the first, in
+ * list order, of those in the chain it built that verifies the signature
+ * on its own.
+ *
+ * With more than one certificate to choose from, the chain OpenSSL builds
+ * can go through one that checking them one at a time wouldn't have used,
+ * and fail there, so a failure is only final if the check one at a time
+ * fails too.
+ */
+static CHECK_STATUS check_db_cert_in_ram(sigdb_t *db, authenticode_t *auth,
+					 UINT8 *hash, CHAR16 *dbname,
+					 EFI_GUID guid)
+{
+	sigdb_entry_t *entry;
+	anchor_set_t *set;
+	UINTN candidates = 0;
+	UINTN matched;
+	UINTN i;
+
+	set = get_anchor_set(db, dbname);
+	if (!set || !set->complete)
+		return check_db_cert_each(db, auth, hash, dbname, guid);
+	if (set->count == 0)
+		return DATA_NOT_FOUND;
+
+	/*
+	 * The chain has to reach one of the certificates, so if none of
+	 * them can be in it, there's nothing for OpenSSL to do.
+	 */
+	for (i = 0; i < set->count; i++) {
+		entry = sigdb_cert(db, set->certs[i]);
+		if (may_chain_to(auth, entry->sig->SignatureData,
+				 entry->list->SignatureSize - sizeof(EFI_GUID)))
+			candidates++;
+	}
+	if (candidates == 0) {
+		dprint(L"no cert in %s can be in the signature's chain\n",
+		       dbname);
+		verifications_avoided++;
+		return DATA_NOT_FOUND;
+	}
+
+	drain_openssl_errors();
+	if (!AuthenticodeVerifyWithAnchor(auth->decoded, set->anchor, hash,
+					  SHA256_DIGEST_SIZE, &matched) ||
+	    matched >= set->count) {
+		if (candidates > 1) {
+			dprint(L"%d certs in %s could be in the chain, trying each\n",
+			       candidates, dbname);
+			drain_openssl_errors();
+			return check_db_cert_each(db, auth, hash, dbname, guid);
+		}
+		LogError(L"AuthenticodeVerify(%s) failed\n", dbname);
+		return DATA_NOT_FOUND;
+	}
+
+	entry = sigdb_cert(db, set->certs[matched]);
+	dprint(L"AuthenticodeVerify() succeeded with cert %d (%s)\n",
+	       set->certs[matched], dbname);
+	measure_match(dbname, guid, entry->list->SignatureSize, entry->sig);
+	drain_openssl_errors();
+	return DATA_FOUND;
+}
+
+static CHECK_STATUS check_db_cert(CHAR16 *dbname, EFI_GUID guid,
+				  authenticode_t *auth, UINT8 *hash)
+{
+	sigdb_t *db;
+
+	if (EFI_ERROR(sigdb_get_variable(dbname, guid, &db)))
+		return VAR_NOT_FOUND;
+
+	return check_db_cert_in_ram(db, auth, hash, dbname, guid);
+}
+
+/*
+ * Check a hash against an indexed EFI_SIGNATURE_LIST
+ */
+static CHECK_STATUS check_db_hash_in_ram(sigdb_t *db, UINT8 *data,
+					 EFI_GUID CertType,
+					 CHAR16 *dbname, EFI_GUID guid)
+{
+	sigdb_entry_t *entry;
+
+	entry = sigdb_find_hash(db, &CertType, data);
+	if (!entry)
+		return DATA_NOT_FOUND;
+
+	measure_match(dbname, guid, entry->list->SignatureSize, entry->sig);
+	return DATA_FOUND;
+}
+
 /*
  * Check a hash against an EFI_SIGNATURE_LIST in a UEFI variable
  */
 static CHECK_STATUS check_db_hash(CHAR16 *dbname, EFI_GUID guid, UINT8 *data,
-				  int SignatureSize, EFI_GUID CertType)
+				  EFI_GUID CertType)
 {
-	EFI_STATUS efi_status;
-	EFI_SIGNATURE_LIST *CertList;
-	UINTN dbsize = 0;
-	UINT8 *db;
+	sigdb_t *db;
 
-	efi_status = get_variable(dbname, &db, &dbsize, guid);
-	if (EFI_ERROR(efi_status)) {
+	if (EFI_ERROR(sigdb_get_variable(dbname, guid, &db)))
 		return VAR_NOT_FOUND;
-	}
-
-	CertList = (EFI_SIGNATURE_LIST *)db;
 
-	CHECK_STATUS rc = check_db_hash_in_ram(CertList, dbsize, data,
-					       SignatureSize, CertType,
-					       dbname, guid);
-	FreePool(db);
-	return rc;
+	return check_db_hash_in_ram(db, data, CertType, dbname, guid);
+}
 
+/*
+ * The built-in lists never change, so they are only indexed once
+ */
+static sigdb_t *vendor_sigdb(sigdb_t *db, UINT8 *data, UINTN size)
+{
+	if (!db->indexed)
+		sigdb_init(db, data, size);
+	return db;
 }
 
 /*
  * Check whether the binary signature or hash are present in dbx or the
  * built-in denylist
  */
-static EFI_STATUS check_denylist (WIN_CERTIFICATE_EFI_PKCS *cert,
+static sigdb_t vendor_dbx_index;
+static sigdb_filter_t revocation_filter;
+
+/*
+ * One filter over every hash we refuse to run, from the built-in dbx,
+ * the firmware's dbx and MokListX, rebuilt whenever those are reread.
+ * If it can't be built, or one of the lists couldn't be read, every
+ * check is a maybe and we do the exact lookups.
+ */
+static sigdb_filter_t *revocations(sigdb_t *vendor_dbx)
+{
+	EFI_STATUS dbx_status, mokx_status;
+	sigdb_t *dbs[3];
+
+	dbs[0] = vendor_dbx;
+	dbx_status = sigdb_get_variable(L"dbx", EFI_SECURE_BOOT_DB_GUID,
+					&dbs[1]);
+	mokx_status = sigdb_get_variable(L"MokListX", SHIM_LOCK_GUID,
+					 &dbs[2]);
+
+	if (revocation_filter.valid &&
+	    revocation_filter.epoch == sigdb_epoch())
+		return &revocation_filter;
+
+	sigdb_filter_free(&revocation_filter);
+	if ((EFI_ERROR(dbx_status) && dbx_status != EFI_NOT_FOUND) ||
+	    (EFI_ERROR(mokx_status) && mokx_status != EFI_NOT_FOUND))
+		return &revocation_filter;
+
+	sigdb_filter_build(&revocation_filter, dbs, 3);
+	return &revocation_filter;
+}
+
+static EFI_STATUS check_denylist (authenticode_t *auth,
 				  UINT8 *sha256hash, UINT8 *sha1hash)
 {
-	EFI_SIGNATURE_LIST *dbx = (EFI_SIGNATURE_LIST *)vendor_deauthorized;
+	sigdb_t *dbx = vendor_sigdb(&vendor_dbx_index,
+				    (UINT8 *)vendor_deauthorized,
+				    vendor_deauthorized_size);
+	sigdb_filter_t *filter = revocations(dbx);
+	BOOLEAN sha256_maybe, sha1_maybe;
 
-	if (check_db_hash_in_ram(dbx, vendor_deauthorized_size, sha256hash,
-			SHA256_DIGEST_SIZE, EFI_CERT_SHA256_GUID, L"dbx",
-			EFI_SECURE_BOOT_DB_GUID) == DATA_FOUND) {
+	/*
+	 * Nearly every image is in none of the lists, and the filter says
+	 * so without looking at them; only a maybe needs the exact checks.
+	 */
+	sha256_maybe = sigdb_filter_check(filter, &EFI_CERT_SHA256_GUID,
+					  sha256hash);
+	sha1_maybe = sigdb_filter_check(filter, &EFI_CERT_SHA1_GUID,
+					sha1hash);
+
+	if (sha256_maybe &&
+	    check_db_hash_in_ram(dbx, sha256hash, EFI_CERT_SHA256_GUID,
+				 L"dbx", EFI_SECURE_BOOT_DB_GUID) == DATA_FOUND) {
 		LogError(L"binary sha256hash found in vendor dbx\n");
 		return EFI_SECURITY_VIOLATION;
 	}
-	if (check_db_hash_in_ram(dbx, vendor_deauthorized_size, sha1hash,
-				 SHA1_DIGEST_SIZE, EFI_CERT_SHA1_GUID, L"dbx",
-				 EFI_SECURE_BOOT_DB_GUID) == DATA_FOUND) {
+	if (sha1_maybe &&
+	    check_db_hash_in_ram(dbx, sha1hash, EFI_CERT_SHA1_GUID,
+				 L"dbx", EFI_SECURE_BOOT_DB_GUID) == DATA_FOUND) {
 		LogError(L"binary sha1hash found in vendor dbx\n");
 		return EFI_SECURITY_VIOLATION;
 	}
-	if (cert &&
-	    check_db_cert_in_ram(dbx, vendor_deauthorized_size, cert, sha256hash, L"dbx",
+	if (auth &&
+	    check_db_cert_in_ram(dbx, auth, sha256hash, L"dbx",
 				 EFI_SECURE_BOOT_DB_GUID) == DATA_FOUND) {
 		LogError(L"cert sha256hash found in vendor dbx\n");
 		return EFI_SECURITY_VIOLATION;
 	}
-	if (check_db_hash(L"dbx", EFI_SECURE_BOOT_DB_GUID, sha256hash,
-			  SHA256_DIGEST_SIZE, EFI_CERT_SHA256_GUID) == DATA_FOUND) {
+	if (sha256_maybe &&
+	    check_db_hash(L"dbx", EFI_SECURE_BOOT_DB_GUID, sha256hash,
+			  EFI_CERT_SHA256_GUID) == DATA_FOUND) {
 		LogError(L"binary sha256hash found in system dbx\n");
 		return EFI_SECURITY_VIOLATION;
 	}
-	if (check_db_hash(L"dbx", EFI_SECURE_BOOT_DB_GUID, sha1hash,
-			  SHA1_DIGEST_SIZE, EFI_CERT_SHA1_GUID) == DATA_FOUND) {
+	if (sha1_maybe &&
+	    check_db_hash(L"dbx", EFI_SECURE_BOOT_DB_GUID, sha1hash,
+			  EFI_CERT_SHA1_GUID) == DATA_FOUND) {
 		LogError(L"binary sha1hash found in system dbx\n");
 		return EFI_SECURITY_VIOLATION;
 	}
-	if (cert &&
+	if (auth &&
 	    check_db_cert(L"dbx", EFI_SECURE_BOOT_DB_GUID,
-			  cert, sha256hash) == DATA_FOUND) {
+			  auth, sha256hash) == DATA_FOUND) {
 		LogError(L"cert sha256hash found in system dbx\n");
 		return EFI_SECURITY_VIOLATION;
 	}
-	if (check_db_hash(L"MokListX", SHIM_LOCK_GUID, sha256hash,
-			  SHA256_DIGEST_SIZE, EFI_CERT_SHA256_GUID) == DATA_FOUND) {
+	if (sha256_maybe &&
+	    check_db_hash(L"MokListX", SHIM_LOCK_GUID, sha256hash,
+			  EFI_CERT_SHA256_GUID) == DATA_FOUND) {
 		LogError(L"binary sha256hash found in Mok dbx\n");
 		return EFI_SECURITY_VIOLATION;
 	}
-	if (cert &&
+	if (auth &&
 	    check_db_cert(L"MokListX", SHIM_LOCK_GUID,
-			  cert, sha256hash) == DATA_FOUND) {
+			  auth, sha256hash) == DATA_FOUND) {
 		LogError(L"cert sha256hash found in Mok dbx\n");
 		return EFI_SECURITY_VIOLATION;
 	}
@@ -358,84 +689,138 @@ static EFI_STATUS check_denylist (WIN_CERTIFICATE_EFI_PKCS *cert,
 	return EFI_SUCCESS;
 }
 
+/*
+ * Which digests of an image are worth calculating.  SHA-256 always is:
+ * signatures, the verdict cache and most hash lists use it.  SHA-1 is
+ * only compared with db, dbx and the built-in dbx, so it's left out if
+ * none of them has any SHA-1 hashes, and nothing measures with it.  The
+ * lists are only looked at again when the variables change.
+ */
+static UINT32 db_digest_algs;
+static UINTN db_digest_epoch;
+static BOOLEAN db_digest_planned;
+
+static UINT32 db_sha1_algs(CHAR16 *name)
+{
+	EFI_STATUS efi_status;
+	sigdb_t *db;
+
+	efi_status = sigdb_get_variable(name, EFI_SECURE_BOOT_DB_GUID, &db);
+	if (efi_status == EFI_NOT_FOUND)
+		return 0;
+	/* If we can't tell, assume we need it */
+	if (EFI_ERROR(efi_status))
+		return DIGEST_SHA1;
+	return sigdb_hash_algs(db) & DIGEST_SHA1;
+}
+
+UINT32 digest_plan(void)
+{
+	sigdb_t *dbx = vendor_sigdb(&vendor_dbx_index,
+				    (UINT8 *)vendor_deauthorized,
+				    vendor_deauthorized_size);
+	UINT32 algs;
+
+	if (!db_digest_planned || db_digest_epoch != sigdb_epoch()) {
+		algs = DIGEST_SHA256 | (sigdb_hash_algs(dbx) & DIGEST_SHA1);
+		algs |= db_sha1_algs(L"db") | db_sha1_algs(L"dbx");
+		db_digest_algs = algs;
+		db_digest_epoch = sigdb_epoch();
+		db_digest_planned = TRUE;
+	}
+
+	return db_digest_algs | tpm_digest_algs();
+}
+
+/*
+ * What verifying the current image did to verification_method, so a
+ * cached verdict can do it again: some checks only set it if nothing has
+ * yet, others set it outright.
+ */
+static verification_method_t image_method;
+static BOOLEAN image_method_overrides;
+
 static void update_verification_method(verification_method_t method)
 {
+	if (image_method == VERIFIED_BY_NOTHING)
+		image_method = method;
 	if (verification_method == VERIFIED_BY_NOTHING)
 		verification_method = method;
 }
 
+static void set_verification_method(verification_method_t method)
+{
+	image_method = method;
+	image_method_overrides = TRUE;
+	verification_method = method;
+}
+
 /*
  * Check whether the binary signature or hash are present in db or MokList
  */
-static EFI_STATUS check_allowlist (WIN_CERTIFICATE_EFI_PKCS *cert,
+static EFI_STATUS check_allowlist (authenticode_t *auth,
 				   UINT8 *sha256hash, UINT8 *sha1hash)
 {
 	if (!ignore_db) {
-		if (check_db_hash(L"db", EFI_SECURE_BOOT_DB_GUID, sha256hash, SHA256_DIGEST_SIZE,
-					EFI_CERT_SHA256_GUID) == DATA_FOUND) {
+		if (check_db_hash(L"db", EFI_SECURE_BOOT_DB_GUID, sha256hash,
+				  EFI_CERT_SHA256_GUID) == DATA_FOUND) {
 			update_verification_method(VERIFIED_BY_HASH);
 			return EFI_SUCCESS;
 		} else {
 			LogError(L"check_db_hash(db, sha256hash) != DATA_FOUND\n");
 		}
-		if (check_db_hash(L"db", EFI_SECURE_BOOT_DB_GUID, sha1hash, SHA1_DIGEST_SIZE,
-					EFI_CERT_SHA1_GUID) == DATA_FOUND) {
-			verification_method = VERIFIED_BY_HASH;
-			update_verification_method(VERIFIED_BY_HASH);
+		if (check_db_hash(L"db", EFI_SECURE_BOOT_DB_GUID, sha1hash,
+				  EFI_CERT_SHA1_GUID) == DATA_FOUND) {
+			set_verification_method(VERIFIED_BY_HASH);
 			return EFI_SUCCESS;
 		} else {
 			LogError(L"check_db_hash(db, sha1hash) != DATA_FOUND\n");
 		}
-		if (cert && check_db_cert(L"db", EFI_SECURE_BOOT_DB_GUID, cert, sha256hash)
+		if (auth && check_db_cert(L"db", EFI_SECURE_BOOT_DB_GUID, auth, sha256hash)
 					== DATA_FOUND) {
-			verification_method = VERIFIED_BY_CERT;
-			update_verification_method(VERIFIED_BY_CERT);
+			set_verification_method(VERIFIED_BY_CERT);
 			return EFI_SUCCESS;
-		} else if (cert) {
+		} else if (auth) {
 			LogError(L"check_db_cert(db, sha256hash) != DATA_FOUND\n");
 		}
 	}
 
 #if defined(VENDOR_DB_FILE)
-	EFI_SIGNATURE_LIST *db = (EFI_SIGNATURE_LIST *)vendor_db;
+	static sigdb_t vendor_db_index;
+	sigdb_t *db = vendor_sigdb(&vendor_db_index, (UINT8 *)vendor_db,
+				   vendor_db_size);
 
-	if (check_db_hash_in_ram(db, vendor_db_size,
-				 sha256hash, SHA256_DIGEST_SIZE,
-				 EFI_CERT_SHA256_GUID, L"vendor_db",
+	if (check_db_hash_in_ram(db, sha256hash, EFI_CERT_SHA256_GUID,
+				 L"vendor_db",
 				 EFI_SECURE_BOOT_DB_GUID) == DATA_FOUND) {
-		verification_method = VERIFIED_BY_HASH;
-		update_verification_method(VERIFIED_BY_HASH);
+		set_verification_method(VERIFIED_BY_HASH);
 		return EFI_SUCCESS;
 	} else {
 		LogError(L"check_db_hash(vendor_db, sha256hash) != DATA_FOUND\n");
 	}
-	if (cert &&
-	    check_db_cert_in_ram(db, vendor_db_size,
-				 cert, sha256hash, L"vendor_db",
+	if (auth &&
+	    check_db_cert_in_ram(db, auth, sha256hash, L"vendor_db",
 				 EFI_SECURE_BOOT_DB_GUID) == DATA_FOUND) {
-		verification_method = VERIFIED_BY_CERT;
-		update_verification_method(VERIFIED_BY_CERT);
+		set_verification_method(VERIFIED_BY_CERT);
 		return EFI_SUCCESS;
-	} else if (cert) {
+	} else if (auth) {
 		LogError(L"check_db_cert(vendor_db, sha256hash) != DATA_FOUND\n");
 	}
 #endif
 
 	if (check_db_hash(L"MokList", SHIM_LOCK_GUID, sha256hash,
-			  SHA256_DIGEST_SIZE, EFI_CERT_SHA256_GUID)
+			  EFI_CERT_SHA256_GUID)
 				== DATA_FOUND) {
-		verification_method = VERIFIED_BY_HASH;
-		update_verification_method(VERIFIED_BY_HASH);
+		set_verification_method(VERIFIED_BY_HASH);
 		return EFI_SUCCESS;
 	} else {
 		LogError(L"check_db_hash(MokList, sha256hash) != DATA_FOUND\n");
 	}
-	if (cert && check_db_cert(L"MokList", SHIM_LOCK_GUID, cert, sha256hash)
+	if (auth && check_db_cert(L"MokList", SHIM_LOCK_GUID, auth, sha256hash)
 			== DATA_FOUND) {
-		verification_method = VERIFIED_BY_CERT;
-		update_verification_method(VERIFIED_BY_CERT);
+		set_verification_method(VERIFIED_BY_CERT);
 		return EFI_SUCCESS;
-	} else if (cert) {
+	} else if (auth) {
 		LogError(L"check_db_cert(MokList, sha256hash) != DATA_FOUND\n");
 	}
 
@@ -480,19 +865,40 @@ static EFI_STATUS
 verify_one_signature(WIN_CERTIFICATE_EFI_PKCS *sig,
 		     UINT8 *sha256hash, UINT8 *sha1hash)
 {
+	CRYPTO_MEM_STATS before, after;
+	authenticode_t authenticode, *auth = NULL;
+	UINTN avoided = verifications_avoided;
 	EFI_STATUS efi_status;
 
+	CryptoMemGetStats(&before);
+
+	/*
+	 * Decode the signature once for every certificate we try it
+	 * against.  If it can't be decoded no certificate can match, which
+	 * leaves only the hash checks, same as before.
+	 */
+	drain_openssl_errors();
+	authenticode.der = sig->CertData;
+	authenticode.size = sig->Hdr.dwLength - sizeof(sig->Hdr);
+	authenticode.decoded = AuthenticodeParse(authenticode.der,
+						 authenticode.size);
+	if (authenticode.decoded) {
+		auth = &authenticode;
+	} else {
+		dprint(L"AuthenticodeParse() failed\n");
+	}
+
 	/*
 	 * Ensure that the binary isn't forbidden
 	 */
 	drain_openssl_errors();
-	efi_status = check_denylist(sig, sha256hash, sha1hash);
+	efi_status = check_denylist(auth, sha256hash, sha1hash);
 	if (EFI_ERROR(efi_status)) {
 		perror(L"Binary is forbidden: %r\n", efi_status);
 		PrintErrors();
 		ClearErrors();
 		crypterr(efi_status);
-		return efi_status;
+		goto out;
 	}
 
 	/*
@@ -500,7 +906,7 @@ verify_one_signature(WIN_CERTIFICATE_EFI_PKCS *sig,
 	 * databases
 	 */
 	drain_openssl_errors();
-	efi_status = check_allowlist(sig, sha256hash, sha1hash);
+	efi_status = check_allowlist(auth, sha256hash, sha1hash);
 	if (EFI_ERROR(efi_status)) {
 		if (efi_status != EFI_NOT_FOUND) {
 			dprint(L"check_allowlist(): %r\n", efi_status);
@@ -510,7 +916,7 @@ verify_one_signature(WIN_CERTIFICATE_EFI_PKCS *sig,
 		}
 	} else {
 		drain_openssl_errors();
-		return efi_status;
+		goto out;
 	}
 
 	efi_status = EFI_NOT_FOUND;
@@ -522,18 +928,16 @@ verify_one_signature(WIN_CERTIFICATE_EFI_PKCS *sig,
 	if (build_cert && build_cert_size) {
 		dprint("verifying against shim cert\n");
 	}
-	if (build_cert && build_cert_size &&
-	    AuthenticodeVerify(sig->CertData,
-		       sig->Hdr.dwLength - sizeof(sig->Hdr),
-		       build_cert, build_cert_size, sha256hash,
-		       SHA256_DIGEST_SIZE)) {
+	if (auth && build_cert && build_cert_size &&
+	    verify_with_anchor(auth, build_cert, build_cert_size,
+			       sha256hash)) {
 		dprint(L"AuthenticodeVerify(shim_cert) succeeded\n");
 		update_verification_method(VERIFIED_BY_CERT);
-		tpm_measure_variable(L"Shim", SHIM_LOCK_GUID,
-				     build_cert_size, build_cert);
+		measure_match(L"Shim", SHIM_LOCK_GUID, build_cert_size,
+			      build_cert);
 		efi_status = EFI_SUCCESS;
 		drain_openssl_errors();
-		return efi_status;
+		goto out;
 	} else {
 		dprint(L"AuthenticodeVerify(shim_cert) failed\n");
 		PrintErrors();
@@ -550,18 +954,16 @@ verify_one_signature(WIN_CERTIFICATE_EFI_PKCS *sig,
 	if (vendor_cert_size) {
 		dprint("verifying against vendor_cert\n");
 	}
-	if (vendor_cert_size &&
-	    AuthenticodeVerify(sig->CertData,
-			       sig->Hdr.dwLength - sizeof(sig->Hdr),
-			       vendor_cert, vendor_cert_size,
-			       sha256hash, SHA256_DIGEST_SIZE)) {
+	if (auth && vendor_cert_size &&
+	    verify_with_anchor(auth, vendor_cert, vendor_cert_size,
+			       sha256hash)) {
 		dprint(L"AuthenticodeVerify(vendor_cert) succeeded\n");
 		update_verification_method(VERIFIED_BY_CERT);
-		tpm_measure_variable(L"Shim", SHIM_LOCK_GUID,
-				     vendor_cert_size, vendor_cert);
+		measure_match(L"Shim", SHIM_LOCK_GUID, vendor_cert_size,
+			      vendor_cert);
 		efi_status = EFI_SUCCESS;
 		drain_openssl_errors();
-		return efi_status;
+		goto out;
 	} else {
 		dprint(L"AuthenticodeVerify(vendor_cert) failed\n");
 		PrintErrors();
@@ -570,41 +972,33 @@ verify_one_signature(WIN_CERTIFICATE_EFI_PKCS *sig,
 	}
 #endif /* defined(VENDOR_CERT_FILE) */
 
+out:
+	AuthenticodeFree(authenticode.decoded);
+
+	dprint(L"%lu verifications skipped as certs couldn't be in the chain\n",
+	       verifications_avoided - avoided);
+	CryptoMemGetStats(&after);
+	dprint(L"OpenSSL made %lu allocations, %lu from the firmware, peak %lu bytes\n",
+	       after.Allocations - before.Allocations,
+	       after.PoolAllocations - before.PoolAllocations,
+	       after.PeakBytes);
 	return efi_status;
 }
 
 /*
- * Check that the signature is valid and matches the binary
+ * Check that the signature is valid and matches the binary.  certs is
+ * its certificate table, of which certs_size bytes are in the file.
  */
-EFI_STATUS
-verify_buffer (char *data, int datasize,
-	       PE_COFF_LOADER_IMAGE_CONTEXT *context,
-	       UINT8 *sha256hash, UINT8 *sha1hash)
+static EFI_STATUS
+verify_signatures (pe_image_t *image, UINT8 *certs, UINTN certs_size,
+		   UINT8 *sha256hash, UINT8 *sha1hash)
 {
+	PE_COFF_LOADER_IMAGE_CONTEXT *context = &image->context;
 	EFI_STATUS ret_efi_status;
-	size_t size = datasize;
+	size_t size = image->datasize;
 	size_t offset = 0;
 	unsigned int i = 0;
 
-	if (datasize < 0)
-		return EFI_INVALID_PARAMETER;
-
-	/*
-	 * Clear OpenSSL's error log, because we get some DSO unimplemented
-	 * errors during its intialization, and we don't want those to look
-	 * like they're the reason for validation failures.
-	 */
-	drain_openssl_errors();
-
-	ret_efi_status = generate_hash(data, datasize, context, sha256hash, sha1hash);
-	if (EFI_ERROR(ret_efi_status)) {
-		dprint(L"generate_hash: %r\n", ret_efi_status);
-		PrintErrors();
-		ClearErrors();
-		crypterr(ret_efi_status);
-		return ret_efi_status;
-	}
-
 	/*
 	 * Ensure that the binary isn't forbidden by hash
 	 */
@@ -655,20 +1049,19 @@ verify_buffer (char *data, int datasize,
 		WIN_CERTIFICATE_EFI_PKCS *sig = NULL;
 		size_t sz;
 
-		sig = ImageAddress(data, size,
-				   context->SecDir->VirtualAddress + offset);
-		if (!sig)
+		if (!certs || offset >= certs_size)
 			break;
+		sig = (WIN_CERTIFICATE_EFI_PKCS *)(certs + offset);
 
 		sz = offset + offsetof(WIN_CERTIFICATE_EFI_PKCS, Hdr.dwLength)
 		     + sizeof(sig->Hdr.dwLength);
-		if (sz > context->SecDir->Size) {
+		if (sz > certs_size) {
 			perror(L"Certificate size is too large for secruity database");
 			return EFI_INVALID_PARAMETER;
 		}
 
 		sz = sig->Hdr.dwLength;
-		if (sz > context->SecDir->Size - offset) {
+		if (sz > certs_size - offset) {
 			perror(L"Certificate size is too large for secruity database");
 			return EFI_INVALID_PARAMETER;
 		}
@@ -700,7 +1093,7 @@ verify_buffer (char *data, int datasize,
 				sig->Hdr.wCertificateType);
 		}
 		offset = ALIGN_VALUE(offset + sz, 8);
-	} while (offset < context->SecDir->Size);
+	} while (offset < certs_size);
 
 	if (ret_efi_status != EFI_SUCCESS) {
 		dprint(L"Binary is not authorized\n");
@@ -713,6 +1106,81 @@ verify_buffer (char *data, int datasize,
 	return ret_efi_status;
 }
 
+/*
+ * Check that the signature is valid and matches the binary whose
+ * Authenticode digests are sha256hash and sha1hash, unless we already
+ * know the answer.
+ */
+static EFI_STATUS
+verify_image (pe_image_t *image, UINT8 *certs, UINTN certs_size,
+	      UINT8 *sha256hash, UINT8 *sha1hash)
+{
+	EFI_STATUS efi_status;
+	verification_method_t method;
+	UINT8 certs_hash[SHA256_DIGEST_SIZE];
+	BOOLEAN cacheable, overrides;
+
+	/*
+	 * Clear OpenSSL's error log, because we get some DSO unimplemented
+	 * errors during its intialization, and we don't want those to look
+	 * like they're the reason for validation failures.
+	 */
+	drain_openssl_errors();
+
+	/*
+	 * Certificate matches are measured when the caller reaches a sync
+	 * point, rather than one firmware call each as we find them.
+	 */
+	tpm_queue_measurements();
+
+	/*
+	 * The verdict depends on the signatures as well as the code, and
+	 * the Authenticode digest doesn't cover them.
+	 */
+	cacheable = Sha256HashAll(certs, certs_size, certs_hash);
+	if (cacheable &&
+	    vcache_lookup(sha256hash, certs_hash, &efi_status, &method,
+			  &overrides)) {
+		dprint(L"Already verified: %r\n", efi_status);
+		if (EFI_ERROR(efi_status))
+			return efi_status;
+		if (overrides)
+			set_verification_method(method);
+		else
+			update_verification_method(method);
+		return efi_status;
+	}
+
+	if (cacheable)
+		vcache_start(sha256hash, certs_hash);
+	image_method = VERIFIED_BY_NOTHING;
+	image_method_overrides = FALSE;
+	efi_status = verify_signatures(image, certs, certs_size, sha256hash,
+				       sha1hash);
+	vcache_finish(efi_status, image_method, image_method_overrides);
+
+	return efi_status;
+}
+
+EFI_STATUS
+verify_buffer (char *data, int datasize, pe_image_t *image,
+	       UINT8 *sha256hash, UINT8 *sha1hash)
+{
+	EFI_IMAGE_DATA_DIRECTORY *SecDir = image->context.SecDir;
+	UINT8 *certs;
+	UINTN certs_size = 0;
+
+	if (datasize < 0)
+		return EFI_INVALID_PARAMETER;
+
+	certs = ImageAddress(data, datasize, SecDir->VirtualAddress);
+	if (certs)
+		certs_size = MIN(SecDir->Size,
+				 (UINTN)datasize - SecDir->VirtualAddress);
+
+	return verify_image(image, certs, certs_size, sha256hash, sha1hash);
+}
+
 static int
 should_use_fallback(EFI_HANDLE image_handle)
 {
@@ -882,10 +1350,87 @@ error:
 }
 
 /*
- * Open the second stage bootloader and read it into a buffer
+ * An image being hashed as load_image() reads it
+ */
+typedef struct {
+	unsigned int datasize;
+	pe_image_t *image;
+	image_digest_t id;
+	BOOLEAN hashing;
+	BOOLEAN failed;
+} image_stream_t;
+
+/*
+ * loader_read() consumer: once the headers are in, work out what gets
+ * hashed, and then hash each part of the file as soon as it's arrived.
+ * If anything about that doesn't work out, just stop; handle_image()
+ * hashes the whole file afterwards, and complains about it properly.
+ */
+static EFI_STATUS
+hash_as_read(void *ctx, UINT8 *buffer, UINTN available)
+{
+	image_stream_t *stream = ctx;
+	PE_COFF_LOADER_IMAGE_CONTEXT context;
+	EFI_STATUS efi_status;
+	UINTN headers;
+
+	if (stream->failed)
+		return EFI_SUCCESS;
+
+	if (!stream->hashing) {
+		headers = loader_headers_size(buffer, available);
+		if (headers == 0) {
+			stream->failed = TRUE;
+			return EFI_SUCCESS;
+		}
+		if (headers > available)
+			return EFI_SUCCESS;
+
+		efi_status = read_header(buffer, stream->datasize, &context);
+		if (EFI_ERROR(efi_status) ||
+		    (UINT8 *)(context.FirstSection +
+			      context.NumberOfSections) >
+		    buffer + available) {
+			stream->failed = TRUE;
+			return EFI_SUCCESS;
+		}
+
+		efi_status = pe_image_init(stream->image, buffer,
+					   stream->datasize, &context);
+		if (EFI_ERROR(efi_status)) {
+			stream->failed = TRUE;
+			return EFI_SUCCESS;
+		}
+
+		efi_status = image_digest_init(&stream->id, stream->image,
+					       digest_plan(), NULL);
+		if (EFI_ERROR(efi_status)) {
+			stream->failed = TRUE;
+			return EFI_SUCCESS;
+		}
+		stream->hashing = TRUE;
+	}
+
+	efi_status = image_digest_update(&stream->id, available);
+	if (EFI_ERROR(efi_status)) {
+		image_digest_free(&stream->id);
+		stream->hashing = FALSE;
+		stream->failed = TRUE;
+	}
+
+	return EFI_SUCCESS;
+}
+
+/*
+ * Open the second stage bootloader and read it into a buffer.  If its
+ * headers can be worked out while it's read, image describes it, and if
+ * it can be hashed while it's read, its digests are returned too;
+ * otherwise image->data is NULL or digests->algs is 0.
  */
 static EFI_STATUS load_image (EFI_LOADED_IMAGE *li, void **data,
-			      int *datasize, CHAR16 *PathName)
+			      int *datasize, UINTN *datapages,
+			      pe_image_t *image, digest_set_t *digests,
+			      CHAR16 *PathName)
 {
 	EFI_STATUS efi_status;
 	EFI_HANDLE device;
@@ -893,6 +1438,15 @@ static EFI_STATUS load_image (EFI_LOADED_IMAGE *li, void **data,
 	EFI_FILE_IO_INTERFACE *drive;
 	EFI_FILE *root, *grub;
 	UINTN buffersize = sizeof(EFI_FILE_INFO);
+	EFI_PHYSICAL_ADDRESS address;
+	UINT8 *header = NULL;
+	UINTN headersize, readsize;
+	image_stream_t stream;
+
+	*datapages = 0;
+	ZeroMem(digests, sizeof(*digests));
+	ZeroMem(&stream, sizeof(stream));
+	stream.image = image;
 
 	device = li->DeviceHandle;
 
@@ -954,38 +1508,79 @@ static EFI_STATUS load_image (EFI_LOADED_IMAGE *li, void **data,
 	}
 
 	buffersize = fileinfo->FileSize;
-	*data = AllocatePool(buffersize);
-	if (!*data) {
+
+	/*
+	 * Read the headers first, so the file can go straight into pages
+	 * with room for the whole image; if it's laid out the way it will
+	 * be in memory, handle_image() can then run it right there.
+	 */
+	headersize = MIN(buffersize, LOADER_HEADER_SIZE);
+	header = AllocatePool(headersize ? headersize : 1);
+	if (!header) {
+		perror(L"Unable to allocate file buffer\n");
+		efi_status = EFI_OUT_OF_RESOURCES;
+		goto error;
+	}
+
+	readsize = headersize;
+	efi_status = grub->Read(grub, &readsize, header);
+	if (EFI_ERROR(efi_status) || readsize != headersize) {
+		perror(L"Unexpected return from initial read: %r, buffersize %x\n",
+		       efi_status, readsize);
+		if (!EFI_ERROR(efi_status))
+			efi_status = EFI_LOAD_ERROR;
+		goto error;
+	}
+
+	*datapages = loader_file_pages(header, headersize, buffersize);
+	efi_status = gBS->AllocatePages(AllocateAnyPages, EfiLoaderCode,
+					*datapages, &address);
+	if (EFI_ERROR(efi_status)) {
 		perror(L"Unable to allocate file buffer\n");
+		*datapages = 0;
 		efi_status = EFI_OUT_OF_RESOURCES;
 		goto error;
 	}
+	*data = (void *)(UINTN)address;
+	CopyMem(*data, header, headersize);
 
 	/*
-	 * Perform the actual read
+	 * Perform the actual read, hashing what's already arrived while
+	 * the rest of it is on its way
 	 */
-	efi_status = grub->Read(grub, &buffersize, *data);
-	if (efi_status == EFI_BUFFER_TOO_SMALL) {
-		FreePool(*data);
-		*data = AllocatePool(buffersize);
-		efi_status = grub->Read(grub, &buffersize, *data);
-	}
+	stream.datasize = buffersize;
+	efi_status = loader_read(grub, *data, headersize, buffersize, 0,
+				 hash_as_read, &stream);
 	if (EFI_ERROR(efi_status)) {
 		perror(L"Unexpected return from initial read: %r, buffersize %x\n",
 		       efi_status, buffersize);
 		goto error;
 	}
 
+	if (stream.hashing) {
+		efi_status = image_digest_final(&stream.id, digests);
+		if (EFI_ERROR(efi_status))
+			ZeroMem(digests, sizeof(*digests));
+		image_digest_free(&stream.id);
+	}
+
 	*datasize = buffersize;
 
+	FreePool(header);
 	FreePool(fileinfo);
 
 	return EFI_SUCCESS;
 error:
+	if (stream.hashing)
+		image_digest_free(&stream.id);
+	pe_image_free(image);
 	if (*data) {
-		FreePool(*data);
+		gBS->FreePages((EFI_PHYSICAL_ADDRESS)(UINTN)*data, *datapages);
 		*data = NULL;
+		*datapages = 0;
 	}
+	if (header)
+		FreePool(header);
 
 	if (fileinfo)
 		FreePool(fileinfo);
@@ -993,37 +1588,117 @@ error:
 }
 
 /*
- * Protocol entry point. If secure boot is enabled, verify that the provided
- * buffer is signed with a trusted key.
+ * SHIM_LOCK2 entry points.  A session is hashed as it's handed over, and
+ * measured and verified once, at Final().
  */
-EFI_STATUS shim_verify (void *buffer, UINT32 size)
+static EFI_STATUS EFIAPI
+shim_lock2_init (UINT32 size, VOID **handle)
 {
-	EFI_STATUS efi_status = EFI_SUCCESS;
-	PE_COFF_LOADER_IMAGE_CONTEXT context;
-	UINT8 sha1hash[SHA1_DIGEST_SIZE];
-	UINT8 sha256hash[SHA256_DIGEST_SIZE];
+	session_t *session = NULL;
+	EFI_STATUS efi_status;
 
-	if ((INT32)size < 0)
+	if (!handle)
+		return EFI_INVALID_PARAMETER;
+
+	in_protocol = 1;
+	efi_status = session_init(&session, size, digest_plan());
+	in_protocol = 0;
+
+	*handle = session;
+	return efi_status;
+}
+
+static EFI_STATUS EFIAPI
+shim_lock2_update (VOID *handle, VOID *data, UINTN size)
+{
+	EFI_STATUS efi_status;
+
+	if (!handle || (!data && size))
 		return EFI_INVALID_PARAMETER;
 
-	loader_is_participating = 1;
 	in_protocol = 1;
+	efi_status = session_update(handle, data, size);
+	in_protocol = 0;
+
+	return efi_status;
+}
+
+static VOID EFIAPI
+shim_lock2_abort (VOID *handle)
+{
+	session_free(handle);
+}
+
+/*
+ * A TPM 2 or the CC protocol measures the buffer Final() is given by
+ * hashing it again, so it has to be the image whose digests were just
+ * checked.
+ */
+static EFI_STATUS
+check_measured_buffer (VOID *buffer, UINT32 size, digest_set_t *digests)
+{
+	pe_image_t image = { 0, };
+	digest_set_t check;
+	EFI_STATUS efi_status;
+
+	if (!buffer) {
+		perror(L"Cannot measure an image that isn't in memory\n");
+		return EFI_INVALID_PARAMETER;
+	}
 
-	efi_status = read_header(buffer, size, &context);
+	efi_status = pe_image_init(&image, buffer, size, NULL);
+	if (!EFI_ERROR(efi_status))
+		efi_status = pe_image_digests(&image, DIGEST_SHA256, &check);
+	pe_image_free(&image);
 	if (EFI_ERROR(efi_status))
-		goto done;
+		return efi_status;
+
+	if (CompareMem(check.sha256, digests->sha256, SHA256_DIGEST_SIZE)) {
+		perror(L"Buffer doesn't match the image that was verified\n");
+		return EFI_SECURITY_VIOLATION;
+	}
+	return EFI_SUCCESS;
+}
+
+/*
+ * If secure boot is enabled, verify that the image is signed with a
+ * trusted key.
+ */
+static EFI_STATUS EFIAPI
+shim_lock2_final (VOID *handle, VOID *buffer, SHIM_LOCK2_DIGESTS *result)
+{
+	session_t *session = handle;
+	EFI_STATUS efi_status;
+	digest_set_t digests;
+
+	if (!session)
+		return EFI_INVALID_PARAMETER;
 
-	efi_status = generate_hash(buffer, size, &context,
-				   sha256hash, sha1hash);
+	loader_is_participating = 1;
+	in_protocol = 1;
+
+	efi_status = session_final(session, &digests);
 	if (EFI_ERROR(efi_status))
 		goto done;
 
+	if (result) {
+		CopyMem(result->Sha256, digests.sha256, SHA256_DIGEST_SIZE);
+		CopyMem(result->Sha1, digests.sha1, SHA1_DIGEST_SIZE);
+	}
+
+	if (tpm_measures_image()) {
+		efi_status = check_measured_buffer(buffer, session->datasize,
+						   &digests);
+		if (EFI_ERROR(efi_status))
+			goto done;
+	}
+
 	/* Measure the binary into the TPM */
 #ifdef REQUIRE_TPM
 	efi_status =
 #endif
-	tpm_log_pe((EFI_PHYSICAL_ADDRESS)(UINTN)buffer, size, 0, NULL,
-		   sha1hash, 4);
+	tpm_log_pe((EFI_PHYSICAL_ADDRESS)(UINTN)buffer, session->datasize, 0,
+		   NULL, &digests, 4);
 #ifdef REQUIRE_TPM
 	if (EFI_ERROR(efi_status))
 		goto done;
@@ -1034,25 +1709,150 @@ EFI_STATUS shim_verify (void *buffer, UINT32 size)
 		goto done;
 	}
 
-	efi_status = verify_buffer(buffer, size,
-				   &context, sha256hash, sha1hash);
+	efi_status = verify_image(&session->image, session->certs,
+				  session->certs_size, digests.sha256,
+				  digests.sha1);
 done:
+	session_free(session);
+	tpm_flush_measurements();
 	in_protocol = 0;
 	return efi_status;
 }
 
+/*
+ * Verify several whole images at once.  Their digests are calculated
+ * together, and then each is measured and checked as Final() would.
+ */
+static EFI_STATUS EFIAPI
+shim_lock2_verify_batch (UINTN count, VOID **buffers, UINT32 *sizes,
+			 EFI_STATUS *statuses)
+{
+	pe_image_t *images = NULL;
+	digest_set_t *digests = NULL;
+	EFI_STATUS *verdicts = NULL;
+	EFI_STATUS efi_status, ret = EFI_SUCCESS;
+	UINTN i;
+
+	if (!count || !buffers || !sizes)
+		return EFI_INVALID_PARAMETER;
+
+	images = AllocateZeroPool(count * sizeof(*images));
+	digests = AllocateZeroPool(count * sizeof(*digests));
+	verdicts = AllocateZeroPool(count * sizeof(*verdicts));
+	if (!images || !digests || !verdicts) {
+		ret = EFI_OUT_OF_RESOURCES;
+		goto out;
+	}
+
+	loader_is_participating = 1;
+	in_protocol = 1;
+
+	for (i = 0; i < count; i++) {
+		if (!buffers[i]) {
+			verdicts[i] = EFI_INVALID_PARAMETER;
+			continue;
+		}
+		verdicts[i] = pe_image_init(&images[i], buffers[i], sizes[i],
+					    NULL);
+		if (EFI_ERROR(verdicts[i]))
+			pe_image_free(&images[i]);
+	}
+
+	efi_status = pe_images_digests(images, count, digest_plan(), digests);
+
+	for (i = 0; i < count; i++) {
+		if (EFI_ERROR(verdicts[i]))
+			goto next;
+		verdicts[i] = efi_status;
+		if (EFI_ERROR(verdicts[i]))
+			goto next;
+
+		/* Measure the binary into the TPM */
+#ifdef REQUIRE_TPM
+		verdicts[i] =
+#endif
+		tpm_log_pe((EFI_PHYSICAL_ADDRESS)(UINTN)buffers[i], sizes[i],
+			   0, NULL, &digests[i], 4);
+#ifdef REQUIRE_TPM
+		if (EFI_ERROR(verdicts[i]))
+			goto next;
+#endif
+
+		if (secure_mode())
+			verdicts[i] = verify_buffer(buffers[i], sizes[i],
+						    &images[i],
+						    digests[i].sha256,
+						    digests[i].sha1);
+next:
+		if (EFI_ERROR(verdicts[i]) && !EFI_ERROR(ret))
+			ret = verdicts[i];
+		pe_image_free(&images[i]);
+	}
+
+	if (statuses)
+		CopyMem(statuses, verdicts, count * sizeof(*verdicts));
+
+	tpm_flush_measurements();
+	in_protocol = 0;
+out:
+	if (images)
+		FreePool(images);
+	if (digests)
+		FreePool(digests);
+	if (verdicts)
+		FreePool(verdicts);
+	return ret;
+}
+
+/*
+ * Protocol entry point. If secure boot is enabled, verify that the provided
+ * buffer is signed with a trusted key.
+ */
+EFI_STATUS shim_verify (void *buffer, UINT32 size)
+{
+	EFI_STATUS efi_status;
+	VOID *session;
+
+	efi_status = shim_lock2_init(size, &session);
+	if (EFI_ERROR(efi_status))
+		return efi_status;
+
+	efi_status = shim_lock2_update(session, buffer, size);
+	if (EFI_ERROR(efi_status)) {
+		shim_lock2_abort(session);
+		return efi_status;
+	}
+
+	return shim_lock2_final(session, buffer, NULL);
+}
+
+/*
+ * context is what Context() found in the same data, which is what the
+ * session finds there too.
+ */
 static EFI_STATUS shim_hash (char *data, int datasize,
 			     PE_COFF_LOADER_IMAGE_CONTEXT *context,
 			     UINT8 *sha256hash, UINT8 *sha1hash)
 {
+	session_t *session = NULL;
+	digest_set_t digests;
 	EFI_STATUS efi_status;
 
 	if (datasize < 0)
 		return EFI_INVALID_PARAMETER;
 
 	in_protocol = 1;
-	efi_status = generate_hash(data, datasize, context,
-				   sha256hash, sha1hash);
+	efi_status = session_init(&session, datasize,
+				  DIGEST_SHA1 | DIGEST_SHA256);
+	if (!EFI_ERROR(efi_status))
+		efi_status = session_update(session, data, datasize);
+	if (!EFI_ERROR(efi_status))
+		efi_status = session_final(session, &digests);
+	if (!EFI_ERROR(efi_status)) {
+		CopyMem(sha256hash, digests.sha256, SHA256_DIGEST_SIZE);
+		CopyMem(sha1hash, digests.sha1, SHA1_DIGEST_SIZE);
+	}
+	session_free(session);
 	in_protocol = 0;
 
 	return efi_status;
@@ -1089,13 +1889,16 @@ EFI_STATUS start_image(EFI_HANDLE image_handle, CHAR16 *ImagePath)
 {
 	EFI_STATUS efi_status;
 	EFI_IMAGE_ENTRY_POINT entry_point;
-	EFI_PHYSICAL_ADDRESS alloc_address;
+	EFI_PHYSICAL_ADDRESS alloc_address = 0;
 	UINTN alloc_pages;
 	CHAR16 *PathName = NULL;
 	void *sourcebuffer = NULL;
 	UINT64 sourcesize = 0;
 	void *data = NULL;
 	int datasize = 0;
+	UINTN datapages = 0;
+	pe_image_t image = { 0, };
+	digest_set_t file_digests = { 0, };
 
 	/*
 	 * We need to refer to the loaded image protocol on the running
@@ -1148,7 +1951,8 @@ EFI_STATUS start_image(EFI_HANDLE image_handle, CHAR16 *ImagePath)
 		/*
 		 * Read the new executable off disk
 		 */
-		efi_status = load_image(shim_li, &data, &datasize, PathName);
+		efi_status = load_image(shim_li, &data, &datasize, &datapages,
+					&image, &file_digests, PathName);
 		if (EFI_ERROR(efi_status)) {
 			perror(L"Failed to load image %s: %r\n",
 			       PathName, efi_status);
@@ -1182,8 +1986,11 @@ EFI_STATUS start_image(EFI_HANDLE image_handle, CHAR16 *ImagePath)
 	/*
 	 * Verify and, if appropriate, relocate and execute the executable
 	 */
-	efi_status = handle_image(data, datasize, shim_li, &entry_point,
-				  &alloc_address, &alloc_pages);
+	efi_status = handle_image(data, datasize, datapages, shim_li,
+				  &entry_point, &alloc_address, &alloc_pages,
+				  &image, file_digests.algs ? &file_digests : NULL);
+	pe_image_free(&image);
+	tpm_flush_measurements();
 	if (EFI_ERROR(efi_status)) {
 		perror(L"Failed to load image: %r\n", efi_status);
 		PrintErrors();
@@ -1191,6 +1998,15 @@ EFI_STATUS start_image(EFI_HANDLE image_handle, CHAR16 *ImagePath)
 		goto restore;
 	}
 
+	/*
+	 * If it runs where it was read, the file buffer is the image now,
+	 * and stays allocated like a copied image does.
+	 */
+	if (alloc_address == (EFI_PHYSICAL_ADDRESS)(UINTN)data) {
+		data = NULL;
+		datapages = 0;
+	}
+
 	loader_is_participating = 0;
 
 	/*
@@ -1198,14 +2014,26 @@ EFI_STATUS start_image(EFI_HANDLE image_handle, CHAR16 *ImagePath)
 	 */
 	efi_status = entry_point(image_handle, systab);
 
+	/*
+	 * Whatever just ran (MokManager, for one) may have changed the
+	 * signature databases without going through us
+	 */
+	sigdb_invalidate();
+
 restore:
 	restore_loaded_image();
 done:
+	pe_image_free(&image);
 	if (PathName)
 		FreePool(PathName);
 
-	if (data)
-		FreePool(data);
+	if (data) {
+		if (datapages)
+			gBS->FreePages((EFI_PHYSICAL_ADDRESS)(UINTN)data,
+				       datapages);
+		else
+			FreePool(data);
+	}
 
 	return efi_status;
 }
@@ -1604,47 +2432,23 @@ EFI_STATUS set_second_stage (EFI_HANDLE image_handle)
 	return EFI_SUCCESS;
 }
 
-static void *
-ossl_malloc(size_t num)
-{
-	return AllocatePool(num);
-}
-
-static void
-ossl_free(void *addr)
-{
-	FreePool(addr);
-}
-
 static void
 init_openssl(void)
 {
-	CRYPTO_set_mem_functions(ossl_malloc, NULL, ossl_free);
+	/*
+	 * OpenSSL allocates with Cryptlib's malloc(), realloc() and free(),
+	 * which are CryptoMemAlloc() and friends.
+	 */
 	OPENSSL_init();
-	CRYPTO_set_mem_functions(ossl_malloc, NULL, ossl_free);
-	ERR_load_ERR_strings();
-	ERR_load_BN_strings();
-	ERR_load_RSA_strings();
-	ERR_load_DH_strings();
-	ERR_load_EVP_strings();
-	ERR_load_BUF_strings();
-	ERR_load_OBJ_strings();
-	ERR_load_PEM_strings();
-	ERR_load_X509_strings();
-	ERR_load_ASN1_strings();
-	ERR_load_CONF_strings();
-	ERR_load_CRYPTO_strings();
-	ERR_load_COMP_strings();
-	ERR_load_BIO_strings();
-	ERR_load_PKCS7_strings();
-	ERR_load_X509V3_strings();
-	ERR_load_PKCS12_strings();
-	ERR_load_RAND_strings();
-	ERR_load_DSO_strings();
-	ERR_load_OCSP_strings();
+	/* Error strings are loaded by print_crypto_errors() if it's called */
+
+	/* Once, for verify_eku() to look for on certificates we can't walk */
+	modsign_nid = OBJ_create(OID_EKU_MODSIGN, "modsign-eku",
+				 "modsign-eku");
 }
 
 static SHIM_LOCK shim_lock_interface;
+static SHIM_LOCK2 shim_lock2_interface;
 static EFI_HANDLE shim_lock_handle;
 
 EFI_STATUS
@@ -1687,6 +2491,19 @@ install_shim_protocols(void)
 		return efi_status;
 	}
 
+	efi_status = gBS->InstallProtocolInterface(&shim_lock_handle,
+						   &SHIM_LOCK2_GUID,
+						   EFI_NATIVE_INTERFACE,
+						   &shim_lock2_interface);
+	if (EFI_ERROR(efi_status)) {
+		console_error(L"Could not install security protocol",
+			      efi_status);
+		gBS->UninstallProtocolInterface(shim_lock_handle,
+						&SHIM_LOCK_GUID,
+						&shim_lock_interface);
+		return efi_status;
+	}
+
 	if (!secure_mode())
 		return EFI_SUCCESS;
 
@@ -1706,6 +2523,8 @@ uninstall_shim_protocols(void)
 	/*
 	 * If we're back here then clean everything up before exiting
 	 */
+	gBS->UninstallProtocolInterface(shim_lock_handle, &SHIM_LOCK2_GUID,
+					&shim_lock2_interface);
 	gBS->UninstallProtocolInterface(shim_lock_handle, &SHIM_LOCK_GUID,
 					&shim_lock_interface);
 
@@ -1749,6 +2568,18 @@ shim_init(void)
 
 	hook_exit(systab);
 
+	/*
+	 * Find the TPM and CC measurement protocols once rather than for
+	 * every event we log.
+	 */
+	tpm_backend_init();
+
+	/*
+	 * And work out which digests images need now, so the first one
+	 * doesn't pay for reading the signature databases.
+	 */
+	dprint(L"Image digests: 0x%x\n", digest_plan());
+
 	efi_status = install_shim_protocols();
 	if (EFI_ERROR(efi_status))
 		perror(L"install_shim_protocols() failed: %r\n", efi_status);
@@ -1761,6 +2592,7 @@ shim_fini(void)
 {
 	if (secure_mode())
 		cleanup_sbat_var(&sbat_var);
+	vcache_invalidate();
 
 	/*
 	 * Remove our protocols
@@ -1777,6 +2609,12 @@ shim_fini(void)
 
 	unhook_exit();
 
+	tpm_flush_measurements();
+	tpm_backend_fini();
+	sigdb_filter_free(&revocation_filter);
+	free_trust_anchors();
+	sigdb_invalidate();
+
 	/*
 	 * Free the space allocated for the alternative 2nd stage loader
 	 */
@@ -1913,6 +2751,12 @@ efi_main (EFI_HANDLE passed_image_handle, EFI_SYSTEM_TABLE *passed_systab)
 	shim_lock_interface.Verify = shim_verify;
 	shim_lock_interface.Hash = shim_hash;
 	shim_lock_interface.Context = shim_read_header;
+	shim_lock2_interface.Revision = SHIM_LOCK2_REVISION;
+	shim_lock2_interface.Init = shim_lock2_init;
+	shim_lock2_interface.Update = shim_lock2_update;
+	shim_lock2_interface.Final = shim_lock2_final;
+	shim_lock2_interface.Abort = shim_lock2_abort;
+	shim_lock2_interface.VerifyBatch = shim_lock2_verify_batch;
 
 	systab = passed_systab;
 	image_handle = global_image_handle = passed_image_handle;
@@ -1949,6 +2793,7 @@ efi_main (EFI_HANDLE passed_image_handle, EFI_SYSTEM_TABLE *passed_systab)
 
 		INIT_LIST_HEAD(&sbat_var);
 		efi_status = parse_sbat_var(&sbat_var);
+		vcache_invalidate();
 		if (EFI_ERROR(efi_status)) {
 			perror(L"Parsing %s variable failed: %r\n",
 				SBAT_VAR_NAME, efi_status);
@@ -1973,6 +2818,7 @@ efi_main (EFI_HANDLE passed_image_handle, EFI_SYSTEM_TABLE *passed_systab)
 	 * boot-services-only state variables are what we think they are.
 	 */
 	efi_status = import_mok_state(image_handle);
+	sigdb_invalidate();
 	if (!secure_mode() && efi_status == EFI_INVALID_PARAMETER) {
 		/*
 		 * Make copy failures fatal only if secure_mode is enabled, or
@@ -159,6 +159,8 @@
 #include "include/configtable.h"
 #include "include/console.h"
 #include "include/crypt_blowfish.h"
+#include "include/der.h"
+#include "include/digest.h"
 #include "include/efiauthenticated.h"
 #include "include/errors.h"
 #include "include/execute.h"
@@ -171,17 +173,21 @@
 #include "include/passwordcrypt.h"
 #include "include/peimage.h"
 #include "include/pe.h"
+#include "include/loader.h"
 #include "include/replacements.h"
 #include "include/sbat.h"
 #if defined(OVERRIDE_SECURITY_POLICY)
 #include "include/security_policy.h"
 #endif
+#include "include/session.h"
+#include "include/sigdb.h"
 #include "include/simple_file.h"
 #include "include/str.h"
 #include "include/tpm.h"
 #include "include/cc.h"
 #include "include/ucs2.h"
 #include "include/variables.h"
+#include "include/vcache.h"
 #include "include/hexdump.h"
 
 #include "version.h"
@@ -223,6 +229,81 @@ typedef struct _SHIM_LOCK {
 	EFI_SHIM_LOCK_CONTEXT Context;
 } SHIM_LOCK;
 
+/*
+ * SHIM_LOCK2 verifies an image the way SHIM_LOCK's Verify() does, but it
+ * doesn't have to be in one buffer: Init() starts a session for an image
+ * of Size bytes, Update() hands over each piece of it in order, and
+ * Final() measures it, returns its verdict and, if Digests isn't NULL,
+ * its Authenticode digests, and ends the session.  Abort() ends a
+ * session that isn't going to get to Final().
+ *
+ * If the caller still has the whole file in memory, it passes it to
+ * Final() as Buffer.  A TPM 2 or the CC protocol can only measure an image
+ * it can see, so where there is one, Final() fails without Buffer, or if
+ * Buffer's Authenticode digest isn't that of what Update() was given.
+ * Digests->Sha1 is all zeroes on a platform that has no use for SHA-1.
+ *
+ * VerifyBatch(), from revision 2 on, does what Verify() does for Count
+ * images already in memory, hashing them side by side.  Each image's
+ * verdict goes into Statuses, if it isn't NULL, and the first failure,
+ * if there is one, is what's returned.
+ */
+INTERFACE_DECL(_SHIM_LOCK2);
+
+#define SHIM_LOCK2_REVISION 2
+
+typedef struct {
+	UINT8 Sha256[SHA256_DIGEST_SIZE];
+	UINT8 Sha1[SHA1_DIGEST_SIZE];
+} SHIM_LOCK2_DIGESTS;
+
+typedef
+EFI_STATUS
+(EFIAPI *EFI_SHIM_LOCK2_INIT) (
+	IN UINT32 Size,
+	OUT VOID **Session
+	);
+
+typedef
+EFI_STATUS
+(EFIAPI *EFI_SHIM_LOCK2_UPDATE) (
+	IN VOID *Session,
+	IN VOID *Data,
+	IN UINTN Size
+	);
+
+typedef
+EFI_STATUS
+(EFIAPI *EFI_SHIM_LOCK2_FINAL) (
+	IN VOID *Session,
+	IN VOID *Buffer OPTIONAL,
+	OUT SHIM_LOCK2_DIGESTS *Digests OPTIONAL
+	);
+
+typedef
+VOID
+(EFIAPI *EFI_SHIM_LOCK2_ABORT) (
+	IN VOID *Session
+	);
+
+typedef
+EFI_STATUS
+(EFIAPI *EFI_SHIM_LOCK2_VERIFY_BATCH) (
+	IN UINTN Count,
+	IN VOID **Buffers,
+	IN UINT32 *Sizes,
+	OUT EFI_STATUS *Statuses OPTIONAL
+	);
+
+typedef struct _SHIM_LOCK2 {
+	UINT64 Revision;
+	EFI_SHIM_LOCK2_INIT Init;
+	EFI_SHIM_LOCK2_UPDATE Update;
+	EFI_SHIM_LOCK2_FINAL Final;
+	EFI_SHIM_LOCK2_ABORT Abort;
+	EFI_SHIM_LOCK2_VERIFY_BATCH VerifyBatch;
+} SHIM_LOCK2;
+
 extern EFI_STATUS shim_init(void);
 extern void shim_fini(void);
 extern EFI_STATUS EFIAPI LogError_(const char *file, int line, const char *func,
@@ -257,10 +338,16 @@ extern UINT32 load_options_size;
 BOOLEAN secure_mode (void);
 
 EFI_STATUS
-verify_buffer (char *data, int datasize,
-	       PE_COFF_LOADER_IMAGE_CONTEXT *context,
+verify_buffer (char *data, int datasize, pe_image_t *image,
 	       UINT8 *sha256hash, UINT8 *sha1hash);
 
+/*
+ * The DIGEST_* algorithms an image's Authenticode digests are needed in,
+ * by verification and by the measurement backends.
+ */
+UINT32
+digest_plan (void);
+
 #ifndef SHIM_UNIT_TEST
 #define perror_(file, line, func, fmt, ...) ({					\
 		UINTN __perror_ret = 0;						\
@@ -0,0 +1,553 @@
+// SPDX-License-Identifier: BSD-2-Clause-Patent
+/*
+ * sigdb.c - indexed lookups in EFI_SIGNATURE_LIST databases
+ */
+
+#include "shim.h"
+
+static struct {
+	EFI_GUID *type;
+	UINTN size;
+	UINT32 alg;
+} sigdb_hash_types[SIGDB_HASH_TYPES] = {
+	{ &EFI_CERT_SHA1_GUID, SHA1_DIGEST_SIZE, DIGEST_SHA1 },
+	{ &EFI_CERT_SHA256_GUID, SHA256_DIGEST_SIZE, DIGEST_SHA256 },
+	{ &EFI_CERT_SHA384_GUID, SHA384_DIGEST_SIZE, DIGEST_SHA384 },
+	{ &EFI_CERT_SHA512_GUID, SHA512_DIGEST_SIZE, DIGEST_SHA512 },
+};
+
+/*
+ * Step to the next list in the buffer, or the first one if list is
+ * NULL.  Stops at the first list that doesn't fit in what is left.
+ */
+static EFI_SIGNATURE_LIST *
+sigdb_next_list(sigdb_t *db, EFI_SIGNATURE_LIST *list)
+{
+	UINT8 *pos = db->data;
+	UINTN left = db->size;
+
+	if (list) {
+		left -= (UINT8 *)list - db->data + list->SignatureListSize;
+		pos = (UINT8 *)list + list->SignatureListSize;
+	}
+
+	if (!pos || left < sizeof(EFI_SIGNATURE_LIST))
+		return NULL;
+
+	list = (EFI_SIGNATURE_LIST *)pos;
+	if (list->SignatureListSize < sizeof(EFI_SIGNATURE_LIST) ||
+	    list->SignatureListSize > left ||
+	    list->SignatureHeaderSize >
+	    list->SignatureListSize - sizeof(EFI_SIGNATURE_LIST))
+		return NULL;
+
+	return list;
+}
+
+static UINTN
+sigdb_list_count(EFI_SIGNATURE_LIST *list)
+{
+	if (list->SignatureSize == 0)
+		return 0;
+	return (list->SignatureListSize - sizeof(EFI_SIGNATURE_LIST) -
+		list->SignatureHeaderSize) / list->SignatureSize;
+}
+
+static EFI_SIGNATURE_DATA *
+sigdb_list_sig(EFI_SIGNATURE_LIST *list, UINTN n)
+{
+	return (EFI_SIGNATURE_DATA *)((UINT8 *)list +
+				      sizeof(EFI_SIGNATURE_LIST) +
+				      list->SignatureHeaderSize +
+				      n * list->SignatureSize);
+}
+
+/*
+ * Which of sigdb_hash_types a list holds, or -1 if it isn't one of them
+ * or its entries are too small to hold the digest.
+ */
+static int
+sigdb_hash_type(EFI_SIGNATURE_LIST *list)
+{
+	int i;
+
+	for (i = 0; i < SIGDB_HASH_TYPES; i++) {
+		if (CompareGuid(&list->SignatureType,
+				sigdb_hash_types[i].type) != 0)
+			continue;
+		if (list->SignatureSize <
+		    sizeof(EFI_GUID) + sigdb_hash_types[i].size)
+			return -1;
+		return i;
+	}
+	return -1;
+}
+
+static BOOLEAN
+sigdb_is_cert(EFI_SIGNATURE_LIST *list)
+{
+	return CompareGuid(&list->SignatureType,
+			   &EFI_CERT_TYPE_X509_GUID) == 0 &&
+	       list->SignatureSize > sizeof(EFI_GUID) &&
+	       sigdb_list_count(list) > 0;
+}
+
+static UINT64
+sigdb_key(UINT8 *digest)
+{
+	UINT64 key = 0;
+	int i;
+
+	for (i = 0; i < 8; i++)
+		key = (key << 8) | digest[i];
+	return key;
+}
+
+/*
+ * Order by digest and then by position in the buffer, so the first of
+ * several identical digests is the one a linear walk would find.
+ */
+static int
+sigdb_cmp(sigdb_entry_t *a, sigdb_entry_t *b, UINTN size)
+{
+	int rc;
+
+	if (a->key != b->key)
+		return a->key < b->key ? -1 : 1;
+	rc = CompareMem(a->sig->SignatureData, b->sig->SignatureData, size);
+	if (rc)
+		return rc;
+	if (a->sig != b->sig)
+		return a->sig < b->sig ? -1 : 1;
+	return 0;
+}
+
+static void
+sigdb_sift(sigdb_entry_t *e, UINTN root, UINTN n, UINTN size)
+{
+	sigdb_entry_t tmp;
+	UINTN child;
+
+	while ((child = 2 * root + 1) < n) {
+		if (child + 1 < n && sigdb_cmp(&e[child], &e[child + 1], size) < 0)
+			child++;
+		if (sigdb_cmp(&e[root], &e[child], size) >= 0)
+			return;
+		tmp = e[root];
+		e[root] = e[child];
+		e[child] = tmp;
+		root = child;
+	}
+}
+
+static void
+sigdb_sort(sigdb_entry_t *e, UINTN n, UINTN size)
+{
+	sigdb_entry_t tmp;
+	UINTN i;
+
+	if (n < 2)
+		return;
+
+	for (i = n / 2; i > 0; i--)
+		sigdb_sift(e, i - 1, n, size);
+	for (i = n - 1; i > 0; i--) {
+		tmp = e[0];
+		e[0] = e[i];
+		e[i] = tmp;
+		sigdb_sift(e, 0, i, size);
+	}
+}
+
+EFI_STATUS
+sigdb_init(sigdb_t *db, UINT8 *data, UINTN size)
+{
+	EFI_SIGNATURE_LIST *list;
+	sigdb_entry_t *pos;
+	UINTN total = 0, i;
+	int type;
+
+	ZeroMem(db, sizeof(*db));
+	db->data = data;
+	db->size = size;
+
+	for (list = sigdb_next_list(db, NULL); list;
+	     list = sigdb_next_list(db, list)) {
+		type = sigdb_hash_type(list);
+		if (type >= 0)
+			db->hashes[type].count += sigdb_list_count(list);
+		else if (sigdb_is_cert(list))
+			db->certs.count++;
+	}
+
+	for (type = 0; type < SIGDB_HASH_TYPES; type++)
+		total += db->hashes[type].count;
+	total += db->certs.count;
+	if (total == 0) {
+		db->indexed = TRUE;
+		return EFI_SUCCESS;
+	}
+
+	db->mem = AllocatePool(total * sizeof(sigdb_entry_t));
+	if (!db->mem) {
+		perror(L"Unable to allocate signature database index\n");
+		return EFI_OUT_OF_RESOURCES;
+	}
+
+	pos = db->mem;
+	for (type = 0; type < SIGDB_HASH_TYPES; type++) {
+		db->hashes[type].entries = pos;
+		pos += db->hashes[type].count;
+		db->hashes[type].count = 0;
+	}
+	db->certs.entries = pos;
+	db->certs.count = 0;
+
+	for (list = sigdb_next_list(db, NULL); list;
+	     list = sigdb_next_list(db, list)) {
+		sigdb_index_t *index;
+		UINTN count = sigdb_list_count(list);
+
+		type = sigdb_hash_type(list);
+		if (type < 0) {
+			if (!sigdb_is_cert(list))
+				continue;
+			pos = &db->certs.entries[db->certs.count++];
+			pos->key = 0;
+			pos->list = list;
+			pos->sig = sigdb_list_sig(list, 0);
+			continue;
+		}
+
+		index = &db->hashes[type];
+		for (i = 0; i < count; i++) {
+			pos = &index->entries[index->count++];
+			pos->list = list;
+			pos->sig = sigdb_list_sig(list, i);
+			pos->key = sigdb_key(pos->sig->SignatureData);
+		}
+	}
+
+	for (type = 0; type < SIGDB_HASH_TYPES; type++)
+		sigdb_sort(db->hashes[type].entries, db->hashes[type].count,
+			   sigdb_hash_types[type].size);
+
+	db->indexed = TRUE;
+	return EFI_SUCCESS;
+}
+
+void
+sigdb_free(sigdb_t *db)
+{
+	if (db->mem)
+		FreePool(db->mem);
+	ZeroMem(db, sizeof(*db));
+}
+
+sigdb_entry_t *
+sigdb_find_hash(sigdb_t *db, EFI_GUID *type, UINT8 *digest)
+{
+	static sigdb_entry_t found;
+	sigdb_index_t *index;
+	EFI_SIGNATURE_LIST *list;
+	UINTN size, lo, hi, mid, i;
+	UINT64 key;
+	int t, rc;
+
+	for (t = 0; t < SIGDB_HASH_TYPES; t++)
+		if (CompareGuid(type, sigdb_hash_types[t].type) == 0)
+			break;
+	if (t == SIGDB_HASH_TYPES)
+		return NULL;
+	size = sigdb_hash_types[t].size;
+
+	if (!db->indexed) {
+		for (list = sigdb_next_list(db, NULL); list;
+		     list = sigdb_next_list(db, list)) {
+			if (sigdb_hash_type(list) != t)
+				continue;
+			for (i = 0; i < sigdb_list_count(list); i++) {
+				found.list = list;
+				found.sig = sigdb_list_sig(list, i);
+				if (CompareMem(found.sig->SignatureData,
+					       digest, size) == 0)
+					return &found;
+			}
+		}
+		return NULL;
+	}
+
+	/* Lower bound, so duplicates resolve to the first in list order */
+	index = &db->hashes[t];
+	key = sigdb_key(digest);
+	lo = 0;
+	hi = index->count;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		rc = index->entries[mid].key < key ? -1 :
+		     index->entries[mid].key > key ? 1 :
+		     CompareMem(index->entries[mid].sig->SignatureData,
+				digest, size);
+		if (rc < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	if (lo < index->count && index->entries[lo].key == key &&
+	    CompareMem(index->entries[lo].sig->SignatureData,
+		       digest, size) == 0)
+		return &index->entries[lo];
+	return NULL;
+}
+
+UINT32
+sigdb_hash_algs(sigdb_t *db)
+{
+	EFI_SIGNATURE_LIST *list;
+	UINT32 algs = 0;
+	int t;
+
+	if (db->indexed) {
+		for (t = 0; t < SIGDB_HASH_TYPES; t++)
+			if (db->hashes[t].count)
+				algs |= sigdb_hash_types[t].alg;
+		return algs;
+	}
+
+	for (list = sigdb_next_list(db, NULL); list;
+	     list = sigdb_next_list(db, list)) {
+		t = sigdb_hash_type(list);
+		if (t >= 0 && sigdb_list_count(list))
+			algs |= sigdb_hash_types[t].alg;
+	}
+	return algs;
+}
+
+sigdb_entry_t *
+sigdb_cert(sigdb_t *db, UINTN n)
+{
+	static sigdb_entry_t found;
+	EFI_SIGNATURE_LIST *list;
+
+	if (db->indexed)
+		return n < db->certs.count ? &db->certs.entries[n] : NULL;
+
+	for (list = sigdb_next_list(db, NULL); list;
+	     list = sigdb_next_list(db, list)) {
+		if (!sigdb_is_cert(list) || n--)
+			continue;
+		found.list = list;
+		found.sig = sigdb_list_sig(list, 0);
+		return &found;
+	}
+	return NULL;
+}
+
+static void
+sigdb_filter_hash(int type, UINT8 *digest, UINTN nblocks, UINTN *block,
+		  UINT64 *bits)
+{
+	UINT64 h1 = sigdb_key(digest), h2 = 0;
+	int i;
+
+	/* Digests are already uniform; just keep the types apart */
+	for (i = 8; i < 16; i++)
+		h2 = (h2 << 8) | digest[i];
+	h1 ^= (type + 1) * 0x9e3779b97f4a7c15ULL;
+	h2 ^= (type + 1) * 0xc2b2ae3d27d4eb4fULL;
+
+	*block = h1 & (nblocks - 1);
+	for (i = 0; i < 8; i++)
+		bits[i] = 1ULL << ((h2 >> (6 * i)) & 63);
+}
+
+void
+sigdb_filter_free(sigdb_filter_t *filter)
+{
+	if (filter->mem)
+		FreePool(filter->mem);
+	ZeroMem(filter, sizeof(*filter));
+}
+
+EFI_STATUS
+sigdb_filter_build(sigdb_filter_t *filter, sigdb_t **dbs, UINTN ndbs)
+{
+	UINTN total = 0, nblocks = 1, block, i, j;
+	UINT64 bits[8], *words;
+	int t, w;
+
+	sigdb_filter_free(filter);
+	filter->epoch = sigdb_epoch();
+
+	for (i = 0; i < ndbs; i++) {
+		if (!dbs[i])
+			continue;
+		/* Without an index we can't enumerate it; stay invalid */
+		if (!dbs[i]->indexed)
+			return EFI_OUT_OF_RESOURCES;
+		for (t = 0; t < SIGDB_HASH_TYPES; t++)
+			total += dbs[i]->hashes[t].count;
+	}
+
+	filter->count = total;
+	if (total == 0) {
+		filter->valid = TRUE;
+		return EFI_SUCCESS;
+	}
+
+	while (nblocks * 512 < total * SIGDB_FILTER_BITS_PER_ENTRY)
+		nblocks <<= 1;
+
+	filter->mem = AllocateZeroPool(nblocks * 64 + 63);
+	if (!filter->mem) {
+		perror(L"Unable to allocate signature filter\n");
+		return EFI_OUT_OF_RESOURCES;
+	}
+	filter->blocks = (UINT64 *)ALIGN_VALUE((UINTN)filter->mem, 64);
+	filter->nblocks = nblocks;
+
+	for (i = 0; i < ndbs; i++) {
+		if (!dbs[i])
+			continue;
+		for (t = 0; t < SIGDB_HASH_TYPES; t++) {
+			sigdb_index_t *index = &dbs[i]->hashes[t];
+
+			for (j = 0; j < index->count; j++) {
+				sigdb_filter_hash(t,
+					index->entries[j].sig->SignatureData,
+					nblocks, &block, bits);
+				words = &filter->blocks[block * 8];
+				for (w = 0; w < 8; w++)
+					words[w] |= bits[w];
+			}
+		}
+	}
+
+	filter->valid = TRUE;
+	return EFI_SUCCESS;
+}
+
+BOOLEAN
+sigdb_filter_check(sigdb_filter_t *filter, EFI_GUID *type, UINT8 *digest)
+{
+	UINT64 bits[8], *words;
+	UINTN block;
+	int t, w;
+
+	/* No filter means we know nothing, so everything is a maybe */
+	if (!filter->valid)
+		return TRUE;
+
+	for (t = 0; t < SIGDB_HASH_TYPES; t++)
+		if (CompareGuid(type, sigdb_hash_types[t].type) == 0)
+			break;
+	if (t == SIGDB_HASH_TYPES)
+		return TRUE;
+
+	if (filter->nblocks == 0)
+		return FALSE;
+
+	sigdb_filter_hash(t, digest, filter->nblocks, &block, bits);
+	words = &filter->blocks[block * 8];
+	for (w = 0; w < 8; w++)
+		if (!(words[w] & bits[w]))
+			return FALSE;
+	return TRUE;
+}
+
+/*
+ * The variable cache.  Entries are created the first time a database is
+ * asked for, including ones that turn out not to exist, and all of them
+ * are dropped whenever shim writes a variable or sigdb_invalidate() is
+ * called after something else might have.
+ */
+typedef struct {
+	list_t list;
+	EFI_GUID guid;
+	EFI_STATUS status;
+	UINT8 *data;
+	sigdb_t db;
+	CHAR16 name[0];
+} sigdb_var_t;
+
+static LIST_HEAD(sigdb_vars);
+static UINTN sigdb_generation;
+static UINTN sigdb_epochs;
+
+UINTN
+sigdb_epoch(void)
+{
+	if (sigdb_generation != variable_write_generation)
+		sigdb_invalidate();
+	return sigdb_epochs;
+}
+
+void
+sigdb_invalidate(void)
+{
+	list_t *pos, *tmp;
+	sigdb_var_t *var;
+
+	list_for_each_safe(pos, tmp, &sigdb_vars) {
+		var = list_entry(pos, sigdb_var_t, list);
+		list_del(&var->list);
+		sigdb_free(&var->db);
+		if (var->data)
+			FreePool(var->data);
+		FreePool(var);
+	}
+	sigdb_generation = variable_write_generation;
+	sigdb_epochs++;
+}
+
+EFI_STATUS
+sigdb_get_variable(CHAR16 *name, EFI_GUID guid, sigdb_t **db)
+{
+	EFI_STATUS efi_status;
+	sigdb_var_t *var;
+	UINTN size = 0;
+	list_t *pos;
+
+	*db = NULL;
+	if (sigdb_generation != variable_write_generation)
+		sigdb_invalidate();
+
+	list_for_each(pos, &sigdb_vars) {
+		var = list_entry(pos, sigdb_var_t, list);
+		if (CompareGuid(&var->guid, &guid) == 0 &&
+		    StrCmp(var->name, name) == 0)
+			goto found;
+	}
+
+	var = AllocateZeroPool(sizeof(*var) + StrSize(name));
+	if (!var)
+		return EFI_OUT_OF_RESOURCES;
+	CopyMem(var->name, name, StrSize(name));
+	var->guid = guid;
+
+	efi_status = get_variable(name, &var->data, &size, guid);
+	if (EFI_ERROR(efi_status) && efi_status != EFI_NOT_FOUND) {
+		/* Don't remember transient failures */
+		FreePool(var);
+		return efi_status;
+	}
+	var->status = efi_status;
+	if (EFI_ERROR(efi_status)) {
+		var->data = NULL;
+	} else {
+		/*
+		 * An index we can't allocate only costs us speed;
+		 * sigdb_init() leaves the buffer usable either way.
+		 */
+		sigdb_init(&var->db, var->data, size);
+	}
+	list_add_tail(&var->list, &sigdb_vars);
+
+found:
+	if (!EFI_ERROR(var->status))
+		*db = &var->db;
+	return var->status;
+}
+
+// vim:fenc=utf-8:tw=75:noet
@@ -0,0 +1,327 @@
+// SPDX-License-Identifier: BSD-2-Clause-Patent
+/*
+ * test-bnmont.c - test the Montgomery multiplication kernels
+ */
+
+#ifndef SHIM_UNIT_TEST
+#define SHIM_UNIT_TEST
+#endif
+#include "shim.h"
+
+#include <Library/BaseCryptLib.h>
+#include <openssl/bn.h>
+#include <stdio.h>
+#include <time.h>
+
+static const struct {
+	UINT32 kernel;
+	const char *name;
+} kernels[] = {
+	{ BN_MONT_INT128, "int128" },
+	{ BN_MONT_MULX, "mulx" },
+};
+
+#define N_KERNELS (sizeof(kernels) / sizeof(kernels[0]))
+
+static BN_CTX *bn_ctx;
+
+static void
+to_words(const BIGNUM *bn, UINT64 *words, UINTN n)
+{
+	BN_bn2lebinpad(bn, (unsigned char *)words, n * sizeof(UINT64));
+}
+
+/*
+ * -1 / n mod 2^64, by Newton's method: each step doubles the number of
+ * bits that are right, and n is its own inverse mod 8.
+ */
+static UINT64
+mont_n0(UINT64 n)
+{
+	UINT64 inv = n;
+	int i;
+
+	for (i = 0; i < 5; i++)
+		inv *= 2 - n * inv;
+	return -inv;
+}
+
+/*
+ * An odd modulus with its top bit set, so OpenSSL's Montgomery context
+ * uses the same R as the kernels do.
+ */
+static BIGNUM *
+make_modulus(UINTN words)
+{
+	BIGNUM *n = BN_new();
+
+	if (n && !BN_rand(n, words * 64, BN_RAND_TOP_ONE, BN_RAND_BOTTOM_ODD)) {
+		BN_free(n);
+		return NULL;
+	}
+	return n;
+}
+
+static int
+check_one(BN_MONT_CTX *mont, const BIGNUM *n, UINTN words, const BIGNUM *a,
+	  const BIGNUM *b)
+{
+	UINT64 wa[BN_MONT_MAX_WORDS], wb[BN_MONT_MAX_WORDS];
+	UINT64 wn[BN_MONT_MAX_WORDS], want[BN_MONT_MAX_WORDS];
+	UINT64 got[BN_MONT_MAX_WORDS + 1];
+	UINT64 n0;
+	BIGNUM *r;
+	unsigned int k;
+	int ret = -1;
+
+	r = BN_new();
+	assert_goto(r && BN_mod_mul_montgomery(r, a, b, mont, bn_ctx), err,
+		    "BN_mod_mul_montgomery failed\n");
+	to_words(r, want, words);
+	to_words(a, wa, words);
+	to_words(b, wb, words);
+	to_words(n, wn, words);
+	n0 = mont_n0(wn[0]);
+
+	for (k = 0; k < N_KERNELS; k++) {
+		if (!(BnMontFeatures() & kernels[k].kernel))
+			continue;
+
+		memset(got, 0xa5, sizeof(got));
+		assert_goto(BnMontMul(got, wa, a == b ? wa : wb, wn, n0, words,
+				      kernels[k].kernel), err,
+			    "%s kernel refused %lu words\n", kernels[k].name,
+			    words);
+		assert_goto(memcmp(got, want, words * sizeof(UINT64)) == 0, err,
+			    "%s kernel got the wrong %s for %lu words\n",
+			    kernels[k].name, a == b ? "square" : "product",
+			    words);
+		assert_goto(got[words] == 0xa5a5a5a5a5a5a5a5ull, err,
+			    "%s kernel wrote past the result\n",
+			    kernels[k].name);
+
+		/* The result may overwrite a factor */
+		memcpy(got, wa, words * sizeof(UINT64));
+		BnMontMul(got, got, a == b ? got : wb, wn, n0, words,
+			  kernels[k].kernel);
+		assert_goto(memcmp(got, want, words * sizeof(UINT64)) == 0, err,
+			    "%s kernel got it wrong in place for %lu words\n",
+			    kernels[k].name, words);
+	}
+	ret = 0;
+err:
+	BN_free(r);
+	return ret;
+}
+
+/*
+ * Random products and squares, checked against the host's libcrypto, for
+ * sizes that are and aren't a multiple of the four words the MULX kernel
+ * works in.
+ */
+static int
+test_bnmont_random(void)
+{
+	static const UINTN sizes[] = {
+		2, 3, 4, 5, 6, 7, 8, 9, 15, 16, 17, 31, 32, 33, 48, 63, 64,
+		BN_MONT_MAX_WORDS
+	};
+	BN_MONT_CTX *mont = NULL;
+	BIGNUM *n = NULL, *a = NULL, *b = NULL;
+	unsigned int i, j;
+	int ret = -1;
+
+	a = BN_new();
+	b = BN_new();
+	assert_goto(a && b, err, "BN_new failed\n");
+
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		for (j = 0; j < 20; j++) {
+			n = make_modulus(sizes[i]);
+			mont = BN_MONT_CTX_new();
+			assert_goto(n && mont && BN_MONT_CTX_set(mont, n, bn_ctx),
+				    err, "couldn't make a %lu word modulus\n",
+				    sizes[i]);
+
+			assert_goto(BN_rand_range(a, n) && BN_rand_range(b, n),
+				    err, "BN_rand_range failed\n");
+			/* Some with everything set, for the carries */
+			if (j == 0) {
+				BN_sub(a, n, BN_value_one());
+				BN_sub(b, n, BN_value_one());
+			}
+			if (check_one(mont, n, sizes[i], a, b) < 0 ||
+			    check_one(mont, n, sizes[i], a, a) < 0)
+				goto err;
+
+			BN_MONT_CTX_free(mont);
+			BN_free(n);
+			mont = NULL;
+			n = NULL;
+		}
+	}
+	ret = 0;
+err:
+	BN_MONT_CTX_free(mont);
+	BN_free(n);
+	BN_free(a);
+	BN_free(b);
+	return ret;
+}
+
+static int
+test_bnmont_refused(void)
+{
+	UINT64 w[BN_MONT_MAX_WORDS + 1] = { 1, };
+	unsigned int k;
+
+	for (k = 0; k < N_KERNELS; k++) {
+		if (!(BnMontFeatures() & kernels[k].kernel)) {
+			assert_false_return(BnMontMul(w, w, w, w, 1, 4,
+						      kernels[k].kernel), -1,
+					    "%s kernel isn't available but "
+					    "was used\n", kernels[k].name);
+			continue;
+		}
+		assert_false_return(BnMontMul(w, w, w, w, 1, 1,
+					      kernels[k].kernel), -1,
+				    "%s kernel took one word\n",
+				    kernels[k].name);
+		assert_false_return(BnMontMul(w, w, w, w, 1,
+					      BN_MONT_MAX_WORDS + 1,
+					      kernels[k].kernel), -1,
+				    "%s kernel took too many words\n",
+				    kernels[k].name);
+	}
+	assert_false_return(BnMontMul(w, w, w, w, 1, 4, 0), -1,
+			    "no kernel was used\n");
+	return 0;
+}
+
+static double
+seconds(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * What RSA signature verification spends its time on: s^65537 mod n,
+ * that is 16 squares and a multiply in Montgomery form, with one multiply
+ * either side to get into and out of it.
+ */
+static BOOLEAN
+verify_words(UINT64 *out, const UINT64 *s, const UINT64 *rr, const UINT64 *n,
+	     UINT64 n0, UINTN words, UINT32 kernel)
+{
+	UINT64 x[BN_MONT_MAX_WORDS], t[BN_MONT_MAX_WORDS];
+	UINT64 one[BN_MONT_MAX_WORDS] = { 1, };
+	int i;
+
+	if (!BnMontMul(x, s, rr, n, n0, words, kernel))
+		return FALSE;
+	memcpy(t, x, words * sizeof(UINT64));
+	for (i = 0; i < 16; i++)
+		BnMontMul(t, t, t, n, n0, words, kernel);
+	BnMontMul(t, t, x, n, n0, words, kernel);
+	BnMontMul(out, t, one, n, n0, words, kernel);
+	return TRUE;
+}
+
+static int
+bench_verify(UINTN bits, int rounds)
+{
+	UINT64 ws[BN_MONT_MAX_WORDS], wrr[BN_MONT_MAX_WORDS];
+	UINT64 wn[BN_MONT_MAX_WORDS], want[BN_MONT_MAX_WORDS];
+	UINT64 got[BN_MONT_MAX_WORDS];
+	UINTN words = bits / 64;
+	BN_MONT_CTX *mont = NULL;
+	BIGNUM *n, *s, *e, *r;
+	double start, host;
+	unsigned int k;
+	int i, ret = -1;
+
+	n = make_modulus(words);
+	s = BN_new();
+	e = BN_new();
+	r = BN_new();
+	mont = BN_MONT_CTX_new();
+	assert_goto(n && s && e && r && mont &&
+		    BN_MONT_CTX_set(mont, n, bn_ctx) &&
+		    BN_rand_range(s, n) && BN_set_word(e, 65537), err,
+		    "couldn't set up %lu bit verify\n", bits);
+
+	start = seconds();
+	for (i = 0; i < rounds; i++)
+		BN_mod_exp_mont(r, s, e, n, bn_ctx, mont);
+	host = rounds / (seconds() - start);
+	to_words(r, want, words);
+
+	/* R^2 mod n, for getting into Montgomery form */
+	BN_zero(r);
+	BN_set_bit(r, words * 128);
+	BN_mod(r, r, n, bn_ctx);
+	to_words(r, wrr, words);
+	to_words(s, ws, words);
+	to_words(n, wn, words);
+
+	printf("%lu bit verify/s: host libcrypto %.0f", bits, host);
+	for (k = 0; k < N_KERNELS; k++) {
+		if (!(BnMontFeatures() & kernels[k].kernel))
+			continue;
+
+		start = seconds();
+		for (i = 0; i < rounds; i++)
+			verify_words(got, ws, wrr, wn, mont_n0(wn[0]), words,
+				     kernels[k].kernel);
+		printf(", %s %.0f", kernels[k].name,
+		       rounds / (seconds() - start));
+		assert_goto(memcmp(got, want, words * sizeof(UINT64)) == 0, err,
+			    "\n%s kernel got the wrong signature\n",
+			    kernels[k].name);
+	}
+	printf("\n");
+	ret = 0;
+err:
+	BN_MONT_CTX_free(mont);
+	BN_free(n);
+	BN_free(s);
+	BN_free(e);
+	BN_free(r);
+	return ret;
+}
+
+static int
+test_bnmont_bench(void)
+{
+	if (!BnMontFeatures()) {
+		printf("no Montgomery kernels for this CPU, skipping\n");
+		return 0;
+	}
+	if (bench_verify(2048, 2000) < 0 || bench_verify(4096, 500) < 0)
+		return -1;
+	return 0;
+}
+
+int
+main(void)
+{
+	int status = 0;
+
+	bn_ctx = BN_CTX_new();
+	if (!bn_ctx) {
+		printf("BN_CTX_new failed\n");
+		return -1;
+	}
+
+	test(test_bnmont_random);
+	test(test_bnmont_refused);
+	test(test_bnmont_bench);
+
+	BN_CTX_free(bn_ctx);
+	return status;
+}
+
+// vim:fenc=utf-8:tw=75:noet
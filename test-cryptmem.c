@@ -0,0 +1,201 @@
+// SPDX-License-Identifier: BSD-2-Clause-Patent
+/*
+ * test-cryptmem.c - test the allocator behind OpenSSL's malloc()
+ */
+
+#ifndef SHIM_UNIT_TEST
+#define SHIM_UNIT_TEST
+#endif
+#include "shim.h"
+
+#include <Library/BaseCryptLib.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+static void
+fill(UINT8 *p, UINTN size, UINT8 seed)
+{
+	UINTN i;
+
+	for (i = 0; i < size; i++)
+		p[i] = (UINT8)(seed + i * 7);
+}
+
+static BOOLEAN
+filled(UINT8 *p, UINTN size, UINT8 seed)
+{
+	UINTN i;
+
+	for (i = 0; i < size; i++)
+		if (p[i] != (UINT8)(seed + i * 7))
+			return FALSE;
+	return TRUE;
+}
+
+static int
+test_cryptmem_reuse(void)
+{
+	CRYPTO_MEM_STATS before, after;
+	void *p[64];
+	unsigned int i, round;
+
+	CryptoMemGetStats(&before);
+	for (round = 0; round < 16; round++) {
+		for (i = 0; i < 64; i++) {
+			p[i] = CryptoMemAlloc(24);
+			assert_nonzero_return(p[i], -1, "alloc failed\n");
+			assert_zero_return((UINTN)p[i] & 7, -1,
+					   "%p isn't aligned\n", p[i]);
+			fill(p[i], 24, i);
+		}
+		for (i = 0; i < 64; i++) {
+			assert_true_return(filled(p[i], 24, i), -1,
+					   "block %u was overwritten\n", i);
+			CryptoMemFree(p[i]);
+		}
+	}
+	CryptoMemGetStats(&after);
+
+	assert_equal_return(after.Allocations - before.Allocations, 1024, -1,
+			    "got %lu allocations, expected %d\n");
+	assert_equal_return(after.Frees - before.Frees, 1024, -1,
+			    "got %lu frees, expected %d\n");
+	assert_equal_return(after.CurrentBytes, before.CurrentBytes, -1,
+			    "%lu bytes allocated, expected %lu\n");
+	/* 64 blocks of 32 bytes and their headers fit in one slab */
+	assert_equal_return(after.PoolAllocations - before.PoolAllocations, 1,
+			    -1, "got %lu pool allocations, expected %d\n");
+
+	return 0;
+}
+
+static int
+test_cryptmem_realloc(void)
+{
+	static const UINTN sizes[] = {
+		1, 15, 16, 17, 100, 2048, 2049, 5000, 300, 3, 70000, 10
+	};
+	CRYPTO_MEM_STATS stats;
+	UINT8 *p, *q;
+	UINTN i, size;
+
+	p = CryptoMemAlloc(sizes[0]);
+	assert_nonzero_return(p, -1, "alloc failed\n");
+	fill(p, sizes[0], 0x5a);
+	size = sizes[0];
+
+	for (i = 1; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		q = CryptoMemRealloc(p, sizes[i]);
+		assert_nonzero_return(q, -1, "realloc to %lu failed\n",
+				      sizes[i]);
+		assert_true_return(filled(q, MIN(size, sizes[i]), 0x5a), -1,
+				   "realloc from %lu to %lu lost data\n",
+				   size, sizes[i]);
+		fill(q, sizes[i], 0x5a);
+		p = q;
+		size = sizes[i];
+
+		CryptoMemGetStats(&stats);
+		assert_goto(stats.PeakBytes >= stats.CurrentBytes, err,
+			    "peak %lu below current %lu\n", stats.PeakBytes,
+			    stats.CurrentBytes);
+	}
+
+	/* Shrinking, and growing within the class, stays put */
+	q = CryptoMemRealloc(p, 12);
+	assert_equal_goto(q, p, err, "growing to 12 moved %p to %p\n");
+	q = CryptoMemRealloc(p, 16);
+	assert_equal_goto(q, p, err, "growing to 16 moved %p to %p\n");
+	q = CryptoMemRealloc(p, 5);
+	assert_equal_goto(q, p, err, "shrinking to 5 moved %p to %p\n");
+	assert_true_return(filled(q, 5, 0x5a), -1, "shrinking lost data\n");
+
+	assert_zero_return(CryptoMemRealloc(p, 0), -1,
+			   "realloc to 0 didn't free\n");
+	p = CryptoMemRealloc(NULL, 40);
+	assert_nonzero_return(p, -1, "realloc of NULL didn't allocate\n");
+	CryptoMemFree(p);
+	CryptoMemFree(NULL);
+
+	return 0;
+err:
+	CryptoMemFree(p);
+	return -1;
+}
+
+/*
+ * Random allocations, resizes and frees, each block checked against what
+ * was last written to it.
+ */
+static int
+test_cryptmem_random(void)
+{
+	CRYPTO_MEM_STATS stats;
+	struct {
+		UINT8 *p;
+		UINTN size;
+		UINT8 seed;
+	} blocks[256] = { { 0, } };
+	UINTN expected;
+	unsigned int i, n;
+
+	srandom(0x5eed);
+	CryptoMemGetStats(&stats);
+	expected = stats.CurrentBytes;
+
+	for (n = 0; n < 100000; n++) {
+		i = random() % 256;
+		if (blocks[i].p) {
+			if (!filled(blocks[i].p, blocks[i].size,
+				    blocks[i].seed)) {
+				printf("block %u was overwritten\n", i);
+				return -1;
+			}
+			expected -= blocks[i].size;
+		}
+		switch (random() % 3) {
+		case 0:
+			CryptoMemFree(blocks[i].p);
+			blocks[i].p = NULL;
+			blocks[i].size = 0;
+			break;
+		case 1:
+			CryptoMemFree(blocks[i].p);
+			blocks[i].size = random() % 3000;
+			blocks[i].p = CryptoMemAlloc(blocks[i].size);
+			break;
+		case 2:
+			blocks[i].size = random() % 3000 + 1;
+			blocks[i].p = CryptoMemRealloc(blocks[i].p,
+						       blocks[i].size);
+			break;
+		}
+		if (blocks[i].p) {
+			blocks[i].seed = random();
+			fill(blocks[i].p, blocks[i].size, blocks[i].seed);
+			expected += blocks[i].size;
+		}
+	}
+
+	CryptoMemGetStats(&stats);
+	assert_equal_return(stats.CurrentBytes, expected, -1,
+			    "%lu bytes allocated, expected %lu\n");
+
+	for (i = 0; i < 256; i++)
+		CryptoMemFree(blocks[i].p);
+	return 0;
+}
+
+int
+main(void)
+{
+	int status = 0;
+
+	test(test_cryptmem_reuse);
+	test(test_cryptmem_realloc);
+	test(test_cryptmem_random);
+
+	return status;
+}
+
+// vim:fenc=utf-8:tw=75:noet
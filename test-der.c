@@ -0,0 +1,630 @@
+// SPDX-License-Identifier: BSD-2-Clause-Patent
+/*
+ * test-der.c - test finding things in DER-encoded certificates
+ */
+
+#ifndef SHIM_UNIT_TEST
+#define SHIM_UNIT_TEST
+#endif
+#include "shim.h"
+
+#include <openssl/evp.h>
+#include <openssl/err.h>
+#include <openssl/objects.h>
+#include <openssl/pkcs7.h>
+#include <openssl/x509.h>
+#include <openssl/x509v3.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/* 1.3.6.1.4.1.2312.16.1.2 */
+static const UINT8 module_signing[] = {
+	0x2b, 0x06, 0x01, 0x04, 0x01, 0x92, 0x08, 0x10, 0x01, 0x02
+};
+
+/* 1.3.6.1.5.5.7.3.3 */
+static const UINT8 code_signing[] = {
+	0x2b, 0x06, 0x01, 0x05, 0x05, 0x07, 0x03, 0x03
+};
+
+static EVP_PKEY *key;
+
+/*
+ * Make a self-signed certificate, with the extended key usage extension
+ * eku if there is one, and another extension either side of it so it has
+ * to be looked for.
+ */
+static int
+make_cert_ext(X509_EXTENSION *eku, UINT8 **der)
+{
+	X509_EXTENSION *ext;
+	X509V3_CTX ctx;
+	X509 *x509;
+	int len = -1;
+
+	x509 = X509_new();
+	if (!x509)
+		return -1;
+	X509_set_version(x509, 2);
+	ASN1_INTEGER_set(X509_get_serialNumber(x509), 0x1234);
+	X509_gmtime_adj(X509_getm_notBefore(x509), 0);
+	X509_gmtime_adj(X509_getm_notAfter(x509), 3600);
+	X509_NAME_add_entry_by_txt(X509_get_subject_name(x509), "CN",
+				   MBSTRING_ASC, (unsigned char *)"test-der",
+				   -1, -1, 0);
+	X509_set_issuer_name(x509, X509_get_subject_name(x509));
+	X509_set_pubkey(x509, key);
+
+	X509V3_set_ctx(&ctx, x509, x509, NULL, NULL, 0);
+	ext = X509V3_EXT_conf_nid(NULL, &ctx, NID_basic_constraints,
+				  "critical,CA:FALSE");
+	if (!ext || !X509_add_ext(x509, ext, -1))
+		goto err;
+	X509_EXTENSION_free(ext);
+	ext = NULL;
+	if (eku && !X509_add_ext(x509, eku, -1))
+		goto err;
+	ext = X509V3_EXT_conf_nid(NULL, &ctx, NID_subject_key_identifier,
+				  "hash");
+	if (!ext || !X509_add_ext(x509, ext, -1))
+		goto err;
+	X509_EXTENSION_free(ext);
+	ext = NULL;
+
+	if (!X509_sign(x509, key, EVP_sha256()))
+		goto err;
+	*der = NULL;
+	len = i2d_X509(x509, der);
+err:
+	if (ext)
+		X509_EXTENSION_free(ext);
+	X509_free(x509);
+	return len;
+}
+
+/*
+ * The same, with an extended key usage extension listing ekus if there
+ * are any.
+ */
+static int
+make_cert(const char *ekus, int critical, UINT8 **der)
+{
+	X509_EXTENSION *ext = NULL;
+	int len;
+
+	if (ekus) {
+		ext = X509V3_EXT_conf_nid(NULL, NULL, NID_ext_key_usage, ekus);
+		if (!ext)
+			return -1;
+		X509_EXTENSION_set_critical(ext, critical);
+	}
+	len = make_cert_ext(ext, der);
+	if (ext)
+		X509_EXTENSION_free(ext);
+	return len;
+}
+
+/*
+ * What verify_eku() used to ask OpenSSL.
+ */
+static int
+openssl_has_modsign(const UINT8 *der, int len)
+{
+	EXTENDED_KEY_USAGE *eku;
+	ASN1_OBJECT *modsign;
+	X509 *x509;
+	int found = 0;
+	int i;
+
+	x509 = d2i_X509(NULL, &der, len);
+	if (!x509)
+		return 0;
+	modsign = OBJ_txt2obj("1.3.6.1.4.1.2312.16.1.2", 1);
+	eku = X509_get_ext_d2i(x509, NID_ext_key_usage, NULL, NULL);
+	for (i = 0; eku && i < sk_ASN1_OBJECT_num(eku); i++) {
+		if (OBJ_cmp(sk_ASN1_OBJECT_value(eku, i), modsign) == 0)
+			found = 1;
+	}
+	EXTENDED_KEY_USAGE_free(eku);
+	ASN1_OBJECT_free(modsign);
+	X509_free(x509);
+	return found;
+}
+
+static const struct {
+	const char *ekus;
+	int critical;
+	BOOLEAN modsign;
+	BOOLEAN codesign;
+} certs[] = {
+	{ NULL, 0, FALSE, FALSE },
+	{ "codeSigning", 0, FALSE, TRUE },
+	{ "1.3.6.1.4.1.2312.16.1.2", 0, TRUE, FALSE },
+	{ "1.3.6.1.4.1.2312.16.1.2", 1, TRUE, FALSE },
+	{ "serverAuth,codeSigning,1.3.6.1.4.1.2312.16.1.2", 0, TRUE, TRUE },
+	{ "serverAuth,1.3.6.1.4.1.2312.16.1.2,codeSigning", 1, TRUE, TRUE },
+	{ "1.3.6.1.4.1.2312.16.1", 0, FALSE, FALSE },
+	{ "1.3.6.1.4.1.2312.16.1.2.1", 0, FALSE, FALSE },
+};
+
+static int
+test_x509_has_eku(void)
+{
+	UINT8 *der = NULL;
+	BOOLEAN listed;
+	unsigned int i;
+	int len, ret = -1;
+
+	for (i = 0; i < sizeof(certs) / sizeof(certs[0]); i++) {
+		len = make_cert(certs[i].ekus, certs[i].critical, &der);
+		assert_goto(len > 0, err, "couldn't make cert %u\n", i);
+
+		assert_goto(x509_has_eku(der, len, module_signing,
+					 sizeof(module_signing), &listed),
+			    err, "couldn't parse cert %u\n", i);
+		assert_equal_goto(listed, certs[i].modsign, err,
+				  "module signing: got %d expected %d for cert %u\n",
+				  i);
+		assert_goto(x509_has_eku(der, len, code_signing,
+					 sizeof(code_signing), &listed),
+			    err, "couldn't parse cert %u\n", i);
+		assert_equal_goto(listed, certs[i].codesign, err,
+				  "code signing: got %d expected %d for cert %u\n",
+				  i);
+		assert_equal_goto(openssl_has_modsign(der, len),
+				  certs[i].modsign, err,
+				  "OpenSSL got %d expected %d for cert %u\n", i);
+		OPENSSL_free(der);
+		der = NULL;
+	}
+	ret = 0;
+err:
+	OPENSSL_free(der);
+	return ret;
+}
+
+/*
+ * Any cut-off certificate, or one with a length byte messed with, has to
+ * come back without reading past the end of it.  Each copy is allocated
+ * to size so the sanitizers or valgrind have something to catch.
+ */
+static int
+test_x509_has_eku_damaged(void)
+{
+	UINT8 *der = NULL, *copy = NULL;
+	BOOLEAN listed;
+	unsigned int i, j;
+	int len, ret = -1;
+
+	len = make_cert("codeSigning,1.3.6.1.4.1.2312.16.1.2", 0, &der);
+	assert_goto(len > 0, err, "couldn't make cert\n");
+
+	for (i = 0; i < (unsigned int)len; i++) {
+		copy = malloc(i ? i : 1);
+		assert_goto(copy != NULL, err, "malloc failed\n");
+		memcpy(copy, der, i);
+		x509_has_eku(copy, i, module_signing, sizeof(module_signing),
+			     &listed);
+		free(copy);
+		copy = NULL;
+	}
+	assert_goto(!x509_has_eku(der, 0, module_signing,
+				  sizeof(module_signing), &listed), err,
+		    "empty cert was parsed\n");
+	assert_goto(!x509_has_eku(der, len / 2, module_signing,
+				  sizeof(module_signing), &listed), err,
+		    "half a cert was parsed\n");
+
+	copy = malloc(len);
+	assert_goto(copy != NULL, err, "malloc failed\n");
+	for (i = 0; i < (unsigned int)len; i++) {
+		for (j = 0; j < 4; j++) {
+			static const UINT8 bytes[] = { 0x00, 0x7f, 0x84, 0xff };
+
+			memcpy(copy, der, len);
+			copy[i] = bytes[j];
+			x509_has_eku(copy, len, module_signing,
+				     sizeof(module_signing), &listed);
+		}
+	}
+	ret = 0;
+err:
+	free(copy);
+	OPENSSL_free(der);
+	return ret;
+}
+
+/*
+ * BER that OpenSSL decodes but isn't DER mustn't be taken as not listing
+ * the usage: it has to be left to OpenSSL.  These are a module signing
+ * certificate with the Certificate's own SEQUENCE, then the
+ * tbsCertificate's, then the extension's SEQUENCE OF, re-encoded.
+ */
+static int
+test_x509_has_eku_ber(void)
+{
+	/* SEQUENCE, indefinite length, { OID_EKU_MODSIGN } */
+	static const UINT8 eku_ber[] = {
+		0x30, 0x80,
+		0x06, 0x0a, 0x2b, 0x06, 0x01, 0x04, 0x01, 0x92, 0x08, 0x10,
+		0x01, 0x02,
+		0x00, 0x00
+	};
+	UINT8 *der = NULL, *ber = NULL;
+	ASN1_OCTET_STRING *value = NULL;
+	X509_EXTENSION *ext = NULL;
+	const UINT8 *pos, *end;
+	der_item_t cert, tbs;
+	BOOLEAN listed;
+	UINTN ber_len;
+	int len, ret = -1;
+
+	len = make_cert("1.3.6.1.4.1.2312.16.1.2", 0, &der);
+	assert_goto(len > 0, err, "couldn't make cert\n");
+	pos = der;
+	assert_goto(der_next(&pos, der + len, &cert), err,
+		    "couldn't parse cert\n");
+	pos = cert.data;
+	end = cert.data + cert.size;
+	assert_goto(der_next(&pos, end, &tbs), err, "couldn't parse cert\n");
+	ber = malloc(len + 16);
+	assert_goto(ber != NULL, err, "malloc failed\n");
+
+	/* Certificate ::= SEQUENCE, indefinite length */
+	ber[0] = DER_SEQUENCE;
+	ber[1] = 0x80;
+	memcpy(ber + 2, cert.data, cert.size);
+	ber[2 + cert.size] = 0;
+	ber[3 + cert.size] = 0;
+	ber_len = 4 + cert.size;
+	assert_goto(!x509_has_eku(ber, ber_len, module_signing,
+				  sizeof(module_signing), &listed), err,
+		    "indefinite length Certificate was parsed\n");
+	assert_goto(openssl_has_modsign(ber, ber_len), err,
+		    "OpenSSL didn't find the usage in an indefinite length Certificate\n");
+
+	/*
+	 * tbsCertificate with nine length bytes, more than a UINTN holds,
+	 * the leading ones zero, which newer OpenSSL skips.  The
+	 * Certificate's own length grows by as many bytes as that adds.
+	 */
+	ber_len = cert.size + 11 - (tbs.data - tbs.der);
+	ber[0] = DER_SEQUENCE;
+	ber[1] = 0x82;
+	ber[2] = ber_len >> 8;
+	ber[3] = ber_len & 0xff;
+	ber[4] = tbs.tag;
+	ber[5] = 0x89;
+	SetMem(ber + 6, 7, 0);
+	ber[13] = tbs.size >> 8;
+	ber[14] = tbs.size & 0xff;
+	memcpy(ber + 15, tbs.data, cert.data + cert.size - tbs.data);
+	ber_len = 15 + (cert.data + cert.size - tbs.data);
+	assert_goto(!x509_has_eku(ber, ber_len, module_signing,
+				  sizeof(module_signing), &listed), err,
+		    "tbsCertificate with a long length was parsed\n");
+	assert_goto(openssl_has_modsign(ber, ber_len), err,
+		    "OpenSSL didn't find the usage with a long tbsCertificate length\n");
+	OPENSSL_free(der);
+	der = NULL;
+
+	/* The extension's own value, which is signed */
+	value = ASN1_OCTET_STRING_new();
+	assert_goto(value != NULL &&
+		    ASN1_OCTET_STRING_set(value, eku_ber, sizeof(eku_ber)),
+		    err, "couldn't make extension value\n");
+	ext = X509_EXTENSION_create_by_NID(NULL, NID_ext_key_usage, 0, value);
+	assert_goto(ext != NULL, err, "couldn't make extension\n");
+	len = make_cert_ext(ext, &der);
+	assert_goto(len > 0, err, "couldn't make cert\n");
+	assert_goto(!x509_has_eku(der, len, module_signing,
+				  sizeof(module_signing), &listed), err,
+		    "indefinite length usages were parsed\n");
+	assert_goto(openssl_has_modsign(der, len), err,
+		    "OpenSSL didn't find the usage in indefinite length usages\n");
+
+	ret = 0;
+err:
+	if (ext)
+		X509_EXTENSION_free(ext);
+	if (value)
+		ASN1_OCTET_STRING_free(value);
+	free(ber);
+	OPENSSL_free(der);
+	return ret;
+}
+
+/*
+ * A CA certificate for subject, signed by issuer's key, or its own if
+ * there's no issuer.  With a subject key identifier unless ski is FALSE.
+ */
+static X509 *
+make_ca(const char *subject, int utf8, X509 *issuer, EVP_PKEY *issuer_key,
+	EVP_PKEY *subject_key, BOOLEAN ski)
+{
+	X509_EXTENSION *ext;
+	X509V3_CTX ctx;
+	X509 *x509;
+
+	x509 = X509_new();
+	if (!x509)
+		return NULL;
+	X509_set_version(x509, 2);
+	ASN1_INTEGER_set(X509_get_serialNumber(x509), random());
+	X509_gmtime_adj(X509_getm_notBefore(x509), 0);
+	X509_gmtime_adj(X509_getm_notAfter(x509), 3600);
+	X509_NAME_add_entry_by_txt(X509_get_subject_name(x509), "O",
+				   MBSTRING_ASC, (unsigned char *)"test-der",
+				   -1, -1, 0);
+	X509_NAME_add_entry_by_txt(X509_get_subject_name(x509), "CN",
+				   utf8 ? MBSTRING_UTF8 : MBSTRING_ASC,
+				   (unsigned char *)subject, -1, -1, 0);
+	X509_set_issuer_name(x509, X509_get_subject_name(issuer ? issuer
+								: x509));
+	X509_set_pubkey(x509, subject_key);
+
+	X509V3_set_ctx(&ctx, issuer ? issuer : x509, x509, NULL, NULL, 0);
+	ext = X509V3_EXT_conf_nid(NULL, &ctx, NID_basic_constraints,
+				  "critical,CA:TRUE");
+	if (!ext || !X509_add_ext(x509, ext, -1))
+		goto err;
+	X509_EXTENSION_free(ext);
+	ext = NULL;
+	if (ski) {
+		ext = X509V3_EXT_conf_nid(NULL, &ctx,
+					  NID_subject_key_identifier, "hash");
+		if (!ext || !X509_add_ext(x509, ext, -1))
+			goto err;
+		X509_EXTENSION_free(ext);
+		ext = NULL;
+	}
+	if (issuer) {
+		ext = X509V3_EXT_conf_nid(NULL, &ctx,
+					  NID_authority_key_identifier,
+					  "keyid:always");
+		if (!ext || !X509_add_ext(x509, ext, -1))
+			goto err;
+		X509_EXTENSION_free(ext);
+		ext = NULL;
+	}
+
+	if (X509_sign(x509, issuer_key ? issuer_key : subject_key,
+		      EVP_sha256()))
+		return x509;
+err:
+	if (ext)
+		X509_EXTENSION_free(ext);
+	X509_free(x509);
+	return NULL;
+}
+
+static EVP_PKEY *
+make_key(void)
+{
+	EVP_PKEY_CTX *ctx;
+	EVP_PKEY *pkey = NULL;
+
+	ctx = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, NULL);
+	if (!ctx || EVP_PKEY_keygen_init(ctx) <= 0 ||
+	    EVP_PKEY_CTX_set_ec_paramgen_curve_nid(ctx,
+						   NID_X9_62_prime256v1) <= 0 ||
+	    EVP_PKEY_keygen(ctx, &pkey) <= 0)
+		pkey = NULL;
+	EVP_PKEY_CTX_free(ctx);
+	return pkey;
+}
+
+/*
+ * Whether the host's libcrypto verifies p7 with cert as the only trusted
+ * certificate.
+ */
+static BOOLEAN
+openssl_verifies(PKCS7 *p7, X509 *cert, const char *data)
+{
+	X509_STORE *store;
+	BIO *bio;
+	int ok;
+
+	store = X509_STORE_new();
+	bio = BIO_new_mem_buf(data, -1);
+	if (!store || !bio || !X509_STORE_add_cert(store, cert)) {
+		ok = -1;
+		goto out;
+	}
+	X509_STORE_set_flags(store, X509_V_FLAG_PARTIAL_CHAIN);
+	X509_STORE_set_purpose(store, X509_PURPOSE_ANY);
+	ok = PKCS7_verify(p7, NULL, store, bio, NULL, PKCS7_BINARY);
+	ERR_clear_error();
+out:
+	BIO_free(bio);
+	X509_STORE_free(store);
+	return ok == 1;
+}
+
+/*
+ * A signature from a leaf certificate, carrying it and the intermediate
+ * CA that issued it, checked against every certificate that could or
+ * couldn't end its chain.  Whatever pkcs7_may_chain_to() rules out, the
+ * host's libcrypto has to fail to verify.
+ */
+static int
+test_pkcs7_may_chain_to(void)
+{
+	static const char data[] = "test-der signed data";
+	EVP_PKEY *root_key = NULL, *inter_key = NULL, *leaf_key = NULL;
+	EVP_PKEY *other_key = NULL;
+	X509 *root = NULL, *inter = NULL, *leaf = NULL;
+	STACK_OF(X509) *chain = NULL;
+	PKCS7 *p7 = NULL;
+	BIO *bio = NULL;
+	UINT8 *p7_der = NULL, *signed_der = NULL, *der = NULL, *copy = NULL;
+	int p7_len, signed_len, len, ret = -1;
+	unsigned int i;
+	struct {
+		const char *what;
+		X509 *cert;
+		BOOLEAN may;
+	} anchors[9];
+	unsigned int n = 0;
+
+	root_key = make_key();
+	inter_key = make_key();
+	leaf_key = make_key();
+	other_key = make_key();
+	assert_goto(root_key && inter_key && leaf_key && other_key, err,
+		    "couldn't make keys\n");
+	root = make_ca("Test Root", 0, NULL, NULL, root_key, TRUE);
+	inter = make_ca("Test Intermediate", 0, root, root_key, inter_key,
+			TRUE);
+	leaf = make_ca("Test Leaf", 0, inter, inter_key, leaf_key, TRUE);
+	assert_goto(root && inter && leaf, err, "couldn't make the chain\n");
+
+	chain = sk_X509_new_null();
+	bio = BIO_new_mem_buf(data, -1);
+	assert_goto(chain && bio && sk_X509_push(chain, inter), err,
+		    "allocation failed\n");
+	p7 = PKCS7_sign(leaf, leaf_key, chain, bio,
+			PKCS7_BINARY | PKCS7_DETACHED);
+	assert_goto(p7 != NULL, err, "PKCS7_sign failed\n");
+	p7_len = i2d_PKCS7(p7, &p7_der);
+	assert_goto(p7_len > 0, err, "i2d_PKCS7 failed\n");
+	/* Without its ContentInfo, as Authenticode allows */
+	signed_len = i2d_PKCS7_SIGNED(p7->d.sign, &signed_der);
+	assert_goto(signed_len > 0, err, "i2d_PKCS7_SIGNED failed\n");
+
+	anchors[n].what = "root";
+	anchors[n].cert = X509_dup(root);
+	anchors[n++].may = TRUE;
+	anchors[n].what = "intermediate";
+	anchors[n].cert = X509_dup(inter);
+	anchors[n++].may = TRUE;
+	anchors[n].what = "leaf";
+	anchors[n].cert = X509_dup(leaf);
+	anchors[n++].may = TRUE;
+	anchors[n].what = "unrelated root";
+	anchors[n].cert = make_ca("Other Root", 0, NULL, NULL, other_key,
+				  TRUE);
+	anchors[n++].may = FALSE;
+	anchors[n].what = "root with another key";
+	anchors[n].cert = make_ca("Test Root", 0, NULL, NULL, other_key,
+				  TRUE);
+	anchors[n++].may = FALSE;
+	anchors[n].what = "root with another key and no identifier";
+	anchors[n].cert = make_ca("Test Root", 0, NULL, NULL, other_key,
+				  FALSE);
+	anchors[n++].may = TRUE;
+	/* OpenSSL folds these to the same name, so this one verifies */
+	anchors[n].what = "root named in another case and spacing";
+	anchors[n].cert = make_ca("  test   ROOT ", 1, NULL, NULL, root_key,
+				  FALSE);
+	anchors[n++].may = TRUE;
+	anchors[n].what = "root with a longer name";
+	anchors[n].cert = make_ca("Test Root 2", 0, NULL, NULL, root_key,
+				  FALSE);
+	anchors[n++].may = FALSE;
+	/* Not ASCII, so it's left to OpenSSL */
+	anchors[n].what = "root with a name that isn't ASCII";
+	anchors[n].cert = make_ca("Test R\xc3\xb6ot", 1, NULL, NULL,
+				  root_key, FALSE);
+	anchors[n++].may = TRUE;
+
+	for (i = 0; i < n; i++) {
+		assert_goto(anchors[i].cert != NULL, err,
+			    "couldn't make the %s\n", anchors[i].what);
+		len = i2d_X509(anchors[i].cert, &der);
+		assert_goto(len > 0, err, "i2d_X509 failed\n");
+
+		assert_goto(pkcs7_may_chain_to(p7_der, p7_len, der, len) ==
+			    anchors[i].may, err,
+			    "the %s %s be in the chain\n", anchors[i].what,
+			    anchors[i].may ? "should" : "shouldn't");
+		assert_goto(pkcs7_may_chain_to(signed_der, signed_len, der,
+					       len) == anchors[i].may, err,
+			    "without a ContentInfo, the %s %s be in the chain\n",
+			    anchors[i].what,
+			    anchors[i].may ? "should" : "shouldn't");
+		assert_goto(anchors[i].may ||
+			    !openssl_verifies(p7, anchors[i].cert, data), err,
+			    "OpenSSL verifies with the %s\n", anchors[i].what);
+		OPENSSL_free(der);
+		der = NULL;
+	}
+	assert_goto(openssl_verifies(p7, anchors[0].cert, data) &&
+		    openssl_verifies(p7, anchors[6].cert, data), err,
+		    "OpenSSL doesn't verify with the root\n");
+
+	/*
+	 * Cut off or messed with, the signature mustn't be read past its
+	 * end, and whatever can't be parsed could end the chain.
+	 */
+	len = i2d_X509(anchors[3].cert, &der);
+	assert_goto(len > 0, err, "i2d_X509 failed\n");
+	for (i = 0; i < (unsigned int)p7_len; i++) {
+		copy = malloc(i ? i : 1);
+		assert_goto(copy != NULL, err, "malloc failed\n");
+		memcpy(copy, p7_der, i);
+		assert_goto(pkcs7_may_chain_to(copy, i, der, len), err,
+			    "%u bytes of the signature can't chain\n", i);
+		free(copy);
+		copy = NULL;
+	}
+	copy = malloc(p7_len);
+	assert_goto(copy != NULL, err, "malloc failed\n");
+	for (i = 0; i < (unsigned int)p7_len; i++) {
+		static const UINT8 bytes[] = { 0x00, 0x7f, 0x84, 0xff };
+		unsigned int j;
+
+		for (j = 0; j < 4; j++) {
+			memcpy(copy, p7_der, p7_len);
+			copy[i] = bytes[j];
+			pkcs7_may_chain_to(copy, p7_len, der, len);
+		}
+	}
+
+	ret = 0;
+err:
+	while (n > 0)
+		X509_free(anchors[--n].cert);
+	free(copy);
+	OPENSSL_free(der);
+	OPENSSL_free(p7_der);
+	OPENSSL_free(signed_der);
+	PKCS7_free(p7);
+	BIO_free(bio);
+	sk_X509_free(chain);
+	X509_free(root);
+	X509_free(inter);
+	X509_free(leaf);
+	EVP_PKEY_free(root_key);
+	EVP_PKEY_free(inter_key);
+	EVP_PKEY_free(leaf_key);
+	EVP_PKEY_free(other_key);
+	return ret;
+}
+
+int
+main(void)
+{
+	EVP_PKEY_CTX *ctx;
+	int status = 0;
+
+	ctx = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, NULL);
+	if (!ctx || EVP_PKEY_keygen_init(ctx) <= 0 ||
+	    EVP_PKEY_CTX_set_ec_paramgen_curve_nid(ctx,
+						   NID_X9_62_prime256v1) <= 0 ||
+	    EVP_PKEY_keygen(ctx, &key) <= 0) {
+		printf("couldn't make a key\n");
+		return -1;
+	}
+	EVP_PKEY_CTX_free(ctx);
+
+	test(test_x509_has_eku);
+	test(test_x509_has_eku_damaged);
+	test(test_x509_has_eku_ber);
+	test(test_pkcs7_may_chain_to);
+
+	EVP_PKEY_free(key);
+	return status;
+}
+
+// vim:fenc=utf-8:tw=75:noet
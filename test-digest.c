@@ -0,0 +1,575 @@
+// SPDX-License-Identifier: BSD-2-Clause-Patent
+/*
+ * test-digest.c - test the multi-digest engine and the SHA kernels
+ */
+
+#ifndef SHIM_UNIT_TEST
+#define SHIM_UNIT_TEST
+#endif
+#include "shim.h"
+
+#include <Library/BaseCryptLib.h>
+#include <openssl/sha.h>
+#include <stdio.h>
+
+#include "test-random.h"
+
+static UINT32 all_algs = DIGEST_SHA1 | DIGEST_SHA256 | DIGEST_SHA384 |
+			 DIGEST_SHA512;
+
+static int
+check_digests(digest_set_t *digests, const UINT8 *data, size_t size)
+{
+	UINT8 md[SHA512_DIGEST_SIZE];
+
+	SHA1(data, size, md);
+	assert_zero_return(memcmp(md, digests->sha1, SHA1_DIGEST_SIZE), -1,
+			   "sha1 mismatch for size %zu\n", size);
+	SHA256(data, size, md);
+	assert_zero_return(memcmp(md, digests->sha256, SHA256_DIGEST_SIZE), -1,
+			   "sha256 mismatch for size %zu\n", size);
+	SHA384(data, size, md);
+	assert_zero_return(memcmp(md, digests->sha384, SHA384_DIGEST_SIZE), -1,
+			   "sha384 mismatch for size %zu\n", size);
+	SHA512(data, size, md);
+	assert_zero_return(memcmp(md, digests->sha512, SHA512_DIGEST_SIZE), -1,
+			   "sha512 mismatch for size %zu\n", size);
+	return 0;
+}
+
+static UINT8 *
+make_buffer(size_t size)
+{
+	UINT8 *buf = malloc(size);
+	size_t i;
+
+	if (!buf)
+		return NULL;
+	for (i = 0; i < size; i++)
+		buf[i] = random_bin[i % random_bin_len] ^ (i >> 9);
+	return buf;
+}
+
+static int
+test_digest_kat(void)
+{
+	static const UINT8 abc_sha256[SHA256_DIGEST_SIZE] = {
+		0xba, 0x78, 0x16, 0xbf, 0x8f, 0x01, 0xcf, 0xea,
+		0x41, 0x41, 0x40, 0xde, 0x5d, 0xae, 0x22, 0x23,
+		0xb0, 0x03, 0x61, 0xa3, 0x96, 0x17, 0x7a, 0x9c,
+		0xb4, 0x10, 0xff, 0x61, 0xf2, 0x00, 0x15, 0xad
+	};
+	digest_ctx_t ctx;
+	digest_set_t digests;
+	EFI_STATUS efi_status;
+
+	efi_status = digest_init(&ctx, all_algs);
+	assert_zero_return(efi_status, -1, "digest_init failed\n");
+	digest_update(&ctx, "abc", 3);
+	efi_status = digest_final(&ctx, &digests);
+	digest_free(&ctx);
+	assert_zero_return(efi_status, -1, "digest_final failed\n");
+	assert_equal_return(digests.algs, all_algs, -1, "got %x expected %x\n");
+	assert_zero_return(memcmp(digests.sha256, abc_sha256,
+				  SHA256_DIGEST_SIZE), -1,
+			   "sha256(\"abc\") mismatch\n");
+
+	return check_digests(&digests, (const UINT8 *)"abc", 3);
+}
+
+static int
+test_digest_chunking(void)
+{
+	size_t sizes[] = { 0, 1, 63, 64, 65, DIGEST_CHUNK_SIZE - 1,
+			   DIGEST_CHUNK_SIZE, DIGEST_CHUNK_SIZE + 1,
+			   3 * DIGEST_CHUNK_SIZE + 17 };
+	size_t i, pos, step;
+	digest_ctx_t ctx;
+	digest_set_t digests;
+	UINT8 *buf;
+	int rc = 0;
+
+	buf = make_buffer(4 * DIGEST_CHUNK_SIZE);
+	assert_nonzero_return(buf, -1, "allocation failed\n");
+
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]) && rc == 0; i++) {
+		/* feed it in uneven pieces that straddle the chunk size */
+		digest_init(&ctx, all_algs);
+		for (pos = 0, step = 1; pos < sizes[i]; pos += step, step *= 3) {
+			if (step > sizes[i] - pos)
+				step = sizes[i] - pos;
+			digest_update(&ctx, buf + pos, step);
+		}
+		digest_final(&ctx, &digests);
+		digest_free(&ctx);
+		rc = check_digests(&digests, buf, sizes[i]);
+	}
+
+	free(buf);
+	return rc;
+}
+
+static int
+test_digest_subset(void)
+{
+	digest_ctx_t ctx;
+	digest_set_t digests;
+	UINT8 md[SHA256_DIGEST_SIZE];
+	UINT8 zero[SHA512_DIGEST_SIZE] = { 0, };
+
+	digest_init(&ctx, DIGEST_SHA256);
+	assert_equal_return(ctx.sha1ctx, NULL, -1, "got %p expected %p\n");
+	digest_update(&ctx, random_bin, random_bin_len);
+	digest_final(&ctx, &digests);
+	digest_free(&ctx);
+
+	SHA256(random_bin, random_bin_len, md);
+	assert_zero_return(memcmp(md, digests.sha256, sizeof(md)), -1,
+			   "sha256 mismatch\n");
+	assert_zero_return(memcmp(zero, digests.sha1, SHA1_DIGEST_SIZE), -1,
+			   "sha1 was computed but not requested\n");
+	assert_zero_return(memcmp(zero, digests.sha384, SHA384_DIGEST_SIZE), -1,
+			   "sha384 was computed but not requested\n");
+	return 0;
+}
+
+/*
+ * digest_update_multi() has to come out the same as digest_update() on
+ * each context, for more contexts than there are lanes, with some of
+ * them given nothing and one not doing SHA-256 at all.
+ */
+#define MULTI_CTXS 11
+#define MULTI_SPAN (3 * 4096)
+
+static int
+test_digest_multi(void)
+{
+	digest_ctx_t ctxs[MULTI_CTXS], *ctxp[MULTI_CTXS];
+	const void *data[MULTI_CTXS];
+	UINTN sizes[MULTI_CTXS], done[MULTI_CTXS] = { 0, };
+	digest_set_t digests;
+	UINT8 md[SHA1_DIGEST_SIZE];
+	EFI_STATUS efi_status;
+	UINT8 *buf, *mine;
+	UINTN i, round;
+	int rc = 0;
+
+	buf = make_buffer(MULTI_CTXS * MULTI_SPAN);
+	assert_nonzero_return(buf, -1, "allocation failed\n");
+
+	for (i = 0; i < MULTI_CTXS; i++) {
+		digest_init(&ctxs[i], i == 4 ? DIGEST_SHA1 : all_algs);
+		ctxp[i] = &ctxs[i];
+	}
+
+	for (round = 0; round < 3; round++) {
+		for (i = 0; i < MULTI_CTXS; i++) {
+			data[i] = buf + i * MULTI_SPAN + done[i];
+			sizes[i] = i == 7 ? 0 : (i * 577 + round * 1061) % 4096;
+			done[i] += sizes[i];
+		}
+		efi_status = digest_update_multi(ctxp, data, sizes, MULTI_CTXS);
+		assert_goto(!EFI_ERROR(efi_status), out,
+			    "digest_update_multi failed\n");
+	}
+
+	for (i = 0; i < MULTI_CTXS && rc == 0; i++) {
+		mine = buf + i * MULTI_SPAN;
+		digest_final(&ctxs[i], &digests);
+		if (i != 4) {
+			rc = check_digests(&digests, mine, done[i]);
+			continue;
+		}
+		SHA1(mine, done[i], md);
+		assert_goto(memcmp(md, digests.sha1, sizeof(md)) == 0, out,
+			    "sha1 mismatch\n");
+		assert_goto(digests.algs == DIGEST_SHA1, out,
+			    "got algs %x\n", digests.algs);
+	}
+	goto done;
+out:
+	rc = -1;
+done:
+	for (i = 0; i < MULTI_CTXS; i++)
+		digest_free(&ctxs[i]);
+	free(buf);
+	return rc;
+}
+
+/*
+ * Hash a synthetic PE-sized image the way pe_image_digests() walks it: a
+ * few header ranges followed by large sections.
+ */
+#define BENCH_SIZE (24 * 1024 * 1024)
+#define BENCH_ROUNDS 3
+
+struct range {
+	size_t start;
+	size_t size;
+};
+
+static struct range bench_ranges[] = {
+	{ 0, 0xd8 },
+	{ 0xdc, 0x98 - 0x8 },
+	{ 0x180, 0x400 - 0x180 },
+	{ 0x400, 0x200000 },
+	{ 0x200400, 0x40000 },
+	{ 0x240400, BENCH_SIZE - 0x240400 },
+};
+#define N_RANGES (sizeof(bench_ranges) / sizeof(bench_ranges[0]))
+
+static UINT64
+bench_separate(const UINT8 *buf, digest_set_t *digests)
+{
+	void *sha1ctx = malloc(Sha1GetContextSize());
+	void *sha256ctx = malloc(Sha256GetContextSize());
+	UINT64 start, end;
+	size_t i;
+
+	start = test_ticks();
+	Sha256Init(sha256ctx);
+	Sha1Init(sha1ctx);
+	for (i = 0; i < N_RANGES; i++) {
+		Sha256Update(sha256ctx, buf + bench_ranges[i].start,
+			     bench_ranges[i].size);
+		Sha1Update(sha1ctx, buf + bench_ranges[i].start,
+			   bench_ranges[i].size);
+	}
+	Sha256Final(sha256ctx, digests->sha256);
+	Sha1Final(sha1ctx, digests->sha1);
+	end = test_ticks();
+
+	free(sha1ctx);
+	free(sha256ctx);
+	return end - start;
+}
+
+static UINT64
+bench_fused(const UINT8 *buf, digest_set_t *digests)
+{
+	digest_ctx_t ctx;
+	UINT64 start, end;
+	size_t i;
+
+	start = test_ticks();
+	digest_init(&ctx, DIGEST_SHA1 | DIGEST_SHA256);
+	for (i = 0; i < N_RANGES; i++)
+		digest_update(&ctx, buf + bench_ranges[i].start,
+			      bench_ranges[i].size);
+	digest_final(&ctx, digests);
+	digest_free(&ctx);
+	end = test_ticks();
+
+	return end - start;
+}
+
+static int
+test_digest_bench(void)
+{
+	digest_set_t separate, fused;
+	UINT64 t_separate = ~0ull, t_fused = ~0ull, t;
+	size_t bytes = 0, i;
+	UINT8 *buf;
+
+	buf = make_buffer(BENCH_SIZE);
+	assert_nonzero_return(buf, -1, "allocation failed\n");
+
+	for (i = 0; i < N_RANGES; i++)
+		bytes += bench_ranges[i].size;
+
+	for (i = 0; i < BENCH_ROUNDS; i++) {
+		t = bench_separate(buf, &separate);
+		t_separate = MIN(t, t_separate);
+		t = bench_fused(buf, &fused);
+		t_fused = MIN(t, t_fused);
+	}
+	free(buf);
+
+	assert_zero_return(memcmp(separate.sha1, fused.sha1,
+				  SHA1_DIGEST_SIZE), -1, "sha1 mismatch\n");
+	assert_zero_return(memcmp(separate.sha256, fused.sha256,
+				  SHA256_DIGEST_SIZE), -1, "sha256 mismatch\n");
+
+	printf("sha1+sha256 over %zu bytes: separate %.3f bytes/%s, "
+	       "fused %.3f bytes/%s\n", bytes,
+	       (double)bytes / t_separate, test_tick_unit(),
+	       (double)bytes / t_fused, test_tick_unit());
+	return 0;
+}
+
+/*
+ * Pad and hash a message with the SHA extension kernels alone, so they
+ * can be checked against the host's libcrypto.
+ */
+static BOOLEAN
+accel_hash(int sha256, const UINT8 *data, size_t size, UINT8 *md)
+{
+	UINT32 state[8] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476,
+			    0xc3d2e1f0 };
+	static const UINT32 sha256_iv[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+		0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+	};
+	UINT8 tail[128] = { 0, };
+	size_t whole = size & ~(size_t)63, rest = size - whole, tailsz, i;
+	UINT64 bits = (UINT64)size * 8;
+	int nwords = sha256 ? 8 : 5;
+	BOOLEAN (EFIAPI *blocks)(UINT32 *, CONST UINT8 *, UINTN) =
+		sha256 ? Sha256AccelBlocks : Sha1AccelBlocks;
+
+	if (sha256)
+		memcpy(state, sha256_iv, sizeof(state));
+
+	memcpy(tail, data + whole, rest);
+	tail[rest] = 0x80;
+	tailsz = rest + 9 > 64 ? 128 : 64;
+	for (i = 0; i < 8; i++)
+		tail[tailsz - 1 - i] = bits >> (8 * i);
+
+	if (whole && !blocks(state, data, whole / 64))
+		return FALSE;
+	if (!blocks(state, tail, tailsz / 64))
+		return FALSE;
+
+	for (i = 0; i < (size_t)nwords; i++) {
+		md[4 * i] = state[i] >> 24;
+		md[4 * i + 1] = state[i] >> 16;
+		md[4 * i + 2] = state[i] >> 8;
+		md[4 * i + 3] = state[i];
+	}
+	return TRUE;
+}
+
+static int
+test_sha_accel_kat(void)
+{
+	size_t sizes[] = { 0, 3, 55, 56, 63, 64, 65, 119, 120, 1000,
+			   random_bin_len };
+	UINT8 md[SHA256_DIGEST_SIZE], expected[SHA256_DIGEST_SIZE];
+	size_t i;
+
+	if (ShaAccelFeatures() == 0) {
+		printf("no SHA instructions on this CPU, skipping\n");
+		return 0;
+	}
+
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		if (ShaAccelFeatures() & SHA_ACCEL_SHA1) {
+			accel_hash(0, random_bin, sizes[i], md);
+			SHA1(random_bin, sizes[i], expected);
+			assert_zero_return(memcmp(md, expected,
+						  SHA1_DIGEST_SIZE), -1,
+					   "sha1 mismatch for size %zu\n",
+					   sizes[i]);
+		}
+		if (ShaAccelFeatures() & SHA_ACCEL_SHA256) {
+			accel_hash(1, random_bin, sizes[i], md);
+			SHA256(random_bin, sizes[i], expected);
+			assert_zero_return(memcmp(md, expected,
+						  SHA256_DIGEST_SIZE), -1,
+					   "sha256 mismatch for size %zu\n",
+					   sizes[i]);
+		}
+	}
+	return 0;
+}
+
+static int
+test_sha_accel_bench(void)
+{
+	UINT8 md[SHA256_DIGEST_SIZE];
+	size_t size = 8 * 1024 * 1024;
+	UINT64 t, t_sha1 = ~0ull, t_sha256 = ~0ull;
+	UINT8 *buf;
+	int i;
+
+	if ((ShaAccelFeatures() & (SHA_ACCEL_SHA1 | SHA_ACCEL_SHA256)) !=
+	    (SHA_ACCEL_SHA1 | SHA_ACCEL_SHA256))
+		return 0;
+
+	buf = make_buffer(size);
+	assert_nonzero_return(buf, -1, "allocation failed\n");
+	for (i = 0; i < BENCH_ROUNDS; i++) {
+		t = test_ticks();
+		accel_hash(0, buf, size, md);
+		t_sha1 = MIN(test_ticks() - t, t_sha1);
+		t = test_ticks();
+		accel_hash(1, buf, size, md);
+		t_sha256 = MIN(test_ticks() - t, t_sha256);
+	}
+	free(buf);
+
+	printf("SHA extensions over %zu bytes: sha1 %.3f bytes/%s, "
+	       "sha256 %.3f bytes/%s\n", size,
+	       (double)size / t_sha1, test_tick_unit(),
+	       (double)size / t_sha256, test_tick_unit());
+	return 0;
+}
+
+/*
+ * Pad and hash several messages of the same size with the multi-buffer
+ * kernel, so it can be checked against the host's libcrypto.
+ */
+static BOOLEAN
+mb_hash(UINTN lanes, const UINT8 **data, size_t size,
+	UINT8 md[][SHA256_DIGEST_SIZE])
+{
+	static const UINT32 sha256_iv[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+		0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+	};
+	UINT32 state[SHA256_MB_LANES][8];
+	UINT32 *states[SHA256_MB_LANES];
+	UINT8 tail[SHA256_MB_LANES][128];
+	const UINT8 *tails[SHA256_MB_LANES];
+	size_t whole = size & ~(size_t)63, rest = size - whole, tailsz, i;
+	UINT64 bits = (UINT64)size * 8;
+	UINTN lane;
+
+	tailsz = rest + 9 > 64 ? 128 : 64;
+	for (lane = 0; lane < lanes; lane++) {
+		memcpy(state[lane], sha256_iv, sizeof(sha256_iv));
+		states[lane] = state[lane];
+		memset(tail[lane], 0, sizeof(tail[lane]));
+		memcpy(tail[lane], data[lane] + whole, rest);
+		tail[lane][rest] = 0x80;
+		for (i = 0; i < 8; i++)
+			tail[lane][tailsz - 1 - i] = bits >> (8 * i);
+		tails[lane] = tail[lane];
+	}
+
+	if (whole && !Sha256AccelMultiBlocks(states, data, lanes, whole / 64))
+		return FALSE;
+	if (!Sha256AccelMultiBlocks(states, tails, lanes, tailsz / 64))
+		return FALSE;
+
+	for (lane = 0; lane < lanes; lane++) {
+		for (i = 0; i < 8; i++) {
+			md[lane][4 * i] = state[lane][i] >> 24;
+			md[lane][4 * i + 1] = state[lane][i] >> 16;
+			md[lane][4 * i + 2] = state[lane][i] >> 8;
+			md[lane][4 * i + 3] = state[lane][i];
+		}
+	}
+	return TRUE;
+}
+
+static int
+test_sha256_mb_kat(void)
+{
+	size_t sizes[] = { 0, 3, 55, 56, 63, 64, 65, 119, 120, 1000, 4096 };
+	UINT8 md[SHA256_MB_LANES][SHA256_DIGEST_SIZE];
+	UINT8 expected[SHA256_DIGEST_SIZE];
+	const UINT8 *data[SHA256_MB_LANES];
+	UINTN lanes, lane;
+	size_t i;
+
+	if (!(ShaAccelFeatures() & SHA_ACCEL_SHA256_MB)) {
+		printf("no multi-buffer SHA-256 on this CPU, skipping\n");
+		return 0;
+	}
+
+	assert_false_return(Sha256AccelMultiBlocks(NULL, NULL,
+						   SHA256_MB_LANES + 1, 1),
+			    -1, "took too many lanes\n");
+
+	for (lanes = 1; lanes <= SHA256_MB_LANES; lanes++) {
+		for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+			/* a different message in every lane */
+			for (lane = 0; lane < lanes; lane++)
+				data[lane] = random_bin + lane * 257;
+			assert_true_return(mb_hash(lanes, data, sizes[i], md),
+					   -1, "kernel refused %lu lanes\n",
+					   lanes);
+			for (lane = 0; lane < lanes; lane++) {
+				SHA256(data[lane], sizes[i], expected);
+				assert_zero_return(memcmp(md[lane], expected,
+							  SHA256_DIGEST_SIZE),
+						   -1, "lane %lu of %lu mismatch "
+						   "for size %zu\n", lane,
+						   lanes, sizes[i]);
+			}
+		}
+	}
+	return 0;
+}
+
+/*
+ * N images verified one after another, against all of them at once
+ */
+static int
+test_sha256_mb_bench(void)
+{
+	UINT8 md[SHA256_MB_LANES][SHA256_DIGEST_SIZE];
+	UINT8 one[SHA256_DIGEST_SIZE];
+	const UINT8 *data[SHA256_MB_LANES];
+	size_t size = 2 * 1024 * 1024;
+	UINT64 t, t_portable = ~0ull, t_accel = ~0ull, t_lane = ~0ull;
+	UINT64 t_mb = ~0ull;
+	UINTN lane;
+	UINT8 *buf;
+	int i;
+
+	if (!(ShaAccelFeatures() & SHA_ACCEL_SHA256_MB))
+		return 0;
+
+	buf = make_buffer(size * SHA256_MB_LANES);
+	assert_nonzero_return(buf, -1, "allocation failed\n");
+	for (lane = 0; lane < SHA256_MB_LANES; lane++)
+		data[lane] = buf + lane * size;
+
+	for (i = 0; i < BENCH_ROUNDS; i++) {
+		t = test_ticks();
+		for (lane = 0; lane < SHA256_MB_LANES; lane++)
+			SHA256(data[lane], size, one);
+		t_portable = MIN(test_ticks() - t, t_portable);
+
+		if (ShaAccelFeatures() & SHA_ACCEL_SHA256) {
+			t = test_ticks();
+			for (lane = 0; lane < SHA256_MB_LANES; lane++)
+				accel_hash(1, data[lane], size, one);
+			t_accel = MIN(test_ticks() - t, t_accel);
+		}
+
+		/* what the vector code does for one image on its own */
+		t = test_ticks();
+		for (lane = 0; lane < SHA256_MB_LANES; lane++)
+			mb_hash(1, &data[lane], size, md);
+		t_lane = MIN(test_ticks() - t, t_lane);
+
+		t = test_ticks();
+		mb_hash(SHA256_MB_LANES, data, size, md);
+		t_mb = MIN(test_ticks() - t, t_mb);
+	}
+	free(buf);
+
+	printf("sha256 of %d %zu byte images: one at a time %.3f bytes/%s",
+	       SHA256_MB_LANES, size,
+	       (double)size * SHA256_MB_LANES / t_portable, test_tick_unit());
+	if (t_accel != ~0ull)
+		printf(", one at a time with SHA extensions %.3f bytes/%s",
+		       (double)size * SHA256_MB_LANES / t_accel,
+		       test_tick_unit());
+	printf(", one per vector %.3f bytes/%s, all at once %.3f bytes/%s\n",
+	       (double)size * SHA256_MB_LANES / t_lane, test_tick_unit(),
+	       (double)size * SHA256_MB_LANES / t_mb, test_tick_unit());
+	return 0;
+}
+
+int
+main(void)
+{
+	int status = 0;
+	test(test_digest_kat);
+	test(test_digest_chunking);
+	test(test_digest_subset);
+	test(test_digest_multi);
+	test(test_digest_bench);
+	test(test_sha_accel_kat);
+	test(test_sha_accel_bench);
+	test(test_sha256_mb_kat);
+	test(test_sha256_mb_bench);
+	return status;
+}
+
+// vim:fenc=utf-8:tw=75:noet
@@ -0,0 +1,589 @@
+// SPDX-License-Identifier: BSD-2-Clause-Patent
+/*
+ * test-loader.c - test deciding where an image is loaded, and reading
+ * it there
+ */
+
+#ifndef SHIM_UNIT_TEST
+#define SHIM_UNIT_TEST
+#endif
+#include "shim.h"
+
+#include <openssl/sha.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <time.h>
+
+#define FIXTURE_PAGES 16
+
+struct fixture_section {
+	char name[8];
+	UINT32 va;
+	UINT32 vsize;
+	UINT32 ptr;
+	UINT32 rawsize;
+	UINT32 flags;
+};
+
+struct fixture {
+	UINT32 file_alignment;
+	UINT32 section_alignment;
+	UINT32 image_size;
+	UINT32 header_size;
+	UINT32 file_size;
+	UINTN nsections;
+	struct fixture_section sections[4];
+};
+
+/*
+ * A PE32+ image the way a linker lays out a UKI: sections on page
+ * boundaries in the file as well as in memory, uninitialized data past the
+ * end of the file, and the signature at the end.
+ */
+static const struct fixture aligned = {
+	.file_alignment = 0x1000,
+	.section_alignment = 0x1000,
+	.image_size = 0x7000,
+	.header_size = 0x1000,
+	.file_size = 0x4300,
+	.nsections = 3,
+	.sections = {
+		{ ".text", 0x1000, 0x1e00, 0x1000, 0x2000,
+		  EFI_IMAGE_SCN_CNT_CODE },
+		{ ".data", 0x3000, 0x1000, 0x3000, 0x1000,
+		  EFI_IMAGE_SCN_CNT_INITIALIZED_DATA },
+		{ ".bss", 0x4000, 0x3000, 0, 0,
+		  EFI_IMAGE_SCN_CNT_UNINITIALIZED_DATA },
+	},
+};
+
+/*
+ * The same image linked with the usual 512 byte file alignment, so the
+ * sections have to be moved to their virtual addresses.
+ */
+static const struct fixture misaligned = {
+	.file_alignment = 0x200,
+	.section_alignment = 0x1000,
+	.image_size = 0x7000,
+	.header_size = 0x400,
+	.file_size = 0x3700,
+	.nsections = 3,
+	.sections = {
+		{ ".text", 0x1000, 0x1e00, 0x400, 0x2000,
+		  EFI_IMAGE_SCN_CNT_CODE },
+		{ ".data", 0x3000, 0x1000, 0x2400, 0x1000,
+		  EFI_IMAGE_SCN_CNT_INITIALIZED_DATA },
+		{ ".bss", 0x4000, 0x3000, 0, 0,
+		  EFI_IMAGE_SCN_CNT_UNINITIALIZED_DATA },
+	},
+};
+
+/*
+ * Write the headers of an image into data and fill in context the way
+ * read_header() would.
+ */
+static void
+build_image(const struct fixture *f, UINT8 *data,
+	    PE_COFF_LOADER_IMAGE_CONTEXT *context)
+{
+	EFI_IMAGE_DOS_HEADER *DosHdr = (EFI_IMAGE_DOS_HEADER *)data;
+	EFI_IMAGE_OPTIONAL_HEADER_UNION *PEHdr;
+	EFI_IMAGE_SECTION_HEADER *Section;
+	UINTN i;
+
+	memset(data, 0, f->file_size);
+	DosHdr->e_magic = EFI_IMAGE_DOS_SIGNATURE;
+	DosHdr->e_lfanew = 0x80;
+
+	PEHdr = (EFI_IMAGE_OPTIONAL_HEADER_UNION *)(data + DosHdr->e_lfanew);
+	PEHdr->Pe32Plus.Signature = EFI_IMAGE_NT_SIGNATURE;
+	PEHdr->Pe32Plus.FileHeader.NumberOfSections = f->nsections;
+	PEHdr->Pe32Plus.FileHeader.SizeOfOptionalHeader =
+		sizeof(EFI_IMAGE_OPTIONAL_HEADER64);
+	PEHdr->Pe32Plus.OptionalHeader.Magic = EFI_IMAGE_NT_OPTIONAL_HDR64_MAGIC;
+	PEHdr->Pe32Plus.OptionalHeader.SectionAlignment = f->section_alignment;
+	PEHdr->Pe32Plus.OptionalHeader.FileAlignment = f->file_alignment;
+	PEHdr->Pe32Plus.OptionalHeader.SizeOfImage = f->image_size;
+	PEHdr->Pe32Plus.OptionalHeader.SizeOfHeaders = f->header_size;
+	PEHdr->Pe32Plus.OptionalHeader.NumberOfRvaAndSizes =
+		EFI_IMAGE_NUMBER_OF_DIRECTORY_ENTRIES;
+
+	Section = (EFI_IMAGE_SECTION_HEADER *)(PEHdr + 1);
+	for (i = 0; i < f->nsections; i++) {
+		memcpy(Section[i].Name, f->sections[i].name, 8);
+		Section[i].VirtualAddress = f->sections[i].va;
+		Section[i].Misc.VirtualSize = f->sections[i].vsize;
+		Section[i].PointerToRawData = f->sections[i].ptr;
+		Section[i].SizeOfRawData = f->sections[i].rawsize;
+		Section[i].Characteristics = f->sections[i].flags;
+	}
+
+	memset(context, 0, sizeof(*context));
+	context->PEHdr = PEHdr;
+	context->FirstSection = Section;
+	context->NumberOfSections = f->nsections;
+	context->ImageSize = f->image_size;
+	context->SizeOfHeaders = f->header_size;
+	context->SectionAlignment = MAX(f->section_alignment, f->file_alignment);
+}
+
+static int
+test_loader_aligned(void)
+{
+	PE_COFF_LOADER_IMAGE_CONTEXT context;
+	UINT8 *data;
+	UINTN pages;
+	int rc = -1;
+
+	data = aligned_alloc(PAGE_SIZE, FIXTURE_PAGES * PAGE_SIZE);
+	assert_nonzero_return(data, -1, "\n");
+	build_image(&aligned, data, &context);
+
+	/* room for .bss, which is past the end of the file */
+	pages = loader_file_pages(data, LOADER_HEADER_SIZE, aligned.file_size);
+	assert_equal_goto(pages, aligned.image_size / PAGE_SIZE, err,
+			  "got %lu expected %lu\n");
+
+	assert_goto(loader_runs_in_place(data, aligned.file_size,
+					 pages * PAGE_SIZE, &context),
+		    err, "\n");
+
+	/* ... but not without that room */
+	pages = ALIGN_VALUE(aligned.file_size, PAGE_SIZE) / PAGE_SIZE;
+	assert_goto(!loader_runs_in_place(data, aligned.file_size,
+					  pages * PAGE_SIZE, &context),
+		    err, "\n");
+
+	rc = 0;
+err:
+	free(data);
+	return rc;
+}
+
+static int
+test_loader_misaligned(void)
+{
+	PE_COFF_LOADER_IMAGE_CONTEXT context;
+	UINT8 *data;
+	UINTN pages;
+	int rc = -1;
+
+	data = aligned_alloc(PAGE_SIZE, FIXTURE_PAGES * PAGE_SIZE);
+	assert_nonzero_return(data, -1, "\n");
+	build_image(&misaligned, data, &context);
+
+	/* nothing can run from this buffer, so it's only the file */
+	pages = loader_file_pages(data, LOADER_HEADER_SIZE,
+				  misaligned.file_size);
+	assert_equal_goto(pages,
+			  ALIGN_VALUE(misaligned.file_size, PAGE_SIZE) / PAGE_SIZE,
+			  err, "got %lu expected %lu\n");
+
+	assert_goto(!loader_runs_in_place(data, misaligned.file_size,
+					  FIXTURE_PAGES * PAGE_SIZE,
+					  &context),
+		    err, "\n");
+
+	rc = 0;
+err:
+	free(data);
+	return rc;
+}
+
+/*
+ * Page alignment in the headers isn't enough; every section has to be
+ * where it would be in memory, the buffer has to be aligned, and no two
+ * sections can share memory.
+ */
+static int
+test_loader_layout(void)
+{
+	PE_COFF_LOADER_IMAGE_CONTEXT context;
+	struct fixture f;
+	UINT8 *data;
+	int rc = -1;
+
+	data = aligned_alloc(PAGE_SIZE, (FIXTURE_PAGES + 1) * PAGE_SIZE);
+	assert_nonzero_return(data, -1, "\n");
+
+	f = aligned;
+	f.sections[1].ptr = 0x3100;
+	build_image(&f, data, &context);
+	assert_goto(!loader_runs_in_place(data, f.file_size,
+					  FIXTURE_PAGES * PAGE_SIZE,
+					  &context),
+		    err, "moved section\n");
+
+	f = aligned;
+	f.sections[1].vsize = 0x1800;
+	build_image(&f, data, &context);
+	assert_goto(loader_sections_overlap(&context), err, "\n");
+	assert_goto(!loader_runs_in_place(data, f.file_size,
+					  FIXTURE_PAGES * PAGE_SIZE,
+					  &context),
+		    err, "overlapping sections\n");
+
+	/* discardable sections aren't loaded, so they can't overlap */
+	f.sections[2].flags |= EFI_IMAGE_SCN_MEM_DISCARDABLE;
+	build_image(&f, data, &context);
+	assert_goto(!loader_sections_overlap(&context), err, "\n");
+
+	f = aligned;
+	build_image(&f, data + 0x200, &context);
+	assert_goto(!loader_runs_in_place(data + 0x200, f.file_size,
+					  FIXTURE_PAGES * PAGE_SIZE,
+					  &context),
+		    err, "unaligned buffer\n");
+
+	rc = 0;
+err:
+	free(data);
+	return rc;
+}
+
+static int
+test_loader_not_pe(void)
+{
+	UINT8 header[LOADER_HEADER_SIZE];
+	EFI_IMAGE_DOS_HEADER *DosHdr = (EFI_IMAGE_DOS_HEADER *)header;
+	UINTN pages;
+
+	memset(header, 0xa5, sizeof(header));
+	pages = loader_file_pages(header, sizeof(header), 0x2345);
+	assert_equal_return(pages, 3, -1, "got %lu expected %lu\n");
+
+	/* e_lfanew pointing past what was read */
+	DosHdr->e_magic = EFI_IMAGE_DOS_SIGNATURE;
+	DosHdr->e_lfanew = sizeof(header) - 8;
+	pages = loader_file_pages(header, sizeof(header), 0x2345);
+	assert_equal_return(pages, 3, -1, "got %lu expected %lu\n");
+
+	pages = loader_file_pages(header, 0, 0);
+	assert_equal_return(pages, 1, -1, "got %lu expected %lu\n");
+
+	return 0;
+}
+
+/*
+ * A file on a slow disk: every read takes latency_us, and ReadEx() does
+ * its reading on another thread, the way a disk controller would.
+ */
+struct throttled_file {
+	EFI_FILE file;
+	const UINT8 *contents;
+	UINTN size;
+	UINTN pos;
+	unsigned int latency_us;
+	BOOLEAN unsupported;
+	pthread_t thread;
+	EFI_FILE_IO_TOKEN *token;
+	volatile BOOLEAN in_flight;
+	unsigned int reads;
+	unsigned int events;
+};
+
+static struct throttled_file *the_file;
+
+static void
+throttle(unsigned int us)
+{
+	struct timespec ts = {
+		.tv_sec = us / 1000000,
+		.tv_nsec = (us % 1000000) * 1000,
+	};
+
+	nanosleep(&ts, NULL);
+}
+
+static UINTN
+throttled_copy(struct throttled_file *tf, UINTN size, VOID *buffer)
+{
+	throttle(tf->latency_us);
+	size = MIN(size, tf->size - tf->pos);
+	memcpy(buffer, tf->contents + tf->pos, size);
+	tf->pos += size;
+	tf->reads++;
+	return size;
+}
+
+static EFI_STATUS EFIAPI
+throttled_read(EFI_FILE *file, UINTN *size, VOID *buffer)
+{
+	struct throttled_file *tf = (struct throttled_file *)file;
+
+	*size = throttled_copy(tf, *size, buffer);
+	return EFI_SUCCESS;
+}
+
+static void *
+throttled_read_thread(void *arg)
+{
+	struct throttled_file *tf = arg;
+
+	tf->token->BufferSize = throttled_copy(tf, tf->token->BufferSize,
+					       tf->token->Buffer);
+	tf->token->Status = EFI_SUCCESS;
+	tf->in_flight = FALSE;
+	return NULL;
+}
+
+static EFI_STATUS EFIAPI
+throttled_read_ex(EFI_FILE *file, EFI_FILE_IO_TOKEN *token)
+{
+	struct throttled_file *tf = (struct throttled_file *)file;
+
+	if (tf->unsupported)
+		return EFI_UNSUPPORTED;
+	if (!token->Event || tf->in_flight)
+		return EFI_INVALID_PARAMETER;
+
+	tf->token = token;
+	tf->in_flight = TRUE;
+	if (pthread_create(&tf->thread, NULL, throttled_read_thread, tf)) {
+		tf->in_flight = FALSE;
+		return EFI_DEVICE_ERROR;
+	}
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI
+fake_create_event(UINT32 type, EFI_TPL tpl, EFI_EVENT_NOTIFY notify,
+		  VOID *context, EFI_EVENT *event)
+{
+	*event = the_file;
+	the_file->events++;
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI
+fake_wait_for_event(UINTN n, EFI_EVENT *events, UINTN *index)
+{
+	struct throttled_file *tf = events[0];
+
+	pthread_join(tf->thread, NULL);
+	*index = 0;
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI
+fake_close_event(EFI_EVENT event)
+{
+	the_file->events--;
+	return EFI_SUCCESS;
+}
+
+static EFI_BOOT_SERVICES fake_bs;
+
+static void
+throttled_open(struct throttled_file *tf, const UINT8 *contents, UINTN size,
+	       UINT64 revision, unsigned int latency_us)
+{
+	memset(tf, 0, sizeof(*tf));
+	tf->file.Revision = revision;
+	tf->file.Read = throttled_read;
+	tf->file.ReadEx = throttled_read_ex;
+	tf->contents = contents;
+	tf->size = size;
+	tf->latency_us = latency_us;
+	the_file = tf;
+
+	fake_bs.CreateEvent = fake_create_event;
+	fake_bs.WaitForEvent = fake_wait_for_event;
+	fake_bs.CloseEvent = fake_close_event;
+	BS = &fake_bs;
+}
+
+/*
+ * Hash the file as it comes in, noting whether a read was still going
+ * on while we did.
+ */
+struct hasher {
+	SHA256_CTX ctx;
+	UINTN hashed;
+	unsigned int calls;
+	unsigned int overlapped;
+};
+
+static EFI_STATUS
+hash_consumer(void *ctx, UINT8 *buffer, UINTN available)
+{
+	struct hasher *h = ctx;
+
+	h->calls++;
+	if (the_file->in_flight)
+		h->overlapped++;
+	if (available < h->hashed)
+		return EFI_INVALID_PARAMETER;
+
+	SHA256_Update(&h->ctx, buffer + h->hashed, available - h->hashed);
+	h->hashed = available;
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS
+fail_consumer(void *ctx, UINT8 *buffer, UINTN available)
+{
+	return available > 0x10000 ? EFI_ABORTED : EFI_SUCCESS;
+}
+
+#define STREAM_SIZE (4 * 1024 * 1024 + 123)
+#define STREAM_CHUNK (256 * 1024)
+#define STREAM_LATENCY_US 2000
+
+static UINT64
+elapsed_us(struct timespec *start)
+{
+	struct timespec end;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	return (end.tv_sec - start->tv_sec) * 1000000ull +
+	       end.tv_nsec / 1000 - start->tv_nsec / 1000;
+}
+
+static int
+stream_one(const UINT8 *contents, UINT8 *buffer, UINT64 revision,
+	   BOOLEAN unsupported, struct hasher *h, UINT64 *us)
+{
+	UINT8 want[SHA256_DIGEST_LENGTH], got[SHA256_DIGEST_LENGTH];
+	struct throttled_file tf;
+	struct timespec start;
+	EFI_STATUS efi_status;
+
+	SHA256(contents, STREAM_SIZE, want);
+
+	throttled_open(&tf, contents, STREAM_SIZE, revision,
+		       STREAM_LATENCY_US);
+	tf.unsupported = unsupported;
+	memset(h, 0, sizeof(*h));
+	SHA256_Init(&h->ctx);
+
+	/* the way load_image() does it: the headers are already there */
+	memcpy(buffer, contents, LOADER_HEADER_SIZE);
+	tf.pos = LOADER_HEADER_SIZE;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	efi_status = loader_read(&tf.file, buffer, LOADER_HEADER_SIZE,
+				 STREAM_SIZE, STREAM_CHUNK, hash_consumer, h);
+	*us = elapsed_us(&start);
+	assert_zero_return(efi_status, -1, "got %lx\n");
+	assert_zero_return(tf.events, -1, "event left open\n");
+
+	SHA256_Final(got, &h->ctx);
+	assert_zero_return(memcmp(got, want, sizeof(want)), -1,
+			   "digest mismatch\n");
+	assert_zero_return(memcmp(buffer, contents, STREAM_SIZE), -1,
+			   "contents mismatch\n");
+	assert_equal_return(h->hashed, STREAM_SIZE, -1,
+			    "got %lu expected %lu\n");
+
+	return 0;
+}
+
+static int
+test_loader_read(void)
+{
+	UINT8 *contents, *buffer;
+	struct hasher h;
+	UINT64 sync_us, async_us, fallback_us;
+	UINTN i;
+	int rc = -1;
+
+	contents = malloc(STREAM_SIZE);
+	buffer = malloc(STREAM_SIZE);
+	if (!contents || !buffer)
+		goto err;
+	for (i = 0; i < STREAM_SIZE; i++)
+		contents[i] = (i * 2654435761u) >> 13;
+
+	/* Read() only: reading and hashing take turns */
+	if (stream_one(contents, buffer, EFI_FILE_PROTOCOL_REVISION, FALSE,
+		       &h, &sync_us) < 0)
+		goto err;
+	assert_equal_goto(h.overlapped, 0, err, "got %u expected %u\n");
+
+	/* ReadEx(): everything but the last chunk is hashed mid-read */
+	if (stream_one(contents, buffer, EFI_FILE_PROTOCOL_REVISION2, FALSE,
+		       &h, &async_us) < 0)
+		goto err;
+	assert_equal_goto(h.overlapped, h.calls - 1, err,
+			  "got %u expected %u\n");
+
+	/* ReadEx() that isn't really there falls back to Read() */
+	if (stream_one(contents, buffer, EFI_FILE_PROTOCOL_REVISION2, TRUE,
+		       &h, &fallback_us) < 0)
+		goto err;
+	assert_equal_goto(h.overlapped, 0, err, "got %u expected %u\n");
+
+	printf("read and hashed %u bytes in %u byte chunks at %uus/chunk:\n",
+	       STREAM_SIZE, STREAM_CHUNK, STREAM_LATENCY_US);
+	printf("  Read():   %8llu us\n", (unsigned long long)sync_us);
+	printf("  ReadEx(): %8llu us\n", (unsigned long long)async_us);
+
+	rc = 0;
+err:
+	free(contents);
+	free(buffer);
+	return rc;
+}
+
+static int
+test_loader_read_errors(void)
+{
+	UINT8 contents[0x20000], buffer[sizeof(contents)];
+	struct throttled_file tf;
+	struct hasher h;
+	EFI_STATUS efi_status;
+
+	memset(contents, 0x5a, sizeof(contents));
+
+	/* the file is shorter than it said it was */
+	throttled_open(&tf, contents, sizeof(contents) / 2,
+		       EFI_FILE_PROTOCOL_REVISION2, 0);
+	memset(&h, 0, sizeof(h));
+	SHA256_Init(&h.ctx);
+	efi_status = loader_read(&tf.file, buffer, 0, sizeof(contents),
+				 0x4000, hash_consumer, &h);
+	assert_equal_return(efi_status, EFI_LOAD_ERROR, -1,
+			    "got %lx expected %lx\n");
+	assert_zero_return(tf.events, -1, "event left open\n");
+
+	/* the consumer gives up, and the read in flight is collected */
+	throttled_open(&tf, contents, sizeof(contents),
+		       EFI_FILE_PROTOCOL_REVISION2, 0);
+	efi_status = loader_read(&tf.file, buffer, 0, sizeof(contents),
+				 0x4000, fail_consumer, NULL);
+	assert_equal_return(efi_status, EFI_ABORTED, -1,
+			    "got %lx expected %lx\n");
+	assert_false_return(tf.in_flight, -1, "read left in flight\n");
+	assert_zero_return(tf.events, -1, "event left open\n");
+
+	/* and without a consumer it's just a read */
+	throttled_open(&tf, contents, sizeof(contents),
+		       EFI_FILE_PROTOCOL_REVISION2, 0);
+	memset(buffer, 0, sizeof(buffer));
+	efi_status = loader_read(&tf.file, buffer, 0, sizeof(contents),
+				 0, NULL, NULL);
+	assert_zero_return(efi_status, -1, "got %lx\n");
+	assert_zero_return(memcmp(buffer, contents, sizeof(contents)), -1,
+			   "contents mismatch\n");
+	assert_equal_return(tf.reads, 1, -1, "got %u expected %u\n");
+
+	return 0;
+}
+
+int
+main(void)
+{
+	int status = 0;
+
+	test(test_loader_aligned);
+	test(test_loader_misaligned);
+	test(test_loader_layout);
+	test(test_loader_not_pe);
+	test(test_loader_read);
+	test(test_loader_read_errors);
+
+	return status;
+}
+
+// vim:fenc=utf-8:tw=75:noet
@@ -0,0 +1,324 @@
+// SPDX-License-Identifier: BSD-2-Clause-Patent
+/*
+ * test-pkcs7anchor.c - test telling which trusted certificate a signature
+ * verified against
+ */
+
+#ifndef SHIM_UNIT_TEST
+#define SHIM_UNIT_TEST
+#endif
+#include "shim.h"
+
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/pkcs7.h>
+#include <openssl/x509.h>
+#include <openssl/x509v3.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+X509_STORE *Pkcs7StoreNew(VOID);
+BOOLEAN Pkcs7FindAnchor(STACK_OF(X509) *Certs, STACK_OF(X509) *Chain,
+			PKCS7 *Pkcs7, CONST UINT8 *InData, UINTN DataLength,
+			UINTN *Matched);
+
+/*
+ * Cryptlib's callback also accepts partial chains and expired
+ * certificates for OpenSSL 1.0.2; the host's libcrypto needs no help with
+ * the certificates made here.
+ */
+int
+X509VerifyCb(int status, X509_STORE_CTX *ctx)
+{
+	return status;
+}
+
+static const char data[] = "test-pkcs7anchor signed data";
+
+static EVP_PKEY *
+make_key(void)
+{
+	EVP_PKEY_CTX *ctx;
+	EVP_PKEY *pkey = NULL;
+
+	ctx = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, NULL);
+	if (!ctx || EVP_PKEY_keygen_init(ctx) <= 0 ||
+	    EVP_PKEY_CTX_set_ec_paramgen_curve_nid(ctx,
+						   NID_X9_62_prime256v1) <= 0 ||
+	    EVP_PKEY_keygen(ctx, &pkey) <= 0)
+		pkey = NULL;
+	EVP_PKEY_CTX_free(ctx);
+	return pkey;
+}
+
+/*
+ * A CA certificate for subject, signed by issuer's key, or its own if
+ * there's no issuer.
+ */
+static X509 *
+make_ca(const char *subject, X509 *issuer, EVP_PKEY *issuer_key,
+	EVP_PKEY *subject_key)
+{
+	X509_EXTENSION *ext;
+	X509V3_CTX ctx;
+	X509 *x509;
+
+	x509 = X509_new();
+	if (!x509)
+		return NULL;
+	X509_set_version(x509, 2);
+	ASN1_INTEGER_set(X509_get_serialNumber(x509), random());
+	X509_gmtime_adj(X509_getm_notBefore(x509), 0);
+	X509_gmtime_adj(X509_getm_notAfter(x509), 3600);
+	X509_NAME_add_entry_by_txt(X509_get_subject_name(x509), "CN",
+				   MBSTRING_ASC, (unsigned char *)subject,
+				   -1, -1, 0);
+	X509_set_issuer_name(x509, X509_get_subject_name(issuer ? issuer
+								: x509));
+	X509_set_pubkey(x509, subject_key);
+
+	X509V3_set_ctx(&ctx, issuer ? issuer : x509, x509, NULL, NULL, 0);
+	ext = X509V3_EXT_conf_nid(NULL, &ctx, NID_basic_constraints,
+				  "critical,CA:TRUE");
+	if (!ext || !X509_add_ext(x509, ext, -1)) {
+		X509_EXTENSION_free(ext);
+		X509_free(x509);
+		return NULL;
+	}
+	X509_EXTENSION_free(ext);
+
+	if (!X509_sign(x509, issuer_key ? issuer_key : subject_key,
+		       EVP_sha256())) {
+		X509_free(x509);
+		return NULL;
+	}
+	return x509;
+}
+
+/*
+ * Which of db, taken in order, a signature verified with chain is matched
+ * to, or -1 if none
+ */
+static int
+find_anchor(PKCS7 *p7, STACK_OF(X509) *chain, X509 **db, unsigned int n)
+{
+	STACK_OF(X509) *certs;
+	UINTN matched;
+	unsigned int i;
+	int ret = -1;
+
+	certs = sk_X509_new_null();
+	if (!certs)
+		return -1;
+	for (i = 0; i < n; i++)
+		if (!sk_X509_push(certs, db[i]))
+			goto out;
+	if (Pkcs7FindAnchor(certs, chain, p7, (CONST UINT8 *)data,
+			    strlen(data), &matched))
+		ret = matched;
+out:
+	ERR_clear_error();
+	sk_X509_free(certs);
+	return ret;
+}
+
+/*
+ * Whether a signature verifies against a store of db, added in order, set
+ * up the way a trust anchor's is.
+ */
+static int
+verify_with(PKCS7 *p7, X509 **db, unsigned int n)
+{
+	X509_STORE *store;
+	BIO *bio = NULL;
+	unsigned int i;
+	int ret = 0;
+
+	store = Pkcs7StoreNew();
+	if (!store)
+		goto out;
+	for (i = 0; i < n; i++)
+		if (!X509_STORE_add_cert(store, db[i]))
+			goto out;
+	bio = BIO_new_mem_buf(data, -1);
+	if (bio)
+		ret = PKCS7_verify(p7, NULL, store, bio, NULL,
+				   PKCS7_BINARY) == 1;
+out:
+	ERR_clear_error();
+	BIO_free(bio);
+	X509_STORE_free(store);
+	return ret;
+}
+
+static PKCS7 *
+sign(X509 *signer, EVP_PKEY *key, X509 *extra)
+{
+	STACK_OF(X509) *certs;
+	PKCS7 *p7 = NULL;
+	BIO *bio;
+
+	certs = sk_X509_new_null();
+	bio = BIO_new_mem_buf(data, -1);
+	if (certs && bio && (!extra || sk_X509_push(certs, extra)))
+		p7 = PKCS7_sign(signer, key, certs, bio,
+				PKCS7_BINARY | PKCS7_DETACHED);
+	BIO_free(bio);
+	sk_X509_free(certs);
+	return p7;
+}
+
+/*
+ * A signer issued by an intermediate A, which is issued by a root R.
+ * Checking each certificate of db = [R, A] in turn stops at A when the
+ * signature doesn't carry A, because R alone can't be reached.  Having
+ * found A in the store, though, OpenSSL 1.0.2 goes on to R, so the first
+ * of db in the chain it builds is R.  The host's libcrypto stops at A, so
+ * that chain is put together here.
+ */
+static int
+test_pkcs7anchor_order(void)
+{
+	EVP_PKEY *root_key = NULL, *inter_key = NULL, *signer_key = NULL;
+	EVP_PKEY *other_key = NULL;
+	X509 *root = NULL, *inter = NULL, *signer = NULL, *other = NULL;
+	STACK_OF(X509) *chain = NULL;
+	PKCS7 *p7 = NULL, *p7_inter = NULL;
+	X509 *db[3];
+	int ret = -1;
+
+	root_key = make_key();
+	inter_key = make_key();
+	signer_key = make_key();
+	other_key = make_key();
+	assert_goto(root_key && inter_key && signer_key && other_key, err,
+		    "couldn't make keys\n");
+	root = make_ca("Test Root", NULL, NULL, root_key);
+	inter = make_ca("Test Intermediate", root, root_key, inter_key);
+	signer = make_ca("Test Signer", inter, inter_key, signer_key);
+	other = make_ca("Other Root", NULL, NULL, other_key);
+	assert_goto(root && inter && signer && other, err,
+		    "couldn't make certificates\n");
+	p7 = sign(signer, signer_key, NULL);
+	p7_inter = sign(signer, signer_key, inter);
+	assert_goto(p7 && p7_inter, err, "PKCS7_sign failed\n");
+
+	chain = sk_X509_new_null();
+	assert_goto(chain && sk_X509_push(chain, signer) &&
+		    sk_X509_push(chain, inter) && sk_X509_push(chain, root),
+		    err, "allocation failed\n");
+
+	db[0] = root;
+	db[1] = inter;
+	assert_goto(find_anchor(p7, chain, db, 2) == 1, err,
+		    "matched the root, which can't verify alone\n");
+
+	/* Carrying the intermediate, the root does verify alone */
+	assert_goto(find_anchor(p7_inter, chain, db, 2) == 0, err,
+		    "didn't match the root with the intermediate carried\n");
+
+	db[0] = inter;
+	db[1] = root;
+	assert_goto(find_anchor(p7, chain, db, 2) == 0, err,
+		    "didn't match the intermediate listed first\n");
+
+	/* Only one of db in the chain, so it needn't be checked again */
+	db[0] = other;
+	db[1] = inter;
+	assert_goto(find_anchor(p7, chain, db, 2) == 1, err,
+		    "didn't match the only certificate in the chain\n");
+	db[0] = other;
+	assert_goto(find_anchor(p7, chain, db, 1) == -1, err,
+		    "matched a certificate that isn't in the chain\n");
+
+	db[0] = other;
+	db[1] = root;
+	db[2] = inter;
+	assert_goto(find_anchor(p7, chain, db, 3) == 2, err,
+		    "didn't skip past the root\n");
+
+	ret = 0;
+err:
+	sk_X509_free(chain);
+	PKCS7_free(p7);
+	PKCS7_free(p7_inter);
+	X509_free(root);
+	X509_free(inter);
+	X509_free(signer);
+	X509_free(other);
+	EVP_PKEY_free(root_key);
+	EVP_PKEY_free(inter_key);
+	EVP_PKEY_free(signer_key);
+	EVP_PKEY_free(other_key);
+	return ret;
+}
+
+/*
+ * Verifying against all of db at once can fail where one of them alone
+ * succeeds, so check_db_cert_in_ram() has to fall back to checking each
+ * when more than one could be in the chain.  OpenSSL 1.0.2 does it going
+ * on from a trusted intermediate to a root whose signature on it doesn't
+ * verify; both it and the host's libcrypto do it taking the first
+ * certificate in the store with the issuer's name, here an intermediate
+ * that was issued again with a new key.
+ */
+static int
+test_pkcs7anchor_set_fails(void)
+{
+	EVP_PKEY *root_key = NULL, *inter_key = NULL, *signer_key = NULL;
+	EVP_PKEY *old_key = NULL;
+	X509 *root = NULL, *inter = NULL, *signer = NULL, *old = NULL;
+	PKCS7 *p7 = NULL;
+	X509 *db[2];
+	int ret = -1;
+
+	root_key = make_key();
+	inter_key = make_key();
+	signer_key = make_key();
+	old_key = make_key();
+	assert_goto(root_key && inter_key && signer_key && old_key, err,
+		    "couldn't make keys\n");
+	root = make_ca("Test Root", NULL, NULL, root_key);
+	inter = make_ca("Test Intermediate", root, root_key, inter_key);
+	old = make_ca("Test Intermediate", root, root_key, old_key);
+	signer = make_ca("Test Signer", inter, inter_key, signer_key);
+	assert_goto(root && inter && old && signer, err,
+		    "couldn't make certificates\n");
+	p7 = sign(signer, signer_key, NULL);
+	assert_goto(p7 != NULL, err, "PKCS7_sign failed\n");
+
+	db[0] = old;
+	db[1] = inter;
+	assert_goto(!verify_with(p7, db, 1), err,
+		    "verified with the old intermediate\n");
+	assert_goto(verify_with(p7, db + 1, 1), err,
+		    "didn't verify with the new intermediate\n");
+	assert_goto(!verify_with(p7, db, 2), err,
+		    "verified with both, so there's nothing to fall back for\n");
+
+	ret = 0;
+err:
+	PKCS7_free(p7);
+	X509_free(root);
+	X509_free(inter);
+	X509_free(old);
+	X509_free(signer);
+	EVP_PKEY_free(root_key);
+	EVP_PKEY_free(inter_key);
+	EVP_PKEY_free(signer_key);
+	EVP_PKEY_free(old_key);
+	return ret;
+}
+
+int
+main(void)
+{
+	int status = 0;
+
+	test(test_pkcs7anchor_order);
+	test(test_pkcs7anchor_set_fails);
+
+	return status;
+}
+
+// vim:fenc=utf-8:tw=75:noet
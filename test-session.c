@@ -0,0 +1,391 @@
+// SPDX-License-Identifier: BSD-2-Clause-Patent
+/*
+ * test-session.c - test hashing an image as a loader hands it over
+ */
+
+#ifndef SHIM_UNIT_TEST
+#define SHIM_UNIT_TEST
+#endif
+#include "shim.h"
+
+#include <stdio.h>
+
+#define FILE_SIZE 0x3200
+#define CERTS_OFFSET 0x2c00
+#define CERTS_SIZE 0x600
+
+struct fixture {
+	UINT32 header_size;
+	UINTN nranges;
+	pe_hash_range_t ranges[8];
+};
+
+/*
+ * The usual layout: three pieces of header around the checksum and the
+ * certificate table entry, then the sections in file order.
+ */
+static const struct fixture in_order = {
+	.header_size = 0x400,
+	.nranges = 5,
+	.ranges = {
+		{ 0, 0xd8, NULL },
+		{ 0xdc, 0x4c, NULL },
+		{ 0x130, 0x2d0, NULL },
+		{ 0x400, 0x1800, NULL },
+		{ 0x1c00, 0x1000, NULL },
+	},
+};
+
+/*
+ * Headers bigger than the first read of the file
+ */
+static const struct fixture big_headers = {
+	.header_size = 0x1400,
+	.nranges = 5,
+	.ranges = {
+		{ 0, 0xd8, NULL },
+		{ 0xdc, 0x4c, NULL },
+		{ 0x130, 0x12d0, NULL },
+		{ 0x1400, 0x800, NULL },
+		{ 0x1c00, 0x1000, NULL },
+	},
+};
+
+/*
+ * Sections that are hashed in a different order from the one they're in
+ * the file in
+ */
+static const struct fixture out_of_order = {
+	.header_size = 0x400,
+	.nranges = 5,
+	.ranges = {
+		{ 0, 0xd8, NULL },
+		{ 0xdc, 0x4c, NULL },
+		{ 0x130, 0x2d0, NULL },
+		{ 0x1c00, 0x1000, NULL },
+		{ 0x400, 0x1800, NULL },
+	},
+};
+
+static const struct fixture *fixture;
+static UINT8 file[FILE_SIZE];
+
+/*
+ * The parts of pe.c a session uses, cut down to what the fixture needs
+ */
+EFI_STATUS
+read_header(void *data, unsigned int datasize,
+	    PE_COFF_LOADER_IMAGE_CONTEXT *context)
+{
+	EFI_IMAGE_DOS_HEADER *DosHdr = data;
+	EFI_IMAGE_OPTIONAL_HEADER_UNION *PEHdr;
+
+	PEHdr = (EFI_IMAGE_OPTIONAL_HEADER_UNION *)((UINT8 *)data +
+						    DosHdr->e_lfanew);
+	ZeroMem(context, sizeof(*context));
+	context->PEHdr = PEHdr;
+	context->SizeOfHeaders = PEHdr->Pe32Plus.OptionalHeader.SizeOfHeaders;
+	context->NumberOfSections = PEHdr->Pe32Plus.FileHeader.NumberOfSections;
+	context->FirstSection = (EFI_IMAGE_SECTION_HEADER *)(PEHdr + 1);
+	context->SecDir = &PEHdr->Pe32Plus.OptionalHeader.DataDirectory[
+					EFI_IMAGE_DIRECTORY_ENTRY_SECURITY];
+	return EFI_SUCCESS;
+}
+
+EFI_STATUS
+pe_image_init(pe_image_t *image, void *data, unsigned int datasize,
+	      PE_COFF_LOADER_IMAGE_CONTEXT *context)
+{
+	ZeroMem(image, sizeof(*image));
+	image->data = data;
+	image->datasize = datasize;
+	CopyMem(&image->context, context, sizeof(image->context));
+
+	image->nranges = fixture->nranges;
+	image->ranges = AllocatePool(sizeof(*image->ranges) * image->nranges);
+	if (!image->ranges)
+		return EFI_OUT_OF_RESOURCES;
+	CopyMem(image->ranges, fixture->ranges,
+		sizeof(*image->ranges) * image->nranges);
+	return EFI_SUCCESS;
+}
+
+void
+pe_image_free(pe_image_t *image)
+{
+	if (image->ranges)
+		FreePool(image->ranges);
+	ZeroMem(image, sizeof(*image));
+}
+
+EFI_STATUS
+image_digest_init(image_digest_t *id, pe_image_t *image, UINT32 algs,
+		  char *load)
+{
+	ZeroMem(id, sizeof(*id));
+	id->image = image;
+	return digest_init(&id->ctx, algs);
+}
+
+static unsigned int hashed;
+
+EFI_STATUS
+image_digest_update_window(image_digest_t *id, char *window, UINTN start,
+			   UINTN size)
+{
+	pe_image_t *image = id->image;
+	pe_hash_range_t *range;
+	UINTN end = start + size;
+	UINTN hashsize;
+
+	while (id->next < image->nranges) {
+		range = &image->ranges[id->next];
+		if (range->offset + id->hashed >= end)
+			break;
+		if (range->offset + id->hashed < start)
+			return EFI_INVALID_PARAMETER;
+
+		hashsize = MIN(range->offset + range->size, end) -
+			   (range->offset + id->hashed);
+		digest_update(&id->ctx,
+			      window + (range->offset + id->hashed - start),
+			      hashsize);
+		hashed += hashsize;
+
+		id->hashed += hashsize;
+		if (id->hashed < range->size)
+			break;
+		id->next++;
+		id->hashed = 0;
+	}
+
+	return EFI_SUCCESS;
+}
+
+EFI_STATUS
+image_digest_final(image_digest_t *id, digest_set_t *digests)
+{
+	if (id->next < id->image->nranges)
+		return EFI_INVALID_PARAMETER;
+	return digest_final(&id->ctx, digests);
+}
+
+void
+image_digest_free(image_digest_t *id)
+{
+	digest_free(&id->ctx);
+}
+
+static void
+build_file(const struct fixture *f)
+{
+	EFI_IMAGE_DOS_HEADER *DosHdr = (EFI_IMAGE_DOS_HEADER *)file;
+	EFI_IMAGE_OPTIONAL_HEADER_UNION *PEHdr;
+	EFI_IMAGE_DATA_DIRECTORY *SecDir;
+	UINTN i;
+
+	for (i = 0; i < sizeof(file); i++)
+		file[i] = (i * 7) ^ (i >> 8);
+
+	ZeroMem(file, 0x80 + sizeof(*PEHdr) + sizeof(EFI_IMAGE_SECTION_HEADER));
+	DosHdr->e_magic = EFI_IMAGE_DOS_SIGNATURE;
+	DosHdr->e_lfanew = 0x80;
+
+	PEHdr = (EFI_IMAGE_OPTIONAL_HEADER_UNION *)(file + DosHdr->e_lfanew);
+	PEHdr->Pe32Plus.Signature = EFI_IMAGE_NT_SIGNATURE;
+	PEHdr->Pe32Plus.FileHeader.NumberOfSections = 1;
+	PEHdr->Pe32Plus.OptionalHeader.Magic = EFI_IMAGE_NT_OPTIONAL_HDR64_MAGIC;
+	PEHdr->Pe32Plus.OptionalHeader.SizeOfHeaders = f->header_size;
+	SecDir = &PEHdr->Pe32Plus.OptionalHeader.DataDirectory[
+					EFI_IMAGE_DIRECTORY_ENTRY_SECURITY];
+	SecDir->VirtualAddress = CERTS_OFFSET;
+	SecDir->Size = CERTS_SIZE;
+
+	fixture = f;
+}
+
+static void
+expected_digest(const struct fixture *f, digest_set_t *digests)
+{
+	digest_ctx_t ctx;
+	UINTN i;
+
+	digest_init(&ctx, DIGEST_SHA256);
+	for (i = 0; i < f->nranges; i++)
+		digest_update(&ctx, file + f->ranges[i].offset,
+			      f->ranges[i].size);
+	digest_final(&ctx, digests);
+	digest_free(&ctx);
+}
+
+/*
+ * What a loader does: read the file a chunk at a time, and hand over
+ * each chunk as it comes in.
+ */
+static EFI_STATUS
+stream(UINTN chunk, digest_set_t *digests, session_t **sessionp)
+{
+	session_t *session = NULL;
+	EFI_STATUS efi_status;
+	UINTN offset;
+
+	efi_status = session_init(&session, sizeof(file), DIGEST_SHA256);
+	if (EFI_ERROR(efi_status))
+		return efi_status;
+
+	for (offset = 0; offset < sizeof(file); offset += chunk) {
+		efi_status = session_update(session, file + offset,
+					    MIN(chunk, sizeof(file) - offset));
+		if (EFI_ERROR(efi_status))
+			goto out;
+	}
+
+	efi_status = session_final(session, digests);
+out:
+	if (sessionp && !EFI_ERROR(efi_status))
+		*sessionp = session;
+	else
+		session_free(session);
+	return efi_status;
+}
+
+static int
+check_fixture(const struct fixture *f, BOOLEAN keeps_copy)
+{
+	static const UINTN chunks[] = {
+		1, 7, 0x200, 0x1000, 0x1234, FILE_SIZE
+	};
+	digest_set_t expected, digests;
+	session_t *session = NULL;
+	EFI_STATUS efi_status;
+	unsigned int i;
+	int rc = -1;
+
+	build_file(f);
+	expected_digest(f, &expected);
+
+	for (i = 0; i < sizeof(chunks) / sizeof(chunks[0]); i++) {
+		hashed = 0;
+		efi_status = stream(chunks[i], &digests, &session);
+		assert_equal_goto(efi_status, EFI_SUCCESS, err,
+				  "got %lx expected %lx\n");
+		assert_goto(memcmp(digests.sha256, expected.sha256,
+				   SHA256_DIGEST_SIZE) == 0, err,
+			    "digest of %lu byte chunks is wrong\n", chunks[i]);
+
+		/* every byte that's hashed is hashed once */
+		assert_equal_goto(hashed, 0x2bf4, err,
+				  "hashed %u bytes expected %u\n");
+
+		/* the certificate table is kept, and nothing else */
+		assert_equal_goto(session->certs_size, CERTS_SIZE, err,
+				  "got %lu expected %lu\n");
+		assert_goto(memcmp(session->certs, file + CERTS_OFFSET,
+				   CERTS_SIZE) == 0, err,
+			    "certificate table is wrong\n");
+		assert_goto(!!session->copy ==
+			    (keeps_copy && chunks[i] != FILE_SIZE), err,
+			    "copy is %p for %lu byte chunks\n",
+			    session->copy, chunks[i]);
+		assert_equal_goto(session->header_len,
+				  MAX((UINTN)f->header_size,
+				      MIN((UINTN)LOADER_HEADER_SIZE,
+					  (UINTN)FILE_SIZE)), err,
+				  "kept %lu bytes of header expected %lu\n");
+
+		session_free(session);
+		session = NULL;
+	}
+	rc = 0;
+err:
+	session_free(session);
+	return rc;
+}
+
+static int
+test_session_in_order(void)
+{
+	return check_fixture(&in_order, FALSE);
+}
+
+static int
+test_session_big_headers(void)
+{
+	return check_fixture(&big_headers, FALSE);
+}
+
+static int
+test_session_out_of_order(void)
+{
+	return check_fixture(&out_of_order, TRUE);
+}
+
+static int
+test_session_errors(void)
+{
+	session_t *session = NULL;
+	digest_set_t digests;
+	EFI_STATUS efi_status;
+	UINT8 extra = 0;
+	int rc = -1;
+
+	build_file(&in_order);
+
+	assert_equal_return(session_init(&session, 0, DIGEST_SHA256),
+			    EFI_INVALID_PARAMETER, -1,
+			    "got %lx expected %lx\n");
+
+	/* more than we were told there'd be */
+	efi_status = session_init(&session, sizeof(file), DIGEST_SHA256);
+	assert_equal_return(efi_status, EFI_SUCCESS, -1,
+			    "got %lx expected %lx\n");
+	efi_status = session_update(session, file, sizeof(file));
+	assert_equal_goto(efi_status, EFI_SUCCESS, err,
+			  "got %lx expected %lx\n");
+	efi_status = session_update(session, &extra, 1);
+	assert_equal_goto(efi_status, EFI_BAD_BUFFER_SIZE, err,
+			  "got %lx expected %lx\n");
+	efi_status = session_final(session, &digests);
+	assert_equal_goto(efi_status, EFI_BAD_BUFFER_SIZE, err,
+			  "error didn't stick: %lx\n");
+	session_free(session);
+
+	/* less */
+	efi_status = session_init(&session, sizeof(file), DIGEST_SHA256);
+	assert_equal_return(efi_status, EFI_SUCCESS, -1,
+			    "got %lx expected %lx\n");
+	efi_status = session_update(session, file, sizeof(file) - 1);
+	assert_equal_goto(efi_status, EFI_SUCCESS, err,
+			  "got %lx expected %lx\n");
+	efi_status = session_final(session, &digests);
+	assert_equal_goto(efi_status, EFI_INVALID_PARAMETER, err,
+			  "got %lx expected %lx\n");
+	session_free(session);
+
+	/* not an image at all */
+	file[0] = 0;
+	file[0x80] = 0;
+	efi_status = stream(0x200, &digests, NULL);
+	assert_equal_return(efi_status, EFI_UNSUPPORTED, -1,
+			    "got %lx expected %lx\n");
+
+	return 0;
+err:
+	session_free(session);
+	return rc;
+}
+
+int
+main(void)
+{
+	int status = 0;
+
+	test(test_session_in_order);
+	test(test_session_big_headers);
+	test(test_session_out_of_order);
+	test(test_session_errors);
+
+	return status;
+}
+
+// vim:fenc=utf-8:tw=75:noet
@@ -0,0 +1,615 @@
+// SPDX-License-Identifier: BSD-2-Clause-Patent
+/*
+ * test-sigdb.c - test indexed signature database lookups
+ */
+
+#ifndef SHIM_UNIT_TEST
+#define SHIM_UNIT_TEST
+#endif
+#include "shim.h"
+
+#include <stdio.h>
+
+EFI_GUID EFI_CERT_SHA1_GUID = { 0x826ca512, 0xcf10, 0x4ac9, {0xb1, 0x87, 0xbe, 0x1, 0x49, 0x66, 0x31, 0xbd }};
+EFI_GUID EFI_CERT_SHA256_GUID  = { 0xc1c41626, 0x504c, 0x4092, { 0xac, 0xa9, 0x41, 0xf9, 0x36, 0x93, 0x43, 0x28 } };
+EFI_GUID EFI_CERT_SHA384_GUID = { 0xff3e5307, 0x9fd0, 0x48c9, {0x85, 0xf1, 0x8a, 0xd5, 0x6c, 0x70, 0x1e, 0x1} };
+EFI_GUID EFI_CERT_SHA512_GUID = { 0x93e0fae, 0xa6c4, 0x4f50, {0x9f, 0x1b, 0xd4, 0x1e, 0x2b, 0x89, 0xc1, 0x9a} };
+EFI_GUID EFI_CERT_TYPE_X509_GUID = { 0xa5c059a1, 0x94e4, 0x4aa7, {0x87, 0xb5, 0xab, 0x15, 0x5c, 0x2b, 0xf0, 0x72} };
+EFI_GUID EFI_SECURE_BOOT_DB_GUID =  { 0xd719b2cb, 0x3d3a, 0x4596, { 0xa3, 0xbc, 0xda, 0xd0, 0x0e, 0x67, 0x65, 0x6f } };
+
+UINTN variable_write_generation;
+
+struct esl_buf {
+	UINT8 *data;
+	UINTN size;
+};
+
+/*
+ * Append a list of count signatures of sigsize bytes each; signature i
+ * holds the bytes at sigs + i * (sigsize - sizeof(EFI_GUID)).
+ */
+static EFI_SIGNATURE_LIST *
+append_list(struct esl_buf *buf, EFI_GUID *type, UINT32 sigsize,
+	    UINTN count, const UINT8 *sigs)
+{
+	EFI_SIGNATURE_LIST *list;
+	EFI_SIGNATURE_DATA *sig;
+	UINTN datasz = sigsize - sizeof(EFI_GUID);
+	UINTN listsz = sizeof(*list) + count * sigsize;
+	UINTN i;
+
+	buf->data = realloc(buf->data, buf->size + listsz);
+	assert(buf->data != NULL);
+	list = (EFI_SIGNATURE_LIST *)(buf->data + buf->size);
+	ZeroMem(list, listsz);
+	list->SignatureType = *type;
+	list->SignatureListSize = listsz;
+	list->SignatureHeaderSize = 0;
+	list->SignatureSize = sigsize;
+	for (i = 0; i < count; i++) {
+		sig = (EFI_SIGNATURE_DATA *)((UINT8 *)(list + 1) + i * sigsize);
+		sig->SignatureOwner = SHIM_LOCK_GUID;
+		CopyMem(sig->SignatureData, sigs + i * datasz, datasz);
+	}
+	buf->size += listsz;
+	return list;
+}
+
+/*
+ * What check_db_hash_in_ram() used to do: walk every list in order
+ */
+static EFI_SIGNATURE_DATA *
+linear_find(UINT8 *data, UINTN size, EFI_GUID *type, UINT8 *digest,
+	    UINTN digestsz)
+{
+	EFI_SIGNATURE_LIST *list;
+	EFI_SIGNATURE_DATA *sig;
+
+	certlist_for_each_certentry(list, data, size, size) {
+		if (CompareGuid(&list->SignatureType, type) != 0)
+			continue;
+		certentry_for_each_cert(sig, list)
+			if (CompareMem(sig->SignatureData, digest, digestsz) == 0)
+				return sig;
+	}
+	return NULL;
+}
+
+static void
+fill_digests(UINT8 *digests, UINTN count, UINTN size, unsigned int seed)
+{
+	UINTN i;
+
+	srand(seed);
+	for (i = 0; i < count * size; i++)
+		digests[i] = rand() & 0xff;
+}
+
+static int
+test_sigdb_first_match(void)
+{
+	UINT8 a[3][SHA256_DIGEST_SIZE], b[3][SHA256_DIGEST_SIZE];
+	UINT8 sha1[2][SHA1_DIGEST_SIZE];
+	UINT8 cert[64];
+	struct esl_buf buf = { NULL, 0 };
+	EFI_SIGNATURE_LIST *first, *second, *x509;
+	sigdb_entry_t *entry;
+	sigdb_t db;
+	int pass, rc = -1;
+
+	fill_digests(&a[0][0], 3, SHA256_DIGEST_SIZE, 1);
+	fill_digests(&sha1[0][0], 2, SHA1_DIGEST_SIZE, 2);
+	memset(cert, 0x30, sizeof(cert));
+	/* a[1] shows up in both SHA256 lists; the first one has to win */
+	CopyMem(b[0], a[1], SHA256_DIGEST_SIZE);
+	fill_digests(&b[1][0], 2, SHA256_DIGEST_SIZE, 3);
+	/* same first 8 bytes as a[0], different after that */
+	CopyMem(b[2], a[0], 8);
+
+	append_list(&buf, &EFI_CERT_SHA256_GUID,
+		    sizeof(EFI_GUID) + SHA256_DIGEST_SIZE, 3, &a[0][0]);
+	append_list(&buf, &EFI_CERT_TYPE_X509_GUID,
+		    sizeof(EFI_GUID) + sizeof(cert), 1, cert);
+	append_list(&buf, &EFI_CERT_SHA256_GUID,
+		    sizeof(EFI_GUID) + SHA256_DIGEST_SIZE, 3, &b[0][0]);
+	append_list(&buf, &EFI_CERT_SHA1_GUID,
+		    sizeof(EFI_GUID) + SHA1_DIGEST_SIZE, 2, &sha1[0][0]);
+	/* the buffer may have moved while we built it */
+	first = (EFI_SIGNATURE_LIST *)buf.data;
+	x509 = (EFI_SIGNATURE_LIST *)((UINT8 *)first + first->SignatureListSize);
+	second = (EFI_SIGNATURE_LIST *)((UINT8 *)x509 + x509->SignatureListSize);
+
+	assert_goto(!EFI_ERROR(sigdb_init(&db, buf.data, buf.size)), err,
+		    "\n");
+
+	/* the second pass takes the path used when there's no index */
+	for (pass = 0; pass < 2; pass++) {
+		if (pass == 1)
+			db.indexed = FALSE;
+
+		entry = sigdb_find_hash(&db, &EFI_CERT_SHA256_GUID, a[1]);
+		assert_goto(entry != NULL, err_free, "\n");
+		assert_goto(entry->list == first, err_free,
+			    "duplicate resolved to the wrong list\n");
+		assert_goto(entry->sig == linear_find(buf.data, buf.size,
+						      &EFI_CERT_SHA256_GUID,
+						      a[1], SHA256_DIGEST_SIZE),
+			    err_free, "\n");
+
+		entry = sigdb_find_hash(&db, &EFI_CERT_SHA256_GUID, b[1]);
+		assert_goto(entry && entry->list == second, err_free, "\n");
+		entry = sigdb_find_hash(&db, &EFI_CERT_SHA256_GUID, b[2]);
+		assert_goto(entry && entry->list == second, err_free, "\n");
+		entry = sigdb_find_hash(&db, &EFI_CERT_SHA256_GUID, a[0]);
+		assert_goto(entry && entry->list == first, err_free, "\n");
+
+		/* a SHA-1 digest is only found as a SHA-1 entry */
+		entry = sigdb_find_hash(&db, &EFI_CERT_SHA1_GUID, sha1[1]);
+		assert_goto(entry != NULL, err_free, "\n");
+		assert_goto(CompareMem(entry->sig->SignatureData, sha1[1],
+				       SHA1_DIGEST_SIZE) == 0, err_free, "\n");
+		assert_goto(sigdb_find_hash(&db, &EFI_CERT_SHA256_GUID,
+					    sha1[1]) == NULL, err_free, "\n");
+		assert_goto(sigdb_find_hash(&db, &EFI_CERT_SHA384_GUID,
+					    a[0]) == NULL, err_free, "\n");
+
+		entry = sigdb_cert(&db, 0);
+		assert_goto(entry && entry->list == x509, err_free, "\n");
+		assert_goto(sigdb_cert(&db, 1) == NULL, err_free, "\n");
+	}
+
+	rc = 0;
+err_free:
+	sigdb_free(&db);
+err:
+	free(buf.data);
+	return rc;
+}
+
+static int
+test_sigdb_malformed(void)
+{
+	UINT8 digest[SHA256_DIGEST_SIZE];
+	struct esl_buf buf = { NULL, 0 };
+	EFI_SIGNATURE_LIST *list;
+	sigdb_t db;
+	int rc = -1;
+
+	fill_digests(digest, 1, SHA256_DIGEST_SIZE, 4);
+
+	/* entries too short to hold a SHA-256 digest aren't indexed */
+	append_list(&buf, &EFI_CERT_SHA256_GUID, sizeof(EFI_GUID) + 8, 1,
+		    digest);
+	/* an empty X509 list has no certificate to offer */
+	append_list(&buf, &EFI_CERT_TYPE_X509_GUID, 0, 0, digest);
+	append_list(&buf, &EFI_CERT_SHA256_GUID,
+		    sizeof(EFI_GUID) + SHA256_DIGEST_SIZE, 1, digest);
+
+	assert_goto(!EFI_ERROR(sigdb_init(&db, buf.data, buf.size)), err,
+		    "\n");
+	assert_goto(sigdb_find_hash(&db, &EFI_CERT_SHA256_GUID, digest),
+		    err_free, "\n");
+	assert_goto(sigdb_cert(&db, 0) == NULL, err_free, "\n");
+	sigdb_free(&db);
+
+	/* a truncated buffer stops at the last whole list */
+	assert_goto(!EFI_ERROR(sigdb_init(&db, buf.data, buf.size - 1)), err,
+		    "\n");
+	assert_goto(sigdb_find_hash(&db, &EFI_CERT_SHA256_GUID, digest)
+		    == NULL, err_free, "\n");
+	sigdb_free(&db);
+
+	/* a zero SignatureListSize must not loop forever */
+	list = (EFI_SIGNATURE_LIST *)buf.data;
+	list->SignatureListSize = 0;
+	assert_goto(!EFI_ERROR(sigdb_init(&db, buf.data, buf.size)), err,
+		    "\n");
+	assert_goto(sigdb_find_hash(&db, &EFI_CERT_SHA256_GUID, digest)
+		    == NULL, err_free, "\n");
+	db.indexed = FALSE;
+	assert_goto(sigdb_find_hash(&db, &EFI_CERT_SHA256_GUID, digest)
+		    == NULL, err_free, "\n");
+	sigdb_free(&db);
+
+	/* nor may a header claiming more than the list holds */
+	list->SignatureListSize = sizeof(*list) + 8 + sizeof(EFI_GUID);
+	list->SignatureHeaderSize = 0x1000;
+	assert_goto(!EFI_ERROR(sigdb_init(&db, buf.data, buf.size)), err,
+		    "\n");
+	assert_goto(sigdb_find_hash(&db, &EFI_CERT_SHA256_GUID, digest)
+		    == NULL, err_free, "\n");
+	sigdb_free(&db);
+
+	assert_goto(!EFI_ERROR(sigdb_init(&db, NULL, 0)), err, "\n");
+	assert_goto(sigdb_find_hash(&db, &EFI_CERT_SHA256_GUID, digest)
+		    == NULL, err_free, "\n");
+	assert_goto(sigdb_cert(&db, 0) == NULL, err_free, "\n");
+
+	rc = 0;
+err_free:
+	sigdb_free(&db);
+err:
+	free(buf.data);
+	return rc;
+}
+
+/*
+ * sigdb_hash_algs() is what decides whether images get a SHA-1 digest at
+ * all, so it has to agree with lookups, indexed or not.
+ */
+static int
+test_sigdb_hash_algs(void)
+{
+	UINT8 digests[2 * SHA384_DIGEST_SIZE];
+	struct esl_buf buf = { NULL, 0 };
+	sigdb_t db;
+	int rc = -1;
+
+	fill_digests(digests, 2, SHA384_DIGEST_SIZE, 5);
+
+	/* entries too short for their digest and empty lists don't count */
+	append_list(&buf, &EFI_CERT_SHA1_GUID, sizeof(EFI_GUID) + 8, 1,
+		    digests);
+	append_list(&buf, &EFI_CERT_SHA512_GUID,
+		    sizeof(EFI_GUID) + SHA512_DIGEST_SIZE, 0, digests);
+	append_list(&buf, &EFI_CERT_SHA256_GUID,
+		    sizeof(EFI_GUID) + SHA256_DIGEST_SIZE, 2, digests);
+	append_list(&buf, &EFI_CERT_SHA384_GUID,
+		    sizeof(EFI_GUID) + SHA384_DIGEST_SIZE, 1, digests);
+
+	assert_goto(!EFI_ERROR(sigdb_init(&db, buf.data, buf.size)), err,
+		    "\n");
+	assert_goto(sigdb_hash_algs(&db) == (DIGEST_SHA256 | DIGEST_SHA384),
+		    err_free, "got 0x%x\n", sigdb_hash_algs(&db));
+	db.indexed = FALSE;
+	assert_goto(sigdb_hash_algs(&db) == (DIGEST_SHA256 | DIGEST_SHA384),
+		    err_free, "got 0x%x\n", sigdb_hash_algs(&db));
+	sigdb_free(&db);
+
+	append_list(&buf, &EFI_CERT_SHA1_GUID,
+		    sizeof(EFI_GUID) + SHA1_DIGEST_SIZE, 1, digests);
+	assert_goto(!EFI_ERROR(sigdb_init(&db, buf.data, buf.size)), err,
+		    "\n");
+	assert_goto(sigdb_hash_algs(&db) & DIGEST_SHA1, err_free,
+		    "got 0x%x\n", sigdb_hash_algs(&db));
+	sigdb_free(&db);
+
+	assert_goto(!EFI_ERROR(sigdb_init(&db, NULL, 0)), err, "\n");
+	assert_goto(sigdb_hash_algs(&db) == 0, err_free, "\n");
+
+	rc = 0;
+err_free:
+	sigdb_free(&db);
+err:
+	free(buf.data);
+	return rc;
+}
+
+/*
+ * A one-variable store, so we can count how often the cache goes to it
+ */
+static struct esl_buf store;
+static unsigned int store_reads;
+
+static EFI_STATUS
+store_get_variable(const CHAR16 * const var, UINT8 **data, UINTN *len,
+		   EFI_GUID owner, UINT32 *attributes)
+{
+	store_reads++;
+	if (StrCmp(var, L"dbx") != 0 ||
+	    CompareGuid(&owner, &EFI_SECURE_BOOT_DB_GUID) != 0)
+		return EFI_NOT_FOUND;
+	*data = malloc(store.size);
+	assert(*data != NULL);
+	CopyMem(*data, store.data, store.size);
+	*len = store.size;
+	return EFI_SUCCESS;
+}
+
+static int
+test_sigdb_variable_cache(void)
+{
+	UINT8 digest[2][SHA256_DIGEST_SIZE];
+	EFI_STATUS efi_status;
+	sigdb_t *db;
+	int rc = -1;
+
+	fill_digests(&digest[0][0], 2, SHA256_DIGEST_SIZE, 5);
+	append_list(&store, &EFI_CERT_SHA256_GUID,
+		    sizeof(EFI_GUID) + SHA256_DIGEST_SIZE, 1, digest[0]);
+	test_get_variable_attr = store_get_variable;
+	store_reads = 0;
+
+	efi_status = sigdb_get_variable(L"dbx", EFI_SECURE_BOOT_DB_GUID, &db);
+	assert_goto(!EFI_ERROR(efi_status), out, "\n");
+	assert_goto(sigdb_find_hash(db, &EFI_CERT_SHA256_GUID, digest[0]),
+		    out, "\n");
+	efi_status = sigdb_get_variable(L"dbx", EFI_SECURE_BOOT_DB_GUID, &db);
+	assert_goto(!EFI_ERROR(efi_status) && db, out, "\n");
+	assert_equal_goto(store_reads, 1, out, "got %u expected %u\n");
+
+	/* missing variables are remembered too */
+	efi_status = sigdb_get_variable(L"MokListX", SHIM_LOCK_GUID, &db);
+	assert_goto(efi_status == EFI_NOT_FOUND && !db, out, "\n");
+	efi_status = sigdb_get_variable(L"MokListX", SHIM_LOCK_GUID, &db);
+	assert_goto(efi_status == EFI_NOT_FOUND && !db, out, "\n");
+	efi_status = sigdb_get_variable(L"MokList", SHIM_LOCK_GUID, &db);
+	assert_goto(efi_status == EFI_NOT_FOUND && !db, out, "\n");
+	assert_equal_goto(store_reads, 3, out, "got %u expected %u\n");
+
+	/* a write through shim drops everything */
+	append_list(&store, &EFI_CERT_SHA256_GUID,
+		    sizeof(EFI_GUID) + SHA256_DIGEST_SIZE, 1, digest[1]);
+	variable_write_generation++;
+	efi_status = sigdb_get_variable(L"dbx", EFI_SECURE_BOOT_DB_GUID, &db);
+	assert_goto(!EFI_ERROR(efi_status), out, "\n");
+	assert_goto(sigdb_find_hash(db, &EFI_CERT_SHA256_GUID, digest[1]),
+		    out, "\n");
+	assert_equal_goto(store_reads, 4, out, "got %u expected %u\n");
+
+	/* and so does an explicit invalidation */
+	sigdb_invalidate();
+	efi_status = sigdb_get_variable(L"dbx", EFI_SECURE_BOOT_DB_GUID, &db);
+	assert_goto(!EFI_ERROR(efi_status), out, "\n");
+	assert_equal_goto(store_reads, 5, out, "got %u expected %u\n");
+
+	rc = 0;
+out:
+	sigdb_invalidate();
+	test_get_variable_attr = NULL;
+	free(store.data);
+	store.data = NULL;
+	store.size = 0;
+	return rc;
+}
+
+/*
+ * A dbx on the scale of the current UEFI revocation list, spread over a
+ * few lists the way updates append them, looked up by as many digests,
+ * half of which are in it.
+ */
+#define DBX_ENTRIES 20000
+#define DBX_LISTS 8
+
+static int
+test_sigdb_dbx_bench(void)
+{
+	UINTN per_list = DBX_ENTRIES / DBX_LISTS;
+	struct esl_buf buf = { NULL, 0 };
+	UINT8 *digests, *queries;
+	EFI_SIGNATURE_DATA *expected;
+	sigdb_entry_t *entry;
+	UINT64 start, linear, indexed, build;
+	UINTN i, hits = 0;
+	sigdb_t db;
+	int rc = -1;
+
+	digests = malloc(DBX_ENTRIES * SHA256_DIGEST_SIZE);
+	queries = malloc(DBX_ENTRIES * SHA256_DIGEST_SIZE);
+	assert_goto(digests && queries, err, "\n");
+	fill_digests(digests, DBX_ENTRIES, SHA256_DIGEST_SIZE, 6);
+	fill_digests(queries, DBX_ENTRIES, SHA256_DIGEST_SIZE, 7);
+	for (i = 0; i < DBX_ENTRIES; i += 2)
+		CopyMem(queries + i * SHA256_DIGEST_SIZE,
+			digests + ((i * 7919) % DBX_ENTRIES) * SHA256_DIGEST_SIZE,
+			SHA256_DIGEST_SIZE);
+	for (i = 0; i < DBX_LISTS; i++)
+		append_list(&buf, &EFI_CERT_SHA256_GUID,
+			    sizeof(EFI_GUID) + SHA256_DIGEST_SIZE, per_list,
+			    digests + i * per_list * SHA256_DIGEST_SIZE);
+
+	start = test_ticks();
+	assert_goto(!EFI_ERROR(sigdb_init(&db, buf.data, buf.size)), err,
+		    "\n");
+	build = test_ticks() - start;
+
+	indexed = 0;
+	linear = 0;
+	for (i = 0; i < DBX_ENTRIES; i++) {
+		UINT8 *q = queries + i * SHA256_DIGEST_SIZE;
+
+		start = test_ticks();
+		entry = sigdb_find_hash(&db, &EFI_CERT_SHA256_GUID, q);
+		indexed += test_ticks() - start;
+
+		start = test_ticks();
+		expected = linear_find(buf.data, buf.size,
+				       &EFI_CERT_SHA256_GUID, q,
+				       SHA256_DIGEST_SIZE);
+		linear += test_ticks() - start;
+
+		assert_goto((entry ? entry->sig : NULL) == expected, err_free,
+			    "lookup %lu disagrees with a linear walk\n", i);
+		if (entry)
+			hits++;
+	}
+	assert_equal_goto(hits, DBX_ENTRIES / 2, err_free,
+			  "got %lu expected %lu\n");
+
+	printf("dbx of %d: index built in %lu %s, lookup %lu %s (linear %lu)\n",
+	       DBX_ENTRIES, build, test_tick_unit(),
+	       indexed / DBX_ENTRIES, test_tick_unit(), linear / DBX_ENTRIES);
+
+	rc = 0;
+err_free:
+	sigdb_free(&db);
+err:
+	free(buf.data);
+	free(digests);
+	free(queries);
+	return rc;
+}
+
+static int
+test_sigdb_filter(void)
+{
+	UINT8 sha256[64][SHA256_DIGEST_SIZE], sha1[16][SHA1_DIGEST_SIZE];
+	UINT8 other[SHA256_DIGEST_SIZE];
+	struct esl_buf one = { NULL, 0 }, two = { NULL, 0 };
+	sigdb_t db[2], *dbs[3] = { &db[0], NULL, &db[1] };
+	sigdb_filter_t filter = { 0 };
+	UINTN i;
+	int rc = -1;
+
+	fill_digests(&sha256[0][0], 64, SHA256_DIGEST_SIZE, 8);
+	fill_digests(&sha1[0][0], 16, SHA1_DIGEST_SIZE, 9);
+	append_list(&one, &EFI_CERT_SHA256_GUID,
+		    sizeof(EFI_GUID) + SHA256_DIGEST_SIZE, 32, &sha256[0][0]);
+	append_list(&two, &EFI_CERT_SHA1_GUID,
+		    sizeof(EFI_GUID) + SHA1_DIGEST_SIZE, 16, &sha1[0][0]);
+	append_list(&two, &EFI_CERT_SHA256_GUID,
+		    sizeof(EFI_GUID) + SHA256_DIGEST_SIZE, 32, &sha256[32][0]);
+	sigdb_init(&db[0], one.data, one.size);
+	sigdb_init(&db[1], two.data, two.size);
+
+	/* an unbuilt filter can't rule anything out */
+	assert_goto(sigdb_filter_check(&filter, &EFI_CERT_SHA256_GUID,
+				       sha256[0]), out, "\n");
+
+	/* an empty one rules out everything */
+	assert_goto(!EFI_ERROR(sigdb_filter_build(&filter, dbs + 1, 1)), out,
+		    "\n");
+	assert_goto(!sigdb_filter_check(&filter, &EFI_CERT_SHA256_GUID,
+					sha256[0]), out, "\n");
+
+	/* every entry of every source is a maybe */
+	assert_goto(!EFI_ERROR(sigdb_filter_build(&filter, dbs, 3)), out,
+		    "\n");
+	assert_equal_goto(filter.count, 80, out, "got %lu expected %lu\n");
+	for (i = 0; i < 64; i++)
+		assert_goto(sigdb_filter_check(&filter, &EFI_CERT_SHA256_GUID,
+					       sha256[i]), out,
+			    "false negative for sha256 %lu\n", i);
+	for (i = 0; i < 16; i++)
+		assert_goto(sigdb_filter_check(&filter, &EFI_CERT_SHA1_GUID,
+					       sha1[i]), out,
+			    "false negative for sha1 %lu\n", i);
+
+	/* something that isn't there almost certainly isn't a maybe */
+	fill_digests(other, 1, SHA256_DIGEST_SIZE, 10);
+	assert_goto(!sigdb_filter_check(&filter, &EFI_CERT_SHA256_GUID,
+					other), out, "\n");
+	/* types we don't index are always a maybe */
+	assert_goto(sigdb_filter_check(&filter, &EFI_CERT_TYPE_X509_GUID,
+				       other), out, "\n");
+
+	/* a source we couldn't index leaves the filter unusable */
+	db[1].indexed = FALSE;
+	assert_goto(EFI_ERROR(sigdb_filter_build(&filter, dbs, 3)), out,
+		    "\n");
+	assert_goto(sigdb_filter_check(&filter, &EFI_CERT_SHA256_GUID, other),
+		    out, "\n");
+
+	rc = 0;
+out:
+	sigdb_filter_free(&filter);
+	sigdb_free(&db[0]);
+	sigdb_free(&db[1]);
+	free(one.data);
+	free(two.data);
+	return rc;
+}
+
+/*
+ * The revocation check for an image that isn't revoked, which is nearly
+ * all of them, against a 50000-entry dbx: the filter on its own, the
+ * filter followed by the index on a maybe, the index on its own, and
+ * the old linear walk.
+ */
+#define FILTER_ENTRIES 50000
+#define FILTER_QUERIES 50000
+
+static int
+test_sigdb_filter_bench(void)
+{
+	struct esl_buf buf = { NULL, 0 };
+	UINT8 *digests, *queries, *q;
+	sigdb_filter_t filter = { 0 };
+	sigdb_t db, *dbs[1] = { &db };
+	UINT64 start, filtered = 0, indexed = 0, linear = 0;
+	UINTN i, maybes = 0, hits = 0, linear_queries;
+	int rc = -1;
+
+	digests = malloc(FILTER_ENTRIES * SHA256_DIGEST_SIZE);
+	queries = malloc(FILTER_QUERIES * SHA256_DIGEST_SIZE);
+	assert_goto(digests && queries, err, "\n");
+	fill_digests(digests, FILTER_ENTRIES, SHA256_DIGEST_SIZE, 11);
+	fill_digests(queries, FILTER_QUERIES, SHA256_DIGEST_SIZE, 12);
+	append_list(&buf, &EFI_CERT_SHA256_GUID,
+		    sizeof(EFI_GUID) + SHA256_DIGEST_SIZE, FILTER_ENTRIES,
+		    digests);
+	assert_goto(!EFI_ERROR(sigdb_init(&db, buf.data, buf.size)), err,
+		    "\n");
+	assert_goto(!EFI_ERROR(sigdb_filter_build(&filter, dbs, 1)),
+		    err_free, "\n");
+
+	for (i = 0; i < FILTER_ENTRIES; i++)
+		assert_goto(sigdb_filter_check(&filter, &EFI_CERT_SHA256_GUID,
+					digests + i * SHA256_DIGEST_SIZE),
+			    err_free, "false negative for entry %lu\n", i);
+
+	for (i = 0; i < FILTER_QUERIES; i++) {
+		BOOLEAN maybe;
+
+		q = queries + i * SHA256_DIGEST_SIZE;
+		start = test_ticks();
+		maybe = sigdb_filter_check(&filter, &EFI_CERT_SHA256_GUID, q);
+		if (maybe && sigdb_find_hash(&db, &EFI_CERT_SHA256_GUID, q))
+			hits++;
+		filtered += test_ticks() - start;
+		if (maybe)
+			maybes++;
+
+		start = test_ticks();
+		sigdb_find_hash(&db, &EFI_CERT_SHA256_GUID, q);
+		indexed += test_ticks() - start;
+	}
+	assert_equal_goto(hits, 0, err_free, "got %lu expected %lu\n");
+	assert_goto(maybes < FILTER_QUERIES / 100, err_free,
+		    "%lu false positives in %d\n", maybes, FILTER_QUERIES);
+
+	/* the walk is slow enough that a sample will do */
+	linear_queries = FILTER_QUERIES / 100;
+	for (i = 0; i < linear_queries; i++) {
+		q = queries + i * SHA256_DIGEST_SIZE;
+		start = test_ticks();
+		linear_find(buf.data, buf.size, &EFI_CERT_SHA256_GUID, q,
+			    SHA256_DIGEST_SIZE);
+		linear += test_ticks() - start;
+	}
+
+	printf("dbx of %d, %lu KiB filter: %lu/%d false positives, "
+	       "filtered %lu %s, index %lu %s, linear %lu %s per check\n",
+	       FILTER_ENTRIES, filter.nblocks * 64 / 1024, maybes,
+	       FILTER_QUERIES, filtered / FILTER_QUERIES, test_tick_unit(),
+	       indexed / FILTER_QUERIES, test_tick_unit(),
+	       linear / linear_queries, test_tick_unit());
+
+	rc = 0;
+err_free:
+	sigdb_filter_free(&filter);
+	sigdb_free(&db);
+err:
+	free(buf.data);
+	free(digests);
+	free(queries);
+	return rc;
+}
+
+int
+main(void)
+{
+	int status = 0;
+
+	test(test_sigdb_first_match);
+	test(test_sigdb_malformed);
+	test(test_sigdb_hash_algs);
+	test(test_sigdb_variable_cache);
+	test(test_sigdb_dbx_bench);
+	test(test_sigdb_filter);
+	test(test_sigdb_filter_bench);
+
+	return status;
+}
+
+// vim:fenc=utf-8:tw=75:noet
@@ -0,0 +1,743 @@
+// SPDX-License-Identifier: BSD-2-Clause-Patent
+/*
+ * test-tpm.c - test measurement into the CC event log
+ */
+
+#ifndef SHIM_UNIT_TEST
+#define SHIM_UNIT_TEST
+#endif
+#include "shim.h"
+
+#include <openssl/sha.h>
+#include <stdio.h>
+
+EFI_GUID EFI_CC_MEASUREMENT_PROTOCOL_GUID = { 0x96751a3d, 0x72f4, 0x41a6, {0xa7, 0x94, 0xed, 0x5d, 0x0e, 0x67, 0xae, 0x6b } };
+EFI_GUID EFI_TPM_GUID = { 0xf541796d, 0xa62e, 0x4954, {0xa7, 0x75, 0x95, 0x84, 0xf6, 0x1b, 0x9c, 0xdd } };
+EFI_GUID EFI_TPM2_GUID = { 0x607f766c, 0x7455, 0x42be, {0x93, 0x0b, 0xe4, 0xd7, 0x6d, 0xb2, 0x72, 0x0f } };
+
+/*
+ * A software stand-in for the firmware's EFI_CC_MEASUREMENT_PROTOCOL: it
+ * maps PCRs to TDX MRs, hashes the data it is handed with SHA-384 and
+ * extends the result into its own copy of the measurement registers.
+ */
+struct fake_cc {
+	efi_cc_protocol_t cc;
+	efi_tpm_protocol_t tpm12;
+	BOOLEAN have_cc;
+	BOOLEAN have_tpm12;
+	BOOLEAN pe_coff_supported;
+	unsigned int locate_calls;
+	unsigned int map_calls;
+	unsigned int hash_calls;
+	unsigned int pe_coff_calls;
+	UINT64 bytes_hashed;
+	UINT32 last_type;
+	EFI_CC_MR_INDEX last_mr;
+	UINT8 mr[5][SHA384_DIGEST_SIZE];
+	UINT8 *log;
+	UINTN log_size;
+};
+
+static struct fake_cc fake;
+
+static void
+fake_extend(EFI_CC_EVENT *event, const UINT8 *digest)
+{
+	EFI_CC_MR_INDEX mr = event->Header.MrIndex;
+	SHA512_CTX ctx;
+
+	/* The log holds each event followed by the digest extended */
+	fake.log = realloc(fake.log,
+			   fake.log_size + event->Size + SHA384_DIGEST_SIZE);
+	assert(fake.log != NULL);
+	CopyMem(fake.log + fake.log_size, event, event->Size);
+	fake.log_size += event->Size;
+	CopyMem(fake.log + fake.log_size, digest, SHA384_DIGEST_SIZE);
+	fake.log_size += SHA384_DIGEST_SIZE;
+
+	SHA384_Init(&ctx);
+	SHA384_Update(&ctx, fake.mr[mr], SHA384_DIGEST_SIZE);
+	SHA384_Update(&ctx, digest, SHA384_DIGEST_SIZE);
+	SHA384_Final(fake.mr[mr], &ctx);
+}
+
+static EFI_STATUS EFIAPI
+fake_tpm12_status_check(efi_tpm_protocol_t *this,
+			TCG_EFI_BOOT_SERVICE_CAPABILITY *caps, uint32_t *flags,
+			EFI_PHYSICAL_ADDRESS *eventlog,
+			EFI_PHYSICAL_ADDRESS *lastevent)
+{
+	ZeroMem(caps, sizeof(*caps));
+	caps->TPMPresentFlag = 1;
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI
+fake_map_pcr_to_mr_index(efi_cc_protocol_t *this, UINT32 pcr,
+			 EFI_CC_MR_INDEX *mr)
+{
+	fake.map_calls++;
+	if (pcr > 16)
+		return EFI_INVALID_PARAMETER;
+	if (pcr == 0)
+		*mr = TDX_MR_INDEX_MRTD;
+	else if (pcr == 1 || pcr == 7)
+		*mr = TDX_MR_INDEX_RTMR0;
+	else if (pcr <= 6)
+		*mr = TDX_MR_INDEX_RTMR1;
+	else if (pcr <= 15)
+		*mr = TDX_MR_INDEX_RTMR2;
+	else
+		*mr = TDX_MR_INDEX_RTMR3;
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI
+fake_hash_log_extend_event(efi_cc_protocol_t *this, UINT64 flags,
+			   EFI_PHYSICAL_ADDRESS data, UINT64 datalen,
+			   EFI_CC_EVENT *event)
+{
+	UINT8 digest[SHA384_DIGEST_SIZE];
+
+	if (flags & PE_COFF_IMAGE) {
+		fake.pe_coff_calls++;
+		if (!fake.pe_coff_supported)
+			return EFI_UNSUPPORTED;
+	}
+	fake.hash_calls++;
+	fake.bytes_hashed += datalen;
+
+	/* The images used here have no certificate table, so the
+	   Authenticode digest is the digest of the whole buffer. */
+	SHA384((const UINT8 *)(UINTN)data, datalen, digest);
+	fake_extend(event, digest);
+	fake.last_type = event->Header.EventType;
+	fake.last_mr = event->Header.MrIndex;
+	return EFI_SUCCESS;
+}
+
+/*
+ * Just enough of boot services for protocol notifications: "reinstalling"
+ * a protocol signals the events registered for it.
+ */
+struct fake_event {
+	EFI_EVENT_NOTIFY notify;
+	VOID *context;
+	EFI_GUID *guid;
+	BOOLEAN open;
+};
+
+#define FAKE_EVENTS 8
+static struct fake_event fake_events[FAKE_EVENTS];
+static EFI_BOOT_SERVICES fake_bs;
+
+static EFI_STATUS EFIAPI
+fake_create_event(UINT32 type, EFI_TPL tpl, EFI_EVENT_NOTIFY notify,
+		  VOID *context, EFI_EVENT *event)
+{
+	UINTN i;
+
+	for (i = 0; i < FAKE_EVENTS; i++) {
+		if (fake_events[i].open)
+			continue;
+		fake_events[i].notify = notify;
+		fake_events[i].context = context;
+		fake_events[i].guid = NULL;
+		fake_events[i].open = TRUE;
+		*event = &fake_events[i];
+		return EFI_SUCCESS;
+	}
+	return EFI_OUT_OF_RESOURCES;
+}
+
+static EFI_STATUS EFIAPI
+fake_register_protocol_notify(EFI_GUID *guid, EFI_EVENT event,
+			      VOID **registration)
+{
+	struct fake_event *ev = event;
+
+	ev->guid = guid;
+	*registration = ev;
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI
+fake_close_event(EFI_EVENT event)
+{
+	struct fake_event *ev = event;
+
+	if (!ev->open)
+		return EFI_INVALID_PARAMETER;
+	ev->open = FALSE;
+	return EFI_SUCCESS;
+}
+
+static unsigned int
+fake_reinstall(EFI_GUID *guid)
+{
+	unsigned int signalled = 0;
+	UINTN i;
+
+	for (i = 0; i < FAKE_EVENTS; i++) {
+		if (!fake_events[i].open || !fake_events[i].guid ||
+		    CompareMem(fake_events[i].guid, guid, sizeof(*guid)))
+			continue;
+		fake_events[i].notify(&fake_events[i],
+				      fake_events[i].context);
+		signalled++;
+	}
+	return signalled;
+}
+
+static unsigned int
+fake_open_events(void)
+{
+	unsigned int open = 0;
+	UINTN i;
+
+	for (i = 0; i < FAKE_EVENTS; i++)
+		if (fake_events[i].open)
+			open++;
+	return open;
+}
+
+static void
+fake_reset(BOOLEAN have_cc)
+{
+	/* Drop whatever the last test left cached */
+	tpm_backend_fini();
+
+	fake_bs.CreateEvent = fake_create_event;
+	fake_bs.RegisterProtocolNotify = fake_register_protocol_notify;
+	fake_bs.CloseEvent = fake_close_event;
+	BS = &fake_bs;
+	ZeroMem(fake_events, sizeof(fake_events));
+
+	if (fake.log)
+		free(fake.log);
+	ZeroMem(&fake, sizeof(fake));
+	fake.cc.map_pcr_to_mr_index = fake_map_pcr_to_mr_index;
+	fake.cc.hash_log_extend_event = fake_hash_log_extend_event;
+	fake.tpm12.status_check = fake_tpm12_status_check;
+	fake.have_cc = have_cc;
+	fake.pe_coff_supported = TRUE;
+}
+
+EFI_STATUS
+LibLocateProtocol(EFI_GUID *guid, VOID **interface)
+{
+	fake.locate_calls++;
+	*interface = NULL;
+	if (fake.have_cc &&
+	    !CompareMem(guid, &EFI_CC_MEASUREMENT_PROTOCOL_GUID,
+			sizeof(*guid)))
+		*interface = &fake.cc;
+	else if (fake.have_tpm12 &&
+		 !CompareMem(guid, &EFI_TPM_GUID, sizeof(*guid)))
+		*interface = &fake.tpm12;
+	return *interface ? EFI_SUCCESS : EFI_NOT_FOUND;
+}
+
+UINTN
+DevicePathSize(EFI_DEVICE_PATH *path)
+{
+	return 0;
+}
+
+static UINT8 *
+make_image(UINTN size)
+{
+	UINT8 *image;
+	UINTN i;
+
+	image = AllocatePool(size);
+	if (!image)
+		return NULL;
+	for (i = 0; i < size; i++)
+		image[i] = (UINT8)(i * 131 + 7);
+	return image;
+}
+
+static void
+image_digests(UINT8 *image, UINTN size, UINT32 algs, digest_set_t *digests)
+{
+	ZeroMem(digests, sizeof(*digests));
+	SHA1(image, size, digests->sha1);
+	SHA256(image, size, digests->sha256);
+	digests->algs = algs;
+}
+
+static int
+test_cc_digest_algs(void)
+{
+	fake_reset(FALSE);
+	assert_equal_return(tpm_digest_algs(), 0, -1,
+			    "got %u expected %u\n");
+
+	/* The CC protocol hashes the image itself */
+	fake_reset(TRUE);
+	assert_equal_return(tpm_digest_algs(), 0, -1,
+			    "got %u expected %u\n");
+
+	/* A TPM 1.2 is handed the SHA-1 Authenticode digest */
+	fake_reset(TRUE);
+	fake.have_tpm12 = TRUE;
+	assert_equal_return(tpm_digest_algs(), DIGEST_SHA1, -1,
+			    "got %u expected %u\n");
+	return 0;
+}
+
+static int
+test_measures_image(void)
+{
+	fake_reset(FALSE);
+	assert_false_return(tpm_measures_image(), -1, "\n");
+
+	/* A TPM 1.2 is handed the digest, so it needn't see the image */
+	fake.have_tpm12 = TRUE;
+	assert_false_return(tpm_measures_image(), -1, "\n");
+
+	fake_reset(TRUE);
+	assert_true_return(tpm_measures_image(), -1, "\n");
+	return 0;
+}
+
+static int
+test_cc_log_pe(void)
+{
+	UINTN size = 65536 + 17;
+	UINT8 *image = make_image(size);
+	UINT8 zero[SHA384_DIGEST_SIZE] = { 0, };
+	digest_set_t digests;
+	EFI_STATUS efi_status;
+	int rc = -1;
+
+	assert_nonzero_return(image, -1, "\n");
+
+	fake_reset(TRUE);
+	image_digests(image, size, DIGEST_SHA1 | DIGEST_SHA256, &digests);
+	efi_status = tpm_log_pe((EFI_PHYSICAL_ADDRESS)(UINTN)image, size, 0,
+				NULL, &digests, 4);
+	assert_goto(!EFI_ERROR(efi_status), err, "\n");
+	assert_goto(fake.pe_coff_calls == 1, err, "\n");
+	assert_goto(fake.bytes_hashed == size, err, "\n");
+	assert_goto(fake.last_type == EV_EFI_BOOT_SERVICES_APPLICATION, err,
+		    "\n");
+	assert_goto(fake.last_mr == TDX_MR_INDEX_RTMR1, err, "\n");
+
+	/* The firmware has nothing to hash without the image */
+	fake_reset(TRUE);
+	tpm_log_pe(0, size, 0, NULL, &digests, 4);
+	assert_goto(fake.hash_calls == 0 && fake.pe_coff_calls == 0, err,
+		    "\n");
+	assert_goto(!CompareMem(fake.mr[TDX_MR_INDEX_RTMR1], zero,
+				sizeof(zero)), err,
+		    "RTMR extended without the image\n");
+
+	rc = 0;
+err:
+	FreePool(image);
+	return rc;
+}
+
+static int
+test_cc_log_pe_fallback(void)
+{
+	UINTN size = 4096;
+	UINT8 *image = make_image(size);
+	digest_set_t digests;
+	EFI_STATUS efi_status;
+	int rc = -1;
+
+	assert_nonzero_return(image, -1, "\n");
+
+	/* PE_COFF_IMAGE failing falls back to measuring the raw buffer */
+	fake_reset(TRUE);
+	fake.pe_coff_supported = FALSE;
+	image_digests(image, size, DIGEST_SHA1 | DIGEST_SHA256, &digests);
+	efi_status = tpm_log_pe((EFI_PHYSICAL_ADDRESS)(UINTN)image, size, 0,
+				NULL, &digests, 4);
+	assert_goto(!EFI_ERROR(efi_status), err, "\n");
+	assert_goto(fake.pe_coff_calls == 1, err, "\n");
+	assert_goto(fake.hash_calls == 1, err, "\n");
+
+	rc = 0;
+err:
+	FreePool(image);
+	return rc;
+}
+
+static int
+test_cc_log_event(void)
+{
+	const CHAR8 *desc = (const CHAR8 *)"test event";
+	UINT8 data[64];
+	EFI_STATUS efi_status;
+
+	SetMem(data, sizeof(data), 0x5a);
+	fake_reset(TRUE);
+	efi_status = tpm_log_event((EFI_PHYSICAL_ADDRESS)(UINTN)data,
+				   sizeof(data), 8, desc);
+	assert_return(!EFI_ERROR(efi_status), -1, "\n");
+	assert_equal_return(fake.pe_coff_calls, 0, -1,
+			    "got %u expected %u\n");
+	assert_equal_return(fake.hash_calls, 1, -1, "got %u expected %u\n");
+	assert_equal_return(fake.last_mr, TDX_MR_INDEX_RTMR2, -1,
+			    "got %u expected %u\n");
+	assert_equal_return(fake.last_type, EV_IPL, -1,
+			    "got %u expected %u\n");
+	return 0;
+}
+
+static EFI_STATUS
+measure_variables(unsigned int first, unsigned int n)
+{
+	EFI_GUID guid = { 0x605dab50, 0xe046, 0x4300,
+			  {0xab, 0xb6, 0x3d, 0xd8, 0x10, 0xdd, 0x8b, 0x23 } };
+	CHAR16 name[] = L"Var0000";
+	UINT32 data[4];
+	EFI_STATUS efi_status;
+	unsigned int i, v;
+
+	for (i = first; i < first + n; i++) {
+		for (v = 0; v < 4; v++)
+			name[3 + v] = L'0' + (i >> (12 - 4 * v)) % 16;
+		SetMem(data, sizeof(data), i);
+		efi_status = tpm_measure_variable(name, guid, sizeof(data),
+						  data);
+		if (EFI_ERROR(efi_status))
+			return efi_status;
+	}
+	return EFI_SUCCESS;
+}
+
+/*
+ * Probing costs LocateProtocol() for TPM2, TPM1.2 and CC
+ */
+#define PROBE_LOCATES 3
+
+static int
+test_backend_probed_once(void)
+{
+	UINT8 data[64];
+	EFI_STATUS efi_status;
+
+	fake_reset(TRUE);
+	efi_status = tpm_backend_init();
+	assert_return(!EFI_ERROR(efi_status), -1, "\n");
+	assert_equal_return(fake_open_events(), 3, -1,
+			    "got %u expected %u\n");
+	assert_equal_return(fake.locate_calls, PROBE_LOCATES, -1,
+			    "got %u expected %u\n");
+
+	efi_status = measure_variables(0, 40);
+	assert_return(!EFI_ERROR(efi_status), -1, "\n");
+	SetMem(data, sizeof(data), 0xa5);
+	efi_status = tpm_log_event((EFI_PHYSICAL_ADDRESS)(UINTN)data,
+				   sizeof(data), 8, (CHAR8 *)"event");
+	assert_return(!EFI_ERROR(efi_status), -1, "\n");
+	tpm_digest_algs();
+
+	assert_equal_return(fake.hash_calls, 41, -1, "got %u expected %u\n");
+	assert_equal_return(fake.locate_calls, PROBE_LOCATES, -1,
+			    "got %u expected %u\n");
+	/* One lookup each for PCR 7 and PCR 8 */
+	assert_equal_return(fake.map_calls, 2, -1, "got %u expected %u\n");
+
+	tpm_backend_fini();
+	assert_equal_return(fake_open_events(), 0, -1,
+			    "got %u expected %u\n");
+	return 0;
+}
+
+static int
+test_backend_reinstall(void)
+{
+	EFI_STATUS efi_status;
+
+	fake_reset(TRUE);
+	efi_status = tpm_backend_init();
+	assert_return(!EFI_ERROR(efi_status), -1, "\n");
+	efi_status = measure_variables(100, 10);
+	assert_return(!EFI_ERROR(efi_status), -1, "\n");
+	assert_equal_return(fake.locate_calls, PROBE_LOCATES, -1,
+			    "got %u expected %u\n");
+	assert_equal_return(tpm_digest_algs(), 0, -1, "got %u expected %u\n");
+
+	/* Firmware installs a TPM 1.2 after we probed */
+	fake.have_tpm12 = TRUE;
+	assert_equal_return(fake_reinstall(&EFI_TPM_GUID), 1, -1,
+			    "got %u expected %u\n");
+	assert_equal_return(tpm_digest_algs(), DIGEST_SHA1, -1,
+			    "got %u expected %u\n");
+	fake.have_tpm12 = FALSE;
+
+	/* A reinstalled CC protocol may map PCRs differently */
+	assert_equal_return(fake_reinstall(&EFI_CC_MEASUREMENT_PROTOCOL_GUID),
+			    1, -1, "got %u expected %u\n");
+	efi_status = measure_variables(110, 10);
+	assert_return(!EFI_ERROR(efi_status), -1, "\n");
+	assert_equal_return(fake.locate_calls, 3 * PROBE_LOCATES, -1,
+			    "got %u expected %u\n");
+	assert_equal_return(fake.map_calls, 2, -1, "got %u expected %u\n");
+	assert_equal_return(fake.hash_calls, 20, -1, "got %u expected %u\n");
+	return 0;
+}
+
+static int
+test_backend_lazy(void)
+{
+	EFI_STATUS efi_status;
+
+	/* Measurements made before shim_init() probe on first use */
+	fake_reset(TRUE);
+	efi_status = measure_variables(200, 20);
+	assert_return(!EFI_ERROR(efi_status), -1, "\n");
+	assert_equal_return(fake_open_events(), 0, -1,
+			    "got %u expected %u\n");
+	assert_equal_return(fake.locate_calls, PROBE_LOCATES, -1,
+			    "got %u expected %u\n");
+	assert_equal_return(fake.map_calls, 1, -1, "got %u expected %u\n");
+	assert_equal_return(fake.hash_calls, 20, -1, "got %u expected %u\n");
+	return 0;
+}
+
+static int
+test_variable_dedupe(void)
+{
+	EFI_GUID guid1 = { 0xd719b2cb, 0x3d3a, 0x4596,
+			   {0xa3, 0xbc, 0xda, 0xd0, 0x0e, 0x67, 0x65, 0x6f } };
+	EFI_GUID guid2 = { 0x8be4df61, 0x93ca, 0x11d2,
+			   {0xaa, 0x0d, 0x00, 0xe0, 0x98, 0x03, 0x2b, 0x8c } };
+	UINT8 data[] = "dbdata";
+	EFI_STATUS efi_status;
+
+	fake_reset(TRUE);
+	efi_status = measure_variables(300, 200);
+	assert_return(!EFI_ERROR(efi_status), -1, "\n");
+	efi_status = measure_variables(300, 200);
+	assert_return(!EFI_ERROR(efi_status), -1, "\n");
+	assert_equal_return(fake.hash_calls, 200, -1, "got %u expected %u\n");
+
+	efi_status = tpm_measure_variable(L"db", guid1, sizeof(data), data);
+	assert_return(!EFI_ERROR(efi_status), -1, "\n");
+	efi_status = tpm_measure_variable(L"db", guid1, sizeof(data), data);
+	assert_return(!EFI_ERROR(efi_status), -1, "\n");
+	assert_equal_return(fake.hash_calls, 201, -1, "got %u expected %u\n");
+
+	/* Any of name, GUID, size or contents differing is a new entry */
+	efi_status = tpm_measure_variable(L"db", guid2, sizeof(data), data);
+	assert_return(!EFI_ERROR(efi_status), -1, "\n");
+	efi_status = tpm_measure_variable(L"dbx", guid1, sizeof(data), data);
+	assert_return(!EFI_ERROR(efi_status), -1, "\n");
+	efi_status = tpm_measure_variable(L"db", guid1, sizeof(data) - 1,
+					  data);
+	assert_return(!EFI_ERROR(efi_status), -1, "\n");
+	data[0] = 'D';
+	efi_status = tpm_measure_variable(L"db", guid1, sizeof(data), data);
+	assert_return(!EFI_ERROR(efi_status), -1, "\n");
+	assert_equal_return(fake.hash_calls, 205, -1, "got %u expected %u\n");
+	return 0;
+}
+
+/*
+ * Roughly what booting two images does: measure each one, find its signer
+ * in a couple of databases (and the same one twice), then measure
+ * something else.  Batched, the first verification is flushed explicitly
+ * and the second by the next measurement.
+ */
+static int
+measure_boot(BOOLEAN batched, UINT8 *image, UINTN size)
+{
+	EFI_GUID guid = { 0x605dab50, 0xe046, 0x4300,
+			  {0xab, 0xb6, 0x3d, 0xd8, 0x10, 0xdd, 0x8b, 0x23 } };
+	UINT8 cert[700];
+	digest_set_t digests;
+	EFI_STATUS efi_status;
+	unsigned int i, before;
+
+	for (i = 0; i < 2; i++) {
+		image_digests(image + i, size - i, DIGEST_SHA1 |
+			      DIGEST_SHA256 | tpm_digest_algs(), &digests);
+		efi_status = tpm_log_pe((EFI_PHYSICAL_ADDRESS)(UINTN)image + i,
+					size - i, 0, NULL, &digests, 4);
+		assert_return(!EFI_ERROR(efi_status), -1, "\n");
+
+		if (batched)
+			tpm_queue_measurements();
+		before = fake.hash_calls;
+		SetMem(cert, sizeof(cert), 0x40 + i);
+		tpm_measure_variable(L"db", guid, sizeof(cert), cert);
+		tpm_measure_variable(L"MokList", guid, sizeof(cert), cert);
+		tpm_measure_variable(L"db", guid, sizeof(cert), cert);
+		measure_variables(1000 + 10 * i, 3);
+		if (batched)
+			assert_equal_return(fake.hash_calls, before, -1,
+					    "got %u expected %u\n");
+		else
+			assert_equal_return(fake.hash_calls, before + 5, -1,
+					    "got %u expected %u\n");
+		if (batched && i == 0)
+			tpm_flush_measurements();
+	}
+
+	efi_status = tpm_log_event((EFI_PHYSICAL_ADDRESS)(UINTN)image, 32,
+				   8, (CHAR8 *)"next");
+	assert_return(!EFI_ERROR(efi_status), -1, "\n");
+	return 0;
+}
+
+static int
+test_batched_log(void)
+{
+	UINTN size = 8192;
+	UINT8 *image = make_image(size);
+	UINT8 *log = NULL, mr[5][SHA384_DIGEST_SIZE];
+	UINTN log_size = 0;
+	int rc = -1;
+
+	assert_nonzero_return(image, -1, "\n");
+
+	fake_reset(TRUE);
+	tpm_forget_measurements();
+	if (measure_boot(FALSE, image, size) < 0)
+		goto err;
+	log = fake.log;
+	log_size = fake.log_size;
+	fake.log = NULL;
+	CopyMem(mr, fake.mr, sizeof(mr));
+	assert_goto(fake.pe_coff_calls == 2, err, "\n");
+	assert_goto(fake.hash_calls == 13, err, "\n");
+
+	fake_reset(TRUE);
+	tpm_forget_measurements();
+	if (measure_boot(TRUE, image, size) < 0)
+		goto err;
+	assert_goto(fake.pe_coff_calls == 2, err, "\n");
+	assert_goto(fake.hash_calls == 13, err, "\n");
+	assert_goto(fake.log_size == log_size, err, "%lu != %lu\n",
+		    fake.log_size, log_size);
+	assert_goto(!CompareMem(fake.log, log, log_size), err,
+		    "batched event log differs\n");
+	assert_goto(!CompareMem(fake.mr, mr, sizeof(mr)), err,
+		    "batched MRs differ\n");
+
+	rc = 0;
+err:
+	if (log)
+		free(log);
+	FreePool(image);
+	return rc;
+}
+
+/*
+ * The linear list tpm_measure_variable() used to keep, for comparison
+ */
+struct linear_record {
+	CHAR16 *name;
+	EFI_GUID guid;
+	VOID *data;
+	UINTN size;
+};
+
+static struct linear_record *linear_records;
+static UINTN linear_count;
+
+static void
+linear_measure(CHAR16 *name, EFI_GUID *guid, UINTN size, VOID *data)
+{
+	UINTN i;
+
+	for (i = 0; i < linear_count; i++) {
+		if (StrCmp(name, linear_records[i].name) == 0 &&
+		    CompareGuid(guid, &linear_records[i].guid) == 0 &&
+		    size == linear_records[i].size &&
+		    CompareMem(data, linear_records[i].data, size) == 0)
+			return;
+	}
+
+	linear_records = ReallocatePool(linear_records,
+					linear_count * sizeof(*linear_records),
+					(linear_count + 1) *
+					sizeof(*linear_records));
+	linear_records[linear_count].name = AllocatePool(StrSize(name));
+	linear_records[linear_count].data = AllocatePool(size);
+	StrCpy(linear_records[linear_count].name, name);
+	CopyMem(&linear_records[linear_count].guid, guid, sizeof(*guid));
+	CopyMem(linear_records[linear_count].data, data, size);
+	linear_records[linear_count].size = size;
+	linear_count++;
+}
+
+#define BENCH_VARIABLES 10000
+
+static int
+test_variable_dedupe_bench(void)
+{
+	EFI_GUID guid = { 0x605dab50, 0xe046, 0x4300,
+			  {0xab, 0xb6, 0x3d, 0xd8, 0x10, 0xdd, 0x8b, 0x23 } };
+	CHAR16 name[] = L"MokListRT0000";
+	UINT8 data[16 + 1024];
+	UINT64 t, t_linear, t_hashed;
+	EFI_STATUS efi_status;
+	unsigned int i, v, pass;
+
+	/* No measurement protocols, so this is only the dedupe cost */
+	fake_reset(FALSE);
+
+	t_linear = t_hashed = 0;
+	for (pass = 0; pass < 2; pass++) {
+		for (i = 0; i < BENCH_VARIABLES; i++) {
+			for (v = 0; v < 4; v++)
+				name[9 + v] = L'a' + (i >> (12 - 4 * v)) % 16;
+			SetMem(data, sizeof(data), 0x30);
+			CopyMem(data, &i, sizeof(i));
+
+			t = test_ticks();
+			linear_measure(name, &guid, sizeof(data), data);
+			t_linear += test_ticks() - t;
+
+			t = test_ticks();
+			efi_status = tpm_measure_variable(name, guid,
+							  sizeof(data), data);
+			t_hashed += test_ticks() - t;
+			assert_return(!EFI_ERROR(efi_status), -1, "\n");
+		}
+	}
+	assert_equal_return(linear_count, BENCH_VARIABLES, -1,
+			    "got %lu expected %u\n");
+
+	printf("%u variables measured twice: linear %llu %ss/measurement, "
+	       "hashed %llu %ss/measurement\n", BENCH_VARIABLES,
+	       (unsigned long long)(t_linear / (2 * BENCH_VARIABLES)),
+	       test_tick_unit(),
+	       (unsigned long long)(t_hashed / (2 * BENCH_VARIABLES)),
+	       test_tick_unit());
+
+	for (i = 0; i < linear_count; i++) {
+		FreePool(linear_records[i].name);
+		FreePool(linear_records[i].data);
+	}
+	FreePool(linear_records);
+	return 0;
+}
+
+int
+main(void)
+{
+	int status = 0;
+	test(test_cc_digest_algs);
+	test(test_measures_image);
+	test(test_cc_log_pe);
+	test(test_cc_log_pe_fallback);
+	test(test_cc_log_event);
+	test(test_backend_probed_once);
+	test(test_backend_reinstall);
+	test(test_backend_lazy);
+	test(test_variable_dedupe);
+	test(test_batched_log);
+	test(test_variable_dedupe_bench);
+	return status;
+}
+
+// vim:fenc=utf-8:tw=75:noet
@@ -0,0 +1,294 @@
+// SPDX-License-Identifier: BSD-2-Clause-Patent
+/*
+ * test-vcache.c - test remembering verification verdicts
+ */
+
+#ifndef SHIM_UNIT_TEST
+#define SHIM_UNIT_TEST
+#endif
+#include "shim.h"
+
+#include <stdio.h>
+
+static UINTN fake_epoch;
+
+UINTN
+sigdb_epoch(void)
+{
+	return fake_epoch;
+}
+
+static struct {
+	unsigned int calls;
+	CHAR16 *name;
+	UINTN size;
+	void *data;
+} measured;
+
+EFI_STATUS
+tpm_measure_variable(CHAR16 *dbname, EFI_GUID guid, UINTN size, void *data)
+{
+	measured.calls++;
+	measured.name = dbname;
+	measured.size = size;
+	measured.data = data;
+	return EFI_SUCCESS;
+}
+
+static UINT8 cert[] = "not really a certificate";
+
+static void
+fake_hash(UINT8 *hash, UINT8 seed)
+{
+	memset(hash, seed, SHA256_DIGEST_SIZE);
+}
+
+/*
+ * The certificate table most of these images have
+ */
+static UINT8 certs_hash[SHA256_DIGEST_SIZE] = { 0xce, 0x27 };
+
+/*
+ * What verify_image() does on a miss
+ */
+static void
+verify_signed(UINT8 *hash, UINT8 *certs, EFI_STATUS status,
+	      verification_method_t method, UINTN nmeasurements)
+{
+	UINTN i;
+
+	vcache_start(hash, certs);
+	for (i = 0; i < nmeasurements; i++) {
+		tpm_measure_variable(L"db", SHIM_LOCK_GUID, sizeof(cert), cert);
+		vcache_measured(L"db", SHIM_LOCK_GUID, sizeof(cert), cert);
+	}
+	vcache_finish(status, method, FALSE);
+}
+
+static void
+verify(UINT8 *hash, EFI_STATUS status, verification_method_t method,
+       UINTN nmeasurements)
+{
+	verify_signed(hash, certs_hash, status, method, nmeasurements);
+}
+
+static int
+test_vcache_hit(void)
+{
+	UINT8 hash[SHA256_DIGEST_SIZE];
+	EFI_STATUS status = EFI_NOT_READY;
+	verification_method_t method = VERIFIED_BY_NOTHING;
+	BOOLEAN overrides = FALSE;
+
+	vcache_invalidate();
+	fake_hash(hash, 1);
+
+	assert_false_return(vcache_lookup(hash, certs_hash, &status, &method,
+					  &overrides), -1,
+			    "empty cache hit\n");
+	verify(hash, EFI_SUCCESS, VERIFIED_BY_CERT, 1);
+
+	/* the hit measures the certificate again, as verifying did */
+	ZeroMem(&measured, sizeof(measured));
+	assert_true_return(vcache_lookup(hash, certs_hash, &status, &method,
+					 &overrides), -1,
+			   "missed\n");
+	assert_equal_return(status, EFI_SUCCESS, -1, "got %lx expected %lx\n");
+	assert_equal_return(method, VERIFIED_BY_CERT, -1,
+			    "got %d expected %d\n");
+	assert_equal_return(measured.calls, 1, -1, "got %u expected %u\n");
+	assert_zero_return(StrCmp(measured.name, L"db"), -1, "wrong name\n");
+	assert_equal_return(measured.data, cert, -1, "got %p expected %p\n");
+	assert_equal_return(measured.size, sizeof(cert), -1,
+			    "got %lu expected %lu\n");
+	assert_false_return(overrides, -1, "overrides when it didn't\n");
+
+	/* and one that replaced verification_method does it again */
+	fake_hash(hash, 3);
+	vcache_start(hash, certs_hash);
+	vcache_finish(EFI_SUCCESS, VERIFIED_BY_HASH, TRUE);
+	assert_true_return(vcache_lookup(hash, certs_hash, &status, &method,
+					 &overrides), -1,
+			   "missed\n");
+	assert_equal_return(method, VERIFIED_BY_HASH, -1,
+			    "got %d expected %d\n");
+	assert_true_return(overrides, -1, "doesn't override\n");
+
+	/* a different image is still a miss */
+	fake_hash(hash, 2);
+	assert_false_return(vcache_lookup(hash, certs_hash, &status, &method,
+					  &overrides), -1,
+			    "wrong image hit\n");
+
+	return 0;
+}
+
+static int
+test_vcache_verdicts(void)
+{
+	UINT8 hash[SHA256_DIGEST_SIZE];
+	EFI_STATUS status;
+	verification_method_t method;
+	BOOLEAN overrides = FALSE;
+
+	vcache_invalidate();
+
+	/* being forbidden is as definite as being allowed */
+	fake_hash(hash, 1);
+	verify(hash, EFI_SECURITY_VIOLATION, VERIFIED_BY_NOTHING, 0);
+	assert_true_return(vcache_lookup(hash, certs_hash, &status, &method,
+					 &overrides), -1,
+			   "missed\n");
+	assert_equal_return(status, EFI_SECURITY_VIOLATION, -1,
+			    "got %lx expected %lx\n");
+
+	/* running out of memory isn't */
+	fake_hash(hash, 2);
+	verify(hash, EFI_OUT_OF_RESOURCES, VERIFIED_BY_NOTHING, 0);
+	assert_false_return(vcache_lookup(hash, certs_hash, &status, &method,
+					  &overrides), -1,
+			    "transient error cached\n");
+
+	/* nor is anything we couldn't replay all the measurements of */
+	fake_hash(hash, 3);
+	verify(hash, EFI_SUCCESS, VERIFIED_BY_HASH, VCACHE_MEASUREMENTS + 1);
+	assert_false_return(vcache_lookup(hash, certs_hash, &status, &method,
+					  &overrides), -1,
+			    "lost measurements\n");
+
+	return 0;
+}
+
+/*
+ * The Authenticode digest doesn't cover the certificate table, so the
+ * same code signed differently is a different image as far as the
+ * verdict goes.
+ */
+static int
+test_vcache_certs(void)
+{
+	UINT8 hash[SHA256_DIGEST_SIZE];
+	UINT8 other_certs[SHA256_DIGEST_SIZE];
+	EFI_STATUS status;
+	verification_method_t method;
+	BOOLEAN overrides = FALSE;
+
+	vcache_invalidate();
+	fake_hash(hash, 1);
+	fake_hash(other_certs, 0x77);
+
+	/* an unsigned copy being refused doesn't refuse a signed one */
+	verify_signed(hash, other_certs, EFI_SECURITY_VIOLATION,
+		      VERIFIED_BY_NOTHING, 0);
+	assert_false_return(vcache_lookup(hash, certs_hash, &status, &method,
+					  &overrides),
+			    -1, "refusal of another copy reused\n");
+
+	/* nor does a signed copy being allowed allow one signed otherwise */
+	verify(hash, EFI_SUCCESS, VERIFIED_BY_CERT, 1);
+	fake_hash(other_certs, 0x78);
+	ZeroMem(&measured, sizeof(measured));
+	assert_false_return(vcache_lookup(hash, other_certs, &status, &method,
+					  &overrides),
+			    -1, "verdict of another copy reused\n");
+	assert_zero_return(measured.calls, -1,
+			   "another copy's measurements replayed\n");
+
+	/* each keeps its own verdict */
+	fake_hash(other_certs, 0x77);
+	assert_true_return(vcache_lookup(hash, other_certs, &status, &method,
+					 &overrides),
+			   -1, "missed\n");
+	assert_equal_return(status, EFI_SECURITY_VIOLATION, -1,
+			    "got %lx expected %lx\n");
+	assert_true_return(vcache_lookup(hash, certs_hash, &status, &method,
+					 &overrides),
+			   -1, "missed\n");
+	assert_equal_return(status, EFI_SUCCESS, -1, "got %lx expected %lx\n");
+
+	return 0;
+}
+
+static int
+test_vcache_invalidate(void)
+{
+	UINT8 hash[SHA256_DIGEST_SIZE];
+	EFI_STATUS status;
+	verification_method_t method;
+	BOOLEAN overrides = FALSE;
+
+	vcache_invalidate();
+	fake_hash(hash, 1);
+
+	/* the databases changing forgets everything */
+	verify(hash, EFI_SUCCESS, VERIFIED_BY_HASH, 1);
+	fake_epoch++;
+	assert_false_return(vcache_lookup(hash, certs_hash, &status, &method,
+					  &overrides), -1,
+			    "hit after the databases changed\n");
+
+	/* including while we were in the middle of verifying */
+	vcache_start(hash, certs_hash);
+	vcache_measured(L"db", SHIM_LOCK_GUID, sizeof(cert), cert);
+	fake_epoch++;
+	vcache_finish(EFI_SUCCESS, VERIFIED_BY_HASH, FALSE);
+	assert_false_return(vcache_lookup(hash, certs_hash, &status, &method,
+					  &overrides), -1,
+			    "kept a verdict from old databases\n");
+
+	/* and so does being told to, when the SBAT policy changes */
+	verify(hash, EFI_SUCCESS, VERIFIED_BY_HASH, 1);
+	vcache_invalidate();
+	assert_false_return(vcache_lookup(hash, certs_hash, &status, &method,
+					  &overrides), -1,
+			    "hit after invalidation\n");
+
+	return 0;
+}
+
+static int
+test_vcache_evict(void)
+{
+	UINT8 hash[SHA256_DIGEST_SIZE];
+	EFI_STATUS status;
+	verification_method_t method;
+	BOOLEAN overrides = FALSE;
+	UINTN i;
+
+	vcache_invalidate();
+
+	for (i = 0; i <= VCACHE_ENTRIES; i++) {
+		fake_hash(hash, i + 1);
+		verify(hash, EFI_SUCCESS, VERIFIED_BY_HASH, 0);
+	}
+
+	/* the oldest one made way for the newest */
+	fake_hash(hash, 1);
+	assert_false_return(vcache_lookup(hash, certs_hash, &status, &method,
+					  &overrides), -1,
+			    "oldest entry still there\n");
+	for (i = 1; i <= VCACHE_ENTRIES; i++) {
+		fake_hash(hash, i + 1);
+		assert_true_return(vcache_lookup(hash, certs_hash, &status, &method,
+						 &overrides), -1,
+				   "entry %lu missing\n", i);
+	}
+
+	return 0;
+}
+
+int
+main(void)
+{
+	int status = 0;
+
+	test(test_vcache_hit);
+	test(test_vcache_verdicts);
+	test(test_vcache_certs);
+	test(test_vcache_invalidate);
+	test(test_vcache_evict);
+
+	return status;
+}
+
+// vim:fenc=utf-8:tw=75:noet
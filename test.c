@@ -9,8 +9,16 @@
 #endif
 #include "shim.h"
 
+#include <Library/BaseCryptLib.h>
+#include <openssl/sha.h>
+#include <time.h>
+
 UINT8 in_protocol = 0;
 int debug = DEFAULT_DEBUG_PRINT_STATE;
+EFI_BOOT_SERVICES *BS = NULL;
+EFI_STATUS (*test_get_variable_attr)(const CHAR16 * const var,
+				    UINT8 **data, UINTN *len, EFI_GUID owner,
+				    UINT32 *attributes) = NULL;
 
 #pragma GCC diagnostic ignored "-Wunused-parameter"
 #pragma GCC diagnostic ignored "-Wunused-function"
@@ -32,7 +40,7 @@ StrCmp(CONST CHAR16 *s1, CONST CHAR16 *s2) {
 		if (s1[i] != s2[i])
 			return s2[i] - s1[i];
 	}
-	return 0;
+	return s2[i] - s1[i];
 }
 
 INTN
@@ -46,13 +54,48 @@ StrnCmp(CONST CHAR16 *s1, CONST CHAR16 *s2, UINTN len) {
 			return s2[i] - s1[i];
 
 	}
-	return 0;
+	return i < len ? s2[i] - s1[i] : 0;
+}
+
+UINTN
+StrLen(CONST CHAR16 *s1)
+{
+	UINTN i;
+
+	assert(s1 != NULL);
+	for (i = 0; s1[i]; i++)
+		;
+	return i;
+}
+
+UINTN
+StrSize(CONST CHAR16 *s1)
+{
+	return (StrLen(s1) + 1) * sizeof(*s1);
+}
+
+VOID
+StrCpy(CHAR16 *dest, CONST CHAR16 *src)
+{
+	assert(dest != NULL);
+	assert(src != NULL);
+
+	memcpy(dest, src, StrSize(src));
+}
+
+INTN
+CompareGuid(EFI_GUID *guid1, EFI_GUID *guid2)
+{
+	return memcmp(guid1, guid2, sizeof(*guid1));
 }
 
 EFI_STATUS
 get_variable_attr(const CHAR16 * const var, UINT8 **data, UINTN *len,
 		  EFI_GUID owner, UINT32 *attributes)
 {
+	if (test_get_variable_attr)
+		return test_get_variable_attr(var, data, len, owner,
+					      attributes);
 	return EFI_UNSUPPORTED;
 }
 
@@ -62,6 +105,69 @@ get_variable(const CHAR16 * const var, UINT8 **data, UINTN *len, EFI_GUID owner)
 	return get_variable_attr(var, data, len, owner, NULL);
 }
 
+/*
+ * Cryptlib's hash entry points, backed by the host's libcrypto
+ */
+#define HOST_HASH(name, ctxtype, prefix)				\
+UINTN EFIAPI name##GetContextSize(VOID) { return sizeof(ctxtype); }	\
+BOOLEAN EFIAPI name##Init(VOID *ctx)					\
+{									\
+	return ctx && prefix##_Init(ctx);				\
+}									\
+BOOLEAN EFIAPI name##Update(VOID *ctx, CONST VOID *data, UINTN size)	\
+{									\
+	return ctx && prefix##_Update(ctx, data, size);			\
+}									\
+BOOLEAN EFIAPI name##Final(VOID *ctx, UINT8 *digest)			\
+{									\
+	return ctx && prefix##_Final(digest, ctx);			\
+}
+
+HOST_HASH(Sha1, SHA_CTX, SHA1)
+HOST_HASH(Sha256, SHA256_CTX, SHA256)
+HOST_HASH(Sha384, SHA512_CTX, SHA384)
+HOST_HASH(Sha512, SHA512_CTX, SHA512)
+
+BOOLEAN EFIAPI
+Sha256UpdateMulti(VOID **ctxs, CONST VOID **data, CONST UINTN *sizes,
+		  UINTN count)
+{
+	UINTN i;
+
+	for (i = 0; i < count; i++) {
+		if (!Sha256Update(ctxs[i], data[i], sizes[i]))
+			return FALSE;
+	}
+	return TRUE;
+}
+
+/*
+ * A cheap timestamp for the benchmarks: cycles where we can read them,
+ * nanoseconds otherwise.
+ */
+UINT64
+test_ticks(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __builtin_ia32_rdtsc();
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (UINT64)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+#endif
+}
+
+const char *
+test_tick_unit(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return "cycle";
+#else
+	return "ns";
+#endif
+}
+
 EFI_GUID SHIM_LOCK_GUID = {0x605dab50, 0xe046, 0x4300, {0xab, 0xb6, 0x3d, 0xd8, 0x10, 0xdd, 0x8b, 0x23 } };
 
 // vim:fenc=utf-8:tw=75:noet
@@ -1,15 +1,61 @@
 // SPDX-License-Identifier: BSD-2-Clause-Patent
 #include "shim.h"
 
+/*
+ * Variables we've already measured, as an open-addressing set of SHA-256
+ * digests of their name, GUID and contents.  The slots live in a single
+ * allocation, sized to a power of two and kept at most half full; an
+ * all-zero slot is empty.
+ */
 typedef struct {
-	CHAR16 *VariableName;
-	EFI_GUID *VendorGuid;
-	VOID *Data;
-	UINTN Size;
-} VARIABLE_RECORD;
+	UINT8 digest[SHA256_DIGEST_SIZE];
+} measured_slot_t;
 
-UINTN measuredcount = 0;
-VARIABLE_RECORD *measureddata = NULL;
+#define MEASURED_MIN_SLOTS 64
+
+static measured_slot_t *measured_slots = NULL;
+static UINTN measured_size = 0;
+static UINTN measured_count = 0;
+
+/*
+ * EV_EFI_VARIABLE_AUTHORITY events found while verifying an image are
+ * built in place in one growing arena and submitted in order at the next
+ * sync point.  Measuring anything else flushes the queue first, so the
+ * event log comes out exactly as if they had been logged directly.
+ */
+typedef struct {
+	UINT32 size;
+	UINT32 logsize;
+	UINT8 digest[SHA256_DIGEST_SIZE];
+	UINT8 log[0];
+} queued_event_t;
+
+static BOOLEAN queueing = FALSE;
+static UINT8 *queue = NULL;
+static UINTN queue_size = 0;
+static UINTN queue_used = 0;
+
+/*
+ * The firmware copies events into its own log, so one buffer serves for
+ * every EFI_TCG2_EVENT/EFI_CC_EVENT/TCG_PCR_EVENT we build.
+ */
+static VOID *event_buffer = NULL;
+static UINTN event_buffer_size = 0;
+
+static VOID *
+tpm_event_buffer(UINTN size)
+{
+	if (size > event_buffer_size) {
+		if (event_buffer)
+			FreePool(event_buffer);
+		event_buffer_size = 0;
+		event_buffer = AllocatePool(size);
+		if (!event_buffer)
+			return NULL;
+		event_buffer_size = size;
+	}
+	return event_buffer;
+}
 
 static BOOLEAN
 tpm_present(efi_tpm_protocol_t *tpm)
@@ -105,19 +151,152 @@ tpm_locate_protocol(efi_tpm_protocol_t **tpm, efi_tpm2_protocol_t **tpm2,
 	return EFI_NOT_FOUND;
 }
 
+/*
+ * Finding the measurement protocols takes several LocateProtocol() and
+ * GetCapability() calls, and a boot measures dozens of events, so we probe
+ * once and keep what we found until one of the protocols is installed or
+ * reinstalled.
+ */
+#define MEASURED_PCRS 32
+
+typedef struct {
+	BOOLEAN probed;
+	EFI_STATUS tpm_status;
+	efi_tpm_protocol_t *tpm;
+	efi_tpm2_protocol_t *tpm2;
+	efi_cc_protocol_t *cc;
+	UINT32 mr_mapped;
+	EFI_CC_MR_INDEX mr[MEASURED_PCRS];
+} measurement_backend_t;
+
+static measurement_backend_t backend;
+
+static EFI_GUID *backend_guids[] = {
+	&EFI_TPM_GUID,
+	&EFI_TPM2_GUID,
+	&EFI_CC_MEASUREMENT_PROTOCOL_GUID,
+};
+#define BACKEND_GUIDS (sizeof(backend_guids) / sizeof(backend_guids[0]))
+static EFI_EVENT backend_events[BACKEND_GUIDS];
+
+static void
+tpm_backend_probe(void)
+{
+	EFI_STATUS efi_status;
+
+	ZeroMem(&backend, sizeof(backend));
+
+	backend.tpm_status = tpm_locate_protocol(&backend.tpm, &backend.tpm2,
+	                                         NULL, NULL);
+	if (EFI_ERROR(backend.tpm_status)) {
+		backend.tpm = NULL;
+		backend.tpm2 = NULL;
+	}
+
+	efi_status = LibLocateProtocol(&EFI_CC_MEASUREMENT_PROTOCOL_GUID,
+	                               (VOID **)&backend.cc);
+	if (EFI_ERROR(efi_status))
+		backend.cc = NULL;
+
+	backend.probed = TRUE;
+}
+
+static measurement_backend_t *
+tpm_backend(void)
+{
+	if (!backend.probed)
+		tpm_backend_probe();
+	return &backend;
+}
+
+static VOID EFIAPI
+tpm_backend_notify(EFI_EVENT event, VOID *context)
+{
+	backend.probed = FALSE;
+}
+
+/*
+ * Probe for the measurement protocols, and arrange to probe again if any
+ * of them is (re)installed.  Measurements made before this probe lazily.
+ */
+EFI_STATUS
+tpm_backend_init(void)
+{
+	EFI_STATUS efi_status = EFI_SUCCESS;
+	VOID *registration;
+	UINTN i;
+
+	for (i = 0; i < BACKEND_GUIDS; i++) {
+		if (backend_events[i])
+			continue;
+
+		efi_status = gBS->CreateEvent(EVT_NOTIFY_SIGNAL, TPL_CALLBACK,
+		                              tpm_backend_notify, NULL,
+		                              &backend_events[i]);
+		if (EFI_ERROR(efi_status)) {
+			perror(L"Could not create event: %r\n", efi_status);
+			backend_events[i] = NULL;
+			break;
+		}
+
+		efi_status = gBS->RegisterProtocolNotify(backend_guids[i],
+		                                         backend_events[i],
+		                                         &registration);
+		if (EFI_ERROR(efi_status)) {
+			perror(L"Could not register protocol notify: %r\n",
+			       efi_status);
+			gBS->CloseEvent(backend_events[i]);
+			backend_events[i] = NULL;
+			break;
+		}
+	}
+
+	tpm_backend_probe();
+
+	return efi_status;
+}
+
+void
+tpm_backend_fini(void)
+{
+	UINTN i;
+
+	for (i = 0; i < BACKEND_GUIDS; i++) {
+		if (backend_events[i])
+			gBS->CloseEvent(backend_events[i]);
+		backend_events[i] = NULL;
+	}
+
+	ZeroMem(&backend, sizeof(backend));
+
+	if (event_buffer)
+		FreePool(event_buffer);
+	event_buffer = NULL;
+	event_buffer_size = 0;
+
+	if (queue)
+		FreePool(queue);
+	queue = NULL;
+	queue_size = queue_used = 0;
+	queueing = FALSE;
+}
+
 static EFI_STATUS
 tpm_log_event_raw(EFI_PHYSICAL_ADDRESS buf, UINTN size, UINT8 pcr,
-                  const CHAR8 *log, UINTN logsize, UINT32 type, CHAR8 *hash)
+                  const CHAR8 *log, UINTN logsize, UINT32 type,
+                  const digest_set_t *digests)
 {
 	EFI_STATUS efi_status;
+	measurement_backend_t *be;
 	efi_tpm_protocol_t *tpm;
 	efi_tpm2_protocol_t *tpm2;
-	BOOLEAN old_caps;
-	EFI_TCG2_BOOT_SERVICE_CAPABILITY caps;
 
-	cc_log_event_raw(buf, size, pcr, log, logsize, type, hash);
+	cc_log_event_raw(buf, size, pcr, log, logsize, type, digests);
 
-	efi_status = tpm_locate_protocol(&tpm, &tpm2, &old_caps, &caps);
+	be = tpm_backend();
+	tpm = be->tpm;
+	tpm2 = be->tpm2;
+	efi_status = be->tpm_status;
 	if (EFI_ERROR(efi_status)) {
 #ifdef REQUIRE_TPM
 		perror(L"TPM logging failed: %r\n", efi_status);
@@ -133,7 +312,7 @@ tpm_log_event_raw(EFI_PHYSICAL_ADDRESS buf, UINTN size, UINT8 pcr,
 		UINTN event_size =
 			sizeof(*event) - sizeof(event->Event) + logsize;
 
-		event = AllocatePool(event_size);
+		event = tpm_event_buffer(event_size);
 		if (!event) {
 			perror(L"Unable to allocate event structure\n");
 			return EFI_OUT_OF_RESOURCES;
@@ -145,7 +324,13 @@ tpm_log_event_raw(EFI_PHYSICAL_ADDRESS buf, UINTN size, UINT8 pcr,
 		event->Header.EventType = type;
 		event->Size = event_size;
 		CopyMem(event->Event, (VOID *)log, logsize);
-		if (hash) {
+		if (digests && !buf) {
+			/* There's no way to give a TPM 2 a digest we made
+			   ourselves; it has to see the image. */
+			perror(L"Cannot measure an image that isn't in memory\n");
+			return EFI_UNSUPPORTED;
+		}
+		if (digests) {
 			/* TPM 2 systems will generate the appropriate hash
 			   themselves if we pass PE_COFF_IMAGE.  In case that
 			   fails we fall back to measuring without it.
@@ -154,25 +339,17 @@ tpm_log_event_raw(EFI_PHYSICAL_ADDRESS buf, UINTN size, UINT8 pcr,
 				tpm2, PE_COFF_IMAGE, buf, (UINT64)size, event);
 		}
 
-		if (!hash || EFI_ERROR(efi_status)) {
+		if (!digests || EFI_ERROR(efi_status)) {
 			efi_status = tpm2->hash_log_extend_event(
 				tpm2, 0, buf, (UINT64)size, event);
 		}
-		FreePool(event);
 		return efi_status;
 	} else if (tpm) {
 		TCG_PCR_EVENT *event;
 		UINT32 eventnum = 0;
 		EFI_PHYSICAL_ADDRESS lastevent;
 
-		efi_status = LibLocateProtocol(&EFI_TPM_GUID, (VOID **)&tpm);
-		if (EFI_ERROR(efi_status))
-			return EFI_SUCCESS;
-
-		if (!tpm_present(tpm))
-			return EFI_SUCCESS;
-
-		event = AllocatePool(sizeof(*event) + logsize);
+		event = tpm_event_buffer(sizeof(*event) + logsize);
 
 		if (!event) {
 			perror(L"Unable to allocate event structure\n");
@@ -183,11 +360,12 @@ tpm_log_event_raw(EFI_PHYSICAL_ADDRESS buf, UINTN size, UINT8 pcr,
 		event->EventType = type;
 		event->EventSize = logsize;
 		CopyMem(event->Event, (VOID *)log, logsize);
-		if (hash) {
+		if (digests) {
 			/* TPM 1.2 devices require us to pass the Authenticode
 			   hash rather than allowing the firmware to attempt
 			   to calculate it */
-			CopyMem(event->digest, hash, sizeof(event->digest));
+			CopyMem(event->digest, digests->sha1,
+			        sizeof(event->digest));
 			efi_status =
 				tpm->log_extend_event(tpm, 0, 0, TPM_ALG_SHA,
 			                              event, &eventnum,
@@ -198,7 +376,6 @@ tpm_log_event_raw(EFI_PHYSICAL_ADDRESS buf, UINTN size, UINT8 pcr,
 			                              TPM_ALG_SHA, event,
 			                              &eventnum, &lastevent);
 		}
-		FreePool(event);
 		return efi_status;
 	}
 
@@ -209,18 +386,22 @@ EFI_STATUS
 tpm_log_event(EFI_PHYSICAL_ADDRESS buf, UINTN size, UINT8 pcr,
               const CHAR8 *description)
 {
+	tpm_flush_measurements();
+
 	return tpm_log_event_raw(buf, size, pcr, description,
 	                         strlen(description) + 1, EV_IPL, NULL);
 }
 
 EFI_STATUS
 tpm_log_pe(EFI_PHYSICAL_ADDRESS buf, UINTN size, EFI_PHYSICAL_ADDRESS addr,
-           EFI_DEVICE_PATH *path, UINT8 *sha1hash, UINT8 pcr)
+           EFI_DEVICE_PATH *path, const digest_set_t *digests, UINT8 pcr)
 {
 	EFI_IMAGE_LOAD_EVENT *ImageLoad = NULL;
 	EFI_STATUS efi_status;
 	UINTN path_size = 0;
 
+	tpm_flush_measurements();
+
 	if (path)
 		path_size = DevicePathSize(path);
 
@@ -242,7 +423,7 @@ tpm_log_pe(EFI_PHYSICAL_ADDRESS buf, UINTN size, EFI_PHYSICAL_ADDRESS addr,
 	efi_status = tpm_log_event_raw(buf, size, pcr, (CHAR8 *)ImageLoad,
 	                               sizeof(*ImageLoad) + path_size,
 	                               EV_EFI_BOOT_SERVICES_APPLICATION,
-	                               (CHAR8 *)sha1hash);
+	                               digests);
 	FreePool(ImageLoad);
 
 	return efi_status;
@@ -256,61 +437,216 @@ typedef struct {
 	INT8 VariableData[1];
 } __attribute__((packed)) EFI_VARIABLE_DATA_TREE;
 
+static EFI_STATUS
+tpm_variable_digest(CHAR16 *VarName, EFI_GUID *VendorGuid, UINTN VarSize,
+                    VOID *VarData, UINT8 *digest)
+{
+	EFI_STATUS efi_status;
+	digest_ctx_t ctx;
+	digest_set_t digests;
+	UINT64 len;
+
+	efi_status = digest_init(&ctx, DIGEST_SHA256);
+	if (EFI_ERROR(efi_status))
+		return efi_status;
+
+	/* Length-prefix the name so it can't run into the data */
+	len = StrSize(VarName);
+	efi_status = digest_update(&ctx, &len, sizeof(len));
+	if (!EFI_ERROR(efi_status))
+		efi_status = digest_update(&ctx, VarName, len);
+	if (!EFI_ERROR(efi_status))
+		efi_status = digest_update(&ctx, VendorGuid,
+		                           sizeof(*VendorGuid));
+	len = VarSize;
+	if (!EFI_ERROR(efi_status))
+		efi_status = digest_update(&ctx, &len, sizeof(len));
+	if (!EFI_ERROR(efi_status))
+		efi_status = digest_update(&ctx, VarData, VarSize);
+	if (!EFI_ERROR(efi_status))
+		efi_status = digest_final(&ctx, &digests);
+	digest_free(&ctx);
+	if (EFI_ERROR(efi_status))
+		return efi_status;
+
+	CopyMem(digest, digests.sha256, SHA256_DIGEST_SIZE);
+	return EFI_SUCCESS;
+}
+
 static BOOLEAN
-tpm_data_measured(CHAR16 *VarName, EFI_GUID VendorGuid, UINTN VarSize,
-                  VOID *VarData)
+measured_slot_empty(measured_slot_t *slot)
+{
+	static const UINT8 empty[SHA256_DIGEST_SIZE];
+
+	return CompareMem(slot->digest, empty, sizeof(empty)) == 0;
+}
+
+/*
+ * Find the slot holding digest, or the empty slot it would go in.
+ */
+static measured_slot_t *
+measured_slot_find(measured_slot_t *slots, UINTN size, UINT8 *digest)
 {
+	measured_slot_t *slot;
 	UINTN i;
 
-	for (i = 0; i < measuredcount; i++) {
-		if ((StrCmp(VarName, measureddata[i].VariableName) == 0) &&
-		    (CompareGuid(&VendorGuid, measureddata[i].VendorGuid) ==
-		     0) &&
-		    (VarSize == measureddata[i].Size) &&
-		    (CompareMem(VarData, measureddata[i].Data, VarSize) == 0)) {
-			return TRUE;
-		}
+	CopyMem(&i, digest, sizeof(i));
+	for (;; i++) {
+		slot = &slots[i & (size - 1)];
+		if (measured_slot_empty(slot) ||
+		    CompareMem(slot->digest, digest, SHA256_DIGEST_SIZE) == 0)
+			return slot;
 	}
+}
 
-	return FALSE;
+static BOOLEAN
+tpm_data_measured(UINT8 *digest)
+{
+	if (!measured_slots)
+		return FALSE;
+
+	return !measured_slot_empty(
+		measured_slot_find(measured_slots, measured_size, digest));
 }
 
 static EFI_STATUS
-tpm_record_data_measurement(CHAR16 *VarName, EFI_GUID VendorGuid, UINTN VarSize,
-                            VOID *VarData)
+tpm_record_data_measurement(UINT8 *digest)
 {
-	if (measureddata == NULL) {
-		measureddata = AllocatePool(sizeof(*measureddata));
-	} else {
-		measureddata = ReallocatePool(
-			measureddata, measuredcount * sizeof(*measureddata),
-			(measuredcount + 1) * sizeof(*measureddata));
-	}
+	measured_slot_t *slots, *slot;
+	UINTN size, i;
 
-	if (measureddata == NULL)
-		return EFI_OUT_OF_RESOURCES;
+	if ((measured_count + 1) * 2 > measured_size) {
+		size = measured_size ? measured_size * 2 : MEASURED_MIN_SLOTS;
+		slots = AllocateZeroPool(size * sizeof(*slots));
+		if (!slots)
+			return EFI_OUT_OF_RESOURCES;
 
-	measureddata[measuredcount].VariableName =
-		AllocatePool(StrSize(VarName));
-	measureddata[measuredcount].VendorGuid = AllocatePool(sizeof(EFI_GUID));
-	measureddata[measuredcount].Data = AllocatePool(VarSize);
+		for (i = 0; i < measured_size; i++) {
+			if (measured_slot_empty(&measured_slots[i]))
+				continue;
+			slot = measured_slot_find(slots, size,
+			                          measured_slots[i].digest);
+			CopyMem(slot, &measured_slots[i], sizeof(*slot));
+		}
 
-	if (measureddata[measuredcount].VariableName == NULL ||
-	    measureddata[measuredcount].VendorGuid == NULL ||
-	    measureddata[measuredcount].Data == NULL) {
-		return EFI_OUT_OF_RESOURCES;
+		if (measured_slots)
+			FreePool(measured_slots);
+		measured_slots = slots;
+		measured_size = size;
 	}
 
-	StrCpy(measureddata[measuredcount].VariableName, VarName);
-	CopyMem(measureddata[measuredcount].VendorGuid, &VendorGuid,
-	        sizeof(EFI_GUID));
-	CopyMem(measureddata[measuredcount].Data, VarData, VarSize);
-	measureddata[measuredcount].Size = VarSize;
-	measuredcount++;
+	slot = measured_slot_find(measured_slots, measured_size, digest);
+	if (measured_slot_empty(slot)) {
+		CopyMem(slot->digest, digest, SHA256_DIGEST_SIZE);
+		measured_count++;
+	}
 
 	return EFI_SUCCESS;
 }
 
+static BOOLEAN
+tpm_data_queued(UINT8 *digest)
+{
+	queued_event_t *record;
+	UINTN pos;
+
+	for (pos = 0; pos < queue_used; pos += record->size) {
+		record = (queued_event_t *)(queue + pos);
+		if (CompareMem(record->digest, digest, SHA256_DIGEST_SIZE) == 0)
+			return TRUE;
+	}
+	return FALSE;
+}
+
+static queued_event_t *
+tpm_queue_reserve(UINTN logsize)
+{
+	queued_event_t *record;
+	UINTN size, new_size;
+	UINT8 *new_queue;
+
+	size = ALIGN_VALUE(sizeof(*record) + logsize, 8);
+	if (queue_used + size > queue_size) {
+		new_size = MAX(queue_size * 2, queue_used + size);
+		new_size = MAX(new_size, EFI_PAGE_SIZE);
+		new_queue = ReallocatePool(queue, queue_size, new_size);
+		if (!new_queue)
+			return NULL;
+		queue = new_queue;
+		queue_size = new_size;
+	}
+
+	record = (queued_event_t *)(queue + queue_used);
+	ZeroMem(record, size);
+	record->size = size;
+	record->logsize = logsize;
+	return record;
+}
+
+static void
+tpm_fill_variable_log(EFI_VARIABLE_DATA_TREE *VarLog, CHAR16 *VarName,
+                      UINTN VarNameLength, EFI_GUID *VendorGuid,
+                      UINTN VarSize, VOID *VarData)
+{
+	CopyMem(&VarLog->VariableName, VendorGuid,
+	        sizeof(VarLog->VariableName));
+	VarLog->UnicodeNameLength = VarNameLength;
+	VarLog->VariableDataLength = VarSize;
+	CopyMem(VarLog->UnicodeName, VarName, VarNameLength * sizeof(*VarName));
+	CopyMem((CHAR16 *)VarLog->UnicodeName + VarNameLength, VarData,
+	        VarSize);
+}
+
+static EFI_STATUS
+tpm_log_variable(EFI_VARIABLE_DATA_TREE *VarLog, UINT32 VarLogSize,
+                 UINT8 *digest)
+{
+	EFI_STATUS efi_status;
+
+	efi_status =
+		tpm_log_event_raw((EFI_PHYSICAL_ADDRESS)(intptr_t)VarLog,
+	                          VarLogSize, 7, (CHAR8 *)VarLog, VarLogSize,
+	                          EV_EFI_VARIABLE_AUTHORITY, NULL);
+	if (EFI_ERROR(efi_status))
+		return efi_status;
+
+	return tpm_record_data_measurement(digest);
+}
+
+/*
+ * Queue variable measurements until the next tpm_flush_measurements().
+ */
+void
+tpm_queue_measurements(void)
+{
+	queueing = TRUE;
+}
+
+/*
+ * Submit queued variable measurements, in the order they were made.
+ */
+EFI_STATUS
+tpm_flush_measurements(void)
+{
+	EFI_STATUS efi_status, ret = EFI_SUCCESS;
+	queued_event_t *record;
+	UINTN pos;
+
+	queueing = FALSE;
+
+	for (pos = 0; pos < queue_used; pos += record->size) {
+		record = (queued_event_t *)(queue + pos);
+		efi_status = tpm_log_variable(
+			(EFI_VARIABLE_DATA_TREE *)record->log,
+			record->logsize, record->digest);
+		if (EFI_ERROR(efi_status) && !EFI_ERROR(ret))
+			ret = efi_status;
+	}
+	queue_used = 0;
+
+	return ret;
+}
+
 EFI_STATUS
 tpm_measure_variable(CHAR16 *VarName, EFI_GUID VendorGuid, UINTN VarSize,
                      VOID *VarData)
@@ -319,9 +655,16 @@ tpm_measure_variable(CHAR16 *VarName, EFI_GUID VendorGuid, UINTN VarSize,
 	UINTN VarNameLength;
 	EFI_VARIABLE_DATA_TREE *VarLog;
 	UINT32 VarLogSize;
+	UINT8 digest[SHA256_DIGEST_SIZE];
+	queued_event_t *record;
+
+	efi_status = tpm_variable_digest(VarName, &VendorGuid, VarSize, VarData,
+	                                 digest);
+	if (EFI_ERROR(efi_status))
+		return efi_status;
 
 	/* Don't measure something that we've already measured */
-	if (tpm_data_measured(VarName, VendorGuid, VarSize, VarData))
+	if (tpm_data_measured(digest) || tpm_data_queued(digest))
 		return EFI_SUCCESS;
 
 	VarNameLength = StrLen(VarName);
@@ -329,67 +672,128 @@ tpm_measure_variable(CHAR16 *VarName, EFI_GUID VendorGuid, UINTN VarSize,
 		sizeof(*VarLog) + VarNameLength * sizeof(*VarName) + VarSize -
 		sizeof(VarLog->UnicodeName) - sizeof(VarLog->VariableData));
 
+	if (queueing) {
+		record = tpm_queue_reserve(VarLogSize);
+		if (record) {
+			CopyMem(record->digest, digest, SHA256_DIGEST_SIZE);
+			tpm_fill_variable_log(
+				(EFI_VARIABLE_DATA_TREE *)record->log,
+				VarName, VarNameLength, &VendorGuid, VarSize,
+				VarData);
+			queue_used += record->size;
+			return EFI_SUCCESS;
+		}
+		/* Out of memory; log directly, after what's queued */
+		tpm_flush_measurements();
+	}
+
 	VarLog = (EFI_VARIABLE_DATA_TREE *)AllocateZeroPool(VarLogSize);
 	if (VarLog == NULL) {
 		return EFI_OUT_OF_RESOURCES;
 	}
 
-	CopyMem(&VarLog->VariableName, &VendorGuid,
-	        sizeof(VarLog->VariableName));
-	VarLog->UnicodeNameLength = VarNameLength;
-	VarLog->VariableDataLength = VarSize;
-	CopyMem(VarLog->UnicodeName, VarName, VarNameLength * sizeof(*VarName));
-	CopyMem((CHAR16 *)VarLog->UnicodeName + VarNameLength, VarData,
-	        VarSize);
-
-	efi_status =
-		tpm_log_event_raw((EFI_PHYSICAL_ADDRESS)(intptr_t)VarLog,
-	                          VarLogSize, 7, (CHAR8 *)VarLog, VarLogSize,
-	                          EV_EFI_VARIABLE_AUTHORITY, NULL);
+	tpm_fill_variable_log(VarLog, VarName, VarNameLength, &VendorGuid,
+	                      VarSize, VarData);
+	efi_status = tpm_log_variable(VarLog, VarLogSize, digest);
 
 	FreePool(VarLog);
 
-	if (EFI_ERROR(efi_status))
-		return efi_status;
+	return efi_status;
+}
 
-	return tpm_record_data_measurement(VarName, VendorGuid, VarSize,
-	                                   VarData);
+#ifdef SHIM_UNIT_TEST
+void
+tpm_forget_measurements(void)
+{
+	if (measured_slots)
+		FreePool(measured_slots);
+	measured_slots = NULL;
+	measured_size = measured_count = 0;
 }
+#endif
 
 EFI_STATUS
 fallback_should_prefer_reset(void)
+{
+	if (EFI_ERROR(tpm_backend()->tpm_status))
+		return EFI_NOT_FOUND;
+	return EFI_SUCCESS;
+}
+
+/*
+ * Digests that tpm_log_pe() hands to the measurement backends
+ * precomputed.  Callers fold these into the same pass that produces the
+ * Authenticode hashes.  A TPM 1.2 is given the SHA-1 Authenticode digest;
+ * a TPM 2 and the CC protocol hash the image themselves whatever their
+ * banks are, so they need none.
+ */
+UINT32
+tpm_digest_algs(void)
+{
+	measurement_backend_t *be = tpm_backend();
+
+	if (!EFI_ERROR(be->tpm_status) && be->tpm)
+		return DIGEST_SHA1;
+	return 0;
+}
+
+/*
+ * Whether a measurement backend hashes the image itself, and so can't
+ * measure one that isn't in memory.
+ */
+BOOLEAN
+tpm_measures_image(void)
+{
+	measurement_backend_t *be = tpm_backend();
+
+	if (be->cc)
+		return TRUE;
+	return !EFI_ERROR(be->tpm_status) && be->tpm2;
+}
+
+static EFI_STATUS
+cc_map_pcr(measurement_backend_t *be, UINT8 pcr, EFI_CC_MR_INDEX *mr)
 {
 	EFI_STATUS efi_status;
-	efi_tpm_protocol_t *tpm;
-	efi_tpm2_protocol_t *tpm2;
 
-	efi_status = tpm_locate_protocol(&tpm, &tpm2, NULL, NULL);
-	if (EFI_ERROR(efi_status))
-		return EFI_NOT_FOUND;
+	if (pcr >= MEASURED_PCRS)
+		return be->cc->map_pcr_to_mr_index(be->cc, pcr, mr);
+
+	if (!(be->mr_mapped & (1U << pcr))) {
+		efi_status = be->cc->map_pcr_to_mr_index(be->cc, pcr,
+		                                         &be->mr[pcr]);
+		if (EFI_ERROR(efi_status))
+			return efi_status;
+		be->mr_mapped |= 1U << pcr;
+	}
+
+	*mr = be->mr[pcr];
 	return EFI_SUCCESS;
 }
 
 EFI_STATUS
 cc_log_event_raw(EFI_PHYSICAL_ADDRESS buf, UINTN size, UINT8 pcr,
-                 const CHAR8 *log, UINTN logsize, UINT32 type, CHAR8 *hash)
+                 const CHAR8 *log, UINTN logsize, UINT32 type,
+                 const digest_set_t *digests)
 {
 	EFI_STATUS efi_status;
 	EFI_CC_EVENT *event;
+	measurement_backend_t *be;
 	efi_cc_protocol_t *cc;
 	EFI_CC_MR_INDEX mr;
 
-	efi_status = LibLocateProtocol(&EFI_CC_MEASUREMENT_PROTOCOL_GUID,
-	                               (VOID **)&cc);
-	if (EFI_ERROR(efi_status) || cc == NULL)
+	be = tpm_backend();
+	cc = be->cc;
+	if (cc == NULL)
 		return EFI_SUCCESS;
 
-	efi_status = cc->map_pcr_to_mr_index(cc, pcr, &mr);
+	efi_status = cc_map_pcr(be, pcr, &mr);
 	if (EFI_ERROR(efi_status))
 		return EFI_NOT_FOUND;
 
 	UINTN event_size = sizeof(*event) - sizeof(event->Event) + logsize;
 
-	event = AllocatePool(event_size);
+	event = tpm_event_buffer(event_size);
 	if (!event) {
 		perror(L"Unable to allocate event structure\n");
 		return EFI_OUT_OF_RESOURCES;
@@ -401,15 +805,19 @@ cc_log_event_raw(EFI_PHYSICAL_ADDRESS buf, UINTN size, UINT8 pcr,
 	event->Header.EventType = type;
 	event->Size = event_size;
 	CopyMem(event->Event, (VOID *)log, logsize);
-	if (hash) {
+	if (digests && !buf) {
+		/* As with a TPM 2, the firmware has to see the image */
+		perror(L"Cannot measure an image that isn't in memory\n");
+		return EFI_UNSUPPORTED;
+	}
+	if (digests) {
 		efi_status = cc->hash_log_extend_event(cc, PE_COFF_IMAGE, buf,
 		                                       (UINT64)size, event);
 	}
 
-	if (!hash || EFI_ERROR(efi_status)) {
+	if (!digests || EFI_ERROR(efi_status)) {
 		efi_status = cc->hash_log_extend_event(cc, 0, buf, (UINT64)size,
 		                                       event);
 	}
-	FreePool(event);
 	return efi_status;
 }
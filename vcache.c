@@ -0,0 +1,161 @@
+// SPDX-License-Identifier: BSD-2-Clause-Patent
+/*
+ * vcache.c - remember which images we've already verified
+ *
+ * The same buffer can be verified more than once in a boot: a loader
+ * may call SHIM_LOCK's Verify() and then load it through the firmware,
+ * which brings it back to us through the security policy hook, and a
+ * menu entry that fails to boot verifies its kernel again next time.
+ * The answer can't change unless the databases behind it do, so keep it.
+ */
+
+#include "shim.h"
+
+typedef struct {
+	CHAR16 *name;
+	EFI_GUID guid;
+	UINTN size;
+	void *data;
+} vcache_measurement_t;
+
+typedef struct {
+	BOOLEAN valid;
+	UINT8 sha256[SHA256_DIGEST_SIZE];
+	UINT8 certs_sha256[SHA256_DIGEST_SIZE];
+	EFI_STATUS status;
+	verification_method_t method;
+	BOOLEAN overrides;
+	UINTN nmeasurements;
+	vcache_measurement_t measurements[VCACHE_MEASUREMENTS];
+} vcache_entry_t;
+
+static vcache_entry_t vcache[VCACHE_ENTRIES];
+static UINTN vcache_next;
+static UINTN vcache_epoch;
+
+/*
+ * The verification in progress.  Measured data is remembered by
+ * reference; it lives in the sigdb variable cache or in shim itself, and
+ * either way stays put until sigdb_epoch() changes, which empties this
+ * cache too.
+ */
+static vcache_entry_t vcache_pending;
+static BOOLEAN vcache_recording;
+static BOOLEAN vcache_overflow;
+static UINTN vcache_pending_epoch;
+
+void
+vcache_invalidate(void)
+{
+	ZeroMem(vcache, sizeof(vcache));
+	vcache_next = 0;
+	vcache_recording = FALSE;
+}
+
+static void
+vcache_check_epoch(void)
+{
+	UINTN epoch = sigdb_epoch();
+
+	if (vcache_epoch != epoch) {
+		vcache_invalidate();
+		vcache_epoch = epoch;
+	}
+}
+
+BOOLEAN
+vcache_lookup(UINT8 *sha256hash, UINT8 *certs_sha256hash, EFI_STATUS *status,
+	      verification_method_t *method, BOOLEAN *overrides)
+{
+	vcache_entry_t *entry;
+	vcache_measurement_t *m;
+	UINTN i, j;
+
+	vcache_check_epoch();
+
+	for (i = 0; i < VCACHE_ENTRIES; i++) {
+		entry = &vcache[i];
+		if (!entry->valid ||
+		    CompareMem(entry->sha256, sha256hash, SHA256_DIGEST_SIZE) ||
+		    CompareMem(entry->certs_sha256, certs_sha256hash,
+			       SHA256_DIGEST_SIZE))
+			continue;
+
+		for (j = 0; j < entry->nmeasurements; j++) {
+			m = &entry->measurements[j];
+			tpm_measure_variable(m->name, m->guid, m->size,
+					     m->data);
+		}
+
+		*status = entry->status;
+		*method = entry->method;
+		*overrides = entry->overrides;
+		return TRUE;
+	}
+
+	return FALSE;
+}
+
+void
+vcache_start(UINT8 *sha256hash, UINT8 *certs_sha256hash)
+{
+	vcache_check_epoch();
+
+	ZeroMem(&vcache_pending, sizeof(vcache_pending));
+	CopyMem(vcache_pending.sha256, sha256hash, SHA256_DIGEST_SIZE);
+	CopyMem(vcache_pending.certs_sha256, certs_sha256hash,
+		SHA256_DIGEST_SIZE);
+	vcache_pending_epoch = vcache_epoch;
+	vcache_overflow = FALSE;
+	vcache_recording = TRUE;
+}
+
+void
+vcache_measured(CHAR16 *name, EFI_GUID guid, UINTN size, void *data)
+{
+	vcache_measurement_t *m;
+
+	if (!vcache_recording)
+		return;
+
+	if (vcache_pending.nmeasurements == VCACHE_MEASUREMENTS) {
+		vcache_overflow = TRUE;
+		return;
+	}
+
+	m = &vcache_pending.measurements[vcache_pending.nmeasurements++];
+	m->name = name;
+	m->guid = guid;
+	m->size = size;
+	m->data = data;
+}
+
+void
+vcache_finish(EFI_STATUS status, verification_method_t method,
+	      BOOLEAN overrides)
+{
+	if (!vcache_recording)
+		return;
+	vcache_recording = FALSE;
+
+	if (status != EFI_SUCCESS &&
+	    status != EFI_SECURITY_VIOLATION &&
+	    status != EFI_ACCESS_DENIED)
+		return;
+
+	/*
+	 * If the databases changed while we were looking at them, what we
+	 * measured may already be gone.
+	 */
+	if (vcache_overflow || sigdb_epoch() != vcache_pending_epoch)
+		return;
+
+	vcache_pending.valid = TRUE;
+	vcache_pending.status = status;
+	vcache_pending.method = method;
+	vcache_pending.overrides = overrides;
+	CopyMem(&vcache[vcache_next], &vcache_pending, sizeof(vcache_pending));
+	vcache_next = (vcache_next + 1) % VCACHE_ENTRIES;
+}
+
+// vim:fenc=utf-8:tw=75:noet